@@ -0,0 +1,276 @@
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+#include <infiniband/verbs.h>
+#include "common.h"
+
+// Small C++20 coroutine runtime over the verbs data path.
+//
+//     async_task<void> flow(async_connection &conn, local_buffer_s buf) {
+//         struct ibv_wc wc = co_await conn.recv(buf);
+//         ...
+//         wc = co_await conn.send(buf);
+//     }
+//
+// Every awaitable operation posts its WR when the coroutine suspends and uses
+// its own address as wr_id. One completion_reactor per thread polls the CQ and
+// resumes whichever coroutine the completion belongs to, so thousands of
+// logical flows share a few threads and a single poll loop. Nothing here is
+// thread safe: a reactor, its CQ and the connections on it belong to one thread.
+
+typedef struct local_buffer_ {
+    void *addr;
+    uint32_t length;
+    uint32_t lkey;
+} local_buffer_s;
+
+typedef struct remote_buffer_ {
+    uint64_t addr;
+    uint32_t rkey;
+} remote_buffer_s;
+
+inline local_buffer_s make_local_buffer(struct ibv_mr *mr, size_t offset, uint32_t length) {
+    local_buffer_s buf = { (char *)mr->addr + offset, length, mr->lkey };
+    return buf;
+}
+
+// ==== task ====
+
+template <typename T>
+class async_task;
+
+template <typename T>
+struct async_task_promise_base {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    // resume whoever awaited us (symmetric transfer keeps the stack flat)
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            auto next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    final_awaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct async_task_promise : async_task_promise_base<T> {
+    T value;
+    async_task<T> get_return_object();
+    void return_value(T v) { value = std::move(v); }
+};
+
+template <>
+struct async_task_promise<void> : async_task_promise_base<void> {
+    async_task<void> get_return_object();
+    void return_void() {}
+};
+
+// Lazily started coroutine, runs when it is co_awaited (or spawned on a reactor).
+template <typename T>
+class async_task {
+public:
+    using promise_type = async_task_promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    explicit async_task(handle_type h) : handle(h) {}
+    async_task(async_task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    async_task(const async_task &) = delete;
+    async_task &operator=(const async_task &) = delete;
+    ~async_task() {
+        if (handle)
+            handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return !handle || handle.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+
+    T await_resume() {
+        if (handle.promise().exception)
+            std::rethrow_exception(handle.promise().exception);
+        if constexpr (!std::is_void_v<T>)
+            return std::move(handle.promise().value);
+    }
+
+private:
+    handle_type handle;
+};
+
+template <typename T>
+async_task<T> async_task_promise<T>::get_return_object() {
+    return async_task<T>(std::coroutine_handle<async_task_promise<T>>::from_promise(*this));
+}
+
+inline async_task<void> async_task_promise<void>::get_return_object() {
+    return async_task<void>(std::coroutine_handle<async_task_promise<void>>::from_promise(*this));
+}
+
+// ==== reactor ====
+
+// Common part of every awaitable operation: the suspended coroutine and the
+// completion that resumes it. Its address travels as the WR's wr_id.
+struct pending_op {
+    std::coroutine_handle<> waiter;
+    struct ibv_wc wc;
+};
+
+class completion_reactor {
+public:
+    static const int POLL_BATCH = 32;
+
+    explicit completion_reactor(struct ibv_cq *cq) : cq(cq), live_tasks(0), outstanding(0) {}
+
+    // Reap up to POLL_BATCH completions and resume their coroutines.
+    int poll() {
+        struct ibv_wc wcs[POLL_BATCH];
+        int n = ibv_poll_cq(cq, POLL_BATCH, wcs);
+        for (int i = 0; i < n; i++)
+            dispatch(wcs[i]);
+        return n;
+    }
+
+    void dispatch(const struct ibv_wc &wc) {
+        pending_op *op = (pending_op *)(uintptr_t)wc.wr_id;
+        op->wc = wc;
+        outstanding--;
+        op->waiter.resume();
+    }
+
+    // Start `task` and let it run to completion in the background; the reactor
+    // keeps count so run() knows when every flow is finished.
+    void spawn(async_task<void> task) {
+        live_tasks++;
+        run_detached(this, std::move(task));
+    }
+
+    // Poll until every spawned task has returned.
+    void run() {
+        while (live_tasks > 0)
+            poll();
+    }
+
+    size_t live() const { return live_tasks; }
+
+    // operations posted and not yet completed
+    size_t in_flight() const { return outstanding; }
+
+    void posted() { outstanding++; }
+
+private:
+    struct detached {
+        struct promise_type {
+            detached get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    static detached run_detached(completion_reactor *reactor, async_task<void> task) {
+        co_await task;
+        reactor->live_tasks--;
+    }
+
+    struct ibv_cq *cq;
+    size_t live_tasks;
+    size_t outstanding;
+};
+
+// ==== connection ====
+
+class async_connection;
+
+// One verbs operation; posted from await_suspend, resumed by the reactor with
+// the work completion as result. A failed post resumes immediately with
+// IBV_WC_GENERAL_ERR in wc.status and the errno in wc.vendor_err.
+struct verbs_op : pending_op {
+    enum kind_e { SEND, RECV, READ, WRITE };
+
+    async_connection *conn;
+    kind_e kind;
+    local_buffer_s local;
+    remote_buffer_s remote;
+
+    verbs_op(async_connection *conn, kind_e kind, local_buffer_s local, remote_buffer_s remote)
+        : conn(conn), kind(kind), local(local), remote(remote) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h);
+    struct ibv_wc await_resume() const noexcept { return wc; }
+};
+
+class async_connection {
+public:
+    async_connection(struct ibv_qp *qp, completion_reactor &reactor) : qp(qp), reactor(reactor) {}
+
+    verbs_op send(local_buffer_s buf) { return verbs_op(this, verbs_op::SEND, buf, {0, 0}); }
+    verbs_op recv(local_buffer_s buf) { return verbs_op(this, verbs_op::RECV, buf, {0, 0}); }
+    verbs_op read(local_buffer_s buf, remote_buffer_s remote) { return verbs_op(this, verbs_op::READ, buf, remote); }
+    verbs_op write(local_buffer_s buf, remote_buffer_s remote) { return verbs_op(this, verbs_op::WRITE, buf, remote); }
+
+    int post(verbs_op &op) {
+        struct ibv_sge sge;
+        sge.addr   = (uintptr_t)op.local.addr;
+        sge.length = op.local.length;
+        sge.lkey   = op.local.lkey;
+
+        int ret;
+        if (op.kind == verbs_op::RECV) {
+            struct ibv_recv_wr wr, *bad_wr;
+            memset(&wr, 0, sizeof(wr));
+            wr.wr_id   = (uintptr_t)&op;
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            ret = ibv_post_recv(qp, &wr, &bad_wr);
+        } else {
+            struct ibv_send_wr wr, *bad_wr;
+            memset(&wr, 0, sizeof(wr));
+            wr.wr_id      = (uintptr_t)&op;
+            wr.sg_list    = &sge;
+            wr.num_sge    = 1;
+            wr.send_flags = IBV_SEND_SIGNALED;
+            if (op.kind == verbs_op::SEND) {
+                wr.opcode = IBV_WR_SEND;
+            } else {
+                wr.opcode = op.kind == verbs_op::READ ? IBV_WR_RDMA_READ : IBV_WR_RDMA_WRITE;
+                wr.wr.rdma.remote_addr = op.remote.addr;
+                wr.wr.rdma.rkey        = op.remote.rkey;
+            }
+            ret = ibv_post_send(qp, &wr, &bad_wr);
+        }
+
+        if (ret == 0)
+            reactor.posted();
+        return ret;
+    }
+
+    struct ibv_qp *qp;
+    completion_reactor &reactor;
+};
+
+inline bool verbs_op::await_suspend(std::coroutine_handle<> h) {
+    waiter = h;
+    int ret = conn->post(*this);
+    if (ret == 0)
+        return true;
+
+    memset(&wc, 0, sizeof(wc));
+    wc.status = IBV_WC_GENERAL_ERR;
+    wc.vendor_err = ret;
+    return false;
+}
@@ -0,0 +1,318 @@
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <chrono>
+
+#include <infiniband/verbs.h>
+#include "async_rdma.h"
+
+using namespace std;
+
+// Per-message cost of the coroutine runtime compared with hand-written
+// post/poll loops.
+//
+// 1. "soft": completions come from an in-memory queue instead of a CQ, which
+//    isolates suspend + dispatch + resume from NIC and driver costs.
+// 2. "verbs": only when an RDMA device is present. Two RC QPs on the same
+//    device are connected back to back and ping data with SEND/RECV, once
+//    with a raw loop and once with one coroutine pair per flow.
+//
+// usage: bench_coro.exe [messages] [flows]
+
+// ==== soft completions ====
+
+struct soft_queue {
+    vector<pending_op *> ops;
+    size_t head = 0;
+
+    void push(pending_op *op) { ops.push_back(op); }
+    bool empty() const { return head == ops.size(); }
+    pending_op *pop() {
+        pending_op *op = ops[head++];
+        if (head == ops.size()) {
+            ops.clear();
+            head = 0;
+        }
+        return op;
+    }
+};
+
+struct soft_op : pending_op {
+    soft_queue *queue;
+    completion_reactor *reactor;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        waiter = h;
+        queue->push(this);
+        reactor->posted();
+    }
+    struct ibv_wc await_resume() const noexcept { return wc; }
+};
+
+async_task<void> soft_flow(soft_queue &queue, completion_reactor &reactor, int messages, uint64_t &checksum) {
+    for (int i = 0; i < messages; i++) {
+        soft_op op;
+        op.queue = &queue;
+        op.reactor = &reactor;
+        struct ibv_wc wc = co_await op;
+        checksum += wc.byte_len;
+    }
+}
+
+double bench_soft_coroutines(int messages, int flows) {
+    soft_queue queue;
+    completion_reactor reactor(nullptr);
+    uint64_t checksum = 0;
+
+    auto start = chrono::steady_clock::now();
+    for (int f = 0; f < flows; f++)
+        reactor.spawn(soft_flow(queue, reactor, messages / flows, checksum));
+
+    struct ibv_wc wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.byte_len = 1;
+    while (reactor.live() > 0) {
+        pending_op *op = queue.pop();
+        wc.wr_id = (uintptr_t)op;
+        reactor.dispatch(wc);
+    }
+    double ns = elapsed_us(start) * 1000.0;
+
+    if (checksum != (uint64_t)(messages / flows) * flows)
+        cerr << "soft coroutine benchmark lost completions" << endl;
+    return ns / ((messages / flows) * flows);
+}
+
+// same queue traffic, but completions are handled inline like the existing
+// post/poll loops do
+double bench_soft_raw(int messages, int flows) {
+    soft_queue queue;
+    vector<pending_op> ops(flows);
+    vector<int> remaining(flows, messages / flows);
+    uint64_t checksum = 0;
+
+    auto start = chrono::steady_clock::now();
+    for (int f = 0; f < flows; f++)
+        queue.push(&ops[f]);
+
+    while (!queue.empty()) {
+        pending_op *op = queue.pop();
+        size_t f = op - ops.data();
+        checksum += 1;
+        if (--remaining[f] > 0)
+            queue.push(op);
+    }
+    double ns = elapsed_us(start) * 1000.0;
+
+    if (checksum != (uint64_t)(messages / flows) * flows)
+        cerr << "soft raw benchmark lost completions" << endl;
+    return ns / ((messages / flows) * flows);
+}
+
+// ==== verbs loopback ====
+
+const int BENCH_MSG_SIZE = 64;
+
+struct loopback {
+    struct ibv_context *context;
+    struct ibv_pd *pd;
+    struct ibv_cq *cq;
+    struct ibv_qp *qp[2];
+    struct ibv_mr *mr;
+    char *buf;
+};
+
+struct ibv_qp *create_bench_qp(struct ibv_pd *pd, struct ibv_cq *cq, int depth) {
+    struct ibv_qp_init_attr qp_init_attr;
+    memset(&qp_init_attr, 0, sizeof(qp_init_attr));
+    qp_init_attr.recv_cq = cq;
+    qp_init_attr.send_cq = cq;
+    qp_init_attr.qp_type = IBV_QPT_RC;
+    qp_init_attr.cap.max_send_wr  = depth;
+    qp_init_attr.cap.max_recv_wr  = depth;
+    qp_init_attr.cap.max_send_sge = 1;
+    qp_init_attr.cap.max_recv_sge = 1;
+    return ibv_create_qp(pd, &qp_init_attr);
+}
+
+int open_loopback(struct loopback &lb, int flows) {
+    int num_devices;
+    struct ibv_device **dev_list = ibv_get_device_list(&num_devices);
+    if (!dev_list || num_devices == 0) {
+        if (dev_list)
+            ibv_free_device_list(dev_list);
+        return -1;
+    }
+
+    lb.context = ibv_open_device(dev_list[0]);
+    ibv_free_device_list(dev_list);
+    if (!lb.context)
+        return -1;
+
+    struct ibv_port_attr port_attr;
+    struct device_info local;
+    uint32_t gidIndex = 0;
+    set_gid(lb.context, port_attr, &local, gidIndex);
+    if (gidIndex == 0) {
+        cerr << "no RoCEv2 GID on 192.168.x.x, skipping verbs benchmark" << endl;
+        return -1;
+    }
+
+    lb.pd = ibv_alloc_pd(lb.context);
+    lb.cq = ibv_create_cq(lb.context, 4 * flows + 16, nullptr, nullptr, 0);
+    lb.buf = new char[2 * flows * BENCH_MSG_SIZE]();
+    lb.mr = ibv_reg_mr(lb.pd, lb.buf, 2 * flows * BENCH_MSG_SIZE, IBV_ACCESS_LOCAL_WRITE);
+    if (!lb.pd || !lb.cq || !lb.mr)
+        return -1;
+
+    for (int i = 0; i < 2; i++) {
+        lb.qp[i] = create_bench_qp(lb.pd, lb.cq, flows + 1);
+        if (!lb.qp[i] || modify_qp_to_init(lb.qp[i]) != 0)
+            return -1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        struct device_info remote = local;
+        remote.send_qp_num = lb.qp[1 - i]->qp_num;
+        if (modify_qp_to_rtr(lb.qp[i], remote, gidIndex, port_attr.active_mtu, 0) != 0 ||
+            modify_qp_to_rts(lb.qp[i], 0) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+void close_loopback(struct loopback &lb) {
+    ibv_destroy_qp(lb.qp[0]);
+    ibv_destroy_qp(lb.qp[1]);
+    ibv_dereg_mr(lb.mr);
+    delete[] lb.buf;
+    ibv_destroy_cq(lb.cq);
+    ibv_dealloc_pd(lb.pd);
+    ibv_close_device(lb.context);
+}
+
+// wr_id: flow index, bit 31 set for receives
+double bench_verbs_raw(struct loopback &lb, int messages, int flows) {
+    int per_flow = messages / flows;
+    vector<int> sent(flows, 0), received(flows, 0);
+    int done = 0;
+
+    auto post = [&](int f, bool recv) {
+        struct ibv_sge sge;
+        sge.addr   = (uintptr_t)(lb.buf + (2 * f + (recv ? 1 : 0)) * BENCH_MSG_SIZE);
+        sge.length = BENCH_MSG_SIZE;
+        sge.lkey   = lb.mr->lkey;
+        if (recv) {
+            struct ibv_recv_wr wr, *bad_wr;
+            memset(&wr, 0, sizeof(wr));
+            wr.wr_id = f | (1u << 31);
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            return ibv_post_recv(lb.qp[1], &wr, &bad_wr);
+        }
+        struct ibv_send_wr wr, *bad_wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = f;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_SEND;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        return ibv_post_send(lb.qp[0], &wr, &bad_wr);
+    };
+
+    auto start = chrono::steady_clock::now();
+    for (int f = 0; f < flows; f++) {
+        post(f, true);
+        post(f, false);
+    }
+
+    struct ibv_wc wcs[32];
+    while (done < flows) {
+        int n = ibv_poll_cq(lb.cq, 32, wcs);
+        for (int i = 0; i < n; i++) {
+            if (wcs[i].status != IBV_WC_SUCCESS) {
+                cerr << "raw verbs benchmark failed: " << ibv_wc_status_str(wcs[i].status) << endl;
+                return -1;
+            }
+            int f = wcs[i].wr_id & ~(1u << 31);
+            if (wcs[i].wr_id & (1u << 31)) {
+                if (++received[f] == per_flow)
+                    done++;
+                else
+                    post(f, true);
+            } else if (++sent[f] < per_flow) {
+                post(f, false);
+            }
+        }
+    }
+    return elapsed_us(start) * 1000.0 / (per_flow * flows);
+}
+
+async_task<void> coro_sender(async_connection &conn, local_buffer_s buf, int messages) {
+    for (int i = 0; i < messages; i++) {
+        struct ibv_wc wc = co_await conn.send(buf);
+        if (wc.status != IBV_WC_SUCCESS) {
+            cerr << "coroutine send failed: " << ibv_wc_status_str(wc.status) << endl;
+            co_return;
+        }
+    }
+}
+
+async_task<void> coro_receiver(async_connection &conn, local_buffer_s buf, int messages) {
+    for (int i = 0; i < messages; i++) {
+        struct ibv_wc wc = co_await conn.recv(buf);
+        if (wc.status != IBV_WC_SUCCESS) {
+            cerr << "coroutine recv failed: " << ibv_wc_status_str(wc.status) << endl;
+            co_return;
+        }
+    }
+}
+
+double bench_verbs_coroutines(struct loopback &lb, int messages, int flows) {
+    int per_flow = messages / flows;
+    completion_reactor reactor(lb.cq);
+    async_connection sender(lb.qp[0], reactor), receiver(lb.qp[1], reactor);
+
+    auto start = chrono::steady_clock::now();
+    for (int f = 0; f < flows; f++) {
+        reactor.spawn(coro_receiver(receiver, make_local_buffer(lb.mr, (2 * f + 1) * BENCH_MSG_SIZE, BENCH_MSG_SIZE), per_flow));
+        reactor.spawn(coro_sender(sender, make_local_buffer(lb.mr, 2 * f * BENCH_MSG_SIZE, BENCH_MSG_SIZE), per_flow));
+    }
+    reactor.run();
+    return elapsed_us(start) * 1000.0 / (per_flow * flows);
+}
+
+int main(int argc, char *argv[]) {
+    int messages = argc > 1 ? atoi(argv[1]) : 1000000;
+    int flows = argc > 2 ? atoi(argv[2]) : 1000;
+    if (messages <= 0 || flows <= 0 || flows > messages) {
+        cerr << "usage: " << argv[0] << " [messages] [flows]" << endl;
+        return 1;
+    }
+
+    double raw = bench_soft_raw(messages, flows);
+    double coro = bench_soft_coroutines(messages, flows);
+    cout << "soft completions, " << flows << " flows:" << endl;
+    cout << "  inline loop   " << raw << " ns/msg" << endl;
+    cout << "  coroutines    " << coro << " ns/msg" << endl;
+    cout << "  overhead      " << coro - raw << " ns/msg" << endl;
+
+    // a single QP pair has far fewer WQEs than a million flows
+    int verbs_flows = flows > 64 ? 64 : flows;
+    struct loopback lb;
+    if (open_loopback(lb, verbs_flows) != 0) {
+        cout << "no usable RDMA device, skipping verbs benchmark" << endl;
+        return 0;
+    }
+
+    raw = bench_verbs_raw(lb, messages, verbs_flows);
+    coro = bench_verbs_coroutines(lb, messages, verbs_flows);
+    cout << "verbs loopback SEND/RECV " << BENCH_MSG_SIZE << "B, " << verbs_flows << " flows:" << endl;
+    cout << "  raw verbs     " << raw << " ns/msg" << endl;
+    cout << "  coroutines    " << coro << " ns/msg" << endl;
+    cout << "  overhead      " << coro - raw << " ns/msg (" << 100.0 * (coro - raw) / raw << "%)" << endl;
+
+    close_loopback(lb);
+    return 0;
+}
@@ -0,0 +1,142 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstring>
+#include <chrono>
+
+#include "crc32c.h"
+#include "reduce.h"
+
+using namespace std;
+
+// What the CRC32C trailers cost, per message size:
+//
+// 1. every kernel on its own, the master's and the nodes' compute
+// 2. the master's text path: memcpy against the copy that checks on the way
+// 3. the master's reduce path: a f32 sum chunk folded in with and without the
+//    check in the same pass
+//
+// Every size is run over the same amount of data, so the small sizes show
+// the per-message overhead and the large ones the bandwidth. Before anything
+// is timed, every kernel and the checked copy have to agree with the table
+// kernel, at every size and at odd offsets and lengths around it.
+//
+// usage: bench_crc.exe [megabytes per size]
+
+const size_t BENCH_SIZES[] = { 64, 256, 1024, 4096, 65536 };
+
+// keeps the results alive
+volatile uint32_t sink;
+
+template <typename F>
+double ns_per_msg(size_t iterations, F f) {
+    // once to warm the caches and the lazily built tables
+    f();
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++)
+        f();
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / iterations;
+}
+
+// The CRCs of `len` bytes at `offset` of `src`. Returns false and says so if
+// a kernel or the checked copy disagrees with the table.
+bool kernels_agree(const vector<char> &src, vector<char> &dst, crc32c_isa best, size_t offset, size_t len) {
+    const char *data = src.data() + offset;
+    uint32_t expected = crc32c_update_table(CRC32C_INIT, data, len);
+    bool agree = true;
+    for (int isa = CRC32C_ISA_SSE42; isa <= best; isa++) {
+        uint32_t crc = select_crc32c_kernel((crc32c_isa)isa)(CRC32C_INIT, data, len);
+        if (crc != expected) {
+            cerr << crc32c_isa_name((crc32c_isa)isa) << " gives " << hex << crc << " instead of " << expected << dec
+                 << " for " << len << " B at offset " << offset << endl;
+            agree = false;
+        }
+    }
+    uint32_t crc = crc32c_copy(CRC32C_INIT, dst.data() + offset, data, len);
+    if (crc != expected || memcmp(dst.data() + offset, data, len) != 0) {
+        cerr << "copy + crc gives " << hex << crc << " instead of " << expected << dec << " for " << len
+             << " B at offset " << offset << endl;
+        agree = false;
+    }
+    return agree;
+}
+
+void print_row(const char *label, size_t size, double ns) {
+    cout << "  " << left << setw(16) << label << right << fixed << setprecision(1) << setw(10) << ns << " ns/msg "
+         << setw(7) << setprecision(2) << size / ns << " GB/s" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    size_t megabytes = argc > 1 ? atoi(argv[1]) : 256;
+    if (megabytes == 0) {
+        cerr << "usage: " << argv[0] << " [megabytes per size]" << endl;
+        return 1;
+    }
+
+    size_t largest = BENCH_SIZES[sizeof(BENCH_SIZES) / sizeof(BENCH_SIZES[0]) - 1];
+    // room for the odd offsets and lengths of the check
+    const size_t slack = 16;
+    vector<char> src(largest + slack), dst(largest + slack);
+    // plain floats, no denormals to slow the reduce down
+    for (size_t i = 0; i < largest / sizeof(float); i++)
+        ((float *)src.data())[i] = (float)(i % 1000) * 0.25f;
+    for (size_t i = largest; i < src.size(); i++)
+        src[i] = (char)(i * 131);
+
+    crc32c_isa best = crc32c_best_isa();
+    cout << "CRC32C kernels up to " << crc32c_isa_name(best) << ", reduce " << reduce_isa_name(detect_reduce_isa()) << endl;
+
+    // short lengths cover every tail, the sizes with a few bytes either way
+    // the stripes of the three-way kernel and what is left behind them
+    bool agree = true;
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t len = 0; len <= 3 * CRC32C_STRIPE + 8; len++)
+            agree &= kernels_agree(src, dst, best, offset, len);
+        for (size_t size : BENCH_SIZES)
+            for (size_t len = size - 7; len <= size + 7; len++)
+                agree &= kernels_agree(src, dst, best, offset, len);
+    }
+    if (!agree)
+        return 1;
+    cout << "kernels agree" << endl;
+
+    for (size_t size : BENCH_SIZES) {
+        size_t iterations = megabytes * 1024 * 1024 / size;
+        cout << size << " B, " << iterations << " messages:" << endl;
+
+        for (int isa = CRC32C_ISA_TABLE; isa <= best; isa++) {
+            crc32c_fn kernel = select_crc32c_kernel((crc32c_isa)isa);
+            double ns = ns_per_msg(iterations, [&]() { sink = kernel(CRC32C_INIT, src.data(), size); });
+            print_row(crc32c_isa_name((crc32c_isa)isa), size, ns);
+        }
+
+        double copy = ns_per_msg(iterations, [&]() {
+            memcpy(dst.data(), src.data(), size);
+            sink = dst[size - 1];
+        });
+        double checked_copy = ns_per_msg(iterations, [&]() { sink = crc32c_copy(CRC32C_INIT, dst.data(), src.data(), size); });
+        print_row("memcpy", size, copy);
+        print_row("copy + crc", size, checked_copy);
+
+        // one node contributing the same chunk over and over
+        reduce_chunk_header_s hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.elements = hdr.total_elements = size / sizeof(float);
+        hdr.dtype = REDUCE_F32;
+        hdr.op = REDUCE_SUM;
+        gather_reducer reducer;
+        reducer.begin_round(1);
+        double reduce = ns_per_msg(iterations, [&]() { sink = reducer.contribute(0, hdr, src.data()); });
+        uint32_t crc = CRC32C_INIT;
+        double checked_reduce = ns_per_msg(iterations, [&]() {
+            crc = CRC32C_INIT;
+            reducer.contribute(0, hdr, src.data(), &crc);
+            sink = crc;
+        });
+        print_row("reduce f32", size, reduce);
+        print_row("reduce + crc", size, checked_reduce);
+        cout << "  check adds " << setprecision(1) << checked_copy - copy << " ns to a copy, "
+             << checked_reduce - reduce << " ns to a reduce" << defaultfloat << endl;
+    }
+    return 0;
+}
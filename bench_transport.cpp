@@ -0,0 +1,287 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <cstring>
+#include <chrono>
+
+#include "transport_shm.h"
+#include "transport_tcp.h"
+#include "transport_verbs.h"
+
+using namespace std;
+
+// The incast of the master written once against transport_channel and run
+// over every backend. Each node is a thread with its own channel to the
+// master. The master keeps INCAST_RECV_SLOTS receives posted per node and
+// unlocks nodes with a SEND, a node answers with `messages` SENDs of `size`
+// bytes, never more in flight than the master has slots.
+//
+// 1. "serial": one node at a time, the scheduler of server.cpp.
+// 2. "all at once": every node unlocked together, the incast itself.
+//
+// usage: bench_transport.exe [nodes] [messages] [size]
+
+const int BENCH_PASSES = 20;
+const uint64_t CONTROL_WR = 1ULL << 32;
+const char CONTROL_UNLOCK = 'U';
+const char CONTROL_STOP = 'S';
+
+struct bench_node {
+    transport_channel *master_end;
+    transport_channel *node_end;
+    // master side: the receive slots and the control message
+    char *slots;
+    char control;
+    tr_region_s slots_region;
+    tr_region_s control_region;
+    thread worker;
+    int received;
+    uint64_t bytes;
+};
+
+// ==== node ====
+
+// yields while nothing completes, the benchmark may run on fewer cores than
+// it has threads
+int poll_or_yield(transport_channel *ch, tr_completion_s *wcs, int max) {
+    int n = ch->poll(wcs, max);
+    if (n == 0)
+        this_thread::yield();
+    return n;
+}
+
+void run_node(transport_channel *ch, int messages, uint32_t size) {
+    vector<char> payload(size, 'x');
+    char control = 0;
+    tr_region_s payload_region, control_region;
+    ch->register_region(payload.data(), payload.size(), payload_region);
+    ch->register_region(&control, 1, control_region);
+    ch->post_recv(CONTROL_WR, control_region, &control, 1);
+
+    tr_completion_s wcs[16];
+    while (true) {
+        int n = poll_or_yield(ch, wcs, 16);
+        if (n < 0)
+            break;
+        bool unlocked = false, stop = false;
+        for (int i = 0; i < n; i++) {
+            if (wcs[i].status != 0) {
+                cerr << ch->name() << " node completion failed: " << strerror(wcs[i].status) << endl;
+                stop = true;
+            } else if (wcs[i].wr_id == CONTROL_WR) {
+                stop |= control == CONTROL_STOP;
+                unlocked |= control == CONTROL_UNLOCK;
+            }
+        }
+        if (stop)
+            break;
+        if (!unlocked)
+            continue;
+        ch->post_recv(CONTROL_WR, control_region, &control, 1);
+
+        int sent = 0, completed = 0;
+        while (completed < messages) {
+            while (sent < messages && sent - completed < INCAST_RECV_SLOTS) {
+                int ret = ch->post_send(sent, payload_region, payload.data(), size);
+                if (ret == ENOMEM)
+                    break;
+                if (ret != 0) {
+                    cerr << ch->name() << " post_send failed: " << strerror(ret) << endl;
+                    return;
+                }
+                sent++;
+            }
+            n = poll_or_yield(ch, wcs, 16);
+            for (int i = 0; i < n; i++)
+                if (wcs[i].opcode == TR_SEND)
+                    completed++;
+        }
+    }
+    ch->deregister_region(payload_region);
+    ch->deregister_region(control_region);
+}
+
+// ==== master ====
+
+int send_control(bench_node &node, char op) {
+    node.control = op;
+    return node.master_end->post_send(CONTROL_WR, node.control_region, &node.control, 1);
+}
+
+// Drains the completions of one node, reposting every consumed slot. Returns
+// false on a failed completion.
+bool progress_node(bench_node &node, uint32_t size) {
+    tr_completion_s wcs[16];
+    int n = node.master_end->poll(wcs, 16);
+    for (int i = 0; i < n; i++) {
+        if (wcs[i].status != 0) {
+            cerr << node.master_end->name() << " master completion failed: " << strerror(wcs[i].status) << endl;
+            return false;
+        }
+        if (wcs[i].opcode != TR_RECV)
+            continue;
+        node.received++;
+        node.bytes += wcs[i].len;
+        char *slot = node.slots + wcs[i].wr_id * size;
+        node.master_end->post_recv(wcs[i].wr_id, node.slots_region, slot, size);
+    }
+    if (n == 0)
+        this_thread::yield();
+    return n >= 0;
+}
+
+bool run_turn(vector<bench_node> &nodes, size_t first, size_t count, int messages, uint32_t size) {
+    for (size_t i = first; i < first + count; i++) {
+        nodes[i].received = 0;
+        if (send_control(nodes[i], CONTROL_UNLOCK) != 0)
+            return false;
+    }
+    size_t done = 0;
+    while (done < count) {
+        done = 0;
+        for (size_t i = first; i < first + count; i++) {
+            if (!progress_node(nodes[i], size))
+                return false;
+            done += nodes[i].received == messages;
+        }
+    }
+    return true;
+}
+
+struct bench_result {
+    double gbps;
+    double turn_us;
+};
+
+// average over BENCH_PASSES passes, turn_us is one node's turn in serial mode
+// and the whole incast otherwise
+bool bench_mode(vector<bench_node> &nodes, int messages, uint32_t size, bool serial, bench_result &result) {
+    uint64_t bytes = 0;
+    int turns = 0;
+    for (auto &node : nodes)
+        node.bytes = 0;
+
+    auto start = chrono::steady_clock::now();
+    for (int pass = 0; pass < BENCH_PASSES; pass++) {
+        if (serial) {
+            for (size_t i = 0; i < nodes.size(); i++, turns++)
+                if (!run_turn(nodes, i, 1, messages, size))
+                    return false;
+        } else {
+            if (!run_turn(nodes, 0, nodes.size(), messages, size))
+                return false;
+            turns++;
+        }
+    }
+    double us = elapsed_us(start);
+    for (auto &node : nodes)
+        bytes += node.bytes;
+    result.gbps = bytes * 8.0 / (us * 1000.0);
+    result.turn_us = us / turns;
+    return true;
+}
+
+// Runs both modes over channel pairs made by `connect` and prints them.
+template <typename Connect>
+int bench_backend(const char *label, int node_count, int messages, uint32_t size, Connect connect) {
+    vector<bench_node> nodes(node_count);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (connect(nodes[i].node_end, nodes[i].master_end) != 0) {
+            cout << "no " << label << " channel, skipping" << endl;
+            for (size_t j = 0; j < i; j++) {
+                delete nodes[j].master_end;
+                delete nodes[j].node_end;
+            }
+            return -1;
+        }
+    }
+    for (auto &node : nodes) {
+        node.slots = new char[INCAST_RECV_SLOTS * size];
+        node.master_end->register_region(node.slots, INCAST_RECV_SLOTS * size, node.slots_region);
+        node.master_end->register_region(&node.control, 1, node.control_region);
+        for (int slot = 0; slot < INCAST_RECV_SLOTS; slot++)
+            node.master_end->post_recv(slot, node.slots_region, node.slots + slot * size, size);
+        node.worker = thread(run_node, node.node_end, messages, size);
+    }
+
+    bench_result serial, incast;
+    if (!bench_mode(nodes, messages, size, true, serial) || !bench_mode(nodes, messages, size, false, incast)) {
+        // node threads may be stuck in a turn that never ends
+        cerr << label << " failed" << endl;
+        exit(1);
+    }
+
+    for (auto &node : nodes) {
+        // the STOP has to leave the master end before the node can see it
+        bool stopped = send_control(node, CONTROL_STOP) != 0;
+        while (!stopped) {
+            tr_completion_s wcs[16];
+            int n = poll_or_yield(node.master_end, wcs, 16);
+            for (int i = 0; i < n; i++)
+                stopped |= wcs[i].wr_id == CONTROL_WR;
+            stopped |= n < 0;
+        }
+        node.worker.join();
+        node.master_end->deregister_region(node.slots_region);
+        node.master_end->deregister_region(node.control_region);
+        delete node.master_end;
+        delete node.node_end;
+        delete[] node.slots;
+    }
+
+    cout << label << ", " << node_count << " nodes x " << messages << " x " << size << "B:" << endl;
+    cout << "  serial        " << serial.gbps << " Gbit/s, " << serial.turn_us << " us per turn" << endl;
+    cout << "  all at once   " << incast.gbps << " Gbit/s, " << incast.turn_us << " us per incast" << endl;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int node_count = argc > 1 ? atoi(argv[1]) : 4;
+    int messages = argc > 2 ? atoi(argv[2]) : 1000;
+    int size = argc > 3 ? atoi(argv[3]) : BUFFER_SIZE;
+    if (node_count <= 0 || messages <= 0 || size <= 0 || size > (int)SHM_SLOT_SIZE) {
+        cerr << "usage: " << argv[0] << " [nodes] [messages] [size <= " << SHM_SLOT_SIZE << "]" << endl;
+        return 1;
+    }
+
+    bench_backend("shm", node_count, messages, size, [](transport_channel *&a, transport_channel *&b) {
+        shm_channel *x, *y;
+        if (shm_channel::create_pair(0, x, y) != 0)
+            return -1;
+        a = x;
+        b = y;
+        return 0;
+    });
+
+    bench_backend("tcp loopback", node_count, messages, size, [](transport_channel *&a, transport_channel *&b) {
+        tcp_channel *x, *y;
+        if (tcp_channel::create_pair(x, y) != 0)
+            return -1;
+        a = x;
+        b = y;
+        return 0;
+    });
+
+    int num_devices = 0;
+    struct ibv_device **dev_list = ibv_get_device_list(&num_devices);
+    struct ibv_context *context = num_devices > 0 ? ibv_open_device(dev_list[0]) : nullptr;
+    if (dev_list)
+        ibv_free_device_list(dev_list);
+    struct ibv_pd *pd = context ? ibv_alloc_pd(context) : nullptr;
+    if (!pd) {
+        cout << "no usable RDMA device, skipping verbs benchmark" << endl;
+        return 0;
+    }
+
+    bench_backend("verbs loopback", node_count, messages, size, [&](transport_channel *&a, transport_channel *&b) {
+        verbs_channel *x, *y;
+        if (verbs_channel::create_loopback(context, pd, x, y) != 0)
+            return -1;
+        a = x;
+        b = y;
+        return 0;
+    });
+    ibv_dealloc_pd(pd);
+    ibv_close_device(context);
+    return 0;
+}
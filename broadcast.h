@@ -0,0 +1,362 @@
+#pragma once
+#include <vector>
+
+#include <infiniband/verbs.h>
+#include "common.h"
+
+// Broadcast of a large blob from the master to every node.
+//
+// Each node registers a landing buffer for the blob and hands its address and
+// rkey to the master (RPC_BCAST_PREPARE). The blob then moves as RDMA
+// WRITE_WITH_IMM chunks straight into that buffer, imm_data carries the chunk
+// index so the receiver knows how far the blob is valid without touching it.
+//
+//   direct: the master writes every chunk to every node, a batch of chunks per
+//           node goes out as one posted WR list
+//   chain:  the master writes to the first node only and node k forwards each
+//           chunk to node k+1 as soon as it landed, over a relay QP pair set
+//           up by RPC_BCAST_START. The master uplink carries the blob once.
+//
+// Every node reports the end with a SEND_WITH_IMM (BCAST_DONE_IMM) of
+// bcast_done_s on its connection to the master.
+
+// imm_data of a chunk: tag in the top byte, chunk index below
+const uint32_t BCAST_IMM_TAG = 0xbc000000;
+const uint32_t BCAST_IMM_MASK = 0xff000000;
+const uint32_t BCAST_DONE_IMM = 0x42434431;  // "BCD1"
+// chunk writes in flight per QP, matches the receives a node keeps posted
+const uint32_t BCAST_WINDOW = 4;
+const uint32_t BCAST_DEFAULT_CHUNK = 64 * 1024;
+// wr_ids, above the RPC send slots
+const uint64_t BCAST_WR_SLOT = 0x20000;
+const uint64_t BCAST_RELAY_RECV_WR = 0x20001;
+const uint64_t BCAST_DONE_WR = 0x20002;
+
+enum bcast_mode : uint32_t {
+    BCAST_DIRECT = 1,
+    BCAST_CHAIN = 2,
+};
+
+typedef struct bcast_prepare_ {
+    uint64_t size;
+    uint32_t chunk_size;
+    uint32_t reserved;
+} bcast_prepare_s;
+
+// answer to RPC_BCAST_PREPARE
+typedef struct bcast_target_ {
+    uint64_t addr;
+    uint32_t rkey;
+    // relay QPs for chain mode
+    uint32_t in_qp_num;
+    uint32_t out_qp_num;
+    uint32_t reserved;
+} bcast_target_s;
+
+typedef struct bcast_start_ {
+    uint32_t mode;
+    uint32_t has_prev;
+    uint32_t has_next;
+    // out QP of the previous node in the chain
+    uint32_t prev_qp_num;
+    union ibv_gid prev_gid;
+    union ibv_gid next_gid;
+    bcast_target_s next;
+} bcast_start_s;
+
+typedef struct bcast_done_ {
+    uint64_t bytes;
+    uint64_t checksum;
+    // from the first chunk to the last one landed and forwarded
+    double elapsed_us;
+} bcast_done_s;
+
+inline bool is_bcast_chunk(const struct ibv_wc &wc) {
+    return (wc.wc_flags & IBV_WC_WITH_IMM) && (ntohl(wc.imm_data) & BCAST_IMM_MASK) == BCAST_IMM_TAG;
+}
+
+inline uint32_t bcast_chunks(uint64_t size, uint32_t chunk_size) {
+    return (uint32_t)((size + chunk_size - 1) / chunk_size);
+}
+
+// cheap end-to-end check that every node got the same bytes
+inline uint64_t bcast_checksum(const char *buf, uint64_t size) {
+    uint64_t sum = 0;
+    uint64_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, buf + i, 8);
+        sum += word;
+    }
+    for (; i < size; i++)
+        sum += (uint8_t)buf[i];
+    return sum;
+}
+
+// Build the WR list for chunks [first, first + n) of `blob` (inside `mr`),
+// written to the same offsets behind remote_addr. One ibv_post_send posts it.
+inline void bcast_build_writes(std::vector<struct ibv_send_wr> &wrs, std::vector<struct ibv_sge> &sges,
+                               struct ibv_mr *mr, const char *blob, uint64_t size, uint32_t chunk_size,
+                               uint32_t first, uint32_t n, uint64_t remote_addr, uint32_t rkey, uint64_t wr_id) {
+    wrs.resize(n);
+    sges.resize(n);
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t offset = (uint64_t)(first + i) * chunk_size;
+        sges[i].addr   = (uintptr_t)(blob + offset);
+        sges[i].length = size - offset < chunk_size ? (uint32_t)(size - offset) : chunk_size;
+        sges[i].lkey   = mr->lkey;
+
+        memset(&wrs[i], 0, sizeof(wrs[i]));
+        wrs[i].wr_id      = wr_id;
+        wrs[i].sg_list    = &sges[i];
+        wrs[i].num_sge    = 1;
+        wrs[i].opcode     = IBV_WR_RDMA_WRITE_WITH_IMM;
+        wrs[i].imm_data   = htonl(BCAST_IMM_TAG | (first + i));
+        wrs[i].send_flags = IBV_SEND_SIGNALED;
+        wrs[i].wr.rdma.remote_addr = remote_addr + offset;
+        wrs[i].wr.rdma.rkey        = rkey;
+        wrs[i].next = i + 1 < n ? &wrs[i + 1] : nullptr;
+    }
+}
+
+// Node side: landing buffer, chain relay and the done report. The owner of
+// the CQ passes every completion to handle() first.
+class bcast_receiver {
+public:
+    bcast_receiver(struct ibv_pd *pd, struct ibv_cq *cq, struct ibv_qp *master_qp, uint32_t gidIndex, enum ibv_mtu mtu)
+        : pd(pd), cq(cq), master_qp(master_qp), gidIndex(gidIndex), mtu(mtu),
+          buf(nullptr), capacity(0), mr(nullptr), done_mr(nullptr), in_qp(nullptr), out_qp(nullptr),
+          size(0), chunk_size(0), chunks(0), landed(0), forwarded(0), forward_in_flight(0), has_next(false), active(false) {
+        memset(&next, 0, sizeof(next));
+        memset(&done_msg, 0, sizeof(done_msg));
+    }
+
+    ~bcast_receiver() {
+        if (in_qp)
+            ibv_destroy_qp(in_qp);
+        if (out_qp)
+            ibv_destroy_qp(out_qp);
+        if (mr)
+            ibv_dereg_mr(mr);
+        if (done_mr)
+            ibv_dereg_mr(done_mr);
+        delete[] buf;
+    }
+
+    // RPC_BCAST_PREPARE: make room for the blob and have the relay QPs in INIT.
+    uint32_t prepare(const char *args, uint32_t args_len, char *resp, uint32_t resp_cap) {
+        if (args_len < sizeof(bcast_prepare_s) || resp_cap < sizeof(bcast_target_s))
+            return 0;
+        const bcast_prepare_s *req = (const bcast_prepare_s *)args;
+        if (req->size == 0 || req->chunk_size == 0)
+            return 0;
+
+        if (req->size > capacity) {
+            if (mr)
+                ibv_dereg_mr(mr);
+            delete[] buf;
+            buf = new char[req->size];
+            capacity = req->size;
+            mr = ibv_reg_mr(pd, buf, capacity, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+            if (!mr) {
+                cerr << "ibv_reg_mr - broadcast - failed: " << strerror(errno) << endl;
+                capacity = 0;
+                return 0;
+            }
+        }
+
+        if (!done_mr && !(done_mr = ibv_reg_mr(pd, &done_msg, sizeof(done_msg), IBV_ACCESS_LOCAL_WRITE)))
+            return 0;
+        if (reset_relay_qp(in_qp) != 0 || reset_relay_qp(out_qp) != 0)
+            return 0;
+
+        size = req->size;
+        chunk_size = req->chunk_size;
+        chunks = bcast_chunks(size, chunk_size);
+        active = false;
+
+        bcast_target_s *target = (bcast_target_s *)resp;
+        memset(target, 0, sizeof(*target));
+        target->addr = (uintptr_t)buf;
+        target->rkey = mr->rkey;
+        target->in_qp_num = in_qp->qp_num;
+        target->out_qp_num = out_qp->qp_num;
+        return sizeof(*target);
+    }
+
+    // RPC_BCAST_START: connect the relay QPs to the neighbours in the chain.
+    // Chunks only flow after every node answered, so our RTR is never late.
+    // Answers with the chunk count it expects, nothing if it cannot take part.
+    uint32_t start(const char *args, uint32_t args_len, char *resp, uint32_t resp_cap) {
+        if (args_len < sizeof(bcast_start_s) || resp_cap < sizeof(uint32_t) || !mr)
+            return 0;
+        const bcast_start_s *req = (const bcast_start_s *)args;
+
+        if (req->has_prev) {
+            struct device_info prev;
+            memset(&prev, 0, sizeof(prev));
+            prev.gid = req->prev_gid;
+            prev.send_qp_num = req->prev_qp_num;
+            if (modify_qp_to_rtr(in_qp, prev, gidIndex, mtu, 0) != 0 || modify_qp_to_rts(in_qp, 0) != 0)
+                return 0;
+            for (uint32_t i = 0; i < BCAST_WINDOW; i++)
+                post_relay_recv();
+        }
+
+        has_next = req->has_next;
+        if (has_next) {
+            struct device_info peer;
+            memset(&peer, 0, sizeof(peer));
+            peer.gid = req->next_gid;
+            peer.send_qp_num = req->next.in_qp_num;
+            next = req->next;
+            if (modify_qp_to_rtr(out_qp, peer, gidIndex, mtu, 0) != 0 || modify_qp_to_rts(out_qp, 0) != 0)
+                return 0;
+        }
+
+        landed = 0;
+        forwarded = 0;
+        forward_in_flight = 0;
+        active = true;
+        cout << "> Broadcast of " << size << " bytes in " << chunks << " chunks armed"
+             << (req->mode == BCAST_CHAIN ? (has_next ? ", forwarding" : ", end of chain") : "") << endl;
+        memcpy(resp, &chunks, sizeof(chunks));
+        return sizeof(chunks);
+    }
+
+    // Returns true if `wc` belonged to the broadcast. Receive slots of the
+    // master connection are still reposted by the caller.
+    bool handle(const struct ibv_wc &wc) {
+        if (wc.wr_id == BCAST_DONE_WR)
+            return true;
+
+        if (wc.wr_id == BCAST_WR_SLOT) {
+            forward_in_flight--;
+            if (wc.status != ibv_wc_status::IBV_WC_SUCCESS)
+                cerr << "broadcast forward failed: " << ibv_wc_status_str(wc.status) << endl;
+            forward();
+            return true;
+        }
+
+        bool relay_recv = wc.wr_id == BCAST_RELAY_RECV_WR;
+        if (!relay_recv && (wc.status != ibv_wc_status::IBV_WC_SUCCESS || !is_bcast_chunk(wc)))
+            return false;
+        if (wc.status != ibv_wc_status::IBV_WC_SUCCESS) {
+            if (wc.status != ibv_wc_status::IBV_WC_WR_FLUSH_ERR)
+                cerr << "broadcast receive failed: " << ibv_wc_status_str(wc.status) << endl;
+            return true;
+        }
+
+        if (relay_recv)
+            post_relay_recv();
+        if (!active)
+            return true;
+
+        if (landed == 0)
+            first_chunk = std::chrono::steady_clock::now();
+        // RC delivers in order, the index only guards against a stale chunk
+        if ((ntohl(wc.imm_data) & ~BCAST_IMM_MASK) == landed)
+            landed++;
+        forward();
+        return true;
+    }
+
+private:
+    int reset_relay_qp(struct ibv_qp *&qp) {
+        if (!qp) {
+            struct ibv_qp_init_attr qp_init_attr;
+            qp = create_qp_for_send(qp_init_attr, pd, cq);
+            if (!qp) {
+                cerr << "ibv_create_qp - broadcast - failed: " << strerror(errno) << endl;
+                return -1;
+            }
+        } else if (modify_qp_to_reset(qp) != 0) {
+            return -1;
+        }
+        return modify_qp_to_init(qp);
+    }
+
+    void post_relay_recv() {
+        struct ibv_recv_wr wr, *bad_wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id   = BCAST_RELAY_RECV_WR;
+        wr.num_sge = 0;
+        int ret = ibv_post_recv(in_qp, &wr, &bad_wr);
+        if (ret != 0)
+            cerr << "ibv_post_recv - broadcast - failed: " << strerror(ret) << endl;
+    }
+
+    // Pass landed chunks on to the next node, then report once everything
+    // landed and left.
+    void forward() {
+        if (has_next && forwarded < landed && forward_in_flight < BCAST_WINDOW) {
+            uint32_t n = std::min(landed - forwarded, BCAST_WINDOW - forward_in_flight);
+            bcast_build_writes(wrs, sges, mr, buf, size, chunk_size, forwarded, n, next.addr, next.rkey, BCAST_WR_SLOT);
+
+            struct ibv_send_wr *bad_wr;
+            int ret = ibv_post_send(out_qp, wrs.data(), &bad_wr);
+            if (ret != 0) {
+                cerr << "ibv_post_send - broadcast - failed: " << strerror(ret) << endl;
+                return;
+            }
+            forwarded += n;
+            forward_in_flight += n;
+        }
+
+        if (landed == chunks && (!has_next || (forwarded == chunks && forward_in_flight == 0)))
+            report_done();
+    }
+
+    void report_done() {
+        active = false;
+        done_msg.bytes = size;
+        done_msg.checksum = bcast_checksum(buf, size);
+        done_msg.elapsed_us = elapsed_us(first_chunk);
+
+        struct ibv_sge sge;
+        sge.addr   = (uintptr_t)&done_msg;
+        sge.length = sizeof(done_msg);
+        sge.lkey   = done_mr->lkey;
+
+        struct ibv_send_wr wr, *bad_wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id      = BCAST_DONE_WR;
+        wr.sg_list    = &sge;
+        wr.num_sge    = 1;
+        wr.opcode     = IBV_WR_SEND_WITH_IMM;
+        wr.imm_data   = htonl(BCAST_DONE_IMM);
+        wr.send_flags = IBV_SEND_SIGNALED;
+
+        int ret = ibv_post_send(master_qp, &wr, &bad_wr);
+        if (ret != 0)
+            cerr << "ibv_post_send - broadcast done - failed: " << strerror(ret) << endl;
+        cout << "> Broadcast of " << size << " bytes received in " << done_msg.elapsed_us << " us" << endl;
+    }
+
+    struct ibv_pd *pd;
+    struct ibv_cq *cq;
+    struct ibv_qp *master_qp;
+    uint32_t gidIndex;
+    enum ibv_mtu mtu;
+
+    char *buf;
+    uint64_t capacity;
+    struct ibv_mr *mr;
+    bcast_done_s done_msg;
+    struct ibv_mr *done_mr;
+    struct ibv_qp *in_qp;
+    struct ibv_qp *out_qp;
+
+    uint64_t size;
+    uint32_t chunk_size;
+    uint32_t chunks;
+    uint32_t landed;
+    uint32_t forwarded;
+    uint32_t forward_in_flight;
+    bool has_next;
+    bcast_target_s next;
+    bool active;
+    std::chrono::steady_clock::time_point first_chunk;
+    std::vector<struct ibv_send_wr> wrs;
+    std::vector<struct ibv_sge> sges;
+};
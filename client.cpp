@@ -1,253 +1,560 @@
 #include <iostream>
 #include <cstring>
+#include <thread>
+#include <vector>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include <infiniband/verbs.h>
+#include <boost/program_options.hpp>
 #include "common.h"
+#include "rpc.h"
+#include "reduce.h"
+#include "node_link.h"
+#include "tcp_link.h"
+#include "record.h"
 
 using namespace std;
 
 const char* SERVER_IP = "192.168.1.132";
 
-int main() {
-    int clientSocket;
-    struct sockaddr_in serverAddr;
-    ssize_t bytesRead;
-    const char* message = "[CLIENT] RDMA device info about client";
-
+typedef struct node_options_ {
+    uint32_t node_id;
+    string master_ip;
+    int master_port;
+    // gather-and-reduce mode when reduce_elements != 0
+    uint32_t reduce_elements;
+    uint8_t reduce_dtype;
+    uint8_t reduce_op;
+    // PUT and GET this many keys in the master's KV store after connecting
+    uint32_t kv_ops;
+    // bump the master's shared counters this many times after connecting
+    uint32_t atomic_ops;
+    // stream this file to the master after connecting
+    string stream_file;
+    // producer threads, each with its own multiplexed flow, instead of the text message
+    uint32_t flows;
+    uint32_t flow_interval_us;
+    // how the producers encode their messages
+    codec_mode codec;
+    // node_transport: RoCE, or the TCP data path for hosts without it
+    uint32_t transport;
+    // hardware counters around posts and polls, printed at exit
+    bool perf_counters;
+    // end every incast message with a CRC32C trailer for the master to check
+    bool crc;
+} node_options_s;
+
+// gather-and-reduce: the whole vector, pre-chunked with headers, registered once
+char *reduce_buf;
+struct ibv_mr *reduce_mr;
+uint32_t reduce_chunks;
+
+template <typename T>
+void fill_reduce_values(char *chunk_payload, uint32_t offset, uint32_t elements, uint32_t node_id) {
+    T *values = (T *)chunk_payload;
+    for (uint32_t i = 0; i < elements; i++)
+        values[i] = (T)((offset + i) % 1024) + (T)(node_id % 16);
+}
 
-    // ==== RDMA variables ====
-    struct device_info local_rdma, server_rdma;
-    const char* data_to_send = "Hello from NODE !!!";
-    struct ibv_device** dev_list = get_rxe_device();
-	struct ibv_context *context = ibv_open_device(dev_list[0]);
-	struct ibv_pd *pd = ibv_alloc_pd(context);
-    struct ibv_qp_init_attr qp_init_attr;
-    struct ibv_port_attr port_attr;
-    struct ibv_qp *send_qp;
-    struct ibv_cq *send_cq;
-    int ret;
-    struct ibv_qp_attr qp_attr;
-    struct ibv_mr *send_mr;
-    char data_send[100];
-    struct ibv_sge sg_send;
-    struct ibv_send_wr wr_send, *bad_wr_send;
-    uint32_t gidIndex = 0;
+// Lay the node's vector out as ready-to-send chunks, each a header followed
+// by as many elements as fit into one master receive slot.
+int prepare_reduce_vector(struct ibv_pd *pd, const node_options_s &options) {
+    reduce_chunks = reduce_chunk_count(options.reduce_dtype, options.reduce_elements, REDUCE_CHUNK_SIZE);
+
+    reduce_buf = new char[(size_t)reduce_chunks * REDUCE_CHUNK_SIZE]();
+    layout_reduce_chunks(reduce_buf, REDUCE_CHUNK_SIZE, options.reduce_elements, options.reduce_dtype, options.reduce_op, nullptr);
+    for (uint32_t c = 0; c < reduce_chunks; c++) {
+        reduce_chunk_header_s *hdr = (reduce_chunk_header_s *)(reduce_buf + (size_t)c * REDUCE_CHUNK_SIZE);
+        char *payload = (char *)(hdr + 1);
+        if (options.reduce_dtype == REDUCE_F32)
+            fill_reduce_values<float>(payload, hdr->offset, hdr->elements, options.node_id);
+        else if (options.reduce_dtype == REDUCE_F64)
+            fill_reduce_values<double>(payload, hdr->offset, hdr->elements, options.node_id);
+        else
+            fill_reduce_values<int64_t>(payload, hdr->offset, hdr->elements, options.node_id);
+    }
 
-    set_gid(context, port_attr, &local_rdma, gidIndex);
-	
+    // a TCP node registers the buffer with its io_uring instead
     if (!pd)
-	{
-		cerr << "ibv_alloc_pd failed: " << strerror(errno) << endl;
-		goto free_context;
-	}
+        return 0;
+    reduce_mr = ibv_reg_mr(pd, reduce_buf, (size_t)reduce_chunks * REDUCE_CHUNK_SIZE, IBV_ACCESS_LOCAL_WRITE);
+    if (!reduce_mr)
+    {
+        cerr << "ibv_reg_mr - reduce - failed: " << strerror(errno) << endl;
+        return -1;
+    }
 
-	send_cq = ibv_create_cq(context, 0x10, nullptr, nullptr, 0);
-	if (!send_cq)
-	{
-		cerr << "ibv_create_cq - send - failed: " << strerror(errno) << endl;
-		goto free_pd;
-	}
+    cout << "Reduce mode: " << options.reduce_elements << " " << reduce_dtype_name(options.reduce_dtype)
+         << " elements in " << reduce_chunks << " chunks" << endl;
+    return 0;
+}
 
-	send_qp = create_qp_for_send(qp_init_attr, pd, send_cq);
-	if (!send_qp)
-	{
-		cerr << "ibv_create_qp failed: " << strerror(errno) << endl;
-		goto free_send_cq;
-	}
+// Latency of one-sided GETs against PUT RPCs on our own keys, plus how often
+// a GET caught a slot mid-update.
+void run_kv_bench(upstream_link &master_link, const node_options_s &options) {
+    kv_client &kv = master_link.kv_store();
+    char value[KV_VALUE_MAX];
+    uint32_t failed = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < options.kv_ops; i++) {
+        uint64_t key = ((uint64_t)options.node_id << 32) | (i + 1);
+        int len = snprintf(value, sizeof(value), "node %u value %u", options.node_id, i);
+        if (kv.put(key, value, len) != 0)
+            failed++;
+    }
+    double put_us = elapsed_us(start);
 
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < options.kv_ops; i++) {
+        uint64_t key = ((uint64_t)options.node_id << 32) | (i + 1);
+        if (kv.get(key, value, sizeof(value)) < 0)
+            failed++;
+    }
+    double get_us = elapsed_us(start);
 
-	memset(&qp_attr, 0, sizeof(qp_attr));
+    cout << "KV: " << options.kv_ops << " PUTs " << put_us / options.kv_ops << " us/op, "
+         << options.kv_ops << " GETs " << get_us / options.kv_ops << " us/op, "
+         << kv.torn_reads << " torn reads retried, " << failed << " failed" << endl;
+}
 
-	qp_attr.qp_state   = ibv_qp_state::IBV_QPS_INIT;
-	qp_attr.port_num   = 1;
-	qp_attr.pkey_index = 0;
-	qp_attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
-	                          IBV_ACCESS_REMOTE_WRITE | 
-	                          IBV_ACCESS_REMOTE_READ;
+// Slot 0 counts operations of all nodes, slot 1 hands out sequence numbers
+// and slot 2 is a lease every node takes and gives back.
+void run_atomic_bench(upstream_link &master_link, const node_options_s &options) {
+    counter_client &counters = master_link.shared_counters();
+    uint64_t old;
+    uint32_t failed = 0;
+    uint32_t leases = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < options.atomic_ops; i++) {
+        if (counters.fetch_add(0, 1, old) != 0)
+            failed++;
+    }
+    double add_us = elapsed_us(start);
+
+    start = std::chrono::steady_clock::now();
+    uint64_t first = 0, last = 0;
+    for (uint32_t i = 0; i < options.atomic_ops; i++) {
+        if (counters.next_sequence(1, last) != 0)
+            failed++;
+        if (i == 0)
+            first = last;
+    }
+    double seq_us = elapsed_us(start);
+
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < options.atomic_ops; i++) {
+        int held = counters.acquire_lease(2, options.node_id, 10);
+        if (held < 0)
+            failed++;
+        if (held == 1) {
+            leases++;
+            counters.release_lease(2, options.node_id);
+        }
+    }
+    double lease_us = elapsed_us(start);
 
-	// move both QPs in the INIT state, using ibv_modify_qp 
-	ret = ibv_modify_qp(send_qp, &qp_attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
-	if (ret != 0)
+    cout << "Atomics: fetch_add " << add_us / options.atomic_ops << " us/op, sequence "
+         << seq_us / options.atomic_ops << " us/op (got " << first << ".." << last << "), lease acquire+release "
+         << lease_us / options.atomic_ops << " us/op (" << leases << " taken), " << failed << " failed" << endl;
+}
+
+// Zero-copy (mmap + register) against read() into a bounce buffer, both
+// into the same preallocated file on the master.
+void run_file_stream(upstream_link &master_link, const node_options_s &options) {
+    file_streamer &files = master_link.file_upload();
+    string base = options.stream_file.substr(options.stream_file.rfind('/') + 1);
+    string remote = to_string(options.node_id) + "_" + base;
+
+    double zero_copy = files.stream(options.stream_file, remote, true);
+    double copied = files.stream(options.stream_file, remote, false);
+    if (zero_copy < 0 || copied < 0) {
+        cerr << "Streaming " << options.stream_file << " failed" << endl;
+        return;
+    }
+    cout << "File " << options.stream_file << ": zero-copy " << zero_copy << " MB/s, read()+write "
+         << copied << " MB/s" << endl;
+}
+
+// multiplexed flows: producers keep queueing while the link thread sends
+std::atomic<bool> producers_running;
+vector<std::thread> producers;
+
+// The node's message as a record at `buf`, `text` included. Returns the
+// fields to update in place before each send, nullptr if it does not fit.
+node_message_v1 *write_node_message(char *buf, uint32_t capacity, uint32_t node_id, uint16_t flow, const char *text, uint32_t &size) {
+    record_writer<node_message_schema> record(buf, capacity);
+    node_message_v1 &msg = record.fields();
+    msg.node_id = node_id;
+    msg.flow = flow;
+    msg.created_ns = clock_ns();
+    record.put(msg.text, text, strlen(text));
+    size = record.finish();
+    return size ? &msg : nullptr;
+}
+
+// A producer's message as a record at `buf`, formatted in place. Returns its
+// size, 0 if it does not fit.
+uint32_t write_flow_message(char *buf, uint32_t capacity, uint32_t node_id, uint16_t flow, uint32_t seq) {
+    const uint32_t max_text = 64;
+    record_writer<node_message_schema> record(buf, capacity);
+    node_message_v1 &msg = record.fields();
+    msg.node_id = node_id;
+    msg.sequence = seq;
+    msg.created_ns = clock_ns();
+    msg.flow = flow;
+    char *text = record.reserve(msg.text, max_text);
+    if (!text)
+        return 0;
+    int len = snprintf(text, max_text, "node %u flow %u message %u", node_id, flow, seq);
+    record.shrink(msg.text, std::min((uint32_t)len, max_text - 1));
+    return record.finish();
+}
+
+// One tenant of the node: a message every interval_us on its own flow. A full
+// flow means the master has not unlocked us for a while, the message is
+// retried after the next pause. The record is written straight into the
+// flow's buffer, unless a codec has to encode it from somewhere else.
+void run_producer(flow_mux &mux, uint16_t flow, uint32_t node_id, uint32_t interval_us) {
+    alignas(RECORD_ALIGN) char message[128];
+    uint32_t seq = 0;
+    while (producers_running.load(std::memory_order_relaxed)) {
+        bool queued = false;
+        if (mux.coded(flow)) {
+            uint32_t len = write_flow_message(message, sizeof(message), node_id, flow, seq);
+            queued = mux.enqueue(flow, message, len, SEQ_RECORD);
+        } else if (char *buf = mux.claim(flow)) {
+            mux.commit(flow, write_flow_message(buf, MUX_MSG_MAX, node_id, flow, seq), SEQ_RECORD);
+            queued = true;
+        }
+        if (queued)
+            seq++;
+        usleep(interval_us);
+    }
+}
+
+void start_producers(upstream_link &master_link, const node_options_s &options) {
+    producers_running = true;
+    for (uint32_t i = 0; i < options.flows; i++)
+        producers.emplace_back(run_producer, std::ref(master_link.flows()), (uint16_t)(MUX_FIRST_FLOW + i),
+                               options.node_id, options.flow_interval_us);
+    cout << "Started " << options.flows << " producers on flows " << MUX_FIRST_FLOW << ".." << MUX_FIRST_FLOW + options.flows - 1 << endl;
+}
+
+void stop_producers() {
+    producers_running = false;
+    for (auto &t : producers)
+        t.join();
+    producers.clear();
+}
+
+// what the codecs made of each flow's messages
+void report_codecs(flow_mux &mux, const node_options_s &options) {
+    if (options.codec == CODEC_MODE_OFF)
+        return;
+    for (uint32_t i = 0; i < options.flows; i++) {
+        uint16_t flow = MUX_FIRST_FLOW + i;
+        const codec_stats_s &st = mux.codec_stats(flow);
+        if (st.raw_bytes == 0)
+            continue;
+        cout << "> Flow " << flow << ": " << st.raw_bytes << " bytes coded into " << st.coded_bytes << " (x"
+             << (double)st.raw_bytes / st.coded_bytes << "),";
+        for (uint32_t c = 0; c < CODECS; c++)
+            cout << " " << codec_names[c] << " " << st.messages[c];
+        cout << endl;
+    }
+}
+
+uint8_t parse_reduce_dtype(const string &name) {
+	if (name == "f32")
+		return REDUCE_F32;
+	if (name == "f64")
+		return REDUCE_F64;
+	if (name == "i64")
+		return REDUCE_I64;
+	cerr << "unknown --reduce_dtype " << name << ", expected f32, f64 or i64" << endl;
+	exit(1);
+}
+
+// Without --node_id the node is identified by its hostname, which is stable
+// across restarts. Several nodes on one host need explicit IDs.
+void init_input_params_from_argc(int argc, char *argv[], node_options_s &options) {
+	boost::program_options::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "show possible options")
+		("node_id", boost::program_options::value<uint32_t>(), "stable node identifier, defaults to a hash of the hostname")
+		("master_ip", boost::program_options::value<string>()->default_value(SERVER_IP), "address of the master, or of an intermediate master in a tree")
+		("master_port", boost::program_options::value<int>()->default_value(PORT), "control port of the master")
+		("reduce_elements", boost::program_options::value<uint32_t>(), "send a vector of this many elements for gather-and-reduce instead of a text message")
+		("reduce_dtype", boost::program_options::value<string>()->default_value("f32"), "element type: f32, f64 or i64")
+		("reduce_op", boost::program_options::value<string>()->default_value("sum"), "reduction: sum or max")
+		("kv_ops", boost::program_options::value<uint32_t>()->default_value(0), "PUT and GET this many keys in the master's KV store after connecting")
+		("atomic_ops", boost::program_options::value<uint32_t>()->default_value(0), "update the master's shared counters this many times after connecting")
+		("stream_file", boost::program_options::value<string>(), "stream this file into the master's --file_dir, zero-copy and through read()")
+		("flows", boost::program_options::value<uint32_t>()->default_value(0), "producer threads, each sending on its own flow over the one QP, instead of the text message")
+		("flow_interval_us", boost::program_options::value<uint32_t>()->default_value(1000), "pause between two messages of a producer")
+		("codec", boost::program_options::value<string>()->default_value("off"), "encoding of the flow messages: off, lz, xor (against the flow's previous message) or auto (per flow, by measured ratio)")
+		("transport", boost::program_options::value<string>()->default_value("rdma"), "rdma, or tcp for a host without RoCE")
+		("perf_counters", "count cycles, instructions, cache and branch misses of posts and polls, printed per message at exit")
+		("crc", "end every incast message with a CRC32C of its payload, checked by the master")
+	;
+
+	boost::program_options::variables_map vm;
+	boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+	boost::program_options::notify(vm);
+
+	if (vm.count("help"))
 	{
-		cerr << "ibv_modify_qp - INIT - failed: " << strerror(ret) << endl;
-		goto free_send_qp;
+		cout << desc << endl;
+		exit(0);
 	}
 
-    send_mr = ibv_reg_mr(pd, data_send, sizeof(data_send), IBV_ACCESS_LOCAL_WRITE | 
-	             IBV_ACCESS_REMOTE_WRITE | 
-	             IBV_ACCESS_REMOTE_READ);
-	if (!send_mr)
+	if (vm.count("node_id"))
 	{
-		cerr << "ibv_reg_mr failed: " << strerror(errno) << endl;
-		goto free_send_qp;
+		options.node_id = vm["node_id"].as<uint32_t>();
+	}
+	else
+	{
+		char hostname[256] = {0};
+		gethostname(hostname, sizeof(hostname) - 1);
+		options.node_id = (uint32_t)std::hash<string>{}(hostname);
 	}
 
-	local_rdma.send_qp_num = send_qp->qp_num;
+	options.master_ip = vm["master_ip"].as<string>();
+	options.master_port = vm["master_port"].as<int>();
+	options.reduce_elements = vm.count("reduce_elements") ? vm["reduce_elements"].as<uint32_t>() : 0;
+	options.reduce_dtype = parse_reduce_dtype(vm["reduce_dtype"].as<string>());
+	options.reduce_op = vm["reduce_op"].as<string>() == "max" ? REDUCE_MAX : REDUCE_SUM;
+	options.kv_ops = vm["kv_ops"].as<uint32_t>();
+	options.atomic_ops = vm["atomic_ops"].as<uint32_t>();
+	options.stream_file = vm.count("stream_file") ? vm["stream_file"].as<string>() : "";
+	options.flows = vm["flows"].as<uint32_t>();
+	options.flow_interval_us = vm["flow_interval_us"].as<uint32_t>();
+	options.perf_counters = vm.count("perf_counters") != 0;
+	options.crc = vm.count("crc") != 0;
+	if (options.flows > MUX_FLOWS)
+	{
+		cerr << "--flows must not exceed " << MUX_FLOWS << endl;
+		exit(1);
+	}
 
+	string codec = vm["codec"].as<string>();
+	if (codec == "off")
+		options.codec = CODEC_MODE_OFF;
+	else if (codec == "lz")
+		options.codec = CODEC_MODE_LZ;
+	else if (codec == "xor")
+		options.codec = CODEC_MODE_XOR;
+	else if (codec == "auto")
+		options.codec = CODEC_MODE_AUTO;
+	else
+	{
+		cerr << "unknown --codec " << codec << ", expected off, lz, xor or auto" << endl;
+		exit(1);
+	}
+	if (options.codec != CODEC_MODE_OFF && options.flows == 0)
+	{
+		cerr << "--codec encodes the messages of --flows" << endl;
+		exit(1);
+	}
 
-	memset(&qp_attr, 0, sizeof(qp_attr));
+	string transport = vm["transport"].as<string>();
+	if (transport != "rdma" && transport != "tcp")
+	{
+		cerr << "unknown --transport " << transport << ", expected rdma or tcp" << endl;
+		exit(1);
+	}
+	options.transport = transport == "tcp" ? TRANSPORT_TCP : TRANSPORT_RDMA;
+	// RPCs and one-sided operations need a QP
+	if (options.transport == TRANSPORT_TCP &&
+	    (options.kv_ops != 0 || options.atomic_ops != 0 || !options.stream_file.empty() || options.flows != 0 ||
+	     options.perf_counters || options.crc))
+	{
+		cerr << "--kv_ops, --atomic_ops, --stream_file, --flows, --perf_counters and --crc need --transport=rdma" << endl;
+		exit(1);
+	}
+}
 
-	qp_attr.path_mtu              = port_attr.active_mtu;
-	qp_attr.qp_state              = ibv_qp_state::IBV_QPS_RTR;
-	qp_attr.rq_psn                = 0;
-	qp_attr.max_dest_rd_atomic    = 1;
-	qp_attr.min_rnr_timer         = 0;
-	qp_attr.ah_attr.is_global     = 1;
-	qp_attr.ah_attr.sl            = 0;
-	qp_attr.ah_attr.src_path_bits = 0;
-	qp_attr.ah_attr.port_num      = 1;
+// A node without RoCE: the text message or the reduce vector go to the master
+// as frames over the control socket, sent zero-copy by io_uring.
+int run_tcp_node(const node_options_s &options, const char *data_to_send) {
+    alignas(RECORD_ALIGN) char data_send[RDMA_MSG_SIZE];
+    tcp_link link;
+    uint32_t record_size;
 
-    // ====== Create socket =======
-    if ((clientSocket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("Socket creation failed");
+    if (options.reduce_elements != 0 && prepare_reduce_vector(nullptr, options) != 0)
         return 1;
-    }
-
-    // Set up server address structure
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(PORT);
-    serverAddr.sin_addr.s_addr = inet_addr(SERVER_IP);
+    memset(data_send, 0, sizeof(data_send));
+    node_message_v1 *message = write_node_message(data_send, sizeof(data_send), options.node_id, SEQ_FLOW_DATA, data_to_send, record_size);
 
-    // Connect to the server
-    if (connect(clientSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1) {
-        perror("Connection failed");
-        close(clientSocket);
+    if (link.open() != 0 ||
+        link.register_buffer(1, data_send, sizeof(data_send)) != 0 ||
+        (reduce_chunks != 0 && link.register_buffer(2, reduce_buf, (size_t)reduce_chunks * REDUCE_CHUNK_SIZE) != 0))
+        return 1;
+    if (link.connect_to(options.master_ip, options.master_port, options.node_id) != 0)
         return 1;
-    }
-
-    // Send a message to the server
-    cout << "> Send RDMA device info to MASTER. QP: " << local_rdma.send_qp_num << ", intf: " << local_rdma.gid.global.interface_id << endl;
-    if (send(clientSocket, &local_rdma, sizeof(local_rdma), 0) == -1) {
-        perror("Message sending failed");
-    }
-
-    bytesRead = recv(clientSocket, &server_rdma, sizeof(server_rdma), 0);
 
-    if (bytesRead == -1) {
-        perror("Error while receiving data");
-    } else if (bytesRead == 0) {
-        cout << "Server disconnected." << endl;
-    } else {
-        // Null-terminate the received data to treat it as a string
-        cout << "> Receive RDMA device info from MASTER. QP: " << server_rdma.send_qp_num << ", intf: " << server_rdma.gid.global.interface_id << endl;
+    cout << "Waiting for UNLOCK from MASTER" << endl;
+    while (true) {
+        link_event event = link.poll();
+        if (event == LINK_CLOSED)
+            break;
+        if (event != LINK_UNLOCK)
+            continue;
+
+        cout << "Node unblocked to send data" << endl;
+        if (reduce_chunks != 0) {
+            if (link.send_reduce_chunks(2, reduce_buf, reduce_chunks) != 0)
+                continue;
+            cout << "Done sending " << reduce_chunks << " reduce chunks over TCP" << endl;
+        } else {
+            message->created_ns = clock_ns();
+            if (link.send_message(1, data_send, sizeof(data_send), SEQ_RECORD) != 0)
+                continue;
+            message->sequence++;
+            cout << "Done sending data: '" << data_to_send << "' over TCP" << endl;
+        }
+        cout << "TCP: " << link.stats.frames << " frames, " << link.stats.bytes << " bytes, "
+             << link.stats.copied << " copied by the kernel" << endl;
+        cout << "Waiting for UNLOCK from MASTER" << endl;
     }
 
+    delete[] reduce_buf;
+    return 0;
+}
 
-	// ==== RMDA INIT ====
-	memcpy(&qp_attr.ah_attr.grh.dgid, &server_rdma.gid, sizeof(server_rdma.gid));
-
-	qp_attr.ah_attr.grh.flow_label    = 0;
-	qp_attr.ah_attr.grh.hop_limit     = 5;
-	qp_attr.ah_attr.grh.sgid_index    = gidIndex;
-	qp_attr.ah_attr.grh.traffic_class = 0;
-
-	qp_attr.ah_attr.dlid = 1;
-	qp_attr.dest_qp_num  = server_rdma.send_qp_num;
+int main(int argc, char *argv[]) {
+    const char* data_to_send = "Hello from NODE !!!";
+    node_options_s options;
+    init_input_params_from_argc(argc, argv, options);
+    if (options.transport == TRANSPORT_TCP)
+        return run_tcp_node(options, data_to_send);
 
-	// move the send QP into the RTR state, using ibv_modify_qp
-	ret = ibv_modify_qp(send_qp, &qp_attr, IBV_QP_STATE | IBV_QP_AV |
-						IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
-						IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    // ==== RDMA variables ====
+    struct ibv_device** dev_list = get_rxe_device();
+	struct ibv_context *context = ibv_open_device(dev_list[0]);
+	struct ibv_pd *pd = ibv_alloc_pd(context);
+    struct ibv_mr *send_mr;
+    alignas(RECORD_ALIGN) char data_send[RDMA_MSG_SIZE];
+    // the record in data_send, updated in place for every send
+    node_message_v1 *message;
+    uint32_t record_size;
+    // connection to the master: QP, RPC endpoint, stats and config
+    upstream_link master_link;
+    perf_profiler profiler;
 
-	if (ret != 0)
+    if (!pd)
 	{
-		cerr << "ibv_modify_qp - RTR - failed: " << strerror(ret) << endl;
-		exit(1);
+		cerr << "ibv_alloc_pd failed: " << strerror(errno) << endl;
+		goto free_context;
 	}
 
-	qp_attr.qp_state      = ibv_qp_state::IBV_QPS_RTS;
-	qp_attr.timeout       = 0;
-	qp_attr.retry_cnt     = 7;
-	qp_attr.rnr_retry     = 7;
-	qp_attr.sq_psn        = 0;
-	qp_attr.max_rd_atomic = 0;
-
-	// move the send and write QPs into the RTS state, using ibv_modify_qp
-	ret = ibv_modify_qp(send_qp, &qp_attr, IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
-						IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC);
-	if (ret != 0)
+	if (master_link.open(context, pd, options.node_id) != 0)
+		goto free_pd;
+	// this thread drives the link, the producers only fill its rings
+	if (options.perf_counters && profiler.open() == 0)
+		master_link.set_profiler(&profiler);
+	master_link.set_crc(options.crc);
+	master_link.flows().set_codec(options.codec);
+
+    send_mr = ibv_reg_mr(pd, data_send, sizeof(data_send), IBV_ACCESS_LOCAL_WRITE |
+	             IBV_ACCESS_REMOTE_WRITE |
+	             IBV_ACCESS_REMOTE_READ);
+	if (!send_mr)
 	{
-		cerr << "ibv_modify_qp - RTS - failed: " << strerror(ret) << endl;
-		goto free_send_mr;
+		cerr << "ibv_reg_mr failed: " << strerror(errno) << endl;
+		goto free_pd;
 	}
 
-	memset(data_send, 0, sizeof(data_send));
-	memcpy(data_send, data_to_send, strlen(data_to_send));
+	if (options.reduce_elements != 0 && prepare_reduce_vector(pd, options) != 0)
+		goto free_send_mr;
 
-	// initialise sg_send with the send mr address, size and lkey
-	memset(&sg_send, 0, sizeof(sg_send));
-	sg_send.addr   = (uintptr_t)send_mr->addr;
-	sg_send.length = sizeof(data_send);
-	sg_send.lkey   = send_mr->lkey;
+	if (master_link.connect_to(options.master_ip, options.master_port) != 0)
+		goto free_reduce;
 
-	cout << "Using for sending: addr " << (uintptr_t)send_mr->addr << " and lkey: " << send_mr->lkey << endl;
+	if (options.kv_ops != 0)
+		run_kv_bench(master_link, options);
+	if (options.atomic_ops != 0)
+		run_atomic_bench(master_link, options);
+	if (!options.stream_file.empty())
+		run_file_stream(master_link, options);
+	if (options.flows != 0)
+		start_producers(master_link, options);
 
-	// create a work request, with the RDMA Send operation
-	memset(&wr_send, 0, sizeof(wr_send));
-	wr_send.wr_id      = 0;
-	wr_send.sg_list    = &sg_send;
-	wr_send.num_sge    = 1;
-	wr_send.opcode     = IBV_WR_SEND;
-	wr_send.send_flags = IBV_SEND_SIGNALED;
-	// ==== RMDA INIT ====
+	memset(data_send, 0, sizeof(data_send));
+	message = write_node_message(data_send, sizeof(data_send), options.node_id, SEQ_FLOW_DATA, data_to_send, record_size);
+	cout << "Using for sending: addr " << (uintptr_t)send_mr->addr << " and lkey: " << send_mr->lkey << endl;
 
-    char buffer[BUFFER_SIZE];
+    cout << "Waiting for UNLOCK from MASTER" << endl;
     while(true) {
-        cout << "Waiting for UNLOCK from MASTER" << endl;
-        bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
-
-        if (bytesRead == -1) {
-            perror("Error while receiving data");
-            break;
-        } else if (bytesRead == 0) {
-            cout << "Server disconnected." << endl;
+        link_event event = master_link.poll();
+        if (event == LINK_CLOSED)
             break;
-        } else {
-            buffer[bytesRead] = '\0';
-            cout << "Received message from server: " << buffer << endl;
-            // Send data using RDMA
-            // check if i have data
+        if (event != LINK_UNLOCK)
+            continue;
+
+        // Send data using RDMA
+        // check if i have data
 
-            cout << "Node unblocked to send data" << endl;
-            cout << "Checking if I have data to send to master node ..." << endl;
+        cout << "Node unblocked to send data" << endl;
+        cout << "Checking if I have data to send to master node ..." << endl;
 
-            cout << "Send data through RDMA" << endl;
+        cout << "Send data through RDMA" << endl;
 
-            // ===== RDMA operation ======
-            ret = ibv_post_send(send_qp, &wr_send, &bad_wr_send);
-            if (ret != 0)
-            {
-                cerr << "ibv_post_recv failed: " << strerror(ret) << endl;
-            }
+        if (reduce_chunks != 0) {
+            if (master_link.send_reduce_chunks(reduce_mr, reduce_buf, reduce_chunks) != 0)
+                continue;
+            cout << "Done sending " << reduce_chunks << " reduce chunks" << endl;
+            cout << "Waiting for UNLOCK from MASTER" << endl;
+            continue;
+        }
 
-            cout << "Done sending data: '" << data_to_send << "' with len: " << strlen(data_to_send) << endl; 
+        if (options.flows != 0) {
+            int sent = master_link.send_flows();
+            if (sent < 0)
+                continue;
+            cout << "Done sending " << sent << " messages on " << options.flows << " flows" << endl;
+            cout << "Waiting for UNLOCK from MASTER" << endl;
+            continue;
         }
+
+        // ===== RDMA operation ======
+        // the record is written where it goes out from, only what changes is touched
+        message->created_ns = clock_ns();
+        if (master_link.send_message(send_mr, data_send, std::max(record_size, master_link.config.message_size), SEQ_RECORD) != 0)
+            continue;
+        message->sequence++;
+
+        cout << "Done sending data: '" << data_to_send << "' with len: " << strlen(data_to_send) << endl;
+        cout << "Waiting for UNLOCK from MASTER" << endl;
     }
 
-free_send_mr:
-	ibv_dereg_mr(send_mr);
+	stop_producers();
+	report_codecs(master_link.flows(), options);
+	profiler.report(cout, "node");
 
-free_send_qp:
-	ibv_destroy_qp(send_qp);
+free_reduce:
+	if (reduce_mr)
+		ibv_dereg_mr(reduce_mr);
+	delete[] reduce_buf;
 
-free_send_cq:
-	ibv_destroy_cq(send_cq);
+free_send_mr:
+	ibv_dereg_mr(send_mr);
 
 free_pd:
+	// the link owns QP, CQ and memory registered in pd
+	master_link.close();
 	ibv_dealloc_pd(pd);
-    
+
 free_context:
 	ibv_close_device(context);
 
 free_devlist:
 	ibv_free_device_list(dev_list);
 
-close_socket:
-    close(clientSocket);
-	
     return 0;
 }
@@ -0,0 +1,214 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+
+#include "common.h"
+
+// Clock offsets between the master and its nodes, so the send timestamp a
+// node puts into each message (seq_header_s::send_ns, its clock_ns()) can be
+// read on the master's clock and a turn's latency split into the node's part
+// (grant to send) and the fabric's (send to the master polling the message).
+//
+// Sync: the master pings every node over RPC (RPC_CLOCK_SYNC) CLOCK_PINGS
+// times per pass. A ping gives the master's time it was sent, the node's
+// clock when it answered and the master's time the answer was polled. The
+// node's clock is taken to be read at the midpoint, off by at most half the
+// RTT, so of a round only the ping with the smallest RTT counts: the others
+// met a queue on the way. The best pings of the last CLOCK_HISTORY rounds
+// are fitted to a line, offset + drift * t, which keeps the estimate right
+// between syncs while the two oscillators drift apart. Rounds whose best
+// ping was still far slower than the best in the history stay out of the fit.
+
+const uint32_t CLOCK_PINGS = 8;
+const uint32_t CLOCK_HISTORY = 16;
+// a round joins the fit if its RTT is within this factor of the history's best
+const uint32_t CLOCK_RTT_SLACK = 2;
+
+typedef struct clock_sample_ {
+    // master time of the ping's midpoint
+    uint64_t master_ns;
+    // node minus master
+    int64_t offset_ns;
+    uint64_t rtt_ns;
+} clock_sample_s;
+
+class clock_estimator {
+public:
+    clock_estimator() { reset(); }
+
+    // the node may be a new process on another host
+    void reset() {
+        count = 0;
+        next = 0;
+        best.rtt_ns = UINT64_MAX;
+        synced = false;
+        base = 0;
+        offset = 0;
+        drift = 0;
+        min_rtt = 0;
+    }
+
+    void sample(uint64_t sent, uint64_t node, uint64_t answered) {
+        if (answered < sent || answered - sent >= best.rtt_ns)
+            return;
+        uint64_t rtt = answered - sent;
+        uint64_t mid = sent + rtt / 2;
+        best = { mid, (int64_t)(node - mid), rtt };
+    }
+
+    // The round's best ping joins the history and the line is refitted.
+    void end_round() {
+        if (best.rtt_ns == UINT64_MAX)
+            return;
+        history[next] = best;
+        next = (next + 1) % CLOCK_HISTORY;
+        count = std::min(count + 1, CLOCK_HISTORY);
+        best.rtt_ns = UINT64_MAX;
+        fit();
+    }
+
+    bool is_synced() const { return synced; }
+
+    // node minus master at master time `master_ns`
+    int64_t offset_at(uint64_t master_ns) const {
+        return offset + (int64_t)(drift * (double)(int64_t)(master_ns - base));
+    }
+
+    uint64_t to_master(uint64_t node_ns) const {
+        return node_ns - offset_at(node_ns - offset);
+    }
+
+    double drift_ppm() const { return drift * 1e6; }
+    // how far off the estimate can be, half the best RTT in the fit
+    uint64_t error_ns() const { return min_rtt / 2; }
+
+private:
+    // Least squares over the history, relative to the newest sample so the
+    // doubles stay small.
+    void fit() {
+        min_rtt = UINT64_MAX;
+        for (uint32_t i = 0; i < count; i++)
+            min_rtt = std::min(min_rtt, history[i].rtt_ns);
+
+        const clock_sample_s &last = history[(next + CLOCK_HISTORY - 1) % CLOCK_HISTORY];
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            const clock_sample_s &s = history[i];
+            if (s.rtt_ns > min_rtt * CLOCK_RTT_SLACK)
+                continue;
+            double x = (double)(int64_t)(s.master_ns - last.master_ns);
+            double y = (double)(s.offset_ns - last.offset_ns);
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+            n++;
+        }
+
+        double den = n * sxx - sx * sx;
+        drift = n >= 2 && den > 0 ? (n * sxy - sx * sy) / den : 0;
+        base = last.master_ns;
+        offset = last.offset_ns + (int64_t)((sy - drift * sx) / n);
+        synced = true;
+    }
+
+    clock_sample_s history[CLOCK_HISTORY];
+    uint32_t count;
+    uint32_t next;
+    // the current round's fastest ping
+    clock_sample_s best;
+
+    bool synced;
+    uint64_t base;
+    int64_t offset;
+    double drift;
+    uint64_t min_rtt;
+};
+
+// one node's turns of a pass, split at the node's send
+typedef struct latency_split_ {
+    uint64_t messages;
+    // grant to the node's send, the UNLOCK's way to the node included
+    uint64_t node_ns;
+    // the node's send to the master polling the message
+    uint64_t fabric_ns;
+    uint64_t max_fabric_ns;
+} latency_split_s;
+
+typedef struct clock_stats_ {
+    uint64_t pings;
+    // pings that got no answer in time
+    uint64_t lost;
+    // stamped messages of nodes without an estimate, e.g. TCP nodes
+    uint64_t unsynced;
+    // converted sends outside their turn by more than the estimate's error
+    uint64_t skewed;
+} clock_stats_s;
+
+class clock_sync {
+public:
+    clock_sync() {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    void init(uint32_t max_nodes) {
+        estimators.reset(new clock_estimator[max_nodes]);
+        grants.reset(new uint64_t[max_nodes]());
+        splits.reset(new latency_split_s[max_nodes]());
+        nodes = max_nodes;
+    }
+
+    void reset(uint32_t node) {
+        estimators[node].reset();
+        grants[node] = 0;
+    }
+
+    clock_estimator &estimator(uint32_t node) { return estimators[node]; }
+
+    void begin_pass() {
+        memset(splits.get(), 0, sizeof(latency_split_s) * nodes);
+    }
+
+    void grant(uint32_t node, uint64_t now) { grants[node] = now; }
+
+    // A message of `node` stamped `send_ns` on the node's clock was polled at `now`.
+    void arrive(uint32_t node, uint64_t send_ns, uint64_t now) {
+        if (send_ns == 0 || grants[node] == 0)
+            return;
+        const clock_estimator &est = estimators[node];
+        if (!est.is_synced()) {
+            stats.unsynced++;
+            return;
+        }
+
+        // within the estimate's error a send can seem to fall outside its turn
+        uint64_t sent = est.to_master(send_ns);
+        if (sent > now) {
+            if (sent - now > est.error_ns())
+                stats.skewed++;
+            sent = now;
+        } else if (sent < grants[node]) {
+            if (grants[node] - sent > est.error_ns())
+                stats.skewed++;
+            sent = grants[node];
+        }
+
+        latency_split_s &split = splits[node];
+        split.messages++;
+        split.node_ns += sent - grants[node];
+        split.fabric_ns += now - sent;
+        split.max_fabric_ns = std::max(split.max_fabric_ns, now - sent);
+    }
+
+    const latency_split_s &latency(uint32_t node) const { return splits[node]; }
+
+    clock_stats_s stats;
+
+private:
+    uint32_t nodes = 0;
+    std::unique_ptr<clock_estimator[]> estimators;
+    // master time of each node's last grant
+    std::unique_ptr<uint64_t[]> grants;
+    std::unique_ptr<latency_split_s[]> splits;
+};
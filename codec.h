@@ -0,0 +1,378 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Payload codecs for the multiplexed flows, for when the master's link and
+// not its CPU bounds the incast. A producer encodes its message straight
+// into the flow's registered buffer, in place of the plain copy. The master
+// decodes it straight out of the receive slot into the text it collects.
+//
+// A coded message has SEQ_CODED set in its sequence header and starts with
+// a codec_header_s. Codecs:
+// - raw: the bytes as they are, for what does not compress
+// - lz: byte-oriented LZ77 (LZ4-style sequences) with a 64 KB window
+// - xor: XOR against the flow's previous message, then lz. Telemetry that
+//   changes in a few fields becomes runs of zeros.
+//
+// In auto mode each flow measures the ratio every codec gets on the flow's
+// own messages and uses the best one. Probes run on one message in
+// CODEC_PROBE_INTERVAL and feed a moving average per codec. The codec in use
+// feeds it with every message.
+//
+// xor needs the previous message on both ends. Every message of a coded
+// flow carries its number in the flow and updates the reference, whatever
+// its codec. A decoder that missed one (a gap, a failed check) drops the xor
+// messages after it until the next non-xor message. A keyframe every
+// CODEC_KEYFRAME messages bounds the damage.
+
+enum payload_codec : uint8_t {
+    CODEC_RAW = 0,
+    CODEC_LZ,
+    CODEC_XOR,
+    CODECS,
+};
+
+// what a flow is told to use, auto picks by measured ratio
+enum codec_mode {
+    CODEC_MODE_OFF = 0,
+    CODEC_MODE_LZ,
+    CODEC_MODE_XOR,
+    CODEC_MODE_AUTO,
+};
+
+const char *const codec_names[CODECS] = { "raw", "lz", "xor" };
+
+const uint32_t CODEC_PROBE_INTERVAL = 16;
+const uint32_t CODEC_KEYFRAME = 64;
+// weight of a new ratio sample, in 1/256
+const uint32_t CODEC_EWMA_WEIGHT = 32;
+
+typedef struct codec_header_ {
+    uint8_t codec;
+    uint8_t reserved;
+    // bytes after decoding
+    uint16_t raw_len;
+    // message number in the flow, xor refers to the one before
+    uint32_t index;
+} codec_header_s;
+
+// a raw message of up to this many bytes can always be coded
+const uint32_t CODEC_MAX_RAW = UINT16_MAX;
+
+// ==== lz ====
+
+const uint32_t LZ_MIN_MATCH = 4;
+const uint32_t LZ_HASH_BITS = 12;
+const uint32_t LZ_MAX_OFFSET = UINT16_MAX;
+
+inline uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// A literal or match length over 14: 15 in the token, the rest in bytes of
+// 255 and a final one below 255.
+inline uint8_t *lz_put_length(uint8_t *op, const uint8_t *oend, uint32_t n) {
+    for (; n >= 255; n -= 255) {
+        if (op == oend)
+            return nullptr;
+        *op++ = 255;
+    }
+    if (op == oend)
+        return nullptr;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+inline bool lz_get_length(const uint8_t *&ip, const uint8_t *iend, uint32_t &n) {
+    uint8_t b;
+    do {
+        if (ip == iend)
+            return false;
+        b = *ip++;
+        n += b;
+    } while (b == 255);
+    return true;
+}
+
+// the match finder, reused across messages without clearing it
+class lz_compressor {
+public:
+    lz_compressor() : generation(0) {
+        memset(table, 0, sizeof(table));
+    }
+
+    // Returns the compressed size, 0 if it does not fit into `room`.
+    uint32_t compress(const void *src, uint32_t len, void *dst, uint32_t room) {
+        // an entry is (generation << 16) | position, older ones do not count
+        if (++generation == 0x10000) {
+            memset(table, 0, sizeof(table));
+            generation = 1;
+        }
+        const uint8_t *in = (const uint8_t *)src, *iend = in + len, *anchor = in;
+        uint8_t *op = (uint8_t *)dst, *oend = op + room;
+
+        const uint8_t *ip = in;
+        while (len >= LZ_MIN_MATCH && ip <= iend - LZ_MIN_MATCH) {
+            uint32_t v = lz_read32(ip);
+            uint32_t &entry = table[lz_hash(v)];
+            uint32_t ref = entry & 0xffff;
+            bool hit = entry >> 16 == generation && ip - in - ref <= LZ_MAX_OFFSET && lz_read32(in + ref) == v;
+            entry = (generation << 16) | (uint32_t)(ip - in);
+            if (!hit) {
+                ip++;
+                continue;
+            }
+
+            const uint8_t *match = in + ref;
+            uint32_t mlen = LZ_MIN_MATCH;
+            while (ip + mlen < iend && ip[mlen] == match[mlen])
+                mlen++;
+            op = put_sequence(op, oend, anchor, ip - anchor, ip - match, mlen);
+            if (!op)
+                return 0;
+            ip += mlen;
+            anchor = ip;
+        }
+        // the last sequence is literals only
+        op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+        return op ? op - (uint8_t *)dst : 0;
+    }
+
+private:
+    static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals, uint32_t lits,
+                                 uint32_t offset, uint32_t mlen) {
+        if (op == oend)
+            return nullptr;
+        uint32_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+        uint8_t *token = op++;
+        *token = (uint8_t)((lits < 15 ? lits : 15) << 4 | (mcode < 15 ? mcode : 15));
+        if (lits >= 15 && !(op = lz_put_length(op, oend, lits - 15)))
+            return nullptr;
+        if ((size_t)(oend - op) < lits)
+            return nullptr;
+        memcpy(op, literals, lits);
+        op += lits;
+        if (mlen == 0)
+            return op;
+        if (oend - op < 2)
+            return nullptr;
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        if (mcode >= 15 && !(op = lz_put_length(op, oend, mcode - 15)))
+            return nullptr;
+        return op;
+    }
+
+    uint32_t table[1u << LZ_HASH_BITS];
+    uint32_t generation;
+};
+
+// Decode exactly `raw_len` bytes, false for anything malformed. Nothing is
+// read or written out of bounds whatever `src` holds.
+inline bool lz_decompress(const void *src, uint32_t len, void *dst, uint32_t raw_len) {
+    const uint8_t *ip = (const uint8_t *)src, *iend = ip + len;
+    uint8_t *out = (uint8_t *)dst, *op = out, *oend = out + raw_len;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        uint32_t lits = token >> 4;
+        if (lits == 15 && !lz_get_length(ip, iend, lits))
+            return false;
+        if ((size_t)(iend - ip) < lits || (size_t)(oend - op) < lits)
+            return false;
+        memcpy(op, ip, lits);
+        ip += lits;
+        op += lits;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return false;
+        uint32_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        uint32_t mlen = token & 15;
+        if (mlen == 15 && !lz_get_length(ip, iend, mlen))
+            return false;
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - out) || (size_t)(oend - op) < mlen)
+            return false;
+        // byte by byte, a match may overlap what it writes
+        const uint8_t *match = op - offset;
+        for (uint32_t i = 0; i < mlen; i++)
+            op[i] = match[i];
+        op += mlen;
+    }
+    return op == oend;
+}
+
+// ==== flows ====
+
+typedef struct codec_stats_ {
+    uint64_t messages[CODECS];
+    uint64_t raw_bytes;
+    // codec headers included
+    uint64_t coded_bytes;
+} codec_stats_s;
+
+// One flow's sending end, used by its producer only.
+class codec_encoder {
+public:
+    codec_encoder() : mode(CODEC_MODE_OFF), index(0), current(CODEC_LZ) {
+        memset(&stats, 0, sizeof(stats));
+        // raw stays at 1, a codec has to beat it; lz until the first probe
+        for (uint32_t c = 0; c < CODECS; c++)
+            ratio[c] = 256;
+    }
+
+    void set_mode(codec_mode m) { mode = m; }
+    bool enabled() const { return mode != CODEC_MODE_OFF; }
+
+    // Code `len` bytes into `out`, header first. Returns the bytes written,
+    // 0 if `room` cannot take even the raw message.
+    uint32_t encode(const void *data, uint32_t len, char *out, uint32_t room) {
+        if (len > CODEC_MAX_RAW || room < sizeof(codec_header_s) + len)
+            return 0;
+
+        bool has_reference = index % CODEC_KEYFRAME != 0 && index != 0;
+        payload_codec codec;
+        if (mode == CODEC_MODE_LZ) {
+            codec = CODEC_LZ;
+        } else if (mode == CODEC_MODE_XOR) {
+            codec = has_reference ? CODEC_XOR : CODEC_LZ;
+        } else {
+            if (index % CODEC_PROBE_INTERVAL == 1)
+                probe(data, len, out, room);
+            codec = current == CODEC_XOR && !has_reference ? CODEC_LZ : current;
+        }
+
+        uint32_t n = encode_as(codec, data, len, out, room);
+        if (mode == CODEC_MODE_AUTO && codec != CODEC_RAW)
+            measure(codec, len, n ? n : sizeof(codec_header_s) + len);
+        if (n == 0) {
+            codec = CODEC_RAW;
+            n = encode_as(codec, data, len, out, room);
+        }
+
+        reference.assign((const char *)data, (const char *)data + len);
+        index++;
+        stats.messages[codec]++;
+        stats.raw_bytes += len;
+        stats.coded_bytes += n;
+        return n;
+    }
+
+    codec_stats_s stats;
+
+private:
+    uint32_t encode_as(payload_codec codec, const void *data, uint32_t len, char *out, uint32_t room) {
+        codec_header_s *hdr = (codec_header_s *)out;
+        hdr->codec = codec;
+        hdr->reserved = 0;
+        hdr->raw_len = (uint16_t)len;
+        hdr->index = index;
+        char *body = out + sizeof(codec_header_s);
+        uint32_t body_room = room - sizeof(codec_header_s);
+        // not worth it unless it saves more than the header costs
+        if (codec != CODEC_RAW && body_room > len)
+            body_room = len;
+
+        uint32_t n;
+        if (codec == CODEC_RAW) {
+            memcpy(body, data, len);
+            n = len;
+        } else if (codec == CODEC_LZ) {
+            n = lz.compress(data, len, body, body_room);
+        } else {
+            delta.resize(len);
+            const char *src = (const char *)data;
+            uint32_t common = len < reference.size() ? len : (uint32_t)reference.size();
+            for (uint32_t i = 0; i < common; i++)
+                delta[i] = src[i] ^ reference[i];
+            memcpy(delta.data() + common, src + common, len - common);
+            n = lz.compress(delta.data(), len, body, body_room);
+        }
+        return n ? sizeof(codec_header_s) + n : 0;
+    }
+
+    // coded size per raw byte in 1/256, as a moving average
+    void measure(payload_codec codec, uint32_t len, uint32_t coded) {
+        uint32_t sample = len ? (uint32_t)((uint64_t)coded * 256 / len) : 256;
+        ratio[codec] = (ratio[codec] * (256 - CODEC_EWMA_WEIGHT) + sample * CODEC_EWMA_WEIGHT) / 256;
+    }
+
+    // Try every codec on this message, `out` is the scratch space.
+    void probe(const void *data, uint32_t len, char *out, uint32_t room) {
+        for (uint32_t c = CODEC_LZ; c < CODECS; c++) {
+            uint32_t n = encode_as((payload_codec)c, data, len, out, room);
+            measure((payload_codec)c, len, n ? n : sizeof(codec_header_s) + len);
+        }
+        current = CODEC_RAW;
+        for (uint32_t c = CODEC_LZ; c < CODECS; c++)
+            if (ratio[c] < ratio[current])
+                current = (payload_codec)c;
+    }
+
+    codec_mode mode;
+    uint32_t index;
+    payload_codec current;
+    uint32_t ratio[CODECS];
+    std::vector<char> reference;
+    std::vector<char> delta;
+    lz_compressor lz;
+};
+
+// One flow's receiving end, used by one thread at a time.
+class codec_decoder {
+public:
+    codec_decoder() : has_reference(false), next_index(0) {}
+
+    // bytes `coded` decodes to, -1 if it is too short to be coded
+    static int32_t raw_len(const char *coded, uint32_t len) {
+        if (len < sizeof(codec_header_s))
+            return -1;
+        return ((const codec_header_s *)coded)->raw_len;
+    }
+
+    // Decode `len` bytes into `out`, raw_len() of them. Returns false if the
+    // message is corrupt or refers to a message this decoder did not see.
+    bool decode(const char *coded, uint32_t len, char *out) {
+        const codec_header_s *hdr = (const codec_header_s *)coded;
+        const char *body = coded + sizeof(codec_header_s);
+        uint32_t body_len = len - sizeof(codec_header_s);
+        bool ok;
+        if (hdr->codec == CODEC_RAW) {
+            ok = body_len == hdr->raw_len;
+            if (ok)
+                memcpy(out, body, body_len);
+        } else if (hdr->codec == CODEC_LZ) {
+            ok = lz_decompress(body, body_len, out, hdr->raw_len);
+        } else if (hdr->codec == CODEC_XOR) {
+            ok = has_reference && hdr->index == next_index && lz_decompress(body, body_len, out, hdr->raw_len);
+            if (ok) {
+                uint32_t common = hdr->raw_len < reference.size() ? hdr->raw_len : (uint32_t)reference.size();
+                for (uint32_t i = 0; i < common; i++)
+                    out[i] ^= reference[i];
+            }
+        } else {
+            ok = false;
+        }
+
+        has_reference = ok;
+        if (ok) {
+            reference.assign(out, out + hdr->raw_len);
+            next_index = hdr->index + 1;
+        }
+        return ok;
+    }
+
+private:
+    bool has_reference;
+    uint32_t next_index;
+    std::vector<char> reference;
+};
@@ -1,3 +1,4 @@
+#pragma once
 #include <iostream>
 #include <cstring>
 #include <unistd.h>
@@ -6,17 +7,41 @@
 #include <arpa/inet.h>
 #include <list>
 #include <fcntl.h> 
+#include <poll.h>
+#include <chrono>
+#include <ctime>
+#include <random>
 
 #include <infiniband/verbs.h>
 using namespace std;
 
+// how a node's incast messages reach the master
+enum node_transport : uint32_t {
+	TRANSPORT_RDMA = 0,
+	// no RoCE on the node: the data comes over the control socket, see tcp_link.h
+	TRANSPORT_TCP,
+};
+
 struct device_info
 {
 	union ibv_gid gid;
 	uint32_t send_qp_num;
+	// stable across restarts of the node process, together with the GID it
+	// identifies a node when it reconnects
+	uint32_t node_id;
+	uint32_t transport;
 };
 const int PORT = 8080;
 const int BUFFER_SIZE = 1024;
+const int RDMA_MSG_SIZE = 100;
+// receive buffers the master keeps posted per node, a node never has more
+// incast messages than this in flight
+const int INCAST_RECV_SLOTS = 8;
+const int CQ_SIZE = 1024;
+// how long a peer has to answer on the control socket before we give up
+const int CONTROL_TIMEOUT_MS = 5000;
+// RDMA READs and atomics a QP may have outstanding, as initiator and responder
+const int RD_ATOMIC_DEPTH = 4;
 
 bool clientSocketExist(std::list<int> clients, int currentSocket) {
     for(const int& client : clients) {
@@ -99,11 +124,218 @@ struct ibv_qp *create_qp_for_send(struct ibv_qp_init_attr &qp_init_attr, struct
 	qp_init_attr.send_cq = send_cq;
 	qp_init_attr.qp_type    = IBV_QPT_RC;
 	qp_init_attr.sq_sig_all = 1;
-	qp_init_attr.cap.max_send_wr  = 5;
-	qp_init_attr.cap.max_recv_wr  = 5;
-	qp_init_attr.cap.max_send_sge = 1;
+	qp_init_attr.cap.max_send_wr  = 16;
+	qp_init_attr.cap.max_recv_wr  = 16;
+	// sequence header, payload and, with --crc, the CRC32C trailer
+	qp_init_attr.cap.max_send_sge = 3;
 	qp_init_attr.cap.max_recv_sge = 1;
 
 	// create a QP (queue pair) for the send operations, using ibv_create_qp
 	return ibv_create_qp(pd, &qp_init_attr);
 }
+
+// ==== QP state transitions ====
+// Shared by master and node: the first connect and the recovery path both walk
+// the same QP through RESET -> INIT -> RTR -> RTS, only the PSNs differ.
+
+int modify_qp_to_reset(struct ibv_qp *qp) {
+	struct ibv_qp_attr qp_attr;
+	memset(&qp_attr, 0, sizeof(qp_attr));
+	qp_attr.qp_state = ibv_qp_state::IBV_QPS_RESET;
+
+	int ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE);
+	if (ret != 0)
+		cerr << "ibv_modify_qp - RESET - failed: " << strerror(ret) << endl;
+	return ret;
+}
+
+int modify_qp_to_error(struct ibv_qp *qp) {
+	struct ibv_qp_attr qp_attr;
+	memset(&qp_attr, 0, sizeof(qp_attr));
+	qp_attr.qp_state = ibv_qp_state::IBV_QPS_ERR;
+
+	int ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE);
+	if (ret != 0)
+		cerr << "ibv_modify_qp - ERR - failed: " << strerror(ret) << endl;
+	return ret;
+}
+
+int modify_qp_to_init(struct ibv_qp *qp) {
+	struct ibv_qp_attr qp_attr;
+	memset(&qp_attr, 0, sizeof(qp_attr));
+
+	qp_attr.qp_state   = ibv_qp_state::IBV_QPS_INIT;
+	qp_attr.port_num   = 1;
+	qp_attr.pkey_index = 0;
+	qp_attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+	                          IBV_ACCESS_REMOTE_WRITE | 
+	                          IBV_ACCESS_REMOTE_READ |
+	                          IBV_ACCESS_REMOTE_ATOMIC;
+
+	int ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
+	if (ret != 0)
+		cerr << "ibv_modify_qp - INIT - failed: " << strerror(ret) << endl;
+	return ret;
+}
+
+int modify_qp_to_rtr(struct ibv_qp *qp, const struct device_info &remote, uint32_t gidIndex, enum ibv_mtu mtu, uint32_t rq_psn) {
+	struct ibv_qp_attr qp_attr;
+	memset(&qp_attr, 0, sizeof(qp_attr));
+
+	qp_attr.path_mtu              = mtu;
+	qp_attr.qp_state              = ibv_qp_state::IBV_QPS_RTR;
+	qp_attr.rq_psn                = rq_psn;
+	qp_attr.max_dest_rd_atomic    = RD_ATOMIC_DEPTH;
+	// 0 would mean 655 ms, a pipelined sender that runs ahead of the reposted
+	// receives should only back off for 0.01 ms
+	qp_attr.min_rnr_timer         = 1;
+	qp_attr.ah_attr.is_global     = 1;
+	qp_attr.ah_attr.sl            = 0;
+	qp_attr.ah_attr.src_path_bits = 0;
+	qp_attr.ah_attr.port_num      = 1;
+
+	memcpy(&qp_attr.ah_attr.grh.dgid, &remote.gid, sizeof(remote.gid));
+
+	qp_attr.ah_attr.grh.flow_label    = 0;
+	qp_attr.ah_attr.grh.hop_limit     = 5;
+	qp_attr.ah_attr.grh.sgid_index    = gidIndex;
+	qp_attr.ah_attr.grh.traffic_class = 0;
+
+	qp_attr.ah_attr.dlid = 1;
+	qp_attr.dest_qp_num  = remote.send_qp_num;
+
+	int ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_AV |
+						IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+						IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+	if (ret != 0)
+		cerr << "ibv_modify_qp - RTR - failed: " << strerror(ret) << endl;
+	return ret;
+}
+
+int modify_qp_to_rts(struct ibv_qp *qp, uint32_t sq_psn) {
+	struct ibv_qp_attr qp_attr;
+	memset(&qp_attr, 0, sizeof(qp_attr));
+
+	qp_attr.qp_state      = ibv_qp_state::IBV_QPS_RTS;
+	// a finite ack timeout (4.096us * 2^14 ~ 67ms) so a dead peer surfaces as
+	// IBV_WC_RETRY_EXC_ERR instead of hanging the QP forever
+	qp_attr.timeout       = 14;
+	qp_attr.retry_cnt     = 7;
+	qp_attr.rnr_retry     = 7;
+	qp_attr.sq_psn        = sq_psn;
+	// nodes issue RDMA READs (KV GETs) and atomics against the master
+	qp_attr.max_rd_atomic = RD_ATOMIC_DEPTH;
+
+	int ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+						IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC);
+	if (ret != 0)
+		cerr << "ibv_modify_qp - RTS - failed: " << strerror(ret) << endl;
+	return ret;
+}
+
+// Reconnect `qp` to `remote` from any state (including IBV_QPS_ERR).
+int reconnect_qp(struct ibv_qp *qp, const struct device_info &remote, uint32_t gidIndex, enum ibv_mtu mtu,
+                 uint32_t rq_psn, uint32_t sq_psn) {
+	if (modify_qp_to_reset(qp) || modify_qp_to_init(qp))
+		return -1;
+	if (modify_qp_to_rtr(qp, remote, gidIndex, mtu, rq_psn) || modify_qp_to_rts(qp, sq_psn))
+		return -1;
+	return 0;
+}
+
+enum ibv_qp_state query_qp_state(struct ibv_qp *qp) {
+	struct ibv_qp_attr qp_attr;
+	struct ibv_qp_init_attr init_attr;
+	if (ibv_query_qp(qp, &qp_attr, IBV_QP_STATE, &init_attr) != 0)
+		return ibv_qp_state::IBV_QPS_UNKNOWN;
+	return qp_attr.qp_state;
+}
+
+// PSNs are 24 bit; a fresh random pair after every recovery makes sure stale
+// packets of the previous incarnation are dropped by the responder
+uint32_t generate_psn() {
+	static std::mt19937 gen(std::random_device{}());
+	return gen() & 0xffffff;
+}
+
+double elapsed_us(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Control messages ("[SERVER] UNLOCK", "[CLIENT] QP_ERROR", ...) are lines
+// ending in '\n': the socket is a byte stream, one recv() can hold half a
+// message or several.
+const size_t CONTROL_LINE_MAX = 128;
+
+int send_control(int socket, const char *message) {
+	char line[CONTROL_LINE_MAX];
+	int len = snprintf(line, sizeof(line), "%s\n", message);
+	if (len < 0 || (size_t)len >= sizeof(line)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return send(socket, line, len, 0) == len ? 0 : -1;
+}
+
+// What has been received of the control messages on one socket.
+struct control_stream {
+	char buf[2 * CONTROL_LINE_MAX];
+	size_t start;
+	size_t len;
+
+	control_stream() : start(0), len(0) {}
+
+	// on a new connection, whatever the old one left half-read is dropped
+	void reset() {
+		start = len = 0;
+	}
+
+	// The next whole message without its '\n', nullptr if there is none yet.
+	// It stays valid until the next fill().
+	const char *next() {
+		char *nl = (char *)memchr(buf + start, '\n', len - start);
+		if (!nl)
+			return nullptr;
+		*nl = '\0';
+		const char *line = buf + start;
+		start = nl + 1 - buf;
+		return line;
+	}
+
+	// One recv() behind what is buffered. Returns the bytes read, 0 on
+	// disconnect and -1 on error (EAGAIN on a non-blocking socket).
+	ssize_t fill(int socket, int flags = 0) {
+		memmove(buf, buf + start, len - start);
+		len -= start;
+		start = 0;
+		// a line longer than any message is garbage
+		if (len == sizeof(buf))
+			len = 0;
+		ssize_t bytesRead = recv(socket, buf + len, sizeof(buf) - len, flags);
+		if (bytesRead > 0)
+			len += bytesRead;
+		return bytesRead;
+	}
+};
+
+// Wait up to timeout_ms for the next control message on a (possibly
+// non-blocking) socket. nullptr on timeout, error or disconnect.
+const char *recv_control(int socket, control_stream &stream, int timeout_ms) {
+	auto start = std::chrono::steady_clock::now();
+	const char *line;
+	while (!(line = stream.next())) {
+		int left = timeout_ms - (int)(elapsed_us(start) / 1000);
+		struct pollfd pfd = { socket, POLLIN, 0 };
+		if (left <= 0 || poll(&pfd, 1, left) <= 0 || stream.fill(socket) <= 0)
+			return nullptr;
+	}
+	return line;
+}
+
+// CLOCK_MONOTONIC in ns: the send timestamps of incast messages and the
+// clock sync between master and nodes are taken from it
+uint64_t clock_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,231 @@
+#pragma once
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "rpc.h"
+
+// Shared 64-bit counters in a region the master registers for remote
+// atomics. Nodes update them with IBV_WR_ATOMIC_FETCH_AND_ADD and
+// IBV_WR_ATOMIC_CMP_AND_SWP, so control updates that would otherwise be
+// incast messages are a single 8-byte operation the master CPU never sees.
+//
+// Slots are plain uint64_t, what a slot means is up to its users:
+//   counter   fetch_add(slot, delta)
+//   sequence  next_sequence(slot), unique across all nodes
+//   lease     owner in the upper 32 bits, expiry (seconds, CLOCK_REALTIME of
+//             the nodes) in the lower ones, 0 when free
+
+const uint32_t COUNTER_SLOTS = 1024;
+// wr_id of a node's atomic, next to the KV read
+const uint64_t COUNTER_WR = 0x20011;
+
+// answer to RPC_COUNTERS_LOCATE
+typedef struct counter_location_ {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t slots;
+} counter_location_s;
+
+// Master side: owns the region, only reads it for reporting.
+class counter_region {
+public:
+    counter_region() : values(nullptr), mr(nullptr) {}
+
+    ~counter_region() {
+        if (mr)
+            ibv_dereg_mr(mr);
+        free(values);
+    }
+
+    int init(struct ibv_pd *pd) {
+        values = (uint64_t *)aligned_alloc(64, COUNTER_SLOTS * sizeof(uint64_t));
+        if (!values)
+            return -1;
+        memset(values, 0, COUNTER_SLOTS * sizeof(uint64_t));
+
+        mr = ibv_reg_mr(pd, values, COUNTER_SLOTS * sizeof(uint64_t),
+                        IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_ATOMIC);
+        if (!mr)
+        {
+            cerr << "ibv_reg_mr - counters - failed: " << strerror(errno) << endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    void register_methods(rpc_endpoint *rpc) {
+        rpc->register_method(RPC_COUNTERS_LOCATE, [this](const char *, uint32_t, char *resp, uint32_t resp_cap) -> uint32_t {
+            if (resp_cap < sizeof(counter_location_s))
+                return 0;
+            counter_location_s loc;
+            loc.addr = (uintptr_t)values;
+            loc.rkey = mr->rkey;
+            loc.slots = COUNTER_SLOTS;
+            memcpy(resp, &loc, sizeof(loc));
+            return sizeof(loc);
+        });
+    }
+
+    // the NIC updates the slots behind our back
+    uint64_t read(uint32_t slot) const {
+        return __atomic_load_n(&values[slot], __ATOMIC_RELAXED);
+    }
+
+private:
+    uint64_t *values;
+    struct ibv_mr *mr;
+};
+
+// Node side. The owner of the CQ passes every completion to handle() first.
+class counter_client {
+public:
+    counter_client(struct ibv_qp *qp, rpc_endpoint *rpc, std::function<void()> progress)
+        : qp(qp), rpc(rpc), progress(progress), result(0), result_mr(nullptr), status(0), located(false) {}
+
+    ~counter_client() {
+        if (result_mr)
+            ibv_dereg_mr(result_mr);
+    }
+
+    int init(struct ibv_pd *pd) {
+        result_mr = ibv_reg_mr(pd, &result, sizeof(result), IBV_ACCESS_LOCAL_WRITE);
+        if (!result_mr)
+        {
+            cerr << "ibv_reg_mr - counters - failed: " << strerror(errno) << endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    // Each returns 0 and the value the slot had before in `old`, -1 on failure.
+
+    int fetch_add(uint32_t slot, uint64_t delta, uint64_t &old) {
+        return atomic(slot, IBV_WR_ATOMIC_FETCH_AND_ADD, delta, 0, old);
+    }
+
+    int compare_swap(uint32_t slot, uint64_t expected, uint64_t desired, uint64_t &old) {
+        return atomic(slot, IBV_WR_ATOMIC_CMP_AND_SWP, expected, desired, old);
+    }
+
+    int next_sequence(uint32_t slot, uint64_t &seq) {
+        return fetch_add(slot, 1, seq);
+    }
+
+    // Take the lease in `slot` for ttl_s seconds if it is free, expired or
+    // already ours. Returns 1 if we hold it, 0 if someone else does.
+    int acquire_lease(uint32_t slot, uint32_t owner, uint32_t ttl_s) {
+        uint64_t current;
+        // adding 0 is an atomic read
+        if (fetch_add(slot, 0, current) != 0)
+            return -1;
+
+        uint32_t now = (uint32_t)time(nullptr);
+        uint32_t holder = (uint32_t)(current >> 32);
+        uint32_t expiry = (uint32_t)current;
+        if (current != 0 && holder != owner && expiry > now)
+            return 0;
+
+        uint64_t mine = ((uint64_t)owner << 32) | (now + ttl_s);
+        uint64_t old;
+        if (compare_swap(slot, current, mine, old) != 0)
+            return -1;
+        return old == current ? 1 : 0;
+    }
+
+    int release_lease(uint32_t slot, uint32_t owner) {
+        uint64_t current, old;
+        if (fetch_add(slot, 0, current) != 0)
+            return -1;
+        if ((uint32_t)(current >> 32) != owner)
+            return 0;
+        if (compare_swap(slot, current, 0, old) != 0)
+            return -1;
+        return old == current ? 1 : 0;
+    }
+
+    bool handle(const struct ibv_wc &wc) {
+        if (wc.wr_id != COUNTER_WR)
+            return false;
+        status = wc.status == ibv_wc_status::IBV_WC_SUCCESS ? 0 : wc.status;
+        if (wc.status != ibv_wc_status::IBV_WC_SUCCESS)
+            cerr << "atomic failed: " << ibv_wc_status_str(wc.status) << endl;
+        return true;
+    }
+
+private:
+    int locate() {
+        bool answered = false;
+        char *args = rpc->call(RPC_COUNTERS_LOCATE, 0, [this, &answered](uint8_t status, const char *resp, uint32_t resp_len) {
+            answered = true;
+            if (status == RPC_OK && resp_len >= sizeof(counter_location_s)) {
+                memcpy(&location, resp, sizeof(location));
+                located = location.slots != 0;
+            }
+        });
+        if (!args)
+            return -1;
+
+        rpc->flush();
+        auto start = std::chrono::steady_clock::now();
+        while (!answered && elapsed_us(start) < CONTROL_TIMEOUT_MS * 1000.0)
+            progress();
+        if (!answered)
+            // the callback must not outlive `answered`
+            rpc->expire(0);
+        return located ? 0 : -1;
+    }
+
+    int atomic(uint32_t slot, enum ibv_wr_opcode opcode, uint64_t compare_add, uint64_t swap, uint64_t &old) {
+        if (!located && locate() != 0)
+            return -1;
+        if (slot >= location.slots)
+            return -1;
+
+        struct ibv_sge sge;
+        sge.addr   = (uintptr_t)&result;
+        sge.length = sizeof(result);
+        sge.lkey   = result_mr->lkey;
+
+        struct ibv_send_wr wr, *bad_wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id      = COUNTER_WR;
+        wr.sg_list    = &sge;
+        wr.num_sge    = 1;
+        wr.opcode     = opcode;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.wr.atomic.remote_addr = location.addr + slot * sizeof(uint64_t);
+        wr.wr.atomic.rkey        = location.rkey;
+        wr.wr.atomic.compare_add = compare_add;
+        wr.wr.atomic.swap        = swap;
+
+        status = -1;
+        int ret = ibv_post_send(qp, &wr, &bad_wr);
+        if (ret != 0)
+        {
+            cerr << "ibv_post_send - atomic - failed: " << strerror(ret) << endl;
+            return -1;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        while (status == -1 && elapsed_us(start) < CONTROL_TIMEOUT_MS * 1000.0)
+            progress();
+        if (status != 0)
+            return -1;
+
+        old = result;
+        return 0;
+    }
+
+    struct ibv_qp *qp;
+    rpc_endpoint *rpc;
+    std::function<void()> progress;
+
+    uint64_t result;
+    struct ibv_mr *result_mr;
+    int status;
+    bool located;
+    counter_location_s location;
+};
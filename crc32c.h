@@ -0,0 +1,176 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <immintrin.h>
+
+// CRC32C (Castagnoli) of incast payloads, end to end from the node's buffer
+// to the master's consumer, above whatever the link checks.
+//
+// A message whose sequence header has SEQ_CRC32C set ends in a 4-byte
+// trailer: the CRC32C of everything between the header and the trailer.
+//
+// Kernels are picked once at runtime, like the reduce kernels:
+// - sse4.2 streams 8 bytes per crc32 instruction.
+// - sse4.2+pclmul splits long buffers into three stripes of CRC32C_STRIPE
+//   bytes, so three crc32 chains run at once. It then folds them together
+//   with one carry-less multiply per stripe.
+// - Without SSE4.2 a table does it a byte at a time.
+//
+// The update functions work on the raw register (start at CRC32C_INIT,
+// finish with ~), so a CRC can be carried across the pieces of a fused
+// pass.
+
+const uint32_t CRC32C_TRAILER = sizeof(uint32_t);
+const uint32_t CRC32C_INIT = 0xffffffff;
+// reflected polynomial
+const uint32_t CRC32C_POLY = 0x82f63b78;
+// bytes per stripe of the three-way kernel
+const size_t CRC32C_STRIPE = 128;
+
+enum crc32c_isa {
+    CRC32C_ISA_TABLE = 0,
+    CRC32C_ISA_SSE42,
+    CRC32C_ISA_PCLMUL,
+};
+
+inline const char *crc32c_isa_name(crc32c_isa isa) {
+    switch (isa) {
+    case CRC32C_ISA_PCLMUL: return "sse4.2+pclmul";
+    case CRC32C_ISA_SSE42: return "sse4.2";
+    default: return "table";
+    }
+}
+
+inline crc32c_isa detect_crc32c_isa() {
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul"))
+        return CRC32C_ISA_PCLMUL;
+    if (__builtin_cpu_supports("sse4.2"))
+        return CRC32C_ISA_SSE42;
+    return CRC32C_ISA_TABLE;
+}
+
+// ==== table ====
+
+struct crc32c_table_s {
+    uint32_t entries[256];
+
+    crc32c_table_s() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            entries[i] = crc;
+        }
+    }
+};
+
+inline uint32_t crc32c_update_table(uint32_t crc, const void *data, size_t len) {
+    static const crc32c_table_s table;
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < len; i++)
+        crc = table.entries[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+// ==== sse4.2 ====
+
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_update_sse42(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (uint32_t)c;
+    for (; len > 0; p++, len--)
+        crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+
+// ==== sse4.2 + pclmul ====
+
+// x^n mod P, reflected (bit 31 is x^0)
+inline uint32_t crc32c_xpow(size_t n) {
+    uint32_t p = 0x80000000u;
+    while (n--)
+        p = p & 1 ? (p >> 1) ^ CRC32C_POLY : p >> 1;
+    return p;
+}
+
+// The carry-less product of two reflected polynomials is their product
+// times x, and crc32 of 64 bits multiplies by x^32. So moving a CRC past a
+// stripe, a multiplication by x^(8 * CRC32C_STRIPE), takes the constant
+// x^(8 * CRC32C_STRIPE - 33).
+__attribute__((target("sse4.2,pclmul")))
+inline uint32_t crc32c_shift_stripe(uint32_t crc) {
+    static const uint32_t k = crc32c_xpow(8 * CRC32C_STRIPE - 33);
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(k), 0);
+    return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(product));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+inline uint32_t crc32c_update_pclmul(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (len >= 3 * CRC32C_STRIPE) {
+        uint64_t a = crc, b = 0, c = 0;
+        for (size_t i = 0; i < CRC32C_STRIPE; i += 8) {
+            uint64_t va, vb, vc;
+            memcpy(&va, p + i, 8);
+            memcpy(&vb, p + CRC32C_STRIPE + i, 8);
+            memcpy(&vc, p + 2 * CRC32C_STRIPE + i, 8);
+            a = _mm_crc32_u64(a, va);
+            b = _mm_crc32_u64(b, vb);
+            c = _mm_crc32_u64(c, vc);
+        }
+        crc = crc32c_shift_stripe(crc32c_shift_stripe((uint32_t)a) ^ (uint32_t)b) ^ (uint32_t)c;
+        p += 3 * CRC32C_STRIPE;
+        len -= 3 * CRC32C_STRIPE;
+    }
+    return crc32c_update_sse42(crc, p, len);
+}
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const void *data, size_t len);
+
+inline crc32c_fn select_crc32c_kernel(crc32c_isa isa) {
+    switch (isa) {
+    case CRC32C_ISA_PCLMUL: return crc32c_update_pclmul;
+    case CRC32C_ISA_SSE42: return crc32c_update_sse42;
+    default: return crc32c_update_table;
+    }
+}
+
+inline crc32c_isa crc32c_best_isa() {
+    static const crc32c_isa isa = detect_crc32c_isa();
+    return isa;
+}
+
+inline uint32_t crc32c_update(uint32_t crc, const void *data, size_t len) {
+    static const crc32c_fn kernel = select_crc32c_kernel(crc32c_best_isa());
+    return kernel(crc, data, len);
+}
+
+inline uint32_t crc32c(const void *data, size_t len) {
+    return ~crc32c_update(CRC32C_INIT, data, len);
+}
+
+// Copy `len` bytes and run them through the CRC on the way, a piece at a
+// time so each piece is still in L1 for the second look.
+inline uint32_t crc32c_copy(uint32_t crc, void *dst, const void *src, size_t len) {
+    const size_t piece = 3 * CRC32C_STRIPE;
+    for (size_t done = 0; done < len; done += piece) {
+        size_t n = len - done < piece ? len - done : piece;
+        crc = crc32c_update(crc, (const char *)src + done, n);
+        memcpy((char *)dst + done, (const char *)src + done, n);
+    }
+    return crc;
+}
+
+inline uint32_t crc32c_load_trailer(const void *trailer) {
+    uint32_t crc;
+    memcpy(&crc, trailer, sizeof(crc));
+    return crc;
+}
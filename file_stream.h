@@ -0,0 +1,386 @@
+#pragma once
+#include <map>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "rpc.h"
+
+// Streaming a file from a node into a file on the master without copies.
+//
+// The master preallocates the output file, maps it and registers the mapping
+// for REMOTE_WRITE (RPC_FILE_OPEN answers with addr/rkey). The node maps its
+// input file window by window, registers each window and RDMA WRITEs it
+// straight into the master's mapping, chunk by chunk with a few chunks in
+// flight. RPC_FILE_CLOSE follows the last write on the same QP, so the master
+// flushes a complete file.
+//
+// The baseline instead read()s the file into a registered bounce buffer, one
+// half filling while the other is on the wire, which is what a copy-based
+// sender costs.
+
+// wr_id of a chunk write, next to the counters
+const uint64_t FILE_WR = 0x20012;
+const uint32_t FILE_CHUNK = 1 << 20;
+// chunks in flight, below max_send_wr of the QP
+const uint32_t FILE_WINDOW_CHUNKS = 8;
+// bytes of the input mapped and registered at once
+const uint64_t FILE_MAP_WINDOW = 64ull << 20;
+const uint32_t FILE_NAME_MAX = 256;
+
+// arguments of RPC_FILE_OPEN
+typedef struct file_open_ {
+    uint64_t size;
+    char name[FILE_NAME_MAX];
+} file_open_s;
+
+// answer to RPC_FILE_OPEN
+typedef struct file_target_ {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t file_id;
+} file_target_s;
+
+// arguments of RPC_FILE_CLOSE
+typedef struct file_close_ {
+    uint32_t file_id;
+    uint32_t reserved;
+} file_close_s;
+
+// Master side: one preallocated, mapped and registered output file per open.
+class file_sink {
+public:
+    file_sink() : pd(nullptr), next_id(1) {}
+
+    ~file_sink() {
+        for (auto &it : open_files)
+            release(it.second);
+    }
+
+    int init(struct ibv_pd *protection_domain, const std::string &directory) {
+        pd = protection_domain;
+        dir = directory;
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            perror("Cannot create output directory");
+            return -1;
+        }
+        return 0;
+    }
+
+    void register_methods(rpc_endpoint *rpc) {
+        rpc->register_method(RPC_FILE_OPEN, [this](const char *args, uint32_t args_len, char *resp, uint32_t resp_cap) -> uint32_t {
+            if (args_len < sizeof(file_open_s) || resp_cap < sizeof(file_target_s))
+                return 0;
+            return open_file(*(const file_open_s *)args, *(file_target_s *)resp);
+        });
+
+        rpc->register_method(RPC_FILE_CLOSE, [this](const char *args, uint32_t args_len, char *, uint32_t) -> uint32_t {
+            if (args_len >= sizeof(file_close_s))
+                close_file(((const file_close_s *)args)->file_id);
+            return 0;
+        });
+    }
+
+private:
+    struct open_file_s {
+        std::string path;
+        int fd;
+        char *map;
+        uint64_t size;
+        struct ibv_mr *mr;
+        std::chrono::steady_clock::time_point opened;
+    };
+
+    uint32_t open_file(const file_open_s &req, file_target_s &target) {
+        // only the base name, a node must not write outside our directory
+        std::string name(req.name, strnlen(req.name, FILE_NAME_MAX));
+        size_t slash = name.rfind('/');
+        if (slash != std::string::npos)
+            name = name.substr(slash + 1);
+        if (name.empty() || name == "." || name == ".." || req.size == 0)
+            return 0;
+
+        open_file_s file;
+        file.path = dir + "/" + name;
+        file.size = req.size;
+        file.map = nullptr;
+        file.mr = nullptr;
+        file.opened = std::chrono::steady_clock::now();
+        file.fd = open(file.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (file.fd == -1) {
+            perror("Cannot create output file");
+            return 0;
+        }
+
+        // allocate every block now, the NIC must not write into a hole the
+        // file system has to fill on the page fault
+        int ret = posix_fallocate(file.fd, 0, file.size);
+        if (ret != 0) {
+            cerr << "posix_fallocate failed for " << file.path << ": " << strerror(ret) << endl;
+            release(file);
+            return 0;
+        }
+
+        file.map = (char *)mmap(nullptr, file.size, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+        if (file.map == MAP_FAILED) {
+            perror("mmap of output file failed");
+            file.map = nullptr;
+            release(file);
+            return 0;
+        }
+
+        file.mr = ibv_reg_mr(pd, file.map, file.size, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+        if (!file.mr) {
+            cerr << "ibv_reg_mr - file - failed: " << strerror(errno) << endl;
+            release(file);
+            return 0;
+        }
+
+        uint32_t id = next_id++;
+        target.addr = (uintptr_t)file.map;
+        target.rkey = file.mr->rkey;
+        target.file_id = id;
+        open_files[id] = file;
+        cout << "> Receiving " << file.size << " bytes into " << file.path << endl;
+        return sizeof(target);
+    }
+
+    void close_file(uint32_t id) {
+        auto it = open_files.find(id);
+        if (it == open_files.end())
+            return;
+
+        open_file_s &file = it->second;
+        double us = elapsed_us(file.opened);
+        msync(file.map, file.size, MS_ASYNC);
+        cout << "> Received " << file.path << ": " << file.size << " bytes in " << us << " us, "
+             << file.size / us << " MB/s" << endl;
+        release(file);
+        open_files.erase(it);
+    }
+
+    void release(open_file_s &file) {
+        if (file.mr)
+            ibv_dereg_mr(file.mr);
+        if (file.map)
+            munmap(file.map, file.size);
+        if (file.fd != -1)
+            close(file.fd);
+    }
+
+    struct ibv_pd *pd;
+    std::string dir;
+    uint32_t next_id;
+    std::map<uint32_t, open_file_s> open_files;
+};
+
+// Node side. The owner of the CQ passes every completion to handle() first.
+class file_streamer {
+public:
+    file_streamer(struct ibv_pd *pd, struct ibv_qp *qp, rpc_endpoint *rpc, std::function<void()> progress)
+        : pd(pd), qp(qp), rpc(rpc), progress(progress), in_flight(0), failed(false) {}
+
+    // Stream `path` to the master under `remote_name`. zero_copy maps and
+    // registers the input, otherwise it goes through read() and a bounce
+    // buffer. Returns the throughput in MB/s, negative on failure.
+    double stream(const std::string &path, const std::string &remote_name, bool zero_copy) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            perror("Cannot open input file");
+            return -1;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return -1;
+        }
+        uint64_t size = st.st_size;
+
+        auto start = std::chrono::steady_clock::now();
+        file_target_s target;
+        if (open_remote(remote_name, size, target) != 0) {
+            close(fd);
+            return -1;
+        }
+
+        int ret = zero_copy ? send_mapped(fd, size, target) : send_copied(fd, size, target);
+        close(fd);
+        if (ret != 0 || close_remote(target.file_id) != 0)
+            return -1;
+        return size / elapsed_us(start);
+    }
+
+    bool handle(const struct ibv_wc &wc) {
+        if (wc.wr_id != FILE_WR)
+            return false;
+        in_flight--;
+        if (wc.status != ibv_wc_status::IBV_WC_SUCCESS) {
+            cerr << "file write failed: " << ibv_wc_status_str(wc.status) << endl;
+            failed = true;
+        }
+        return true;
+    }
+
+private:
+    int call(uint16_t method, const void *args, uint32_t args_len, void *resp, uint32_t resp_len) {
+        bool answered = false;
+        bool ok = false;
+        char *slot = rpc->call(method, args_len, [&](uint8_t status, const char *data, uint32_t len) {
+            answered = true;
+            if (status == RPC_OK && len >= resp_len) {
+                if (resp_len)
+                    memcpy(resp, data, resp_len);
+                ok = true;
+            }
+        });
+        if (!slot)
+            return -1;
+        memcpy(slot, args, args_len);
+        rpc->flush();
+
+        auto start = std::chrono::steady_clock::now();
+        while (!answered && elapsed_us(start) < CONTROL_TIMEOUT_MS * 1000.0)
+            progress();
+        if (!answered)
+            // the callback must not outlive this frame
+            rpc->expire(0);
+        return ok ? 0 : -1;
+    }
+
+    int open_remote(const std::string &name, uint64_t size, file_target_s &target) {
+        file_open_s req;
+        memset(&req, 0, sizeof(req));
+        req.size = size;
+        strncpy(req.name, name.c_str(), FILE_NAME_MAX - 1);
+        if (call(RPC_FILE_OPEN, &req, sizeof(req), &target, sizeof(target)) != 0) {
+            cerr << "Master refused file " << name << endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    int close_remote(uint32_t file_id) {
+        file_close_s req = { file_id, 0 };
+        return call(RPC_FILE_CLOSE, &req, sizeof(req), nullptr, 0);
+    }
+
+    // Post writes of [offset, offset + len) from `local` (inside `mr`) to the
+    // same offset of the remote file, FILE_WINDOW_CHUNKS chunks at a time.
+    // The last ones may still be in flight on return.
+    int write_range(struct ibv_mr *mr, const char *local, uint64_t offset, uint64_t len, const file_target_s &target) {
+        for (uint64_t done = 0; done < len; ) {
+            if (wait_in_flight(FILE_WINDOW_CHUNKS - 1) != 0)
+                return -1;
+
+            uint32_t chunk = len - done < FILE_CHUNK ? (uint32_t)(len - done) : FILE_CHUNK;
+            struct ibv_sge sge;
+            sge.addr   = (uintptr_t)(local + done);
+            sge.length = chunk;
+            sge.lkey   = mr->lkey;
+
+            struct ibv_send_wr wr, *bad_wr;
+            memset(&wr, 0, sizeof(wr));
+            wr.wr_id      = FILE_WR;
+            wr.sg_list    = &sge;
+            wr.num_sge    = 1;
+            wr.opcode     = IBV_WR_RDMA_WRITE;
+            wr.send_flags = IBV_SEND_SIGNALED;
+            wr.wr.rdma.remote_addr = target.addr + offset + done;
+            wr.wr.rdma.rkey        = target.rkey;
+
+            int ret = ibv_post_send(qp, &wr, &bad_wr);
+            if (ret != 0) {
+                cerr << "ibv_post_send - file - failed: " << strerror(ret) << endl;
+                return -1;
+            }
+            in_flight++;
+            done += chunk;
+        }
+        return 0;
+    }
+
+    // Wait until at most `max` writes are in flight. Completions come back in
+    // posting order, so everything posted before those is done.
+    int wait_in_flight(uint32_t max) {
+        auto start = std::chrono::steady_clock::now();
+        while (in_flight > max && !failed && elapsed_us(start) < CONTROL_TIMEOUT_MS * 1000.0)
+            progress();
+        return failed || in_flight > max ? -1 : 0;
+    }
+
+    int send_mapped(int fd, uint64_t size, const file_target_s &target) {
+        failed = false;
+        for (uint64_t offset = 0; offset < size; offset += FILE_MAP_WINDOW) {
+            uint64_t len = size - offset < FILE_MAP_WINDOW ? size - offset : FILE_MAP_WINDOW;
+            char *map = (char *)mmap(nullptr, len, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, offset);
+            if (map == MAP_FAILED) {
+                perror("mmap of input file failed");
+                return -1;
+            }
+
+            // the NIC only reads, a read-only mapping needs no access flags
+            struct ibv_mr *mr = ibv_reg_mr(pd, map, len, 0);
+            if (!mr) {
+                cerr << "ibv_reg_mr - file - failed: " << strerror(errno) << endl;
+                munmap(map, len);
+                return -1;
+            }
+
+            int ret = write_range(mr, map, offset, len, target);
+            if (wait_in_flight(0) != 0)
+                ret = -1;
+            ibv_dereg_mr(mr);
+            munmap(map, len);
+            if (ret != 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    // Two halves of the bounce buffer: read() fills one while the other is
+    // on the wire.
+    int send_copied(int fd, uint64_t size, const file_target_s &target) {
+        uint64_t half = FILE_CHUNK * (uint64_t)FILE_WINDOW_CHUNKS / 2;
+        std::vector<char> bounce(2 * half);
+        struct ibv_mr *mr = ibv_reg_mr(pd, bounce.data(), bounce.size(), IBV_ACCESS_LOCAL_WRITE);
+        if (!mr) {
+            cerr << "ibv_reg_mr - file - failed: " << strerror(errno) << endl;
+            return -1;
+        }
+
+        failed = false;
+        int ret = 0;
+        uint32_t half_chunks = half / FILE_CHUNK;
+        for (uint64_t offset = 0, i = 0; offset < size && ret == 0; offset += half, i++) {
+            // the writes out of this half from two rounds ago must be done
+            if (wait_in_flight(half_chunks) != 0) {
+                ret = -1;
+                break;
+            }
+
+            char *buf = bounce.data() + (i % 2) * half;
+            uint64_t len = size - offset < half ? size - offset : half;
+            if (pread(fd, buf, len, offset) != (ssize_t)len) {
+                perror("read of input file failed");
+                ret = -1;
+                break;
+            }
+            ret = write_range(mr, buf, offset, len, target);
+        }
+        if (wait_in_flight(0) != 0)
+            ret = -1;
+        ibv_dereg_mr(mr);
+        return ret;
+    }
+
+    struct ibv_pd *pd;
+    struct ibv_qp *qp;
+    rpc_endpoint *rpc;
+    std::function<void()> progress;
+    uint32_t in_flight;
+    bool failed;
+};
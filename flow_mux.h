@@ -0,0 +1,336 @@
+#pragma once
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+
+#include <infiniband/verbs.h>
+#include "codec.h"
+#include "common.h"
+#include "crc32c.h"
+#include "perf_counters.h"
+#include "rings.h"
+#include "sequence.h"
+#include "wr_builder.h"
+
+// Many logical incast streams of one node over its single QP. Each producer
+// (thread or tenant) owns a flow: it copies a message into one of the flow's
+// registered buffers and queues it in the flow's SPSC ring, without locks and
+// without touching the QP. After an UNLOCK the link's thread drains the
+// queues with deficit round robin, so a flow with big messages gets no more
+// bytes than one with small ones, and posts what it took as one linked list of
+// WRs. The flow ID travels in the sequence header, the master demultiplexes
+// on it.
+//
+// A producer with a codec (set_codec()) encodes its message into the buffer
+// instead of copying it, see codec.h.
+//
+// A buffer is reused only once the send that used it completed, which happens
+// in posting order, so a producer finds its flow full instead of overwriting
+// a message in flight.
+
+// flows below are the link's own data and reduce streams
+const uint16_t MUX_FIRST_FLOW = 2;
+const uint32_t MUX_FLOWS = SEQ_MAX_FLOWS - MUX_FIRST_FLOW;
+const uint32_t MUX_QUEUE_DEPTH = 32;
+// a buffer holds a whole message and goes out as it is, so it may be no
+// bigger than a master receive slot (server.cpp checks); the payload leaves
+// room for the sequence header and a CRC32C trailer
+const uint32_t MUX_BUFFER_SIZE = 1024;
+const uint32_t MUX_MSG_MAX = MUX_BUFFER_SIZE - sizeof(seq_header_s) - CRC32C_TRAILER;
+// bytes a flow may send per round
+const int32_t MUX_QUANTUM = 4096;
+// WRs per ibv_post_send
+const uint32_t MUX_BATCH = 8;
+// wr_id of the send of buffer i of flow f: MUX_WR_BASE + f * MUX_QUEUE_DEPTH + i
+const uint64_t MUX_WR_BASE = 0x30000;
+
+// a message in its flow buffer, sequence header and trailer included
+typedef send_wr_format<IBV_WR_SEND, true, false, 1> mux_send_format;
+
+// a queued message: its buffer, payload length and SEQ_* flags of the payload
+typedef struct mux_entry_ {
+    uint32_t index;
+    uint32_t len;
+    uint16_t flags;
+} mux_entry_s;
+
+typedef struct flow_stats_ {
+    uint64_t messages;
+    uint64_t bytes;
+    // enqueue() calls that found every buffer of the flow in use
+    uint64_t full;
+} flow_stats_s;
+
+class flow_mux {
+public:
+    flow_mux(struct ibv_pd *pd, struct ibv_qp *qp, std::function<void()> progress)
+        : pd(pd), qp(qp), progress(progress), profiler(nullptr), crc(false), arena(nullptr), arena_mr(nullptr), cursor(0), in_flight(0), failed(false) {}
+
+    ~flow_mux() {
+        if (arena_mr)
+            ibv_dereg_mr(arena_mr);
+        free(arena);
+    }
+
+    int init() {
+        size_t bytes = (size_t)MUX_FLOWS * MUX_QUEUE_DEPTH * MUX_BUFFER_SIZE;
+        arena = (char *)aligned_alloc(64, bytes);
+        if (!arena)
+            return -1;
+        arena_mr = ibv_reg_mr(pd, arena, bytes, IBV_ACCESS_LOCAL_WRITE);
+        if (!arena_mr)
+        {
+            cerr << "ibv_reg_mr - flows - failed: " << strerror(errno) << endl;
+            return -1;
+        }
+        batch.init({ arena_mr->lkey });
+
+        flows.reset(new flow_s[MUX_FLOWS]);
+        for (uint32_t i = 0; i < MUX_FLOWS; i++)
+            flows[i].queue.init(MUX_QUEUE_DEPTH);
+        return 0;
+    }
+
+    // Producer of `flow`, one thread per flow. Returns false if the message
+    // does not fit or the flow has no free buffer, the producer retries later.
+    // With a codec a message has to fit raw behind the codec header. `flags`
+    // are the SEQ_* bits that describe the message, e.g. SEQ_RECORD.
+    bool enqueue(uint16_t flow, const void *data, uint32_t len, uint16_t flags = 0) {
+        if (flow < MUX_FIRST_FLOW || flow >= SEQ_MAX_FLOWS || len > MUX_MSG_MAX)
+            return false;
+
+        flow_s &f = flows[flow - MUX_FIRST_FLOW];
+        if (!has_room(f))
+            return false;
+        char *payload = buffer(flow, f.produced % MUX_QUEUE_DEPTH) + sizeof(seq_header_s);
+        if (f.codec.enabled()) {
+            len = f.codec.encode(data, len, payload, MUX_MSG_MAX);
+            if (len == 0)
+                return false;
+            if (crc)
+                append_crc(payload, len);
+        } else if (crc) {
+            // the CRC is taken in the same pass as the copy
+            uint32_t sum = ~crc32c_copy(CRC32C_INIT, payload, data, len);
+            memcpy(payload + len, &sum, sizeof(sum));
+        } else {
+            memcpy(payload, data, len);
+        }
+        push(f, len, flags);
+        return true;
+    }
+
+    // Producer of `flow`: the flow's next free buffer, to write a message of
+    // up to MUX_MSG_MAX bytes straight into (8 byte aligned). nullptr if the
+    // flow is full, or coded: a codec needs the message elsewhere to encode
+    // it into the buffer. commit() queues what was written.
+    char *claim(uint16_t flow) {
+        if (flow < MUX_FIRST_FLOW || flow >= SEQ_MAX_FLOWS)
+            return nullptr;
+        flow_s &f = flows[flow - MUX_FIRST_FLOW];
+        if (f.codec.enabled() || !has_room(f))
+            return nullptr;
+        return buffer(flow, f.produced % MUX_QUEUE_DEPTH) + sizeof(seq_header_s);
+    }
+
+    void commit(uint16_t flow, uint32_t len, uint16_t flags = 0) {
+        flow_s &f = flows[flow - MUX_FIRST_FLOW];
+        if (crc)
+            append_crc(buffer(flow, f.produced % MUX_QUEUE_DEPTH) + sizeof(seq_header_s), len);
+        push(f, len, flags);
+    }
+
+    bool coded(uint16_t flow) const {
+        return flows[flow - MUX_FIRST_FLOW].codec.enabled();
+    }
+
+    // Link thread: send everything queued, at most `window` sends in flight
+    // (the receive slots the master keeps posted for us). Returns the number
+    // of messages sent, -1 if a send failed.
+    int drain(uint32_t window) {
+        failed = false;
+        int sent = 0;
+        while (!failed) {
+            while (in_flight >= window && !failed)
+                if (!wait_completion())
+                    return -1;
+
+            uint32_t n = take_batch(std::min(window - in_flight, MUX_BATCH));
+            if (n == 0)
+                break;
+
+            struct ibv_send_wr *bad_wr;
+            int ret;
+            {
+                perf_scope scope(profiler, PERF_POST_SEND, n);
+                ret = ibv_post_send(qp, batch.chain(0, n), &bad_wr);
+            }
+            if (ret != 0)
+            {
+                cerr << "ibv_post_send - flows - failed: " << strerror(ret) << endl;
+                return -1;
+            }
+            in_flight += n;
+            sent += n;
+        }
+
+        while (in_flight > 0 && !failed)
+            if (!wait_completion())
+                return -1;
+        return failed ? -1 : sent;
+    }
+
+    bool handle(const struct ibv_wc &wc) {
+        if (wc.wr_id < MUX_WR_BASE || wc.wr_id >= MUX_WR_BASE + MUX_FLOWS * MUX_QUEUE_DEPTH)
+            return false;
+
+        // the buffer is free either way
+        flow_s &f = flows[(wc.wr_id - MUX_WR_BASE) / MUX_QUEUE_DEPTH];
+        f.completed.fetch_add(1, std::memory_order_release);
+        in_flight--;
+        if (wc.status != ibv_wc_status::IBV_WC_SUCCESS) {
+            cerr << "flow send failed: " << ibv_wc_status_str(wc.status) << endl;
+            failed = true;
+        }
+        return true;
+    }
+
+    // count the posts of the link's thread
+    void set_profiler(perf_profiler *p) { profiler = p; }
+
+    // producers append a CRC32C trailer, set before they start
+    void set_crc(bool on) { crc = on; }
+
+    // how every flow's producer encodes its messages, set before they start
+    void set_codec(codec_mode mode) {
+        for (uint32_t i = 0; i < MUX_FLOWS; i++)
+            flows[i].codec.set_mode(mode);
+    }
+
+    // sends in flight are gone after a QP reset
+    void reset() {
+        for (uint32_t i = 0; i < MUX_FLOWS; i++)
+            flows[i].completed.fetch_add(flows[i].posted - flows[i].completed.load(std::memory_order_relaxed),
+                                         std::memory_order_release);
+        in_flight = 0;
+    }
+
+    flow_stats_s stats(uint16_t flow) const {
+        const flow_s &f = flows[flow - MUX_FIRST_FLOW];
+        return { f.messages, f.bytes, f.full.load(std::memory_order_relaxed) };
+    }
+
+    // the producer's, read once it stopped
+    const codec_stats_s &codec_stats(uint16_t flow) const {
+        return flows[flow - MUX_FIRST_FLOW].codec.stats;
+    }
+
+private:
+    struct flow_s {
+        spsc_ring<mux_entry_s> queue;
+        // producer
+        alignas(64) uint32_t produced = 0;
+        codec_encoder codec;
+        // link thread
+        alignas(64) std::atomic<uint32_t> completed{0};
+        std::atomic<uint64_t> full{0};
+        uint32_t posted = 0;
+        int32_t deficit = 0;
+        uint32_t next_seq = 0;
+        uint64_t messages = 0;
+        uint64_t bytes = 0;
+    };
+
+    char *buffer(uint16_t flow, uint32_t index) {
+        return arena + ((size_t)(flow - MUX_FIRST_FLOW) * MUX_QUEUE_DEPTH + index) * MUX_BUFFER_SIZE;
+    }
+
+    bool has_room(flow_s &f) {
+        if (f.produced - f.completed.load(std::memory_order_acquire) < MUX_QUEUE_DEPTH)
+            return true;
+        f.full.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    static void append_crc(char *payload, uint32_t len) {
+        uint32_t sum = crc32c(payload, len);
+        memcpy(payload + len, &sum, sizeof(sum));
+    }
+
+    void push(flow_s &f, uint32_t len, uint16_t flags) {
+        f.queue.push({ f.produced % MUX_QUEUE_DEPTH, len, flags });
+        f.produced++;
+    }
+
+    // One deficit round robin pass from where the last one stopped, as many
+    // as `room` messages in the first WRs of the batch. Idle flows lose their
+    // deficit.
+    uint32_t take_batch(uint32_t room) {
+        uint32_t n = 0;
+        for (uint32_t visited = 0; visited < MUX_FLOWS && n < room; visited++) {
+            uint32_t i = cursor;
+            flow_s &f = flows[i];
+            if (f.deficit <= 0)
+                f.deficit += MUX_QUANTUM;
+
+            mux_entry_s entry;
+            bool emptied = false;
+            while (f.deficit > 0 && n < room) {
+                if (!f.queue.pop(entry)) {
+                    emptied = true;
+                    break;
+                }
+                add_wr(n++, i + MUX_FIRST_FLOW, entry);
+                f.deficit -= entry.len;
+            }
+            if (emptied)
+                f.deficit = 0;
+            // a flow that still has credit keeps the turn for the next batch
+            if (emptied || f.deficit <= 0)
+                cursor = (cursor + 1) % MUX_FLOWS;
+        }
+        return n;
+    }
+
+    void add_wr(uint32_t n, uint16_t flow, const mux_entry_s &entry) {
+        flow_s &f = flows[flow - MUX_FIRST_FLOW];
+        seq_header_s *hdr = (seq_header_s *)buffer(flow, entry.index);
+        hdr->seq = f.next_seq++;
+        hdr->flow = flow;
+        hdr->flags = entry.flags | (crc ? SEQ_CRC32C : 0) | (f.codec.enabled() ? SEQ_CODED : 0);
+        hdr->send_ns = clock_ns();
+
+        batch.set_wr_id(n, MUX_WR_BASE + (flow - MUX_FIRST_FLOW) * MUX_QUEUE_DEPTH + entry.index);
+        batch.set_sge(n, 0, (uintptr_t)hdr, sizeof(seq_header_s) + entry.len + (crc ? CRC32C_TRAILER : 0));
+
+        f.posted++;
+        f.messages++;
+        f.bytes += entry.len;
+    }
+
+    bool wait_completion() {
+        uint32_t before = in_flight;
+        auto start = std::chrono::steady_clock::now();
+        while (in_flight == before && elapsed_us(start) < CONTROL_TIMEOUT_MS * 1000.0)
+            progress();
+        if (in_flight == before)
+            cerr << "No completion for the posted flow sends" << endl;
+        return in_flight != before;
+    }
+
+    struct ibv_pd *pd;
+    struct ibv_qp *qp;
+    std::function<void()> progress;
+    perf_profiler *profiler;
+    bool crc;
+
+    char *arena;
+    struct ibv_mr *arena_mr;
+    std::unique_ptr<flow_s[]> flows;
+    // next flow to visit
+    uint32_t cursor;
+    uint32_t in_flight;
+    bool failed;
+    send_wr_ring<mux_send_format, MUX_BATCH> batch;
+};
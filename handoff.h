@@ -0,0 +1,138 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "rings.h"
+
+// Zero-copy handoff from the polling thread to consumer threads. The poller
+// publishes a descriptor of a received message (the payload stays in its
+// receive slot) into the bounded SPSC ring of one consumer. When the
+// consumer is done it pushes the descriptor into one MPSC release ring, the
+// poller drains it and gives the slots back to the NIC.
+//
+// Neither side ever blocks on the other: dispatch() fails on a full ring and
+// room() lets the scheduler hold back the next UNLOCK until there is space,
+// so a slow consumer pushes back on the incast instead of growing a queue.
+
+// a received message, read in place by the consumer
+typedef struct handoff_desc_ {
+    const char *data;
+    uint32_t len;
+    uint32_t node;
+    uint32_t slot;
+    uint32_t imm;
+    uint32_t flow;
+} handoff_desc_s;
+
+typedef struct handoff_stats_ {
+    uint64_t dispatched;
+    uint64_t released;
+    // dispatch() calls that found the ring full
+    uint64_t full;
+} handoff_stats_s;
+
+class handoff_stage {
+public:
+    typedef std::function<void(uint32_t consumer, const handoff_desc_s &desc)> consume_fn;
+
+    handoff_stage() : running(false), consumer_count(0) {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    ~handoff_stage() {
+        stop();
+    }
+
+    // `depth` descriptors per consumer, consume(consumer, desc) runs on the
+    // consumer threads
+    void start(uint32_t consumers, uint32_t depth, consume_fn consume) {
+        consumer_count = consumers;
+        process = consume;
+        rings.reset(new spsc_ring<handoff_desc_s>[consumers]);
+        for (uint32_t i = 0; i < consumers; i++)
+            rings[i].init(depth);
+        released.init(consumers * next_pow2(depth));
+
+        running.store(true, std::memory_order_release);
+        for (uint32_t i = 0; i < consumers; i++)
+            threads.emplace_back(&handoff_stage::consumer_loop, this, i);
+    }
+
+    void stop() {
+        if (!running.exchange(false))
+            return;
+        for (auto &t : threads)
+            t.join();
+        threads.clear();
+    }
+
+    uint32_t consumers() const { return consumer_count; }
+
+    // A node always goes to the same consumer, so its messages stay in order.
+    uint32_t consumer_of(uint32_t node) const { return node % consumer_count; }
+
+    // poller: false if the node's consumer is full
+    bool dispatch(const handoff_desc_s &desc) {
+        if (!rings[consumer_of(desc.node)].push(desc)) {
+            stats.full++;
+            return false;
+        }
+        stats.dispatched++;
+        return true;
+    }
+
+    // poller: how many more messages the node's consumer can take
+    uint32_t room(uint32_t node) {
+        return rings[consumer_of(node)].room();
+    }
+
+    // poller: fn(desc) for every message the consumers are done with
+    template <typename F>
+    uint32_t reclaim(F fn) {
+        handoff_desc_s desc;
+        uint32_t n = 0;
+        while (released.pop(desc)) {
+            fn(desc);
+            n++;
+        }
+        stats.released += n;
+        return n;
+    }
+
+    // messages handed out and not back yet
+    uint64_t outstanding() const { return stats.dispatched - stats.released; }
+
+    // poller only
+    handoff_stats_s stats;
+
+private:
+    void consumer_loop(uint32_t index) {
+        spsc_ring<handoff_desc_s> &ring = rings[index];
+        uint32_t idle = 0;
+        handoff_desc_s desc;
+        while (running.load(std::memory_order_acquire)) {
+            if (!ring.pop(desc)) {
+                // spin a little before giving the core away
+                if (++idle > 1024)
+                    std::this_thread::yield();
+                continue;
+            }
+            idle = 0;
+            process(index, desc);
+            // sized for everything the rings hold, it never stays full
+            while (!released.push(desc))
+                std::this_thread::yield();
+        }
+    }
+
+    std::atomic<bool> running;
+    uint32_t consumer_count;
+    consume_fn process;
+    std::unique_ptr<spsc_ring<handoff_desc_s>[]> rings;
+    mpsc_ring<handoff_desc_s> released;
+    std::vector<std::thread> threads;
+};
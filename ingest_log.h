@@ -0,0 +1,342 @@
+#pragma once
+#include <functional>
+#include <map>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "io_ring.h"
+
+// Durable ingest: the master appends every received incast message to a
+// segmented log through io_uring instead of dropping it after the poll.
+//
+// Each receive slot keeps INGEST_HEADER bytes free in front of the buffer the
+// NIC writes into, so header and payload are one contiguous record inside a
+// registered fixed buffer (one per node, indexed by node ID) and go out as a
+// single IORING_OP_WRITE_FIXED without a copy. Writes queue up and are
+// submitted in batches, fdatasync is issued for a group of records at a time.
+// The receive slot is only handed back (on_written) once its write completed.
+//
+// Segments are preallocated, so fdatasync has no size updates to flush. A
+// segment ends at the first header without INGEST_MAGIC. A write that fails
+// is covered by a record of node INGEST_SKIP_NODE over the same bytes, so a
+// reader steps over the hole to the records behind it. Every segment counts
+// its own unsynced records and syncs go to the segment they are for, so a
+// segment that is rotated away gets a last fdatasync once its writes are done
+// and is only closed after it.
+
+const uint32_t INGEST_MAGIC = 0x494e4731;  // "ING1"
+// SQEs queued before they are submitted without waiting for an idle poll
+const uint32_t INGEST_BATCH = 32;
+const uint32_t INGEST_RING_ENTRIES = 1024;
+// user_data bits of fsync and skip record completions, write completions
+// carry the caller's tag
+const uint64_t INGEST_SYNC_TAG = 1ull << 63;
+const uint64_t INGEST_SKIP_TAG = 1ull << 62;
+// node of a record that stands in for a failed write, its bytes are garbage
+const uint32_t INGEST_SKIP_NODE = 0xffffffff;
+
+typedef struct ingest_record_ {
+    uint32_t magic;
+    uint32_t node;
+    // payload bytes following the header
+    uint32_t length;
+    // imm_data of the message, 0 without
+    uint32_t imm;
+} ingest_record_s;
+
+const uint32_t INGEST_HEADER = sizeof(ingest_record_s);
+
+typedef struct ingest_stats_ {
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t syncs;
+    uint64_t segments;
+    uint64_t errors;
+    // failed writes covered by a skip record
+    uint64_t skipped;
+    uint64_t submits;
+} ingest_stats_s;
+
+class ingest_log {
+public:
+    ingest_log() : segment_bytes(0), sync_records(0), sync_us(0), next_skip(0), current(-1), offset(0), reaping(false) {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    ~ingest_log() {
+        for (auto &it : segments)
+            close(it.second.fd);
+    }
+
+    // sync after `records` completed writes or `us` microseconds, whatever
+    // comes first
+    int init(const std::string &directory, uint64_t segment_size, uint32_t records, uint32_t us, uint32_t buffers) {
+        dir = directory;
+        segment_bytes = segment_size;
+        sync_records = records;
+        sync_us = us;
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            perror("Cannot create ingest directory");
+            return -1;
+        }
+        if (ring.init(INGEST_RING_ENTRIES) != 0 || ring.register_sparse_buffers(buffers) != 0)
+            return -1;
+        last_sync = std::chrono::steady_clock::now();
+        return open_segment();
+    }
+
+    // make `len` bytes at `addr` usable as fixed buffer `index`
+    int register_buffer(uint32_t index, void *addr, size_t len) {
+        return ring.register_buffer(index, addr, len);
+    }
+
+    // Queue the record at `record` (header included, inside fixed buffer
+    // `buffer`). on_written(tag) follows once it is in the page cache.
+    int append(uint32_t buffer, const char *record, uint32_t len, uint64_t tag) {
+        if (offset + len > segment_bytes && open_segment() != 0)
+            return -1;
+
+        struct io_uring_sqe *sqe = next_sqe();
+        if (!sqe)
+            return -1;
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = segments[current].fd;
+        sqe->addr = (uintptr_t)record;
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->buf_index = buffer;
+        sqe->user_data = tag;
+
+        inflight[tag] = { current, offset, len };
+        offset += len;
+        segments[current].outstanding++;
+        if (ring.pending() >= INGEST_BATCH)
+            submit();
+        return 0;
+    }
+
+    // Reap completions and, when `idle` or a batch is full, submit what is
+    // queued. Called from the poll loop.
+    void progress(bool idle) {
+        reap();
+
+        segment_s &seg = segments[current];
+        bool sync_due = seg.unsynced >= sync_records ||
+                        (seg.unsynced > 0 && elapsed_us(last_sync) >= sync_us);
+        if (sync_due && !seg.sync_in_flight)
+            queue_sync(current);
+
+        if (ring.pending() > 0 && (idle || ring.pending() >= INGEST_BATCH))
+            submit();
+    }
+
+    std::function<void(uint64_t tag)> on_written;
+    ingest_stats_s stats;
+
+private:
+    struct write_s {
+        int segment;
+        uint64_t offset;
+        uint32_t len;
+    };
+
+    struct skip_s {
+        int segment;
+        ingest_record_s record;
+    };
+
+    struct segment_s {
+        int fd;
+        // writes and syncs in flight
+        uint32_t outstanding;
+        // completed writes since the last sync was queued
+        uint32_t unsynced;
+        bool sync_in_flight;
+    };
+
+    struct io_uring_sqe *next_sqe() {
+        struct io_uring_sqe *sqe = ring.get_sqe();
+        if (!sqe) {
+            submit();
+            reap();
+            sqe = ring.get_sqe();
+        }
+        if (!sqe)
+            cerr << "ingest ring full" << endl;
+        return sqe;
+    }
+
+    // Completions queue syncs and skip records, which can come back here
+    // through next_sqe(); the inner call leaves the CQ to the outer one.
+    void reap() {
+        if (reaping)
+            return;
+        reaping = true;
+        ring.reap([this](const struct io_uring_cqe &cqe) { complete(cqe); });
+        reaping = false;
+    }
+
+    void submit() {
+        if (ring.submit() > 0)
+            stats.submits++;
+    }
+
+    int open_segment() {
+        int index = current + 1;
+        char name[64];
+        snprintf(name, sizeof(name), "/ingest-%06d.log", index);
+        std::string path = dir + name;
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror("Cannot create ingest segment");
+            return -1;
+        }
+        int ret = posix_fallocate(fd, 0, segment_bytes);
+        if (ret != 0)
+            cerr << "posix_fallocate failed for " << path << ": " << strerror(ret) << endl;
+
+        int previous = current;
+        segments[index] = { fd, 0, 0, false };
+        current = index;
+        offset = 0;
+        stats.segments++;
+        retire(previous);
+        return 0;
+    }
+
+    void queue_sync(int segment) {
+        segment_s &seg = segments[segment];
+        struct io_uring_sqe *sqe = next_sqe();
+        if (!sqe)
+            return;
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = seg.fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = INGEST_SYNC_TAG | segment;
+        seg.outstanding++;
+        seg.sync_in_flight = true;
+        seg.unsynced = 0;
+        if (segment == current)
+            last_sync = std::chrono::steady_clock::now();
+    }
+
+    void complete(const struct io_uring_cqe &cqe) {
+        int segment;
+        // a sync, a record or skip record that is in the file, a completed
+        // append, a hole nothing covers
+        bool synced = false, landed = false, written = false, broken = false;
+        if (cqe.user_data & INGEST_SYNC_TAG) {
+            segment = (int)(cqe.user_data & ~INGEST_SYNC_TAG);
+            synced = true;
+            if (cqe.res < 0) {
+                cerr << "ingest fdatasync failed: " << strerror(-cqe.res) << endl;
+                stats.errors++;
+            } else {
+                stats.syncs++;
+            }
+        } else if (cqe.user_data & INGEST_SKIP_TAG) {
+            auto it = skips.find(cqe.user_data & ~INGEST_SKIP_TAG);
+            segment = it->second.segment;
+            skips.erase(it);
+            if (cqe.res == INGEST_HEADER) {
+                stats.skipped++;
+                landed = true;
+            } else {
+                cerr << "cannot cover a failed ingest write: " << (cqe.res < 0 ? strerror(-cqe.res) : "short write") << endl;
+                stats.errors++;
+                broken = segment == current;
+            }
+        } else {
+            write_s w = { current, 0, 0 };
+            auto it = inflight.find(cqe.user_data);
+            if (it != inflight.end()) {
+                w = it->second;
+                inflight.erase(it);
+            }
+            segment = w.segment;
+            if (cqe.res >= 0 && (uint32_t)cqe.res == w.len) {
+                stats.records++;
+                stats.bytes += cqe.res;
+                landed = true;
+            } else {
+                cerr << "ingest write failed: " << (cqe.res < 0 ? strerror(-cqe.res) : "short write") << endl;
+                stats.errors++;
+                broken = !skip(w);
+            }
+            written = true;
+        }
+
+        auto seg = segments.find(segment);
+        if (seg != segments.end()) {
+            seg->second.outstanding--;
+            if (synced)
+                seg->second.sync_in_flight = false;
+            if (landed)
+                seg->second.unsynced++;
+        }
+        // the rest of the segment is out of a reader's reach, new records go
+        // to a new one
+        if (broken && segment == current)
+            open_segment();
+        // may append and rotate, retire() looks the segment up again
+        if (written && on_written)
+            on_written(cqe.user_data);
+        retire(segment);
+    }
+
+    // Write a skip record over the header of the failed write `w`, so the
+    // records behind it stay reachable. false if it cannot be queued.
+    bool skip(const write_s &w) {
+        auto seg = segments.find(w.segment);
+        if (w.len < INGEST_HEADER || seg == segments.end())
+            return false;
+        struct io_uring_sqe *sqe = next_sqe();
+        if (!sqe)
+            return false;
+        uint64_t id = next_skip++;
+        skip_s &entry = skips[id];
+        entry.segment = w.segment;
+        entry.record = { INGEST_MAGIC, INGEST_SKIP_NODE, w.len - INGEST_HEADER, 0 };
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = seg->second.fd;
+        sqe->addr = (uintptr_t)&entry.record;
+        sqe->len = INGEST_HEADER;
+        sqe->off = w.offset;
+        sqe->user_data = INGEST_SKIP_TAG | id;
+        seg->second.outstanding++;
+        return true;
+    }
+
+    // Close a finished segment once nothing refers to it anymore, after one
+    // last sync if records landed in it since the previous one.
+    void retire(int segment) {
+        auto it = segments.find(segment);
+        if (segment == current || it == segments.end() || it->second.outstanding > 0)
+            return;
+        if (it->second.unsynced > 0) {
+            queue_sync(segment);
+            return;
+        }
+        close(it->second.fd);
+        segments.erase(it);
+    }
+
+    io_ring ring;
+    std::string dir;
+    uint64_t segment_bytes;
+    uint32_t sync_records;
+    uint32_t sync_us;
+
+    std::map<int, segment_s> segments;
+    // every write in flight, by tag
+    std::map<uint64_t, write_s> inflight;
+    // skip records in flight, they live here until written
+    std::map<uint64_t, skip_s> skips;
+    uint64_t next_skip;
+    int current;
+    uint64_t offset;
+    bool reaping;
+    std::chrono::steady_clock::time_point last_sync;
+};
@@ -0,0 +1,192 @@
+#pragma once
+#include <atomic>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+// Just enough io_uring on raw syscalls for the I/O paths of master and nodes,
+// so the build needs nothing beyond the kernel headers: one SQ, one CQ, sparse
+// registered buffers that can be filled in later, provided buffers for
+// receives, batched submission.
+//
+// A ring is owned by one thread. Only register_buffer() may be called from
+// others, the kernel serializes it against submissions.
+
+class io_ring {
+public:
+    io_ring() : ring_fd(-1), sq_ptr(nullptr), cq_ptr(nullptr), sqes(nullptr), sq_tail(0), submitted(0) {
+        memset(&params, 0, sizeof(params));
+    }
+
+    ~io_ring() {
+        if (sqes)
+            munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        if (cq_ptr && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_size);
+        if (sq_ptr)
+            munmap(sq_ptr, sq_size);
+        if (ring_fd != -1)
+            close(ring_fd);
+    }
+
+    int init(uint32_t entries) {
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0) {
+            perror("io_uring_setup failed");
+            return -1;
+        }
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single && cq_size > sq_size)
+            sq_size = cq_size;
+
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            sq_ptr = nullptr;
+            return -1;
+        }
+        cq_ptr = single ? sq_ptr : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            cq_ptr = nullptr;
+            return -1;
+        }
+        sqes = (struct io_uring_sqe *)mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            sqes = nullptr;
+            return -1;
+        }
+
+        char *sq = (char *)sq_ptr;
+        char *cq = (char *)cq_ptr;
+        sq_head_ptr = (uint32_t *)(sq + params.sq_off.head);
+        sq_tail_ptr = (uint32_t *)(sq + params.sq_off.tail);
+        sq_mask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+        sq_array = (uint32_t *)(sq + params.sq_off.array);
+        cq_head_ptr = (uint32_t *)(cq + params.cq_off.head);
+        cq_tail_ptr = (uint32_t *)(cq + params.cq_off.tail);
+        cq_mask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+        sq_tail = *sq_tail_ptr;
+        submitted = sq_tail;
+        return 0;
+    }
+
+    // A table of `count` empty buffer slots, filled by register_buffer().
+    int register_sparse_buffers(uint32_t count) {
+        struct io_uring_rsrc_register reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.nr = count;
+        reg.flags = IORING_RSRC_REGISTER_SPARSE;
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) < 0) {
+            perror("io_uring_register - buffers - failed");
+            return -1;
+        }
+        return 0;
+    }
+
+    int register_buffer(uint32_t index, void *addr, size_t len) {
+        struct iovec iov = { addr, len };
+        struct io_uring_rsrc_update2 update;
+        memset(&update, 0, sizeof(update));
+        update.offset = index;
+        update.data = (uintptr_t)&iov;
+        update.nr = 1;
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) < 0) {
+            perror("io_uring_register - buffer update - failed");
+            return -1;
+        }
+        return 0;
+    }
+
+    // Hand `count` buffers of `len` bytes starting at `addr` to buffer group
+    // `bgid` as IDs bid, bid+1, ..., for IOSQE_BUFFER_SELECT requests to pick
+    // from. Queued like any request, -1 while the SQ is full.
+    int provide_buffers(void *addr, uint32_t len, uint32_t count, uint16_t bgid, uint16_t bid, uint64_t user_data) {
+        struct io_uring_sqe *sqe = get_sqe();
+        if (!sqe)
+            return -1;
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = count;
+        sqe->addr = (uintptr_t)addr;
+        sqe->len = len;
+        sqe->off = bid;
+        sqe->buf_group = bgid;
+        sqe->user_data = user_data;
+        return 0;
+    }
+
+    // nullptr while the SQ is full, submit() or reap first
+    struct io_uring_sqe *get_sqe() {
+        uint32_t head = __atomic_load_n(sq_head_ptr, __ATOMIC_ACQUIRE);
+        if (sq_tail - head == params.sq_entries)
+            return nullptr;
+        uint32_t index = sq_tail & sq_mask;
+        struct io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        sq_tail++;
+        return sqe;
+    }
+
+    uint32_t pending() const { return sq_tail - submitted; }
+
+    // One syscall for everything queued since the last submit, optionally
+    // waiting for `wait_nr` completions.
+    int submit(uint32_t wait_nr = 0) {
+        __atomic_store_n(sq_tail_ptr, sq_tail, __ATOMIC_RELEASE);
+        uint32_t to_submit = sq_tail - submitted;
+        if (to_submit == 0 && wait_nr == 0)
+            return 0;
+
+        int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EBUSY || errno == EINTR)
+                return 0;
+            perror("io_uring_enter failed");
+            return -1;
+        }
+        submitted += ret;
+        return ret;
+    }
+
+    // Hand every available completion to fn(cqe), returns how many.
+    template <typename F>
+    uint32_t reap(F fn) {
+        uint32_t head = *cq_head_ptr;
+        uint32_t tail = __atomic_load_n(cq_tail_ptr, __ATOMIC_ACQUIRE);
+        uint32_t n = 0;
+        for (; head != tail; head++, n++)
+            fn(cqes[head & cq_mask]);
+        __atomic_store_n(cq_head_ptr, head, __ATOMIC_RELEASE);
+        return n;
+    }
+
+private:
+    int ring_fd;
+    struct io_uring_params params;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+
+    uint32_t *sq_head_ptr;
+    uint32_t *sq_tail_ptr;
+    uint32_t sq_mask;
+    uint32_t *sq_array;
+    uint32_t *cq_head_ptr;
+    uint32_t *cq_tail_ptr;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // local tail, published to the kernel by submit()
+    uint32_t sq_tail;
+    uint32_t submitted;
+};
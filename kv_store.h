@@ -0,0 +1,350 @@
+#pragma once
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "rpc.h"
+
+// Key-value store hosted by the master and read one-sided by the nodes, in
+// the style of Pilaf and FaRM. The table is an array of cache-line slots in a
+// region registered for REMOTE_READ: a GET is a single RDMA READ of the
+// KV_PROBE slots a key can live in, the master CPU is not involved. PUTs are
+// RPCs (RPC_KV_PUT) served by the master, the only writer.
+//
+// A slot carries a version that is odd while the master rewrites it and a
+// checksum over version, key and value. The NIC can read a slot in the middle
+// of an update, so a reader that sees an odd version or a checksum that does
+// not match reads again.
+
+const uint32_t KV_SLOT_SIZE = 64;
+const uint32_t KV_VALUE_MAX = 40;
+// linear probing window, also what one GET reads
+const uint32_t KV_PROBE = 4;
+const uint32_t KV_DEFAULT_BUCKETS = 4096;
+const int KV_READ_RETRIES = 16;
+// wr_id of a node's GET, next to the broadcast ones
+const uint64_t KV_READ_WR = 0x20010;
+
+typedef struct alignas(64) kv_slot_ {
+    // odd while the master writes the slot
+    uint64_t version;
+    // 0 marks a free slot
+    uint64_t key;
+    uint32_t value_len;
+    uint32_t checksum;
+    char value[KV_VALUE_MAX];
+} kv_slot_s;
+
+static_assert(sizeof(kv_slot_s) == KV_SLOT_SIZE, "a KV slot is one cache line");
+
+// answer to RPC_KV_LOCATE
+typedef struct kv_location_ {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t buckets;
+} kv_location_s;
+
+// arguments of RPC_KV_PUT, answered with an int32_t status
+typedef struct kv_put_ {
+    uint64_t key;
+    uint32_t value_len;
+    uint32_t reserved;
+    char value[KV_VALUE_MAX];
+} kv_put_s;
+
+inline uint64_t kv_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+// FNV-1a over everything a reader relies on
+inline uint32_t kv_slot_checksum(const kv_slot_s &slot) {
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](const void *data, size_t len) {
+        const uint8_t *p = (const uint8_t *)data;
+        for (size_t i = 0; i < len; i++)
+            hash = (hash ^ p[i]) * 16777619u;
+    };
+    uint32_t len = slot.value_len < KV_VALUE_MAX ? slot.value_len : KV_VALUE_MAX;
+    mix(&slot.version, sizeof(slot.version));
+    mix(&slot.key, sizeof(slot.key));
+    mix(&slot.value_len, sizeof(slot.value_len));
+    mix(slot.value, len);
+    return hash;
+}
+
+// Master side: the table and the RPCs that locate and update it.
+class kv_table {
+public:
+    kv_table() : slots(nullptr), mr(nullptr), buckets(0), used(0) {}
+
+    ~kv_table() {
+        if (mr)
+            ibv_dereg_mr(mr);
+        free(slots);
+    }
+
+    // KV_PROBE extra slots at the end keep every probe window contiguous, so
+    // a GET never wraps around
+    int init(struct ibv_pd *pd, uint32_t bucket_count) {
+        buckets = bucket_count;
+        size_t bytes = (size_t)(buckets + KV_PROBE) * KV_SLOT_SIZE;
+        slots = (kv_slot_s *)aligned_alloc(KV_SLOT_SIZE, bytes);
+        if (!slots)
+            return -1;
+        memset(slots, 0, bytes);
+        // free slots have to pass the reader's checks as well
+        for (uint32_t i = 0; i < buckets + KV_PROBE; i++)
+            slots[i].checksum = kv_slot_checksum(slots[i]);
+
+        mr = ibv_reg_mr(pd, slots, bytes, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+        if (!mr)
+        {
+            cerr << "ibv_reg_mr - kv - failed: " << strerror(errno) << endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    // Returns -1 if the key is invalid or its probe window is full.
+    int put(uint64_t key, const char *value, uint32_t len) {
+        if (key == 0 || len > KV_VALUE_MAX)
+            return -1;
+
+        kv_slot_s *window = slots + kv_hash(key) % buckets;
+        kv_slot_s *slot = nullptr;
+        for (uint32_t i = 0; i < KV_PROBE && !slot; i++) {
+            if (window[i].key == key)
+                slot = &window[i];
+        }
+        for (uint32_t i = 0; i < KV_PROBE && !slot; i++) {
+            if (window[i].key == 0) {
+                slot = &window[i];
+                used++;
+            }
+        }
+        if (!slot)
+            return -1;
+
+        // seqlock write: a reader that overlaps sees an odd version or a
+        // checksum that does not match the version it got
+        kv_slot_s next;
+        next.version = slot->version + 2;
+        next.key = key;
+        next.value_len = len;
+        memcpy(next.value, value, len);
+        memset(next.value + len, 0, KV_VALUE_MAX - len);
+        next.checksum = kv_slot_checksum(next);
+
+        __atomic_store_n(&slot->version, slot->version + 1, __ATOMIC_RELAXED);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot->key = next.key;
+        slot->value_len = next.value_len;
+        slot->checksum = next.checksum;
+        memcpy(slot->value, next.value, KV_VALUE_MAX);
+        std::atomic_thread_fence(std::memory_order_release);
+        __atomic_store_n(&slot->version, next.version, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    kv_location_s location() const {
+        kv_location_s loc;
+        loc.addr = (uintptr_t)slots;
+        loc.rkey = mr->rkey;
+        loc.buckets = buckets;
+        return loc;
+    }
+
+    void register_methods(rpc_endpoint *rpc) {
+        rpc->register_method(RPC_KV_LOCATE, [this](const char *, uint32_t, char *resp, uint32_t resp_cap) -> uint32_t {
+            if (resp_cap < sizeof(kv_location_s))
+                return 0;
+            kv_location_s loc = location();
+            memcpy(resp, &loc, sizeof(loc));
+            return sizeof(loc);
+        });
+
+        rpc->register_method(RPC_KV_PUT, [this](const char *args, uint32_t args_len, char *resp, uint32_t resp_cap) -> uint32_t {
+            if (args_len < sizeof(kv_put_s) || resp_cap < sizeof(int32_t))
+                return 0;
+            const kv_put_s *req = (const kv_put_s *)args;
+            int32_t status = put(req->key, req->value, req->value_len);
+            memcpy(resp, &status, sizeof(status));
+            return sizeof(status);
+        });
+    }
+
+    uint32_t size() const { return used; }
+
+private:
+    kv_slot_s *slots;
+    struct ibv_mr *mr;
+    uint32_t buckets;
+    uint32_t used;
+};
+
+// Node side: GETs as one-sided reads, PUTs as RPCs. The owner of the CQ
+// passes every completion to handle() first.
+class kv_client {
+public:
+    kv_client(struct ibv_qp *qp, rpc_endpoint *rpc, std::function<void()> progress)
+        : torn_reads(0), qp(qp), rpc(rpc), progress(progress), read_mr(nullptr), read_status(0), located(false) {}
+
+    ~kv_client() {
+        if (read_mr)
+            ibv_dereg_mr(read_mr);
+    }
+
+    int init(struct ibv_pd *pd) {
+        read_mr = ibv_reg_mr(pd, window, sizeof(window), IBV_ACCESS_LOCAL_WRITE);
+        if (!read_mr)
+        {
+            cerr << "ibv_reg_mr - kv - failed: " << strerror(errno) << endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    int put(uint64_t key, const char *value, uint32_t len) {
+        if (len > KV_VALUE_MAX)
+            return -1;
+
+        int32_t result = -1;
+        bool answered = false;
+        char *args = rpc->call(RPC_KV_PUT, sizeof(kv_put_s), [&result, &answered](uint8_t status, const char *resp, uint32_t resp_len) {
+            answered = true;
+            if (status == RPC_OK && resp_len >= sizeof(result))
+                memcpy(&result, resp, sizeof(result));
+        });
+        if (!args)
+            return -1;
+
+        kv_put_s *req = (kv_put_s *)args;
+        memset(req, 0, sizeof(*req));
+        req->key = key;
+        req->value_len = len;
+        memcpy(req->value, value, len);
+        return wait_call(answered) == 0 ? result : -1;
+    }
+
+    // Returns the value length, -1 if the key is absent and -2 on failure.
+    int get(uint64_t key, char *value, uint32_t cap) {
+        // 0 marks a free slot, no value has it
+        if (key == 0)
+            return -1;
+        if (!located && locate() != 0)
+            return -2;
+
+        uint64_t remote = location.addr + (kv_hash(key) % location.buckets) * KV_SLOT_SIZE;
+        for (int attempt = 0; attempt < KV_READ_RETRIES; attempt++) {
+            if (read_window(remote) != 0)
+                return -2;
+
+            bool torn = false;
+            for (uint32_t i = 0; i < KV_PROBE; i++) {
+                const kv_slot_s &slot = window[i];
+                if (slot.version & 1 || slot.checksum != kv_slot_checksum(slot)) {
+                    torn = true;
+                    continue;
+                }
+                if (slot.key != key)
+                    continue;
+
+                uint32_t len = slot.value_len < cap ? slot.value_len : cap;
+                memcpy(value, slot.value, len);
+                return slot.value_len;
+            }
+
+            // the key may sit in the slot we could not trust
+            if (!torn)
+                return -1;
+            torn_reads++;
+        }
+        return -2;
+    }
+
+    bool handle(const struct ibv_wc &wc) {
+        if (wc.wr_id != KV_READ_WR)
+            return false;
+        read_status = wc.status == ibv_wc_status::IBV_WC_SUCCESS ? 0 : wc.status;
+        if (wc.status != ibv_wc_status::IBV_WC_SUCCESS)
+            cerr << "kv read failed: " << ibv_wc_status_str(wc.status) << endl;
+        return true;
+    }
+
+    uint64_t torn_reads;
+
+private:
+    int locate() {
+        bool answered = false;
+        char *args = rpc->call(RPC_KV_LOCATE, 0, [this, &answered](uint8_t status, const char *resp, uint32_t resp_len) {
+            answered = true;
+            if (status == RPC_OK && resp_len >= sizeof(kv_location_s)) {
+                memcpy(&location, resp, sizeof(location));
+                located = location.buckets != 0;
+            }
+        });
+        if (!args || wait_call(answered) != 0 || !located)
+            return -1;
+        return 0;
+    }
+
+    int wait_call(bool &answered) {
+        rpc->flush();
+        auto start = std::chrono::steady_clock::now();
+        while (!answered && elapsed_us(start) < CONTROL_TIMEOUT_MS * 1000.0)
+            progress();
+        if (!answered) {
+            // the callback must not outlive `answered`
+            rpc->expire(0);
+            return -1;
+        }
+        return 0;
+    }
+
+    int read_window(uint64_t remote) {
+        struct ibv_sge sge;
+        sge.addr   = (uintptr_t)window;
+        sge.length = sizeof(window);
+        sge.lkey   = read_mr->lkey;
+
+        struct ibv_send_wr wr, *bad_wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id      = KV_READ_WR;
+        wr.sg_list    = &sge;
+        wr.num_sge    = 1;
+        wr.opcode     = IBV_WR_RDMA_READ;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.wr.rdma.remote_addr = remote;
+        wr.wr.rdma.rkey        = location.rkey;
+
+        read_status = -1;
+        int ret = ibv_post_send(qp, &wr, &bad_wr);
+        if (ret != 0)
+        {
+            cerr << "ibv_post_send - kv - failed: " << strerror(ret) << endl;
+            return -1;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        while (read_status == -1 && elapsed_us(start) < CONTROL_TIMEOUT_MS * 1000.0)
+            progress();
+        return read_status == 0 ? 0 : -1;
+    }
+
+    struct ibv_qp *qp;
+    rpc_endpoint *rpc;
+    std::function<void()> progress;
+
+    kv_slot_s window[KV_PROBE];
+    struct ibv_mr *read_mr;
+    int read_status;
+    bool located;
+    kv_location_s location;
+};
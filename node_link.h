@@ -0,0 +1,637 @@
+#pragma once
+#include <string>
+
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "crc32c.h"
+#include "rpc.h"
+#include "reduce.h"
+#include "broadcast.h"
+#include "kv_store.h"
+#include "counters.h"
+#include "file_stream.h"
+#include "sequence.h"
+#include "flow_mux.h"
+#include "wr_builder.h"
+
+// Node side of a connection to a master: TCP handshake, the RC QP, the RPC
+// endpoint the master queries, QP recovery, the incast sends after each
+// UNLOCK, the receiving end of broadcasts, the master's KV store, its atomic
+// counters and file streaming to it. Used by the leaf nodes (client.cpp) and by intermediate masters
+// (server.cpp --upstream_ip) that report their aggregate one level up.
+//
+// A link is driven by a single thread through poll(). Other threads only
+// ever touch it through flows().enqueue().
+
+// receive buffers for RPC frames from the master
+const int LINK_RECV_SLOTS = 4;
+const uint32_t LINK_RPC_WINDOW = 16;
+// wr_id of the incast data send, below RPC_WR_SLOT_BASE and above the receive slots
+const uint64_t DATA_WR_ID = 0xffff;
+// reduce chunks use [REDUCE_WR_BASE, REDUCE_WR_BASE + INCAST_RECV_SLOTS)
+const uint64_t REDUCE_WR_BASE = 0x8000;
+// a chunk has to fit into one master receive slot between the sequence header
+// and a CRC32C trailer, and keep the next one's payload 16 byte aligned
+const uint32_t REDUCE_CHUNK_SIZE = (RPC_FRAME_SIZE - sizeof(seq_header_s) - CRC32C_TRAILER) & ~15u;
+// sequence header of the data send, the reduce chunks use the ones before it
+const uint32_t DATA_SEQ_HEADER = INCAST_RECV_SLOTS;
+
+// the text message: sequence header, then the caller's buffer
+typedef send_wr_format<IBV_WR_SEND, true, false, 2> data_send_format;
+// a reduce chunk: sequence header, then the chunk, told apart by its imm
+typedef send_wr_format<IBV_WR_SEND_WITH_IMM, true, false, 2> reduce_send_format;
+// the same with a CRC32C trailer (set_crc()) going out from its own buffer
+typedef send_wr_format<IBV_WR_SEND, true, false, 3> data_crc_send_format;
+typedef send_wr_format<IBV_WR_SEND_WITH_IMM, true, false, 3> reduce_crc_send_format;
+
+enum link_event {
+    LINK_IDLE = 0,
+    LINK_UNLOCK,
+    LINK_CLOSED,
+};
+
+class upstream_link {
+public:
+    upstream_link() : send_qp(nullptr), send_cq(nullptr), recv_mr(nullptr), seq_mr(nullptr), crc_mr(nullptr), rpc(nullptr), bcast(nullptr), kv(nullptr), counters(nullptr), files(nullptr), mux(nullptr),
+                      profiler(nullptr), crc(false), socket_fd(-1), gidIndex(0), data_send_status(0), reduce_in_flight(0), reduce_failed(false) {
+        memset(&stats, 0, sizeof(stats));
+        memset(next_seq, 0, sizeof(next_seq));
+        config.message_size = RDMA_MSG_SIZE;
+        config.reserved = 0;
+    }
+
+    ~upstream_link() {
+        close();
+    }
+
+    // Release everything open() and connect_to() created, before the PD goes.
+    void close() {
+        delete rpc;
+        rpc = nullptr;
+        delete bcast;
+        bcast = nullptr;
+        delete kv;
+        kv = nullptr;
+        delete counters;
+        counters = nullptr;
+        delete files;
+        files = nullptr;
+        delete mux;
+        mux = nullptr;
+        if (recv_mr)
+            ibv_dereg_mr(recv_mr);
+        recv_mr = nullptr;
+        if (seq_mr)
+            ibv_dereg_mr(seq_mr);
+        seq_mr = nullptr;
+        if (crc_mr)
+            ibv_dereg_mr(crc_mr);
+        crc_mr = nullptr;
+        if (send_qp)
+            ibv_destroy_qp(send_qp);
+        send_qp = nullptr;
+        if (send_cq)
+            ibv_destroy_cq(send_cq);
+        send_cq = nullptr;
+        if (socket_fd != -1)
+            ::close(socket_fd);
+        socket_fd = -1;
+    }
+
+    // Create CQ, QP, receive ring and RPC endpoint; the QP ends up in INIT.
+    int open(struct ibv_context *context, struct ibv_pd *pd, uint32_t node_id) {
+        memset(&local_rdma, 0, sizeof(local_rdma));
+        local_rdma.node_id = node_id;
+        set_gid(context, port_attr, &local_rdma, gidIndex);
+
+        // room for the broadcast relay QPs next to our own
+        send_cq = ibv_create_cq(context, 0x100, nullptr, nullptr, 0);
+        if (!send_cq)
+        {
+            cerr << "ibv_create_cq - send - failed: " << strerror(errno) << endl;
+            return -1;
+        }
+
+        struct ibv_qp_init_attr qp_init_attr;
+        send_qp = create_qp_for_send(qp_init_attr, pd, send_cq);
+        if (!send_qp)
+        {
+            cerr << "ibv_create_qp failed: " << strerror(errno) << endl;
+            return -1;
+        }
+
+        // move the QP in the INIT state, using ibv_modify_qp
+        if (modify_qp_to_init(send_qp) != 0)
+            return -1;
+
+        recv_mr = ibv_reg_mr(pd, recv_buf, sizeof(recv_buf), IBV_ACCESS_LOCAL_WRITE);
+        seq_mr = ibv_reg_mr(pd, seq_headers, sizeof(seq_headers), IBV_ACCESS_LOCAL_WRITE);
+        crc_mr = ibv_reg_mr(pd, crc_trailers, sizeof(crc_trailers), IBV_ACCESS_LOCAL_WRITE);
+        if (!recv_mr || !seq_mr || !crc_mr)
+        {
+            cerr << "ibv_reg_mr failed: " << strerror(errno) << endl;
+            return -1;
+        }
+        prepare_wrs();
+
+        rpc = new rpc_endpoint(send_qp, LINK_RPC_WINDOW, 0, [this]() { poll_completions(); });
+        if (rpc->init(pd) != 0)
+            return -1;
+        bcast = new bcast_receiver(pd, send_cq, send_qp, gidIndex, port_attr.active_mtu);
+        kv = new kv_client(send_qp, rpc, [this]() { poll_completions(); });
+        if (kv->init(pd) != 0)
+            return -1;
+        counters = new counter_client(send_qp, rpc, [this]() { poll_completions(); });
+        if (counters->init(pd) != 0)
+            return -1;
+        files = new file_streamer(pd, send_qp, rpc, [this]() { poll_completions(); });
+        mux = new flow_mux(pd, send_qp, [this]() { poll_completions(); });
+        if (mux->init() != 0)
+            return -1;
+        register_rpc_methods();
+
+        local_rdma.send_qp_num = send_qp->qp_num;
+        return 0;
+    }
+
+    // Exchange device info with the master and bring the QP to RTS.
+    int connect_to(const std::string &ip, int port) {
+        struct sockaddr_in serverAddr;
+
+        // ====== Create socket =======
+        if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+            perror("Socket creation failed");
+            return -1;
+        }
+
+        // Set up server address structure
+        memset(&serverAddr, 0, sizeof(serverAddr));
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(port);
+        serverAddr.sin_addr.s_addr = inet_addr(ip.c_str());
+
+        // Connect to the server
+        if (connect(socket_fd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1) {
+            perror("Connection failed");
+            return -1;
+        }
+
+        // Send a message to the server
+        cout << "> Send RDMA device info to MASTER. NODE: " << local_rdma.node_id << ", QP: " << local_rdma.send_qp_num << ", intf: " << local_rdma.gid.global.interface_id << endl;
+        if (send(socket_fd, &local_rdma, sizeof(local_rdma), 0) == -1) {
+            perror("Message sending failed");
+            return -1;
+        }
+
+        ssize_t bytesRead = recv(socket_fd, &server_rdma, sizeof(server_rdma), MSG_WAITALL);
+        if (bytesRead == -1) {
+            perror("Error while receiving data");
+            return -1;
+        } else if (bytesRead == 0) {
+            cout << "Server disconnected." << endl;
+            return -1;
+        }
+        cout << "> Receive RDMA device info from MASTER. QP: " << server_rdma.send_qp_num << ", intf: " << server_rdma.gid.global.interface_id << endl;
+
+        // the master may push RPCs as soon as we are connected
+        if (post_all_recv_slots() != 0)
+            return -1;
+
+        // move the send QP into the RTR and then RTS state, both sides start with PSN 0
+        if (modify_qp_to_rtr(send_qp, server_rdma, gidIndex, port_attr.active_mtu, 0) != 0 ||
+            modify_qp_to_rts(send_qp, 0) != 0)
+            return -1;
+
+        // RPCs from the master arrive on the CQ at any time, so the control
+        // socket is polled alongside it instead of blocking in recv()
+        set_socket_non_blocking(socket_fd);
+        return 0;
+    }
+
+    // One step of the event loop: reap completions and handle at most one
+    // control message, the socket is only read once the buffered ones are
+    // done. Recovery requests are served here, UNLOCK is returned.
+    link_event poll() {
+        poll_completions();
+
+        const char *message = control.next();
+        if (!message) {
+            ssize_t bytesRead = control.fill(socket_fd);
+            if (bytesRead == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return LINK_IDLE;
+                perror("Error while receiving data");
+                return LINK_CLOSED;
+            } else if (bytesRead == 0) {
+                cout << "Server disconnected." << endl;
+                return LINK_CLOSED;
+            }
+            if (!(message = control.next()))
+                return LINK_IDLE;
+        }
+
+        cout << "Received message from server: " << message << endl;
+
+        if (startsWith(message, "[SERVER] RECOVER")) {
+            recover_qp(message);
+            return LINK_IDLE;
+        }
+        if (startsWith(message, "[SERVER] UNLOCK"))
+            return LINK_UNLOCK;
+        return LINK_IDLE;
+    }
+
+    // Send one incast message of `len` bytes out of a registered buffer and
+    // wait for its completion, `flags` are the SEQ_* bits describing it. A
+    // failure is reported to the master, which cannot always see a broken
+    // connection on its side.
+    int send_message(struct ibv_mr *mr, const char *data, uint32_t len, uint16_t flags = 0) {
+        struct ibv_send_wr *bad_wr_send;
+
+        // the sequence header goes out from its own buffer in front of the data
+        stamp_seq_header(DATA_SEQ_HEADER, SEQ_FLOW_DATA, next_seq[SEQ_FLOW_DATA]);
+        seq_headers[DATA_SEQ_HEADER].flags |= flags;
+        struct ibv_send_wr *wr;
+        if (crc) {
+            stamp_crc(DATA_SEQ_HEADER, data, len);
+            data_crc_wr.set_sge(0, 1, (uintptr_t)data, len, mr->lkey);
+            wr = data_crc_wr.chain(0, 1);
+        } else {
+            data_wr.set_sge(0, 1, (uintptr_t)data, len, mr->lkey);
+            wr = data_wr.chain(0, 1);
+        }
+
+        data_send_status = -1;
+        int ret;
+        {
+            perf_scope scope(profiler, PERF_POST_SEND);
+            ret = ibv_post_send(send_qp, wr, &bad_wr_send);
+        }
+        if (ret != 0)
+        {
+            cerr << "ibv_post_send failed: " << strerror(ret) << endl;
+            data_send_status = 0;
+            stats.send_errors++;
+            return -1;
+        }
+        next_seq[SEQ_FLOW_DATA]++;
+
+        if (wait_send_completion() != 0) {
+            report_qp_error();
+            return -1;
+        }
+
+        stats.messages_sent++;
+        return 0;
+    }
+
+    // Stream `chunks` reduce chunks laid out REDUCE_CHUNK_SIZE apart in `mr`,
+    // with at most INCAST_RECV_SLOTS in flight, which is what the master
+    // keeps posted for us. Whatever room there is gets filled with one post.
+    int send_reduce_chunks(struct ibv_mr *mr, const char *chunk_buf, uint32_t chunks) {
+        reduce_failed = false;
+        reduce_in_flight = 0;
+
+        uint32_t c = 0;
+        while (c < chunks && !reduce_failed) {
+            auto start = std::chrono::steady_clock::now();
+            while (reduce_in_flight == INCAST_RECV_SLOTS && !reduce_failed && elapsed_us(start) < CONTROL_TIMEOUT_MS * 1000.0)
+                poll_completions();
+            if (reduce_in_flight == INCAST_RECV_SLOTS || reduce_failed)
+                break;
+
+            // sends complete in order, so chunk c's WR and header are free again
+            uint32_t n = std::min(chunks - c, INCAST_RECV_SLOTS - reduce_in_flight);
+            for (uint32_t i = 0; i < n; i++) {
+                uint32_t index = (c + i) % INCAST_RECV_SLOTS;
+                const reduce_chunk_header_s *hdr = (const reduce_chunk_header_s *)(chunk_buf + (size_t)(c + i) * REDUCE_CHUNK_SIZE);
+                uint32_t bytes = sizeof(*hdr) + hdr->elements * reduce_dtype_size(hdr->dtype);
+                stamp_seq_header(index, SEQ_FLOW_REDUCE, next_seq[SEQ_FLOW_REDUCE] + i);
+                if (crc) {
+                    stamp_crc(index, hdr, bytes);
+                    reduce_crc_wrs.set_sge(index, 1, (uintptr_t)hdr, bytes, mr->lkey);
+                } else {
+                    reduce_wrs.set_sge(index, 1, (uintptr_t)hdr, bytes, mr->lkey);
+                }
+            }
+
+            struct ibv_send_wr *head = crc ? reduce_crc_wrs.chain(c % INCAST_RECV_SLOTS, n) : reduce_wrs.chain(c % INCAST_RECV_SLOTS, n);
+            struct ibv_send_wr *bad_wr;
+            int ret;
+            {
+                perf_scope scope(profiler, PERF_POST_SEND, n);
+                ret = ibv_post_send(send_qp, head, &bad_wr);
+            }
+            uint32_t posted = ret == 0 ? n : send_wr_ring<reduce_send_format, INCAST_RECV_SLOTS>::posted_before(head, bad_wr);
+            next_seq[SEQ_FLOW_REDUCE] += posted;
+            reduce_in_flight += posted;
+            c += posted;
+            if (ret != 0)
+            {
+                cerr << "ibv_post_send failed: " << strerror(ret) << endl;
+                break;
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        while (reduce_in_flight > 0 && elapsed_us(start) < CONTROL_TIMEOUT_MS * 1000.0)
+            poll_completions();
+
+        if (reduce_failed || reduce_in_flight > 0 || c < chunks) {
+            report_qp_error();
+            return -1;
+        }
+
+        stats.messages_sent += chunks;
+        return 0;
+    }
+
+    // Send what the producers queued on the multiplexed flows, after an UNLOCK.
+    int send_flows() {
+        int sent = mux->drain(INCAST_RECV_SLOTS);
+        if (sent < 0) {
+            report_qp_error();
+            return -1;
+        }
+        stats.messages_sent += sent;
+        return sent;
+    }
+
+    // Count the posts and polls of this link, from the thread that opened
+    // `p` and drives the link.
+    void set_profiler(perf_profiler *p) {
+        profiler = p;
+        if (mux)
+            mux->set_profiler(p);
+    }
+
+    // End every incast message, the flows' included, with a CRC32C trailer
+    // the master checks. Set before the producers start.
+    void set_crc(bool on) {
+        crc = on;
+        if (mux)
+            mux->set_crc(on);
+    }
+
+    struct ibv_qp *qp() const { return send_qp; }
+    flow_mux &flows() { return *mux; }
+    kv_client &kv_store() { return *kv; }
+    counter_client &shared_counters() { return *counters; }
+    file_streamer &file_upload() { return *files; }
+
+    node_stats_s stats;
+    node_config_s config;
+
+private:
+    // The WRs of the data send, the reduce chunks and the receive slots,
+    // with everything that stays the same from message to message. The
+    // sequence headers have fixed places, so only the payload is patched in.
+    void prepare_wrs() {
+        // the payload's lkey comes with each message
+        data_wr.init({ seq_mr->lkey, 0 });
+        data_wr.set_wr_id(0, DATA_WR_ID);
+        data_wr.set_sge(0, 0, (uintptr_t)&seq_headers[DATA_SEQ_HEADER], sizeof(seq_header_s));
+
+        reduce_wrs.init({ seq_mr->lkey, 0 });
+        for (uint32_t i = 0; i < INCAST_RECV_SLOTS; i++) {
+            reduce_wrs.set_wr_id(i, REDUCE_WR_BASE + i);
+            reduce_wrs.set_imm(i, REDUCE_IMM);
+            reduce_wrs.set_sge(i, 0, (uintptr_t)&seq_headers[i], sizeof(seq_header_s));
+        }
+
+        // the trailer of header i sits at crc_trailers[i]
+        data_crc_wr.init({ seq_mr->lkey, 0, crc_mr->lkey });
+        data_crc_wr.set_wr_id(0, DATA_WR_ID);
+        data_crc_wr.set_sge(0, 0, (uintptr_t)&seq_headers[DATA_SEQ_HEADER], sizeof(seq_header_s));
+        data_crc_wr.set_sge(0, 2, (uintptr_t)&crc_trailers[DATA_SEQ_HEADER], CRC32C_TRAILER);
+
+        reduce_crc_wrs.init({ seq_mr->lkey, 0, crc_mr->lkey });
+        for (uint32_t i = 0; i < INCAST_RECV_SLOTS; i++) {
+            reduce_crc_wrs.set_wr_id(i, REDUCE_WR_BASE + i);
+            reduce_crc_wrs.set_imm(i, REDUCE_IMM);
+            reduce_crc_wrs.set_sge(i, 0, (uintptr_t)&seq_headers[i], sizeof(seq_header_s));
+            reduce_crc_wrs.set_sge(i, 2, (uintptr_t)&crc_trailers[i], CRC32C_TRAILER);
+        }
+
+        for (uint32_t slot = 0; slot < LINK_RECV_SLOTS; slot++)
+            recv_wrs.set(slot, slot, (uintptr_t)recv_buf[slot], RPC_FRAME_SIZE, recv_mr->lkey);
+    }
+
+    // Number header `index` as message `seq` of `flow`, which is only used up
+    // once the send is posted. A header is not touched again before the send
+    // using it completed.
+    void stamp_seq_header(uint32_t index, uint16_t flow, uint32_t seq) {
+        seq_headers[index].seq = seq;
+        seq_headers[index].flow = flow;
+        seq_headers[index].flags = 0;
+        seq_headers[index].send_ns = clock_ns();
+    }
+
+    // the payload going out behind header `index` gets its CRC32C trailer
+    void stamp_crc(uint32_t index, const void *payload, uint32_t len) {
+        crc_trailers[index] = crc32c(payload, len);
+        seq_headers[index].flags |= SEQ_CRC32C;
+    }
+
+    int post_recv_slot(uint64_t slot) {
+        struct ibv_recv_wr *bad_wr_recv;
+        perf_scope scope(profiler, PERF_POST_RECV);
+        int ret = ibv_post_recv(send_qp, recv_wrs.single(slot), &bad_wr_recv);
+        if (ret != 0)
+            cerr << "ibv_post_recv failed: " << strerror(ret) << endl;
+        return ret;
+    }
+
+    int post_all_recv_slots() {
+        struct ibv_recv_wr *bad_wr_recv;
+        perf_scope scope(profiler, PERF_POST_RECV, LINK_RECV_SLOTS);
+        int ret = ibv_post_recv(send_qp, recv_wrs.chain((1u << LINK_RECV_SLOTS) - 1), &bad_wr_recv);
+        if (ret != 0)
+            cerr << "ibv_post_recv failed: " << strerror(ret) << endl;
+        return ret == 0 ? 0 : -1;
+    }
+
+    // Reap what is on the CQ: RPC frames from the master, completions of our
+    // RPC responses and of the incast sends.
+    void poll_completions() {
+        struct ibv_wc wcs[16];
+        int n;
+        {
+            perf_scope scope(profiler, PERF_POLL_CQ);
+            n = ibv_poll_cq(send_cq, 16, wcs);
+            if (n > 0)
+                scope.count(n);
+            else
+                scope.cancel();
+        }
+
+        perf_scope scope(n > 0 ? profiler : nullptr, PERF_DISPATCH, n);
+        for (int i = 0; i < n; i++) {
+            const struct ibv_wc &wc = wcs[i];
+            if (kv->handle(wc) || counters->handle(wc) || files->handle(wc) || mux->handle(wc))
+                continue;
+
+            if (bcast->handle(wc)) {
+                if (wc.wr_id < LINK_RECV_SLOTS)
+                    post_recv_slot(wc.wr_id);
+                continue;
+            }
+
+            if (wc.wr_id == DATA_WR_ID) {
+                data_send_status = wc.status == ibv_wc_status::IBV_WC_SUCCESS ? 0 : wc.status;
+                if (wc.status != ibv_wc_status::IBV_WC_SUCCESS)
+                    cerr << "ibv_poll_cq failed: " << ibv_wc_status_str(wc.status) << endl;
+                continue;
+            }
+
+            if (wc.wr_id >= REDUCE_WR_BASE && wc.wr_id < REDUCE_WR_BASE + INCAST_RECV_SLOTS) {
+                reduce_in_flight--;
+                if (wc.status != ibv_wc_status::IBV_WC_SUCCESS) {
+                    cerr << "ibv_poll_cq failed: " << ibv_wc_status_str(wc.status) << endl;
+                    reduce_failed = true;
+                }
+                continue;
+            }
+
+            if (wc.status != ibv_wc_status::IBV_WC_SUCCESS) {
+                if (wc.status != ibv_wc_status::IBV_WC_WR_FLUSH_ERR)
+                    cerr << "ibv_poll_cq failed: " << ibv_wc_status_str(wc.status) << endl;
+                continue;
+            }
+
+            if (rpc_endpoint::is_rpc_send(wc.wr_id)) {
+                rpc->handle_send_completion(wc.wr_id);
+            } else if (wc.wr_id < LINK_RECV_SLOTS) {
+                if (rpc_endpoint::is_rpc_recv(wc))
+                    rpc->handle_recv(recv_buf[wc.wr_id], wc.byte_len);
+                post_recv_slot(wc.wr_id);
+            }
+        }
+    }
+
+    int wait_send_completion() {
+        auto start = std::chrono::steady_clock::now();
+        while (data_send_status == -1 && elapsed_us(start) < CONTROL_TIMEOUT_MS * 1000.0)
+            poll_completions();
+
+        if (data_send_status == -1)
+        {
+            cerr << "No completion for the posted send" << endl;
+            return -1;
+        }
+        return data_send_status;
+    }
+
+    void report_qp_error() {
+        send_control(socket_fd, "[CLIENT] QP_ERROR");
+        stats.send_errors++;
+    }
+
+    void register_rpc_methods() {
+        rpc->register_method(RPC_GET_STATS, [this](const char *, uint32_t, char *resp, uint32_t resp_cap) -> uint32_t {
+            if (resp_cap < sizeof(stats))
+                return 0;
+            memcpy(resp, &stats, sizeof(stats));
+            return sizeof(stats);
+        });
+
+        rpc->register_method(RPC_SET_CONFIG, [this](const char *args, uint32_t args_len, char *, uint32_t) -> uint32_t {
+            if (args_len < sizeof(config))
+                return 0;
+            memcpy(&config, args, sizeof(config));
+            if (config.message_size == 0 || config.message_size > RDMA_MSG_SIZE)
+                config.message_size = RDMA_MSG_SIZE;
+            cout << "> Config from MASTER: message_size " << config.message_size << endl;
+            return 0;
+        });
+
+        rpc->register_method(RPC_CLOCK_SYNC, [](const char *, uint32_t, char *resp, uint32_t resp_cap) -> uint32_t {
+            if (resp_cap < sizeof(uint64_t))
+                return 0;
+            uint64_t now = clock_ns();
+            memcpy(resp, &now, sizeof(now));
+            return sizeof(now);
+        });
+
+        rpc->register_method(RPC_BCAST_PREPARE, [this](const char *args, uint32_t args_len, char *resp, uint32_t resp_cap) -> uint32_t {
+            return bcast->prepare(args, args_len, resp, resp_cap);
+        });
+
+        rpc->register_method(RPC_BCAST_START, [this](const char *args, uint32_t args_len, char *resp, uint32_t resp_cap) -> uint32_t {
+            return bcast->start(args, args_len, resp, resp_cap);
+        });
+    }
+
+    // Master asked for "[SERVER] RECOVER <master_psn> <node_psn>": drop whatever
+    // is still queued on our side and bring the same QP back with the new PSNs.
+    int recover_qp(const char *request) {
+        uint32_t master_psn, node_psn;
+        if (sscanf(request, "[SERVER] RECOVER %u %u", &master_psn, &node_psn) != 2)
+        {
+            cerr << "Malformed recover request: " << request << endl;
+            return -1;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        struct ibv_wc wc;
+        modify_qp_to_error(send_qp);
+        while (ibv_poll_cq(send_cq, 1, &wc) > 0)
+            ;
+        rpc->reset();
+        mux->reset();
+        data_send_status = 0;
+        reduce_in_flight = 0;
+
+        if (reconnect_qp(send_qp, server_rdma, gidIndex, port_attr.active_mtu, master_psn, node_psn) != 0)
+            return -1;
+
+        if (post_all_recv_slots() != 0)
+            return -1;
+
+        if (send_control(socket_fd, "[CLIENT] RECOVERED") == -1)
+        {
+            perror("Message sending failed");
+            return -1;
+        }
+
+        stats.recoveries++;
+        cout << "> QP " << send_qp->qp_num << " recovered in " << elapsed_us(start) << " us" << endl;
+        return 0;
+    }
+
+    struct ibv_qp *send_qp;
+    struct ibv_cq *send_cq;
+    struct ibv_mr *recv_mr;
+    char recv_buf[LINK_RECV_SLOTS][RPC_FRAME_SIZE];
+    // one per reduce chunk in flight and one for the data send
+    seq_header_s seq_headers[INCAST_RECV_SLOTS + 1];
+    send_wr_ring<data_send_format, 1> data_wr;
+    send_wr_ring<reduce_send_format, INCAST_RECV_SLOTS> reduce_wrs;
+    recv_wr_ring<LINK_RECV_SLOTS> recv_wrs;
+    struct ibv_mr *seq_mr;
+    // CRC32C trailers, one per sequence header
+    uint32_t crc_trailers[INCAST_RECV_SLOTS + 1];
+    send_wr_ring<data_crc_send_format, 1> data_crc_wr;
+    send_wr_ring<reduce_crc_send_format, INCAST_RECV_SLOTS> reduce_crc_wrs;
+    struct ibv_mr *crc_mr;
+    uint32_t next_seq[SEQ_MAX_FLOWS];
+    rpc_endpoint *rpc;
+    bcast_receiver *bcast;
+    kv_client *kv;
+    counter_client *counters;
+    file_streamer *files;
+    flow_mux *mux;
+    perf_profiler *profiler;
+    bool crc;
+
+    int socket_fd;
+    control_stream control;
+    struct device_info local_rdma, server_rdma;
+    struct ibv_port_attr port_attr;
+    uint32_t gidIndex;
+
+    // status of the last data send: -1 while in flight
+    int data_send_status;
+    uint32_t reduce_in_flight;
+    bool reduce_failed;
+};
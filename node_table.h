@@ -0,0 +1,145 @@
+#pragma once
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "wr_builder.h"
+
+class rpc_endpoint;
+
+// Dense node table for large fan-in. Every node gets a stable integer ID (its
+// index) at its first connect. The fields the scheduler touches on every pass
+// live in their own contiguous arrays, the setup data only needed on connect,
+// reconnect and recovery is kept apart in `setup`.
+//
+// Capacity is fixed up front so the arrays never move: handleClient threads
+// fill the next slot and publish it by bumping `count`, the RDMA thread reads
+// [0, count) without taking the lock.
+
+const uint32_t MAX_NODES = 16384;
+const uint32_t INVALID_NODE = UINT32_MAX;
+
+enum node_state : uint8_t {
+    NODE_READY = 0,
+    NODE_NEEDS_RECOVERY,
+};
+
+// wr_id layout: node ID in the upper 32 bits, the per-node slot in the lower
+// ones, so a completion leads straight to its node without any lookup
+inline uint64_t make_wr_id(uint32_t node, uint32_t slot) {
+    return ((uint64_t)node << 32) | slot;
+}
+
+inline uint32_t wr_id_node(uint64_t wr_id) {
+    return (uint32_t)(wr_id >> 32);
+}
+
+inline uint32_t wr_id_slot(uint64_t wr_id) {
+    return (uint32_t)wr_id;
+}
+
+typedef struct node_key_ {
+    union ibv_gid gid;
+    uint32_t node_id;
+
+    bool operator<(const node_key_ &other) const {
+        if (node_id != other.node_id)
+            return node_id < other.node_id;
+        return memcmp(&gid, &other.gid, sizeof(gid)) < 0;
+    }
+} node_key_s;
+
+inline node_key_s make_node_key(const struct device_info &info) {
+    node_key_s key;
+    memset(&key, 0, sizeof(key));
+    key.gid = info.gid;
+    key.node_id = info.node_id;
+    return key;
+}
+
+// cold per-node data, only touched outside the scheduling loop
+typedef struct node_setup_ {
+    struct device_info rdma_info;
+    struct ibv_mr *recv_mr;
+    char *recv_buf;
+    // one receive WR per slot, set up once the node has its ID
+    recv_wr_ring<INCAST_RECV_SLOTS> recv_wrs;
+    rpc_endpoint *rpc;
+    bool configured;
+    uint32_t recoveries;
+    uint32_t reconnects;
+    // set by handleClient when the same node connects again
+    int pending_socket;
+    struct device_info pending_info;
+    // control messages from the node, read on errors and during recovery
+    control_stream control;
+} node_setup_s;
+
+struct node_table {
+    // ==== hot, one entry per node ID ====
+    std::unique_ptr<struct ibv_qp *[]> qp;
+    std::unique_ptr<int[]> socket_fd;
+    std::unique_ptr<uint8_t[]> state;
+    std::unique_ptr<uint8_t[]> posted_recvs;
+    // receive slots the master still holds: with a consumer or being written
+    // to the ingest log
+    std::unique_ptr<uint8_t[]> held_slots;
+    // node_transport: RDMA nodes have a QP, TCP nodes only their socket
+    std::unique_ptr<uint8_t[]> transport;
+    std::atomic<uint32_t> count;
+
+    // ==== cold ====
+    std::unique_ptr<node_setup_s[]> setup;
+    // connection cache, a reconnecting node gets its previous ID, QP and ring back
+    std::map<node_key_s, uint32_t> by_key;
+    std::vector<uint32_t> pending_reconnects;
+    std::mutex mutex;
+
+    node_table()
+        : qp(new struct ibv_qp *[MAX_NODES]()),
+          socket_fd(new int[MAX_NODES]()),
+          state(new uint8_t[MAX_NODES]()),
+          posted_recvs(new uint8_t[MAX_NODES]()),
+          held_slots(new uint8_t[MAX_NODES]()),
+          transport(new uint8_t[MAX_NODES]()),
+          count(0),
+          setup(new node_setup_s[MAX_NODES]()) {}
+
+    uint32_t size() const {
+        return count.load(std::memory_order_acquire);
+    }
+
+    // Caller holds `mutex`. Returns INVALID_NODE for an unknown node.
+    uint32_t find(const struct device_info &info) const {
+        auto it = by_key.find(make_node_key(info));
+        return it == by_key.end() ? INVALID_NODE : it->second;
+    }
+
+    // Caller holds `mutex` until publish(): the slot is filled (and its receive
+    // ring posted) before `count` makes it visible to the RDMA thread.
+    uint32_t add(struct ibv_qp *node_qp, int socket, const node_setup_s &node_setup) {
+        uint32_t id = count.load(std::memory_order_relaxed);
+        if (id == MAX_NODES)
+            return INVALID_NODE;
+
+        qp[id] = node_qp;
+        socket_fd[id] = socket;
+        state[id] = NODE_READY;
+        setup[id] = node_setup;
+        setup[id].pending_socket = -1;
+        setup[id].control.reset();
+        posted_recvs[id] = 0;
+        held_slots[id] = 0;
+        transport[id] = node_setup.rdma_info.transport;
+        return id;
+    }
+
+    void publish(uint32_t id) {
+        by_key[make_node_key(setup[id].rdma_info)] = id;
+        count.store(id + 1, std::memory_order_release);
+    }
+};
@@ -0,0 +1,207 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Hardware counters around the hot loops: cycles, instructions, cache misses
+// and branch misses of posting sends, posting receives, polling the CQ and
+// dispatching completions, per message.
+//
+// The four counters are one perf_event_open group on the calling thread,
+// user space only (perf_event_paranoid 2 allows that without privileges),
+// read with one read() at either end of a phase. Only the thread that opened
+// the group records, scopes on other threads do nothing. A read costs a
+// syscall, so the counts are made in profiling runs, not with the normal
+// busy loop: the user-space part of a read is calibrated at open and taken
+// off every phase.
+
+enum perf_phase {
+    PERF_POST_SEND = 0,
+    PERF_POST_RECV,
+    // ibv_poll_cq calls that returned a completion
+    PERF_POLL_CQ,
+    // what is done with a completion, reposts included
+    PERF_DISPATCH,
+    PERF_PHASES,
+};
+
+const char *const perf_phase_names[PERF_PHASES] = { "post_send", "post_recv", "poll_cq", "dispatch" };
+
+enum perf_counter {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTERS,
+};
+
+const char *const perf_counter_names[PERF_COUNTERS] = { "cycles", "instructions", "cache-misses", "branch-misses" };
+
+typedef struct perf_totals_ {
+    uint64_t calls;
+    uint64_t messages;
+    uint64_t counts[PERF_COUNTERS];
+} perf_totals_s;
+
+class perf_profiler {
+public:
+    perf_profiler() : leader(-1), members(0) {
+        memset(fds, -1, sizeof(fds));
+        memset(slot, -1, sizeof(slot));
+        memset(totals, 0, sizeof(totals));
+        memset(overhead, 0, sizeof(overhead));
+    }
+
+    ~perf_profiler() {
+        for (int fd : fds)
+            if (fd != -1)
+                close(fd);
+    }
+
+    // Counters of the calling thread from now on. Counters the CPU or the
+    // hypervisor does not offer are left out; without cycles nothing is counted.
+    int open() {
+        static const uint64_t configs[PERF_COUNTERS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+        };
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[c];
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.disabled = leader == -1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+            if (fd == -1) {
+                if (c == PERF_CYCLES) {
+                    perror("perf_event_open cycles");
+                    return -1;
+                }
+                std::cerr << "perf_event_open " << perf_counter_names[c] << ": " << strerror(errno) << ", not counted" << std::endl;
+                continue;
+            }
+            if (leader == -1)
+                leader = fd;
+            fds[c] = fd;
+            slot[c] = members++;
+        }
+        ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        owner = std::this_thread::get_id();
+        calibrate();
+        return 0;
+    }
+
+    bool enabled() const { return leader != -1; }
+
+    // Phases may nest (a dispatch that reposts a receive), each keeps its own
+    // start. Returns false if this thread does not record.
+    bool begin(uint64_t start[PERF_COUNTERS]) {
+        if (leader == -1 || std::this_thread::get_id() != owner)
+            return false;
+        return sample(start);
+    }
+
+    void end(perf_phase phase, const uint64_t start[PERF_COUNTERS], uint64_t messages) {
+        uint64_t now[PERF_COUNTERS];
+        if (!sample(now))
+            return;
+        perf_totals_s &t = totals[phase];
+        t.calls++;
+        t.messages += messages;
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            uint64_t delta = now[c] - start[c];
+            t.counts[c] += delta > overhead[c] ? delta - overhead[c] : 0;
+        }
+    }
+
+    const perf_totals_s &phase(perf_phase p) const { return totals[p]; }
+
+    void report(std::ostream &out, const std::string &who) const {
+        if (leader == -1)
+            return;
+        out << "> Counters of the " << who << " per message:" << std::endl;
+        for (int p = 0; p < PERF_PHASES; p++) {
+            const perf_totals_s &t = totals[p];
+            if (t.messages == 0)
+                continue;
+            out << ">   " << std::left << std::setw(10) << perf_phase_names[p] << std::right << " "
+                << t.messages << " messages in " << t.calls << " calls:";
+            for (int c = 0; c < PERF_COUNTERS; c++)
+                if (fds[c] != -1)
+                    out << " " << std::fixed << std::setprecision(1) << (double)t.counts[c] / t.messages
+                        << " " << perf_counter_names[c];
+            if (fds[PERF_INSTRUCTIONS] != -1 && t.counts[PERF_CYCLES] != 0)
+                out << ", IPC " << std::setprecision(2) << (double)t.counts[PERF_INSTRUCTIONS] / t.counts[PERF_CYCLES];
+            out << std::defaultfloat << std::setprecision(6) << std::endl;
+        }
+    }
+
+private:
+    bool sample(uint64_t values[PERF_COUNTERS]) {
+        uint64_t buf[1 + PERF_COUNTERS];
+        if (read(leader, buf, sizeof(uint64_t) * (1 + members)) <= 0)
+            return false;
+        for (int c = 0; c < PERF_COUNTERS; c++)
+            values[c] = slot[c] >= 0 ? buf[1 + slot[c]] : 0;
+        return true;
+    }
+
+    // what a begin/end pair counts on its own, the least of a few tries
+    void calibrate() {
+        uint64_t best[PERF_COUNTERS];
+        memset(best, 0xff, sizeof(best));
+        for (int i = 0; i < 64; i++) {
+            uint64_t start[PERF_COUNTERS], now[PERF_COUNTERS];
+            if (!sample(start) || !sample(now))
+                return;
+            for (int c = 0; c < PERF_COUNTERS; c++)
+                best[c] = std::min(best[c], now[c] - start[c]);
+        }
+        memcpy(overhead, best, sizeof(overhead));
+    }
+
+    int leader;
+    int fds[PERF_COUNTERS];
+    // position of each counter in a group read, -1 if it is not counted
+    int slot[PERF_COUNTERS];
+    int members;
+    std::thread::id owner;
+    uint64_t overhead[PERF_COUNTERS];
+    perf_totals_s totals[PERF_PHASES];
+};
+
+// One phase on the profiler's thread, a no-op without a profiler.
+class perf_scope {
+public:
+    perf_scope(perf_profiler *profiler, perf_phase phase, uint64_t messages = 1)
+        : profiler(profiler && profiler->begin(start) ? profiler : nullptr), phase(phase), messages(messages) {}
+
+    ~perf_scope() {
+        if (profiler)
+            profiler->end(phase, start, messages);
+    }
+
+    // messages the phase handled, when only known at its end
+    void count(uint64_t n) { messages = n; }
+
+    // the phase was entered for nothing, e.g. an empty poll
+    void cancel() { profiler = nullptr; }
+
+private:
+    uint64_t start[PERF_COUNTERS];
+    perf_profiler *profiler;
+    perf_phase phase;
+    uint64_t messages;
+};
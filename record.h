@@ -0,0 +1,196 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Fixed-layout records, written in place into a registered buffer by the
+// producer and read in place out of the receive slot by the master. There is
+// no encoding step on either side: a record is
+//
+//   record_header_s | typed fields | variable sections
+//
+// everything 8 byte aligned. The typed fields are a plain struct, the
+// schema. A variable section (text, a blob, an array) is a record_span_s
+// among the fields: its offset from the start of the record and its length.
+// A reader resolves a span with bounds checks against the record's size,
+// so a record from the wire cannot point a reader outside of it.
+//
+// Schemas are fixed at compile time: record_schema<id, version, fields>
+// checks that the fields can be read in place. Versions only append
+// fields. The header carries the size of the writer's fields, so a reader
+// takes the fields it knows and skips the ones a newer writer added. A
+// reader that needs a field an older writer did not have gets nullptr from
+// as<>() and can fall back to the older schema. Any other change takes a
+// new schema id.
+//
+// A message holding a record has SEQ_RECORD set in its sequence header.
+
+const uint32_t RECORD_MAGIC = 0x31434552;  // "REC1"
+const uint32_t RECORD_ALIGN = 8;
+
+typedef struct record_header_ {
+    uint32_t magic;
+    uint16_t schema;
+    uint16_t version;
+    // the whole record, header and sections included
+    uint32_t size;
+    // bytes of typed fields behind the header, as the writer's version has them
+    uint32_t fields_size;
+} record_header_s;
+
+// a variable-length section, offset from the start of the record
+typedef struct record_span_ {
+    uint32_t offset;
+    uint32_t length;
+} record_span_s;
+
+template <uint16_t Id, uint16_t Version, typename Fields>
+struct record_schema {
+    static_assert(std::is_standard_layout<Fields>::value && std::is_trivially_copyable<Fields>::value,
+                  "fields are read in place");
+    static_assert(alignof(Fields) <= RECORD_ALIGN && sizeof(Fields) % RECORD_ALIGN == 0,
+                  "fields keep the sections behind them aligned");
+
+    static constexpr uint16_t id = Id;
+    static constexpr uint16_t version = Version;
+    typedef Fields fields;
+};
+
+inline uint32_t record_align(uint32_t n) {
+    return (n + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+}
+
+template <typename Schema>
+class record_writer {
+public:
+    typedef typename Schema::fields fields_type;
+
+    // Start a record at `buf` (8 byte aligned), in at most `capacity` bytes.
+    // The fields start out zeroed.
+    record_writer(void *buf, uint32_t capacity)
+        : base((char *)buf), capacity(capacity), used(sizeof(record_header_s) + sizeof(fields_type)), last(0), failed(false) {
+        if (capacity < used) {
+            failed = true;
+            return;
+        }
+        memset(base, 0, used);
+        record_header_s *hdr = header();
+        hdr->magic = RECORD_MAGIC;
+        hdr->schema = Schema::id;
+        hdr->version = Schema::version;
+        hdr->fields_size = sizeof(fields_type);
+    }
+
+    fields_type &fields() { return *(fields_type *)(base + sizeof(record_header_s)); }
+
+    // Room for a section of `len` bytes, to be written in place; `span`
+    // (one of the fields) points at it. nullptr if the record is full.
+    char *reserve(record_span_s &span, uint32_t len) {
+        if (failed || len > capacity - used) {
+            failed = true;
+            return nullptr;
+        }
+        span.offset = used;
+        span.length = len;
+        last = used;
+        char *section = base + used;
+        used = record_align(used + len) < capacity ? record_align(used + len) : capacity;
+        return section;
+    }
+
+    bool put(record_span_s &span, const void *data, uint32_t len) {
+        char *section = reserve(span, len);
+        if (section)
+            memcpy(section, data, len);
+        return section != nullptr;
+    }
+
+    // Give back what the last section reserved did not use.
+    void shrink(record_span_s &span, uint32_t len) {
+        if (span.offset == last && len < span.length) {
+            span.length = len;
+            used = record_align(span.offset + len);
+        }
+    }
+
+    // The record's size, 0 if something did not fit.
+    uint32_t finish() {
+        if (failed)
+            return 0;
+        header()->size = used;
+        return used;
+    }
+
+private:
+    record_header_s *header() { return (record_header_s *)base; }
+
+    char *base;
+    uint32_t capacity;
+    uint32_t used;
+    // offset of the last section reserved
+    uint32_t last;
+    bool failed;
+};
+
+// A record where it lies. Nothing is parsed or copied, every access is
+// checked against the `len` bytes the record came in.
+class record_view {
+public:
+    record_view(const void *data, uint32_t len) : base((const char *)data), len(len) {}
+
+    bool valid() const {
+        const record_header_s *hdr = header();
+        return len >= sizeof(record_header_s) && (uintptr_t)base % RECORD_ALIGN == 0 && hdr->magic == RECORD_MAGIC &&
+               hdr->size <= len && hdr->size >= sizeof(record_header_s) &&
+               hdr->fields_size <= hdr->size - sizeof(record_header_s);
+    }
+
+    uint16_t schema() const { return header()->schema; }
+    uint16_t version() const { return header()->version; }
+    uint32_t size() const { return header()->size; }
+
+    // The fields as `Schema` lays them out. nullptr for another schema or
+    // for a writer with fewer fields than `Schema`.
+    template <typename Schema>
+    const typename Schema::fields *as() const {
+        if (!valid() || header()->schema != Schema::id || header()->fields_size < sizeof(typename Schema::fields))
+            return nullptr;
+        return (const typename Schema::fields *)(base + sizeof(record_header_s));
+    }
+
+    // The bytes of a section, nullptr if the span leaves the record.
+    const char *section(const record_span_s &span) const {
+        if (span.offset > size() || span.length > size() - span.offset)
+            return nullptr;
+        return base + span.offset;
+    }
+
+private:
+    const record_header_s *header() const { return (const record_header_s *)base; }
+
+    const char *base;
+    uint32_t len;
+};
+
+// ==== schemas ====
+
+enum record_schema_id : uint16_t {
+    RECORD_NODE_MESSAGE = 1,
+};
+
+// a node's incast text message, on the data flow or a multiplexed one
+struct node_message_v1 {
+    uint32_t node_id;
+    // the node's message number on the flow
+    uint32_t sequence;
+    // the node's clock_ns() when the record was written
+    uint64_t created_ns;
+    uint16_t flow;
+    uint16_t reserved[3];
+    // no NUL
+    record_span_s text;
+};
+static_assert(sizeof(node_message_v1) == 32 && offsetof(node_message_v1, text) == 24, "wire layout");
+
+typedef record_schema<RECORD_NODE_MESSAGE, 1, node_message_v1> node_message_schema;
@@ -0,0 +1,429 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include <immintrin.h>
+#include "crc32c.h"
+
+// Gather-and-reduce for incast: every node sends the same typed vector in
+// chunks, the master folds each chunk into one output buffer (sum or max) as
+// soon as it arrives, straight out of the receive slot. While the CPU reduces
+// chunk k the NIC is already writing chunk k+1 into the next posted slot.
+//
+// Kernels are picked once at runtime: AVX-512, AVX2 or scalar. They are built
+// with per-function target attributes, so the binary still runs on CPUs
+// without those extensions.
+
+// SEND_WITH_IMM value marking a reduce chunk, next to RPC_IMM
+const uint32_t REDUCE_IMM = 0x52454431;  // "RED1"
+
+enum reduce_dtype : uint8_t {
+    REDUCE_F32 = 1,
+    REDUCE_F64 = 2,
+    REDUCE_I64 = 3,
+};
+
+enum reduce_op : uint8_t {
+    REDUCE_SUM = 1,
+    REDUCE_MAX = 2,
+};
+
+// in front of every chunk, payload follows right after (16 byte aligned)
+typedef struct reduce_chunk_header_ {
+    uint32_t total_elements;
+    uint32_t offset;
+    uint32_t elements;
+    uint8_t dtype;
+    uint8_t op;
+    uint16_t reserved;
+} reduce_chunk_header_s;
+
+inline size_t reduce_dtype_size(uint8_t dtype) {
+    switch (dtype) {
+    case REDUCE_F32: return sizeof(float);
+    case REDUCE_F64: return sizeof(double);
+    case REDUCE_I64: return sizeof(int64_t);
+    }
+    return 0;
+}
+
+inline const char *reduce_dtype_name(uint8_t dtype) {
+    switch (dtype) {
+    case REDUCE_F32: return "f32";
+    case REDUCE_F64: return "f64";
+    case REDUCE_I64: return "i64";
+    }
+    return "?";
+}
+
+// elements of `dtype` that fit into one chunk of chunk_size bytes
+inline uint32_t reduce_chunk_elements(uint8_t dtype, uint32_t chunk_size) {
+    return (chunk_size - sizeof(reduce_chunk_header_s)) / reduce_dtype_size(dtype);
+}
+
+inline uint32_t reduce_chunk_count(uint8_t dtype, uint32_t elements, uint32_t chunk_size) {
+    uint32_t per_chunk = reduce_chunk_elements(dtype, chunk_size);
+    return (elements + per_chunk - 1) / per_chunk;
+}
+
+// Write the chunk headers of a vector laid out chunk_size bytes apart in buf
+// and copy `values` (if any) behind them. buf holds reduce_chunk_count() chunks.
+inline void layout_reduce_chunks(char *buf, uint32_t chunk_size, uint32_t elements, uint8_t dtype, uint8_t op, const void *values) {
+    size_t width = reduce_dtype_size(dtype);
+    uint32_t per_chunk = reduce_chunk_elements(dtype, chunk_size);
+    uint32_t chunks = reduce_chunk_count(dtype, elements, chunk_size);
+    for (uint32_t c = 0; c < chunks; c++) {
+        reduce_chunk_header_s *hdr = (reduce_chunk_header_s *)(buf + (size_t)c * chunk_size);
+        hdr->total_elements = elements;
+        hdr->offset = c * per_chunk;
+        hdr->elements = elements - hdr->offset < per_chunk ? elements - hdr->offset : per_chunk;
+        hdr->dtype = dtype;
+        hdr->op = op;
+        hdr->reserved = 0;
+        if (values)
+            memcpy(hdr + 1, (const char *)values + (size_t)hdr->offset * width, (size_t)hdr->elements * width);
+    }
+}
+
+typedef void (*reduce_kernel_fn)(void *dst, const void *src, size_t n);
+
+// ==== scalar ====
+
+template <typename T>
+void reduce_sum_scalar(void *dst, const void *src, size_t n) {
+    T *d = (T *)dst;
+    const T *s = (const T *)src;
+    for (size_t i = 0; i < n; i++)
+        d[i] += s[i];
+}
+
+template <typename T>
+void reduce_max_scalar(void *dst, const void *src, size_t n) {
+    T *d = (T *)dst;
+    const T *s = (const T *)src;
+    for (size_t i = 0; i < n; i++)
+        d[i] = s[i] > d[i] ? s[i] : d[i];
+}
+
+// ==== AVX2 ====
+
+__attribute__((target("avx2")))
+inline void reduce_sum_f32_avx2(void *dst, const void *src, size_t n) {
+    float *d = (float *)dst;
+    const float *s = (const float *)src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(d + i, _mm256_add_ps(_mm256_loadu_ps(d + i), _mm256_loadu_ps(s + i)));
+    reduce_sum_scalar<float>(d + i, s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void reduce_max_f32_avx2(void *dst, const void *src, size_t n) {
+    float *d = (float *)dst;
+    const float *s = (const float *)src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(d + i, _mm256_max_ps(_mm256_loadu_ps(d + i), _mm256_loadu_ps(s + i)));
+    reduce_max_scalar<float>(d + i, s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void reduce_sum_f64_avx2(void *dst, const void *src, size_t n) {
+    double *d = (double *)dst;
+    const double *s = (const double *)src;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(d + i, _mm256_add_pd(_mm256_loadu_pd(d + i), _mm256_loadu_pd(s + i)));
+    reduce_sum_scalar<double>(d + i, s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void reduce_max_f64_avx2(void *dst, const void *src, size_t n) {
+    double *d = (double *)dst;
+    const double *s = (const double *)src;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(d + i, _mm256_max_pd(_mm256_loadu_pd(d + i), _mm256_loadu_pd(s + i)));
+    reduce_max_scalar<double>(d + i, s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void reduce_sum_i64_avx2(void *dst, const void *src, size_t n) {
+    int64_t *d = (int64_t *)dst;
+    const int64_t *s = (const int64_t *)src;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(d + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + i));
+        _mm256_storeu_si256((__m256i *)(d + i), _mm256_add_epi64(a, b));
+    }
+    reduce_sum_scalar<int64_t>(d + i, s + i, n - i);
+}
+
+// AVX2 has no 64-bit integer max, compare and blend instead
+__attribute__((target("avx2")))
+inline void reduce_max_i64_avx2(void *dst, const void *src, size_t n) {
+    int64_t *d = (int64_t *)dst;
+    const int64_t *s = (const int64_t *)src;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(d + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i b_greater = _mm256_cmpgt_epi64(b, a);
+        _mm256_storeu_si256((__m256i *)(d + i), _mm256_blendv_epi8(a, b, b_greater));
+    }
+    reduce_max_scalar<int64_t>(d + i, s + i, n - i);
+}
+
+// ==== AVX-512 ====
+
+__attribute__((target("avx512f")))
+inline void reduce_sum_f32_avx512(void *dst, const void *src, size_t n) {
+    float *d = (float *)dst;
+    const float *s = (const float *)src;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(d + i, _mm512_add_ps(_mm512_loadu_ps(d + i), _mm512_loadu_ps(s + i)));
+    if (i < n) {
+        __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+        __m512 a = _mm512_maskz_loadu_ps(tail, d + i);
+        __m512 b = _mm512_maskz_loadu_ps(tail, s + i);
+        _mm512_mask_storeu_ps(d + i, tail, _mm512_add_ps(a, b));
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void reduce_max_f32_avx512(void *dst, const void *src, size_t n) {
+    float *d = (float *)dst;
+    const float *s = (const float *)src;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(d + i, _mm512_max_ps(_mm512_loadu_ps(d + i), _mm512_loadu_ps(s + i)));
+    if (i < n) {
+        __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+        __m512 a = _mm512_maskz_loadu_ps(tail, d + i);
+        __m512 b = _mm512_maskz_loadu_ps(tail, s + i);
+        _mm512_mask_storeu_ps(d + i, tail, _mm512_max_ps(a, b));
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void reduce_sum_f64_avx512(void *dst, const void *src, size_t n) {
+    double *d = (double *)dst;
+    const double *s = (const double *)src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm512_storeu_pd(d + i, _mm512_add_pd(_mm512_loadu_pd(d + i), _mm512_loadu_pd(s + i)));
+    if (i < n) {
+        __mmask8 tail = (__mmask8)((1u << (n - i)) - 1);
+        __m512d a = _mm512_maskz_loadu_pd(tail, d + i);
+        __m512d b = _mm512_maskz_loadu_pd(tail, s + i);
+        _mm512_mask_storeu_pd(d + i, tail, _mm512_add_pd(a, b));
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void reduce_max_f64_avx512(void *dst, const void *src, size_t n) {
+    double *d = (double *)dst;
+    const double *s = (const double *)src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm512_storeu_pd(d + i, _mm512_max_pd(_mm512_loadu_pd(d + i), _mm512_loadu_pd(s + i)));
+    if (i < n) {
+        __mmask8 tail = (__mmask8)((1u << (n - i)) - 1);
+        __m512d a = _mm512_maskz_loadu_pd(tail, d + i);
+        __m512d b = _mm512_maskz_loadu_pd(tail, s + i);
+        _mm512_mask_storeu_pd(d + i, tail, _mm512_max_pd(a, b));
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void reduce_sum_i64_avx512(void *dst, const void *src, size_t n) {
+    int64_t *d = (int64_t *)dst;
+    const int64_t *s = (const int64_t *)src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i a = _mm512_loadu_si512(d + i);
+        __m512i b = _mm512_loadu_si512(s + i);
+        _mm512_storeu_si512(d + i, _mm512_add_epi64(a, b));
+    }
+    if (i < n) {
+        __mmask8 tail = (__mmask8)((1u << (n - i)) - 1);
+        __m512i a = _mm512_maskz_loadu_epi64(tail, d + i);
+        __m512i b = _mm512_maskz_loadu_epi64(tail, s + i);
+        _mm512_mask_storeu_epi64(d + i, tail, _mm512_add_epi64(a, b));
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void reduce_max_i64_avx512(void *dst, const void *src, size_t n) {
+    int64_t *d = (int64_t *)dst;
+    const int64_t *s = (const int64_t *)src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i a = _mm512_loadu_si512(d + i);
+        __m512i b = _mm512_loadu_si512(s + i);
+        _mm512_storeu_si512(d + i, _mm512_max_epi64(a, b));
+    }
+    if (i < n) {
+        __mmask8 tail = (__mmask8)((1u << (n - i)) - 1);
+        __m512i a = _mm512_maskz_loadu_epi64(tail, d + i);
+        __m512i b = _mm512_maskz_loadu_epi64(tail, s + i);
+        _mm512_mask_storeu_epi64(d + i, tail, _mm512_max_epi64(a, b));
+    }
+}
+
+enum reduce_isa {
+    REDUCE_ISA_SCALAR = 0,
+    REDUCE_ISA_AVX2,
+    REDUCE_ISA_AVX512,
+};
+
+inline reduce_isa detect_reduce_isa() {
+    if (__builtin_cpu_supports("avx512f"))
+        return REDUCE_ISA_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return REDUCE_ISA_AVX2;
+    return REDUCE_ISA_SCALAR;
+}
+
+inline const char *reduce_isa_name(reduce_isa isa) {
+    switch (isa) {
+    case REDUCE_ISA_AVX512: return "avx512";
+    case REDUCE_ISA_AVX2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+inline reduce_kernel_fn select_reduce_kernel(uint8_t dtype, uint8_t op, reduce_isa isa) {
+    static const reduce_kernel_fn kernels[3][3][2] = {
+        // scalar
+        { { reduce_sum_scalar<float>, reduce_max_scalar<float> },
+          { reduce_sum_scalar<double>, reduce_max_scalar<double> },
+          { reduce_sum_scalar<int64_t>, reduce_max_scalar<int64_t> } },
+        // avx2
+        { { reduce_sum_f32_avx2, reduce_max_f32_avx2 },
+          { reduce_sum_f64_avx2, reduce_max_f64_avx2 },
+          { reduce_sum_i64_avx2, reduce_max_i64_avx2 } },
+        // avx512
+        { { reduce_sum_f32_avx512, reduce_max_f32_avx512 },
+          { reduce_sum_f64_avx512, reduce_max_f64_avx512 },
+          { reduce_sum_i64_avx512, reduce_max_i64_avx512 } },
+    };
+
+    if (dtype < REDUCE_F32 || dtype > REDUCE_I64 || op < REDUCE_SUM || op > REDUCE_MAX)
+        return nullptr;
+    return kernels[isa][dtype - REDUCE_F32][op - REDUCE_SUM];
+}
+
+// Folds the chunks of one round into a single output vector. A round is
+// complete once `contributors` nodes each delivered all of their elements.
+class gather_reducer {
+public:
+    gather_reducer() : isa(detect_reduce_isa()), dtype(0), op(0), total_elements(0),
+                       contributors(0), completed_nodes(0), kernel(nullptr) {}
+
+    void begin_round(uint32_t nodes) {
+        contributors = nodes;
+        completed_nodes = 0;
+        total_elements = 0;
+        node_elements.assign(nodes, 0);
+    }
+
+    // Returns -1 for a chunk that does not fit this round, 1 once the round
+    // is complete and 0 otherwise. With `crc` the payload is also run through
+    // the CRC32C register *crc, a block at a time right before the block is
+    // folded in, so it is read from memory once; a rejected chunk leaves *crc
+    // alone.
+    int contribute(uint32_t node, const reduce_chunk_header_s &hdr, const char *payload, uint32_t *crc = nullptr) {
+        if (node >= contributors)
+            return -1;
+
+        if (total_elements == 0) {
+            if (start(hdr) != 0)
+                return -1;
+        } else if (hdr.dtype != dtype || hdr.op != op || hdr.total_elements != total_elements) {
+            return -1;
+        }
+
+        if ((uint64_t)hdr.offset + hdr.elements > total_elements)
+            return -1;
+
+        size_t width = reduce_dtype_size(dtype);
+        char *out = output.data() + (size_t)hdr.offset * width;
+        if (crc) {
+            // elements in one three-stripe CRC pass
+            uint32_t block = 3 * CRC32C_STRIPE / width;
+            for (uint32_t done = 0; done < hdr.elements; done += block) {
+                uint32_t n = std::min(block, hdr.elements - done);
+                *crc = crc32c_update(*crc, payload + done * width, n * width);
+                kernel(out + done * width, payload + done * width, n);
+            }
+        } else {
+            kernel(out, payload, hdr.elements);
+        }
+
+        node_elements[node] += hdr.elements;
+        if (node_elements[node] == total_elements)
+            completed_nodes++;
+        return completed_nodes == contributors ? 1 : 0;
+    }
+
+    bool node_complete(uint32_t node) const {
+        return node < contributors && total_elements != 0 && node_elements[node] >= total_elements;
+    }
+
+    bool complete() const {
+        return contributors != 0 && completed_nodes == contributors;
+    }
+
+    const void *result() const { return output.data(); }
+    uint32_t elements() const { return total_elements; }
+    uint8_t result_dtype() const { return dtype; }
+    uint8_t result_op() const { return op; }
+    uint32_t round_contributors() const { return contributors; }
+
+    const reduce_isa isa;
+
+private:
+    int start(const reduce_chunk_header_s &hdr) {
+        kernel = select_reduce_kernel(hdr.dtype, hdr.op, isa);
+        if (!kernel || hdr.total_elements == 0)
+            return -1;
+
+        dtype = hdr.dtype;
+        op = hdr.op;
+        total_elements = hdr.total_elements;
+        output.resize((size_t)total_elements * reduce_dtype_size(dtype));
+
+        if (op == REDUCE_SUM) {
+            memset(output.data(), 0, output.size());
+        } else if (dtype == REDUCE_F32) {
+            fill<float>(-std::numeric_limits<float>::infinity());
+        } else if (dtype == REDUCE_F64) {
+            fill<double>(-std::numeric_limits<double>::infinity());
+        } else {
+            fill<int64_t>(std::numeric_limits<int64_t>::min());
+        }
+        return 0;
+    }
+
+    template <typename T>
+    void fill(T value) {
+        T *out = (T *)output.data();
+        for (uint32_t i = 0; i < total_elements; i++)
+            out[i] = value;
+    }
+
+    uint8_t dtype;
+    uint8_t op;
+    uint32_t total_elements;
+    uint32_t contributors;
+    uint32_t completed_nodes;
+    reduce_kernel_fn kernel;
+    std::vector<char> output;
+    std::vector<uint32_t> node_elements;
+};
@@ -0,0 +1,284 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <infiniband/verbs.h>
+#include <boost/program_options.hpp>
+#include "common.h"
+#include "node_link.h"
+#include "tcp_link.h"
+#include "trace.h"
+
+using namespace std;
+
+// Replays a trace recorded by `server.exe --trace_file` against a master:
+// every traced node becomes a node of its own (one thread, one connection)
+// that answers each UNLOCK with the messages of its next recorded turn. A
+// message goes out as many ns after the UNLOCK as it completed after the
+// grant in the trace (scaled by --speed), with its recorded size.
+//
+// Every message is sent as a text message on the node's data stream:
+// reduce chunks and multiplexed flows keep their size and timing but not
+// their meaning, the master would need the matching round or flow setup.
+//
+// usage: replay_trace.exe --trace_file=<file> [--master_ip=...] [--transport=tcp]
+
+typedef struct replay_options_ {
+    string trace_file;
+    string master_ip;
+    int master_port;
+    uint32_t transport;
+    uint32_t nodes;
+    uint32_t node_id_base;
+    double speed;
+    bool loop;
+} replay_options_s;
+
+typedef struct replay_message_ {
+    // after the grant
+    uint64_t offset_ns;
+    uint32_t size;
+} replay_message_s;
+
+typedef vector<replay_message_s> replay_turn;
+
+typedef struct replay_stats_ {
+    uint64_t turns;
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t failed;
+    // how far sends fell behind their recorded time
+    double late_us;
+    double max_late_us;
+} replay_stats_s;
+
+// the most a text message can carry next to its sequence header
+const uint32_t REPLAY_MAX_SIZE = RPC_FRAME_SIZE - sizeof(seq_header_s);
+
+// Reads the trace and cuts every node's records into turns, one per grant.
+int load_trace(const string &path, map<uint32_t, vector<replay_turn>> &turns) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        perror(("open " + path).c_str());
+        return -1;
+    }
+    trace_file_header_s header;
+    if (read(fd, &header, sizeof(header)) != sizeof(header) || header.magic != TRACE_MAGIC ||
+        header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_s)) {
+        cerr << path << " is not a version " << TRACE_VERSION << " trace" << endl;
+        ::close(fd);
+        return -1;
+    }
+
+    vector<trace_record_s> records;
+    trace_record_s batch[1024];
+    ssize_t got;
+    while ((got = read(fd, batch, sizeof(batch))) > 0)
+        records.insert(records.end(), batch, batch + got / sizeof(trace_record_s));
+    ::close(fd);
+
+    // the writer drains one ring per thread, so the file is only in order per thread
+    sort(records.begin(), records.end(), [](const trace_record_s &a, const trace_record_s &b) {
+        if (a.node != b.node)
+            return a.node < b.node;
+        if (a.grant_ns != b.grant_ns)
+            return a.grant_ns < b.grant_ns;
+        return a.complete_ns < b.complete_ns;
+    });
+
+    uint64_t reduce = 0, bytes = 0, span = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        const trace_record_s &rec = records[i];
+        vector<replay_turn> &node_turns = turns[rec.node];
+        if (i == 0 || rec.node != records[i - 1].node || rec.grant_ns != records[i - 1].grant_ns)
+            node_turns.emplace_back();
+        uint64_t offset = rec.complete_ns > rec.grant_ns ? rec.complete_ns - rec.grant_ns : 0;
+        node_turns.back().push_back({ offset, min(rec.size, REPLAY_MAX_SIZE) });
+        reduce += (rec.flags & TRACE_REDUCE) != 0;
+        bytes += rec.size;
+        span = max(span, rec.complete_ns);
+    }
+
+    size_t turn_count = 0;
+    for (auto &it : turns)
+        turn_count += it.second.size();
+    cout << "Trace " << path << ": " << records.size() << " messages (" << reduce << " reduce chunks), " << bytes
+         << " bytes from " << turns.size() << " nodes in " << turn_count << " turns over " << span / 1e6 << " ms" << endl;
+    return 0;
+}
+
+// Waits for each message's time, then sends it. Returns false once the
+// connection is gone.
+template <typename Send>
+bool replay_turn_messages(const replay_turn &turn, const replay_options_s &options, Send send_one, replay_stats_s &stats) {
+    auto unlocked = chrono::steady_clock::now();
+    for (const replay_message_s &msg : turn) {
+        auto due = unlocked + chrono::nanoseconds((uint64_t)(msg.offset_ns / options.speed));
+        this_thread::sleep_until(due);
+        double late = chrono::duration<double, micro>(chrono::steady_clock::now() - due).count();
+        stats.late_us += late;
+        stats.max_late_us = max(stats.max_late_us, late);
+        if (send_one(msg.size) != 0) {
+            stats.failed++;
+            return false;
+        }
+        stats.messages++;
+        stats.bytes += msg.size;
+    }
+    stats.turns++;
+    return true;
+}
+
+// The node's event loop: the next recorded turn for every UNLOCK.
+template <typename Link, typename Send>
+void replay_loop(Link &link, const vector<replay_turn> &turns, const replay_options_s &options, Send send_one, replay_stats_s &stats) {
+    size_t next = 0;
+    while (true) {
+        link_event event = link.poll();
+        if (event == LINK_CLOSED)
+            break;
+        if (event != LINK_UNLOCK)
+            continue;
+        if (next == turns.size()) {
+            if (!options.loop)
+                break;
+            next = 0;
+        }
+        if (!replay_turn_messages(turns[next++], options, send_one, stats))
+            break;
+    }
+}
+
+void replay_node_tcp(uint32_t node_id, const vector<replay_turn> &turns, const replay_options_s &options, replay_stats_s &stats) {
+    static thread_local char payload[REPLAY_MAX_SIZE];
+    memset(payload, 'r', sizeof(payload));
+    tcp_link link;
+    if (link.open() != 0 || link.register_buffer(1, payload, sizeof(payload)) != 0 ||
+        link.connect_to(options.master_ip, options.master_port, node_id) != 0) {
+        stats.failed++;
+        return;
+    }
+    replay_loop(link, turns, options, [&link](uint32_t size) { return link.send_message(1, payload, size); }, stats);
+}
+
+void replay_node_rdma(struct ibv_context *context, struct ibv_pd *pd, uint32_t node_id, const vector<replay_turn> &turns,
+                      const replay_options_s &options, replay_stats_s &stats) {
+    static thread_local char payload[REPLAY_MAX_SIZE];
+    memset(payload, 'r', sizeof(payload));
+    struct ibv_mr *mr = ibv_reg_mr(pd, payload, sizeof(payload), IBV_ACCESS_LOCAL_WRITE);
+    upstream_link link;
+    if (!mr || link.open(context, pd, node_id) != 0 || link.connect_to(options.master_ip, options.master_port) != 0) {
+        stats.failed++;
+    } else {
+        replay_loop(link, turns, options, [&link, mr](uint32_t size) { return link.send_message(mr, payload, size); }, stats);
+    }
+    link.close();
+    if (mr)
+        ibv_dereg_mr(mr);
+}
+
+void init_input_params_from_argc(int argc, char *argv[], replay_options_s &options) {
+	boost::program_options::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "show possible options")
+		("trace_file", boost::program_options::value<string>(), "trace recorded by server.exe --trace_file")
+		("master_ip", boost::program_options::value<string>()->default_value("127.0.0.1"), "address of the master to replay against")
+		("master_port", boost::program_options::value<int>()->default_value(PORT), "control port of the master")
+		("transport", boost::program_options::value<string>()->default_value("rdma"), "rdma, or tcp for a host without RoCE")
+		("nodes", boost::program_options::value<uint32_t>()->default_value(0), "replay only the first n traced nodes, 0 for all")
+		("node_id_base", boost::program_options::value<uint32_t>()->default_value(0x52500000), "node ID of traced node 0, the others follow")
+		("speed", boost::program_options::value<double>()->default_value(1.0), "replay this many times faster than recorded")
+		("loop", "start over once a node's turns are used up")
+	;
+
+	boost::program_options::variables_map vm;
+	boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+	boost::program_options::notify(vm);
+
+	if (vm.count("help") || !vm.count("trace_file"))
+	{
+		cout << desc << endl;
+		exit(vm.count("help") ? 0 : 1);
+	}
+
+	options.trace_file = vm["trace_file"].as<string>();
+	options.master_ip = vm["master_ip"].as<string>();
+	options.master_port = vm["master_port"].as<int>();
+	options.transport = vm["transport"].as<string>() == "tcp" ? TRANSPORT_TCP : TRANSPORT_RDMA;
+	options.nodes = vm["nodes"].as<uint32_t>();
+	options.node_id_base = vm["node_id_base"].as<uint32_t>();
+	options.speed = vm["speed"].as<double>();
+	options.loop = vm.count("loop") != 0;
+	if (options.speed <= 0)
+	{
+		cerr << "--speed must be positive" << endl;
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[]) {
+    replay_options_s options;
+    init_input_params_from_argc(argc, argv, options);
+
+    map<uint32_t, vector<replay_turn>> turns;
+    if (load_trace(options.trace_file, turns) != 0)
+        return 1;
+    if (options.nodes != 0 && turns.size() > options.nodes)
+        turns.erase(next(turns.begin(), options.nodes), turns.end());
+
+    struct ibv_device **dev_list = nullptr;
+    struct ibv_context *context = nullptr;
+    struct ibv_pd *pd = nullptr;
+    if (options.transport == TRANSPORT_RDMA) {
+        dev_list = get_rxe_device();
+        context = ibv_open_device(dev_list[0]);
+        pd = context ? ibv_alloc_pd(context) : nullptr;
+        if (!pd) {
+            cerr << "ibv_alloc_pd failed: " << strerror(errno) << endl;
+            return 1;
+        }
+    }
+
+    vector<replay_stats_s> stats(turns.size());
+    vector<thread> threads;
+    size_t i = 0;
+    auto start = chrono::steady_clock::now();
+    for (auto &it : turns) {
+        memset(&stats[i], 0, sizeof(stats[i]));
+        uint32_t node_id = options.node_id_base + it.first;
+        if (options.transport == TRANSPORT_TCP)
+            threads.emplace_back(replay_node_tcp, node_id, cref(it.second), cref(options), ref(stats[i]));
+        else
+            threads.emplace_back(replay_node_rdma, context, pd, node_id, cref(it.second), cref(options), ref(stats[i]));
+        i++;
+    }
+    for (thread &t : threads)
+        t.join();
+
+    replay_stats_s total;
+    memset(&total, 0, sizeof(total));
+    for (const replay_stats_s &st : stats) {
+        total.turns += st.turns;
+        total.messages += st.messages;
+        total.bytes += st.bytes;
+        total.failed += st.failed;
+        total.late_us += st.late_us;
+        total.max_late_us = max(total.max_late_us, st.max_late_us);
+    }
+    cout << "Replayed " << total.turns << " turns, " << total.messages << " messages, " << total.bytes << " bytes in "
+         << elapsed_us(start) / 1000.0 << " ms, sends late by " << (total.messages ? total.late_us / total.messages : 0)
+         << " us on average, " << total.max_late_us << " us at most, " << total.failed << " failures" << endl;
+
+    if (pd)
+        ibv_dealloc_pd(pd);
+    if (context)
+        ibv_close_device(context);
+    if (dev_list)
+        ibv_free_device_list(dev_list);
+    return total.failed != 0;
+}
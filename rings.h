@@ -0,0 +1,127 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// Bounded lock-free rings for handing work between threads without locks or
+// allocations. Capacities are rounded up to a power of two.
+
+inline uint32_t next_pow2(uint32_t v) {
+    uint32_t p = 1;
+    while (p < v)
+        p <<= 1;
+    return p;
+}
+
+// single producer, single consumer
+template <typename T>
+class spsc_ring {
+public:
+    spsc_ring() : mask(0), head(0), cached_tail(0), tail(0), cached_head(0) {}
+
+    void init(uint32_t capacity) {
+        uint32_t size = next_pow2(capacity);
+        slots.reset(new T[size]);
+        mask = size - 1;
+    }
+
+    // producer
+    bool push(const T &item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t - cached_head > mask) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (t - cached_head > mask)
+                return false;
+        }
+        slots[t & mask] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // producer, free entries
+    uint32_t room() {
+        cached_head = head.load(std::memory_order_acquire);
+        return mask + 1 - (tail.load(std::memory_order_relaxed) - cached_head);
+    }
+
+    // consumer
+    bool pop(T &item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h == cached_tail) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (h == cached_tail)
+                return false;
+        }
+        item = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::unique_ptr<T[]> slots;
+    uint32_t mask;
+    // each index on its own cache line next to the copy of the other one its
+    // owner keeps
+    alignas(64) std::atomic<uint32_t> head;
+    uint32_t cached_tail;
+    alignas(64) std::atomic<uint32_t> tail;
+    uint32_t cached_head;
+};
+
+// multiple producers, single consumer: a bounded ring with a sequence number
+// per cell, producers claim cells with a CAS on the tail
+template <typename T>
+class mpsc_ring {
+public:
+    mpsc_ring() : mask(0), head(0), tail(0) {}
+
+    void init(uint32_t capacity) {
+        uint32_t size = next_pow2(capacity);
+        cells.reset(new cell_s[size]);
+        for (uint32_t i = 0; i < size; i++)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        mask = size - 1;
+    }
+
+    bool push(const T &item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        while (true) {
+            cell_s &cell = cells[t & mask];
+            int32_t diff = (int32_t)(cell.seq.load(std::memory_order_acquire) - t);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(t, t + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                t = tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell_s &cell = cells[t & mask];
+        cell.item = item;
+        cell.seq.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item) {
+        cell_s &cell = cells[head & mask];
+        if (cell.seq.load(std::memory_order_acquire) != head + 1)
+            return false;
+        item = cell.item;
+        cell.seq.store(head + mask + 1, std::memory_order_release);
+        head++;
+        return true;
+    }
+
+private:
+    struct cell_s {
+        std::atomic<uint32_t> seq;
+        T item;
+    };
+
+    std::unique_ptr<cell_s[]> cells;
+    uint32_t mask;
+    // consumer only
+    alignas(64) uint32_t head;
+    alignas(64) std::atomic<uint32_t> tail;
+};
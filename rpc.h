@@ -0,0 +1,347 @@
+#pragma once
+#include <functional>
+#include <vector>
+
+#include <infiniband/verbs.h>
+#include "common.h"
+
+// Request/response RPC over the RC send/recv path of an existing connection.
+//
+// Messages are packed into frames: one SEND_WITH_IMM per frame, imm_data is
+// RPC_IMM so the owner of the receive ring can tell RPC frames from plain
+// incast data sharing the same QP. Every message in a frame has a fixed
+// rpc_header followed by its payload, padded to 8 bytes.
+//
+//     [rpc_frame_header][rpc_header][args...][rpc_header][args...]...
+//
+// Arguments are written by the caller straight into the registered send ring
+// (call() returns where), so nothing is copied or serialized on the way out.
+// Small requests to the same peer are batched into the open frame until it is
+// full or flush() is called, one WR carries all of them. Responses to a frame
+// are batched the same way.
+//
+// The endpoint does not own receive buffers or the CQ: the owner polls, hands
+// RPC receive completions to handle_recv() and send completions to
+// handle_send_completion(), then reposts its receive buffer.
+
+const uint32_t RPC_IMM = 0x52504331;  // "RPC1"
+const uint32_t RPC_FRAME_SIZE = 1024;
+// frames that can be in flight at once, bounded by max_send_wr of the QP
+const uint32_t RPC_SEND_FRAMES = 4;
+// wr_id slots at and above this belong to the RPC send ring
+const uint32_t RPC_WR_SLOT_BASE = 0x10000;
+
+enum rpc_type : uint8_t {
+    RPC_REQUEST = 1,
+    RPC_RESPONSE = 2,
+};
+
+enum rpc_status : uint8_t {
+    RPC_OK = 0,
+    RPC_UNKNOWN_METHOD = 1,
+    RPC_TIMEOUT = 2,
+};
+
+typedef struct rpc_frame_header_ {
+    uint16_t count;
+    uint16_t reserved;
+    uint32_t length;
+} rpc_frame_header_s;
+
+typedef struct rpc_header_ {
+    uint32_t request_id;
+    uint16_t method_id;
+    uint8_t type;
+    uint8_t status;
+    uint32_t length;
+    uint32_t reserved;
+} rpc_header_s;
+
+inline uint32_t rpc_align(uint32_t len) {
+    return (len + 7) & ~7u;
+}
+
+// Serve `method`: read args, write at most resp_cap bytes of response into
+// resp (which is already inside the registered send ring) and return its length.
+typedef std::function<uint32_t(const char *args, uint32_t args_len, char *resp, uint32_t resp_cap)> rpc_method_fn;
+// Called once per request, with the response payload or a status != RPC_OK.
+typedef std::function<void(uint8_t status, const char *resp, uint32_t resp_len)> rpc_response_fn;
+
+class rpc_endpoint {
+public:
+    // `progress` is called while every send frame is in flight, it must poll
+    // the CQ and feed completions back into this endpoint
+    rpc_endpoint(struct ibv_qp *qp, uint32_t window, uint64_t wr_id_base, std::function<void()> progress)
+        : qp(qp), window(window), wr_id_base(wr_id_base), progress(progress),
+          send_ring(nullptr), send_mr(nullptr), frame_busy(RPC_SEND_FRAMES, false),
+          open_frame(-1), next_request_id(1), in_flight(0), pending(window) {}
+
+    ~rpc_endpoint() {
+        if (send_mr)
+            ibv_dereg_mr(send_mr);
+        delete[] send_ring;
+    }
+
+    int init(struct ibv_pd *pd) {
+        send_ring = new char[RPC_SEND_FRAMES * RPC_FRAME_SIZE]();
+        send_mr = ibv_reg_mr(pd, send_ring, RPC_SEND_FRAMES * RPC_FRAME_SIZE, IBV_ACCESS_LOCAL_WRITE);
+        if (!send_mr)
+        {
+            cerr << "ibv_reg_mr - rpc - failed: " << strerror(errno) << endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    void register_method(uint16_t method_id, rpc_method_fn fn) {
+        if (methods.size() <= method_id)
+            methods.resize(method_id + 1);
+        methods[method_id] = fn;
+    }
+
+    // Queue a request and return where its args_len bytes of arguments go,
+    // nullptr while `window` requests are outstanding.
+    char *call(uint16_t method_id, uint32_t args_len, rpc_response_fn done) {
+        uint32_t request_id = next_request_id;
+        pending_call &slot = pending[request_id % window];
+        if (in_flight == window || slot.request_id != 0)
+            return nullptr;
+
+        char *args = append(RPC_REQUEST, request_id, method_id, RPC_OK, args_len);
+        if (!args)
+            return nullptr;
+
+        // 0 marks a free slot
+        next_request_id = next_request_id + 1 ? next_request_id + 1 : 1;
+        slot.request_id = request_id;
+        slot.done = done;
+        slot.started = std::chrono::steady_clock::now();
+        in_flight++;
+        return args;
+    }
+
+    // Post the open frame, one WR for every message batched in it.
+    int flush() {
+        if (open_frame < 0)
+            return 0;
+
+        int frame = open_frame;
+        open_frame = -1;
+        rpc_frame_header_s *fh = frame_header(frame);
+
+        struct ibv_sge sge;
+        sge.addr   = (uintptr_t)fh;
+        sge.length = fh->length;
+        sge.lkey   = send_mr->lkey;
+
+        struct ibv_send_wr wr, *bad_wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id      = wr_id_base + RPC_WR_SLOT_BASE + frame;
+        wr.sg_list    = &sge;
+        wr.num_sge    = 1;
+        wr.opcode     = IBV_WR_SEND_WITH_IMM;
+        wr.imm_data   = htonl(RPC_IMM);
+        wr.send_flags = IBV_SEND_SIGNALED;
+
+        int ret = ibv_post_send(qp, &wr, &bad_wr);
+        if (ret != 0)
+        {
+            cerr << "ibv_post_send - rpc - failed: " << strerror(ret) << endl;
+            frame_busy[frame] = false;
+        }
+        return ret;
+    }
+
+    static bool is_rpc_recv(const struct ibv_wc &wc) {
+        return (wc.wc_flags & IBV_WC_WITH_IMM) && ntohl(wc.imm_data) == RPC_IMM;
+    }
+
+    static bool is_rpc_send(uint64_t slot) {
+        return slot >= RPC_WR_SLOT_BASE && slot < RPC_WR_SLOT_BASE + RPC_SEND_FRAMES;
+    }
+
+    // `slot` is wr_id - wr_id_base of a send completion
+    void handle_send_completion(uint64_t slot) {
+        frame_busy[slot - RPC_WR_SLOT_BASE] = false;
+    }
+
+    // Walk a received frame: run requests (responses are batched into one
+    // frame and posted at the end) and complete matching outstanding calls.
+    void handle_recv(const char *buf, uint32_t len) {
+        const rpc_frame_header_s *fh = (const rpc_frame_header_s *)buf;
+        if (len < sizeof(*fh) || fh->length > len)
+            return;
+
+        uint32_t offset = sizeof(*fh);
+        bool responded = false;
+        for (uint16_t i = 0; i < fh->count && offset + sizeof(rpc_header_s) <= fh->length; i++) {
+            const rpc_header_s *hdr = (const rpc_header_s *)(buf + offset);
+            const char *payload = buf + offset + sizeof(*hdr);
+            // checked before aligning, a length near 4 GB would wrap
+            if (hdr->length > fh->length - offset - sizeof(*hdr))
+                break;
+            offset += sizeof(*hdr) + rpc_align(hdr->length);
+            if (offset > fh->length)
+                break;
+
+            if (hdr->type == RPC_REQUEST) {
+                serve(*hdr, payload);
+                responded = true;
+            } else if (hdr->type == RPC_RESPONSE) {
+                complete(hdr->request_id, hdr->status, payload, hdr->length);
+            }
+        }
+
+        if (responded)
+            flush();
+    }
+
+    // Fail every call older than timeout_us, e.g. after the QP was recovered.
+    void expire(double timeout_us) {
+        for (auto &slot : pending) {
+            if (slot.request_id != 0 && elapsed_us(slot.started) > timeout_us)
+                complete(slot.request_id, RPC_TIMEOUT, nullptr, 0);
+        }
+    }
+
+    uint32_t outstanding() const { return in_flight; }
+
+    // Drop every frame still owned by the NIC, used after the QP was flushed.
+    void reset() {
+        std::fill(frame_busy.begin(), frame_busy.end(), false);
+        open_frame = -1;
+    }
+
+private:
+    struct pending_call {
+        uint32_t request_id = 0;
+        rpc_response_fn done;
+        std::chrono::steady_clock::time_point started;
+    };
+
+    rpc_frame_header_s *frame_header(int frame) {
+        return (rpc_frame_header_s *)(send_ring + frame * RPC_FRAME_SIZE);
+    }
+
+    int acquire_frame() {
+        for (int attempt = 0; ; attempt++) {
+            for (uint32_t frame = 0; frame < RPC_SEND_FRAMES; frame++) {
+                if (!frame_busy[frame]) {
+                    frame_busy[frame] = true;
+                    rpc_frame_header_s *fh = frame_header(frame);
+                    fh->count = 0;
+                    fh->length = sizeof(*fh);
+                    return frame;
+                }
+            }
+            if (!progress || attempt > 1000000)
+                return -1;
+            progress();
+        }
+    }
+
+    char *append(uint8_t type, uint32_t request_id, uint16_t method_id, uint8_t status, uint32_t len) {
+        uint32_t needed = sizeof(rpc_header_s) + rpc_align(len);
+        if (needed + sizeof(rpc_frame_header_s) > RPC_FRAME_SIZE)
+            return nullptr;
+
+        if (open_frame >= 0 && frame_header(open_frame)->length + needed > RPC_FRAME_SIZE)
+            flush();
+        if (open_frame < 0 && (open_frame = acquire_frame()) < 0)
+            return nullptr;
+
+        rpc_frame_header_s *fh = frame_header(open_frame);
+        rpc_header_s *hdr = (rpc_header_s *)((char *)fh + fh->length);
+        hdr->request_id = request_id;
+        hdr->method_id  = method_id;
+        hdr->type       = type;
+        hdr->status     = status;
+        hdr->length     = len;
+        hdr->reserved   = 0;
+
+        fh->count++;
+        fh->length += needed;
+        return (char *)(hdr + 1);
+    }
+
+    void serve(const rpc_header_s &req, const char *args) {
+        rpc_method_fn *fn = req.method_id < methods.size() && methods[req.method_id] ? &methods[req.method_id] : nullptr;
+
+        // reserve what is left of a frame, then give back the unused part
+        uint32_t cap = RPC_FRAME_SIZE - sizeof(rpc_frame_header_s) - sizeof(rpc_header_s);
+        if (open_frame >= 0 && frame_header(open_frame)->length + sizeof(rpc_header_s) + 64 > RPC_FRAME_SIZE)
+            flush();
+        if (open_frame >= 0)
+            cap = RPC_FRAME_SIZE - frame_header(open_frame)->length - sizeof(rpc_header_s);
+        cap &= ~7u;
+
+        char *resp = append(RPC_RESPONSE, req.request_id, req.method_id, fn ? RPC_OK : RPC_UNKNOWN_METHOD, cap);
+        if (!resp)
+            return;
+
+        rpc_frame_header_s *fh = frame_header(open_frame);
+        rpc_header_s *hdr = (rpc_header_s *)resp - 1;
+        uint32_t len = fn ? (*fn)(args, req.length, resp, cap) : 0;
+        if (len > cap)
+            len = cap;
+        hdr->length = len;
+        fh->length -= cap - rpc_align(len);
+    }
+
+    void complete(uint32_t request_id, uint8_t status, const char *resp, uint32_t len) {
+        pending_call &slot = pending[request_id % window];
+        if (slot.request_id != request_id)
+            return;  // late response to a call that already timed out
+
+        rpc_response_fn done = std::move(slot.done);
+        slot.request_id = 0;
+        slot.done = nullptr;
+        in_flight--;
+        if (done)
+            done(status, resp, len);
+    }
+
+    struct ibv_qp *qp;
+    uint32_t window;
+    uint64_t wr_id_base;
+    std::function<void()> progress;
+
+    char *send_ring;
+    struct ibv_mr *send_mr;
+    std::vector<bool> frame_busy;
+    int open_frame;
+
+    uint32_t next_request_id;
+    uint32_t in_flight;
+    std::vector<pending_call> pending;
+    std::vector<rpc_method_fn> methods;
+};
+
+// ==== methods between master and nodes ====
+
+enum rpc_method : uint16_t {
+    RPC_GET_STATS = 1,
+    RPC_SET_CONFIG = 2,
+    RPC_BCAST_PREPARE = 3,
+    RPC_BCAST_START = 4,
+    // served by the master, called by the nodes
+    RPC_KV_LOCATE = 5,
+    RPC_KV_PUT = 6,
+    RPC_COUNTERS_LOCATE = 7,
+    RPC_FILE_OPEN = 8,
+    RPC_FILE_CLOSE = 9,
+    // answers the node's clock_ns(), see clock_sync.h
+    RPC_CLOCK_SYNC = 10,
+};
+
+typedef struct node_stats_ {
+    uint64_t messages_sent;
+    uint64_t send_errors;
+    uint64_t recoveries;
+} node_stats_s;
+
+typedef struct node_config_ {
+    // bytes of each incast message the node actually sends
+    uint32_t message_size;
+    uint32_t reserved;
+} node_config_s;
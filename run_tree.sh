@@ -0,0 +1,41 @@
+#!/bin/bash
+# Two-level aggregation tree on one machine over rxe:
+#   root master <- intermediate masters (fan_out children each) <- leaf nodes
+#
+# usage: ./run_tree.sh <leaves> <fan_out> [reduce_elements]
+# MASTER_IP is the address of the rxe netdev, logs go to ./tree_logs.
+
+LEAVES=${1:?usage: $0 <leaves> <fan_out> [reduce_elements]}
+FAN_OUT=${2:?usage: $0 <leaves> <fan_out> [reduce_elements]}
+REDUCE=${3:-0}
+MASTER_IP=${MASTER_IP:-192.168.1.132}
+ROOT_PORT=8080
+LEAF_PACE_MS=200
+
+MIDS=$(( (LEAVES + FAN_OUT - 1) / FAN_OUT ))
+# the root unlocks an intermediate only after it finished a full pass
+ROOT_PACE_MS=$(( FAN_OUT * LEAF_PACE_MS + 500 ))
+LEAF_ARGS=""
+if [ "$REDUCE" -gt 0 ]; then
+	LEAF_ARGS="--reduce_elements=$REDUCE"
+fi
+
+mkdir -p tree_logs
+trap 'kill $(jobs -p) 2>/dev/null' EXIT
+
+./server.exe --port=$ROOT_PORT --pace_ms=$ROOT_PACE_MS --fan_out=$MIDS > tree_logs/root.log 2>&1 &
+sleep 1
+
+for g in $(seq 1 $MIDS); do
+	./server.exe --port=$((ROOT_PORT + g)) --pace_ms=$LEAF_PACE_MS --fan_out=$FAN_OUT \
+		--upstream_ip=$MASTER_IP --upstream_port=$ROOT_PORT --node_id=$((100000 + g)) > tree_logs/mid_$g.log 2>&1 &
+done
+sleep 1
+
+for n in $(seq 0 $((LEAVES - 1))); do
+	./client.exe --master_ip=$MASTER_IP --master_port=$((ROOT_PORT + 1 + n / FAN_OUT)) \
+		--node_id=$n $LEAF_ARGS > tree_logs/leaf_$n.log 2>&1 &
+done
+
+echo "root + $MIDS intermediate masters + $LEAVES leaves running, see tree_logs/ (Ctrl-C to stop)"
+wait
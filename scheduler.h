@@ -0,0 +1,121 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+#include "common.h"
+
+// The master's turn scheduling, apart from any verbs, sockets or clocks, so
+// the master and the incast simulator (sim_incast.cpp) run the same code. The
+// host feeds it the time in ns and carries out its decisions.
+//
+// A pass gives every node one turn, in node ID order. A turn starts with the
+// grant (the UNLOCK) and ends when the host reports the node's first message
+// or a timeout. At most `window` turns are open at once, the master keeps it
+// at one. The next grant waits `pace_ns` after the last turn ended.
+//
+// Credits: a node never has more messages in flight than the master keeps
+// receive slots posted for it. Admission: the host's admit(id) decides
+// whether a node can be granted now (its consumer has room for all its
+// credits), has to wait, or is skipped for this pass.
+
+const uint32_t SCHED_NO_NODE = UINT32_MAX;
+
+enum sched_admission {
+    SCHED_ADMIT = 0,
+    SCHED_WAIT,
+    SCHED_SKIP,
+};
+
+typedef struct sched_config_ {
+    // turns open at the same time
+    uint32_t window;
+    // receive slots per node
+    uint32_t credits;
+    uint64_t pace_ns;
+} sched_config_s;
+
+typedef struct sched_stats_ {
+    uint64_t grants;
+    // nodes that could not take their turn, e.g. during recovery
+    uint64_t skipped;
+    // grants held back because the consumer had no room
+    uint64_t stalls;
+    // turns that ended without a message
+    uint64_t timeouts;
+} sched_stats_s;
+
+class incast_scheduler {
+public:
+    incast_scheduler() : count(0), next_node(0), open(0), ready_time(0), stalled(false) {
+        memset(&cfg, 0, sizeof(cfg));
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    void init(const sched_config_s &config) {
+        cfg = config;
+        if (cfg.window == 0)
+            cfg.window = 1;
+    }
+
+    void begin_pass(uint32_t nodes, uint64_t now) {
+        count = nodes;
+        next_node = 0;
+        open = 0;
+        ready_time = now;
+        stalled = false;
+    }
+
+    // The node to grant a turn now, SCHED_NO_NODE while the window is full,
+    // the pace is not over, the next node has to wait, or every turn of the
+    // pass was handed out.
+    template <typename Admit>
+    uint32_t next_grant(uint64_t now, Admit admit) {
+        while (open < cfg.window && now >= ready_time && next_node < count) {
+            uint32_t id = next_node;
+            sched_admission admission = admit(id);
+            if (admission == SCHED_WAIT) {
+                if (!stalled)
+                    stats.stalls++;
+                stalled = true;
+                return SCHED_NO_NODE;
+            }
+            stalled = false;
+            next_node++;
+            if (admission == SCHED_SKIP) {
+                stats.skipped++;
+                continue;
+            }
+            open++;
+            stats.grants++;
+            return id;
+        }
+        return SCHED_NO_NODE;
+    }
+
+    void end_turn(uint64_t now, bool delivered) {
+        open--;
+        if (!delivered)
+            stats.timeouts++;
+        ready_time = now + cfg.pace_ns;
+    }
+
+    // a consumer with `room` free entries can take a node's turn
+    bool has_room(uint32_t room) const { return room >= cfg.credits; }
+
+    bool pass_done() const { return next_node == count && open == 0; }
+    // a grant waits on a consumer, not on the pace or the window
+    bool waiting() const { return stalled; }
+    uint64_t ready_at() const { return ready_time; }
+    uint32_t open_turns() const { return open; }
+    const sched_config_s &config() const { return cfg; }
+
+    sched_stats_s stats;
+
+private:
+    sched_config_s cfg;
+    uint32_t count;
+    uint32_t next_node;
+    uint32_t open;
+    uint64_t ready_time;
+    bool stalled;
+};
@@ -0,0 +1,196 @@
+#pragma once
+#include <functional>
+#include <memory>
+
+#include "common.h"
+
+// Every incast message starts with a seq_header_s: the flow it belongs to and
+// its number within that flow. RC delivers in order and exactly once, but the
+// master does not rely on it, so UD, retries or several rails can be added
+// without touching the consumers.
+//
+// The master runs each node's messages through a reorder window. In-order
+// messages are delivered right away. Early ones are held in their receive slot
+// until the missing ones arrive, stale ones are dropped as duplicates. A node
+// can only have as many messages in flight as the master keeps slots posted,
+// so the window is that big and lives in a fixed array per node. When it is
+// full, or a node is done for the pass, the missing messages are given up and
+// the next held one is delivered flagged as following a gap.
+
+// flows of a node, the node's incast streams
+const uint32_t SEQ_MAX_FLOWS = 16;
+const uint16_t SEQ_FLOW_DATA = 0;
+const uint16_t SEQ_FLOW_REDUCE = 1;
+const uint32_t REORDER_WINDOW = INCAST_RECV_SLOTS;
+// seq_header_s::flags: the message ends in a CRC32C trailer (crc32c.h)
+const uint16_t SEQ_CRC32C = 1;
+// the payload starts with a codec_header_s and is coded (codec.h)
+const uint16_t SEQ_CODED = 2;
+// the payload, once decoded, is a record (record.h)
+const uint16_t SEQ_RECORD = 4;
+
+typedef struct seq_header_ {
+    uint32_t seq;
+    uint16_t flow;
+    // SEQ_* bits
+    uint16_t flags;
+    // the node's clock_ns() when it posted the send, 0 if it did not say
+    uint64_t send_ns;
+} seq_header_s;
+
+// a received message as the reorder stage tracks it, the payload stays in
+// the receive slot
+typedef struct seq_message_ {
+    uint32_t seq;
+    uint16_t flow;
+    uint16_t slot;
+    // payload bytes behind the header
+    uint32_t len;
+    uint32_t imm;
+} seq_message_s;
+
+typedef struct reorder_stats_ {
+    uint64_t delivered;
+    // arrived ahead of a missing message
+    uint64_t reordered;
+    // furthest a message arrived ahead of the next expected one
+    uint32_t max_depth;
+    uint64_t gaps;
+    // messages never seen, summed over all gaps
+    uint64_t lost;
+    uint64_t duplicates;
+    // unknown flow or too short for a header
+    uint64_t invalid;
+} reorder_stats_s;
+
+class reorder_stage {
+public:
+    reorder_stage() {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    void init(uint32_t nodes) {
+        windows.reset(new window_s[nodes]());
+    }
+
+    // the node starts over from sequence 0 in every flow
+    void reset(uint32_t node) {
+        flush(node);
+        memset(&windows[node], 0, sizeof(window_s));
+    }
+
+    // Returns true if one of the on_deliver() calls it made did.
+    bool arrive(uint32_t node, const seq_message_s &msg) {
+        window_s &w = windows[node];
+        if (msg.flow >= SEQ_MAX_FLOWS) {
+            stats.invalid++;
+            on_drop(node, msg);
+            return false;
+        }
+
+        int32_t ahead = (int32_t)(msg.seq - w.expected[msg.flow]);
+        if (ahead < 0) {
+            stats.duplicates++;
+            on_drop(node, msg);
+            return false;
+        }
+        if (ahead == 0) {
+            bool result = deliver(node, w, msg, false);
+            return drain(node, w, msg.flow, false) || result;
+        }
+
+        stats.reordered++;
+        if ((uint32_t)ahead > stats.max_depth)
+            stats.max_depth = ahead;
+
+        bool result = false;
+        if (w.used == FULL_WINDOW) {
+            // make room by giving up on the flow of the first held message
+            uint32_t oldest = __builtin_ctz(w.used);
+            result = skip_gap(node, w, w.held[oldest].flow);
+        }
+        uint32_t free_entry = __builtin_ctz(~w.used);
+        w.held[free_entry] = msg;
+        w.used |= 1u << free_entry;
+
+        // more missing messages than a node can have in flight: they are lost
+        if ((uint32_t)ahead >= REORDER_WINDOW)
+            result = skip_gap(node, w, msg.flow) || result;
+        return result;
+    }
+
+    // Deliver everything still held, the node has nothing more in flight.
+    bool flush(uint32_t node) {
+        window_s &w = windows[node];
+        bool result = false;
+        while (w.used != 0)
+            result = skip_gap(node, w, w.held[__builtin_ctz(w.used)].flow) || result;
+        return result;
+    }
+
+    // on_deliver(node, msg, gap) returns whether the message completed what
+    // the caller waits for, on_drop() hands back the slot of a dropped one
+    std::function<bool(uint32_t node, const seq_message_s &msg, bool gap)> on_deliver;
+    std::function<void(uint32_t node, const seq_message_s &msg)> on_drop;
+    reorder_stats_s stats;
+
+private:
+    static const uint32_t FULL_WINDOW = (1u << REORDER_WINDOW) - 1;
+
+    struct window_s {
+        uint32_t expected[SEQ_MAX_FLOWS];
+        seq_message_s held[REORDER_WINDOW];
+        // bit per used entry of `held`
+        uint32_t used;
+    };
+
+    bool deliver(uint32_t node, window_s &w, const seq_message_s &msg, bool gap) {
+        w.expected[msg.flow] = msg.seq + 1;
+        stats.delivered++;
+        return on_deliver(node, msg, gap);
+    }
+
+    // deliver the held messages of `flow` that are next in line
+    bool drain(uint32_t node, window_s &w, uint16_t flow, bool gap) {
+        bool result = false;
+        bool found = true;
+        while (found) {
+            found = false;
+            for (uint32_t bits = w.used; bits; bits &= bits - 1) {
+                uint32_t i = __builtin_ctz(bits);
+                if (w.held[i].flow != flow || w.held[i].seq != w.expected[flow])
+                    continue;
+                w.used &= ~(1u << i);
+                result = deliver(node, w, w.held[i], gap) || result;
+                gap = false;
+                found = true;
+                break;
+            }
+        }
+        return result;
+    }
+
+    // give up on what is missing before the first held message of `flow`
+    bool skip_gap(uint32_t node, window_s &w, uint16_t flow) {
+        uint32_t next = 0;
+        bool any = false;
+        for (uint32_t bits = w.used; bits; bits &= bits - 1) {
+            const seq_message_s &held = w.held[__builtin_ctz(bits)];
+            if (held.flow != flow)
+                continue;
+            uint32_t distance = held.seq - w.expected[flow];
+            if (!any || distance < next - w.expected[flow])
+                next = held.seq;
+            any = true;
+        }
+        if (!any)
+            return false;
+
+        stats.gaps++;
+        stats.lost += next - w.expected[flow];
+        w.expected[flow] = next;
+        return drain(node, w, flow, true);
+    }
+
+    std::unique_ptr<window_s[]> windows;
+};
@@ -1,37 +1,516 @@
 #include <iostream>
 #include <thread>
 #include <vector>
+#include <mutex>
 #include <cstring>
+#include <cmath>
+#include <algorithm>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <infiniband/verbs.h>
+#include <boost/program_options.hpp>
 #include "common.h"
+#include "node_table.h"
+#include "rpc.h"
+#include "reduce.h"
+#include "node_link.h"
+#include "broadcast.h"
+#include "kv_store.h"
+#include "counters.h"
+#include "file_stream.h"
+#include "ingest_log.h"
+#include "handoff.h"
+#include "sequence.h"
+#include "tcp_ingress.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "clock_sync.h"
+#include "perf_counters.h"
+#include "codec.h"
+#include "record.h"
 using namespace std;
 
 const int BACKLOG = 5;
-typedef struct rdma_client_ {
-    int socket_fd;
-    struct device_info rdma_info;
-} rdma_client_s;
-
-list<rdma_client_s> clients;
+// receive buffers kept posted per connection
+const int RECV_SLOTS = INCAST_RECV_SLOTS;
+// a receive slot has to fit both incast messages and RPC frames
+const int RECV_SLOT_SIZE = RPC_FRAME_SIZE;
+static_assert(MUX_BUFFER_SIZE <= RECV_SLOT_SIZE, "a flow message fits a receive slot");
+// the NIC writes behind an ingest record header, so a message can go to the
+// log as it is
+const int RECV_SLOT_STRIDE = INGEST_HEADER + RECV_SLOT_SIZE;
+// how long the master waits for an unlocked node to deliver its message
+const int RECV_TIMEOUT_MS = 1000;
+// outstanding RPCs per node and how long the master waits for the answers
+const uint32_t RPC_WINDOW = 16;
+const int RPC_TIMEOUT_MS = 100;
+// how long a broadcast may take before the stragglers are given up on
+const int BCAST_TIMEOUT_MS = 10000;
+
+typedef struct master_options_ {
+    int port;
+    // milliseconds between unlocking two nodes
+    uint32_t pace_ms;
+    // children accepted at this level, 0 for no limit
+    uint32_t fan_out;
+    // intermediate master: report each round's aggregate to this master
+    string upstream_ip;
+    int upstream_port;
+    uint32_t node_id;
+    // push a blob of this many bytes to every node after each pass, 0 for never
+    uint64_t bcast_bytes;
+    uint32_t bcast_chunk;
+    uint32_t bcast_mode;
+    uint32_t kv_buckets;
+    // where files streamed by the nodes end up
+    string file_dir;
+    // consumer threads for the text messages, 0 to process them inline
+    uint32_t consumers;
+    uint32_t consumer_depth;
+    // log every incast message here, empty for no log
+    string ingest_dir;
+    uint64_t ingest_segment_bytes;
+    // group fdatasync: after this many records or microseconds
+    uint32_t ingest_sync_records;
+    uint32_t ingest_sync_us;
+    // record a trace of every message here, empty for none
+    string trace_file;
+    // ping the nodes' clocks every pass and split turn latency at the node's send
+    bool clock_sync;
+    // hardware counters around the RDMA thread's posts and polls
+    bool perf_counters;
+} master_options_s;
+
+master_options_s options;
+
+// every node gets its own QP and receive ring, so a broken connection can be
+// reset and recovered without disturbing the traffic of the others
+node_table nodes;
 
 // RDMA params
 struct device_info local_rdma;
-struct ibv_qp_attr qp_attr;
 uint32_t gidIndex = 0;
 struct ibv_port_attr port_attr;
-struct ibv_qp *send_qp;
-struct ibv_recv_wr wr_recv, *bad_wr_recv;
-struct ibv_sge sg_send, sg_write, sg_recv;
-struct ibv_mr *send_mr;
+struct ibv_pd *pd;
 struct ibv_cq *send_cq;
-struct ibv_wc wc;
+// completions of healthy connections reaped while draining a broken one
+list<struct ibv_wc> deferred_wcs;
+// gather-and-reduce: one round per pass over the nodes
+gather_reducer reducer;
+std::chrono::steady_clock::time_point round_start;
+// text messages of the current pass, one line per node
+string round_text;
+
+// Aggregate of the last complete pass, handed from the RDMA thread to the
+// upstream thread of an intermediate master. A reduce round is forwarded as
+// the reduced vector, text messages as their concatenation.
+struct round_aggregate {
+    std::mutex mutex;
+    uint64_t round;
+    vector<char> values;
+    uint32_t elements;
+    uint8_t dtype;
+    uint8_t op;
+    string text;
+} aggregate;
+
+// key-value store the nodes read with RDMA READ and update with RPC_KV_PUT
+kv_table kv;
+// counters the nodes update with RDMA atomics, only read here for reporting
+counter_region counters;
+// output files the nodes RDMA WRITE into
+file_sink files;
+// durable copy of the incast messages, receive slots wait for their write
+ingest_log ingest;
+// puts each node's incast messages back in order and finds the gaps
+reorder_stage reorder;
+// messages and bytes per flow ID over all nodes, for the pass summary
+struct flow_traffic_s {
+    uint64_t messages;
+    uint64_t bytes;
+} flow_traffic[SEQ_MAX_FLOWS];
+// receive side of the nodes without RoCE, polled next to the CQ
+tcp_ingress tcp_nodes;
+bool tcp_ready;
+// incast messages and bytes per node_transport, for the pass summary
+struct transport_traffic_s {
+    uint64_t messages;
+    uint64_t bytes;
+} transport_traffic[2];
+// consumer threads for the text messages, each collects the lines of a pass
+handoff_stage handoff;
+vector<string> consumer_text;
+list<handoff_desc_s> handoff_backlog;
+// who gets unlocked when, shared with the simulator
+incast_scheduler scheduler;
+trace_writer trace;
+clock_sync clocks;
+// opened by the RDMA thread, counts only that thread
+perf_profiler profiler;
+// CRC32C trailers checked per node, the consumer threads count theirs too
+struct crc_counts_s {
+    std::atomic<uint64_t> checked;
+    std::atomic<uint64_t> mismatches;
+};
+unique_ptr<crc_counts_s[]> crc_counts(new crc_counts_s[MAX_NODES]());
+// a reduce chunk is folded in while it is checked, so a bad one spoils the round
+bool round_corrupt;
+// decoders of the coded flows, per node allocated by the thread that gets its
+// text messages
+unique_ptr<unique_ptr<codec_decoder[]>[]> decoders(new unique_ptr<codec_decoder[]>[MAX_NODES]);
+// what the coded messages of a pass were, on the wire and decoded
+struct codec_traffic_s {
+    std::atomic<uint64_t> messages[CODECS];
+    std::atomic<uint64_t> wire_bytes;
+    std::atomic<uint64_t> raw_bytes;
+    std::atomic<uint64_t> decode_ns;
+    // corrupt, or xor against a message this end did not see
+    std::atomic<uint64_t> undecodable;
+} codec_traffic;
+// records read in place, and those of a schema or layout we cannot read
+struct record_stats_s {
+    std::atomic<uint64_t> read;
+    std::atomic<uint64_t> rejected;
+} record_stats;
+
+// broadcast: the blob and the progress of the current run, indexed by node ID
+char *bcast_blob;
+struct ibv_mr *bcast_mr;
+uint64_t bcast_sum;
+struct bcast_run_s {
+    bool active;
+    uint32_t chunks;
+    // chain order
+    vector<uint32_t> members;
+    vector<bcast_target_s> targets;
+    vector<uint32_t> next_chunk;
+    vector<uint32_t> in_flight;
+    vector<double> done_us;
+    uint32_t done;
+    uint32_t mismatches;
+    std::chrono::steady_clock::time_point start;
+} bcast_run;
+vector<struct ibv_send_wr> bcast_wrs;
+vector<struct ibv_sge> bcast_sges;
+
+char *slot_payload(uint32_t id, uint32_t slot) {
+    return nodes.setup[id].recv_buf + slot * RECV_SLOT_STRIDE + INGEST_HEADER;
+}
+
+// The node's receive WRs point at its slots for good, a repost patches
+// nothing. Called once the node has its ID, which is in the wr_ids.
+void prepare_recv_wrs(uint32_t id) {
+    node_setup_s &setup = nodes.setup[id];
+    for (uint32_t slot = 0; slot < RECV_SLOTS; slot++)
+        setup.recv_wrs.set(slot, make_wr_id(id, slot), (uintptr_t)slot_payload(id, slot), RECV_SLOT_SIZE, setup.recv_mr->lkey);
+}
+
+int post_recv_slot(uint32_t id, uint32_t slot) {
+    struct ibv_recv_wr *bad_wr_recv;
+
+    if (nodes.transport[id] == TRANSPORT_TCP) {
+        nodes.posted_recvs[id]++;
+        tcp_nodes.post_recv(id, slot);
+        return 0;
+    }
+
+    memset(slot_payload(id, slot), 0, RECV_SLOT_SIZE);
+
+    int ret;
+    {
+        perf_scope scope(&profiler, PERF_POST_RECV);
+        ret = ibv_post_recv(nodes.qp[id], nodes.setup[id].recv_wrs.single(slot), &bad_wr_recv);
+    }
+    if (ret != 0)
+    {
+        cerr << "ibv_post_recv failed: " << strerror(ret) << endl;
+        return ret;
+    }
+
+    nodes.posted_recvs[id]++;
+    return 0;
+}
+
+// Held slots are posted once the master lets go of them. The others go out
+// as one list.
+int post_all_recv_slots(uint32_t id) {
+    uint32_t free_slots = ((1u << RECV_SLOTS) - 1) & ~nodes.held_slots[id];
+    if (nodes.transport[id] == TRANSPORT_TCP) {
+        for (uint32_t slot = 0; slot < RECV_SLOTS; slot++)
+            if (free_slots & (1u << slot))
+                post_recv_slot(id, slot);
+        return 0;
+    }
+
+    for (uint32_t slot = 0; slot < RECV_SLOTS; slot++)
+        if (free_slots & (1u << slot))
+            memset(slot_payload(id, slot), 0, RECV_SLOT_SIZE);
+    struct ibv_recv_wr *head = nodes.setup[id].recv_wrs.chain(free_slots), *bad_wr_recv;
+    if (!head)
+        return 0;
+
+    int ret;
+    {
+        perf_scope scope(&profiler, PERF_POST_RECV, __builtin_popcount(free_slots));
+        ret = ibv_post_recv(nodes.qp[id], head, &bad_wr_recv);
+    }
+    if (ret != 0)
+    {
+        cerr << "ibv_post_recv failed: " << strerror(ret) << endl;
+        nodes.posted_recvs[id] += recv_wr_ring<RECV_SLOTS>::posted_before(head, bad_wr_recv);
+        return -1;
+    }
+    nodes.posted_recvs[id] += __builtin_popcount(free_slots);
+    return 0;
+}
+
+// Hand a held slot back to the NIC. A node in recovery gets it back with the
+// rest of its ring.
+void return_slot(uint32_t id, uint32_t slot) {
+    nodes.held_slots[id] &= ~(1u << slot);
+    if (nodes.state[id] == NODE_READY)
+        post_recv_slot(id, slot);
+}
+
+// Done with the message in `slot` (`len` payload bytes): log it if ingest is
+// on, the slot is returned by ingest_written() then, right away otherwise. The
+// record holds the message as received, sequence header included.
+void release_slot(uint32_t id, uint32_t slot, uint32_t imm, uint32_t len) {
+    if (options.ingest_dir.empty()) {
+        return_slot(id, slot);
+        return;
+    }
+
+    char *record = nodes.setup[id].recv_buf + slot * RECV_SLOT_STRIDE;
+    ingest_record_s *hdr = (ingest_record_s *)record;
+    hdr->magic = INGEST_MAGIC;
+    hdr->node = id;
+    hdr->length = sizeof(seq_header_s) + len;
+    hdr->imm = imm;
+    if (ingest.append(id, record, INGEST_HEADER + hdr->length, make_wr_id(id, slot)) != 0) {
+        return_slot(id, slot);
+        return;
+    }
+    nodes.held_slots[id] |= 1u << slot;
+}
+
+void ingest_written(uint64_t tag) {
+    return_slot(wr_id_node(tag), wr_id_slot(tag));
+}
+
+// " flow <n>" for the multiplexed flows of a node, nothing for its own stream
+string flow_label(uint32_t flow) {
+    return flow >= MUX_FIRST_FLOW ? " flow " + to_string(flow) : "";
+}
+
+// Compare what a pass over a payload ended with to the trailer behind it.
+bool check_crc(uint32_t id, uint32_t crc, const char *trailer) {
+    crc_counts[id].checked.fetch_add(1, std::memory_order_relaxed);
+    if (~crc == crc32c_load_trailer(trailer))
+        return true;
+    crc_counts[id].mismatches.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+// Bytes of a delivered message, `len` of them behind the sequence header,
+// that come before its CRC32C trailer. deliver_message() made sure a
+// message with the flag has room for one.
+uint32_t payload_len(const char *data, uint32_t len) {
+    const seq_header_s *seq = (const seq_header_s *)(data - sizeof(seq_header_s));
+    return seq->flags & SEQ_CRC32C ? len - CRC32C_TRAILER : len;
+}
+
+// Decode a coded message of `flow` straight out of its receive slot onto
+// the end of `text`.
+bool decode_text(string &text, uint32_t id, uint16_t flow, const char *data, uint32_t len) {
+    int32_t raw = codec_decoder::raw_len(data, len);
+    if (raw < 0 || flow >= SEQ_MAX_FLOWS) {
+        codec_traffic.undecodable++;
+        return false;
+    }
+    if (!decoders[id])
+        decoders[id].reset(new codec_decoder[SEQ_MAX_FLOWS]);
+
+    size_t at = text.size();
+    text.resize(at + raw);
+    uint64_t start = clock_ns();
+    bool ok = decoders[id][flow].decode(data, len, &text[at]);
+    codec_traffic.decode_ns += clock_ns() - start;
+    if (!ok) {
+        codec_traffic.undecodable++;
+        text.resize(at);
+        return false;
+    }
+    uint8_t codec = ((const codec_header_s *)data)->codec;
+    codec_traffic.messages[codec]++;
+    codec_traffic.wire_bytes += len;
+    codec_traffic.raw_bytes += raw;
+    return true;
+}
+
+// A record is read where it lies, only its text section is copied out.
+bool append_record(string &text, uint32_t id, const char *data, uint32_t len) {
+    record_view record(data, len);
+    const node_message_v1 *msg = record.as<node_message_schema>();
+    const char *body = msg ? record.section(msg->text) : nullptr;
+    if (!body) {
+        record_stats.rejected++;
+        cerr << "Dropping record from node " << id
+             << (record.valid() ? " of schema " + to_string(record.schema()) + " v" + to_string(record.version()) : ", malformed") << endl;
+        return false;
+    }
+    record_stats.read++;
+    text.append(body, msg->text.length);
+    return true;
+}
+
+// Append a text message up to its first NUL, or the text of a record. The
+// CRC32C trailer, if the node sent one, is checked during the copy; a
+// message that fails it is taken back out. A coded message or a record is
+// not copied as it is, the check reads its few bytes first.
+bool append_text(string &text, uint32_t id, const char *data, uint32_t len) {
+    const seq_header_s *seq = (const seq_header_s *)(data - sizeof(seq_header_s));
+    size_t at = text.size();
+    len = payload_len(data, len);
+    bool whole_copy = !(seq->flags & (SEQ_CODED | SEQ_RECORD));
+    if ((seq->flags & SEQ_CRC32C) && !whole_copy && !check_crc(id, crc32c_update(CRC32C_INIT, data, len), data + len)) {
+        cerr << "CRC32C mismatch, dropping message from node " << id << flow_label(seq->flow) << endl;
+        return false;
+    }
+
+    if (seq->flags & SEQ_CODED) {
+        // a coded record is decoded aside, only its text is kept
+        thread_local string decoded;
+        decoded.clear();
+        string &out = seq->flags & SEQ_RECORD ? decoded : text;
+        if (!decode_text(out, id, seq->flow, data, len)) {
+            cerr << "Cannot decode message from node " << id << flow_label(seq->flow) << ", dropped" << endl;
+            return false;
+        }
+        if (seq->flags & SEQ_RECORD)
+            return append_record(text, id, decoded.data(), decoded.size());
+        text.resize(at + strnlen(&text[at], text.size() - at));
+        return true;
+    }
+    if (seq->flags & SEQ_RECORD)
+        return append_record(text, id, data, len);
+
+    text.resize(at + len);
+    if (seq->flags & SEQ_CRC32C) {
+        if (!check_crc(id, crc32c_copy(CRC32C_INIT, &text[at], data, len), data + len)) {
+            cerr << "CRC32C mismatch, dropping message from node " << id << flow_label(seq->flow) << endl;
+            text.resize(at);
+            return false;
+        }
+    } else {
+        memcpy(&text[at], data, len);
+    }
+    text.resize(at + strnlen(&text[at], len));
+    return true;
+}
+
+// Text messages are processed by the consumer threads, straight from the
+// receive slot. One that did not fit its consumer's ring waits in
+// handoff_backlog, bounded by the slots the nodes have.
+void consume_message(uint32_t consumer, const handoff_desc_s &desc) {
+    string &text = consumer_text[consumer];
+    size_t at = text.size();
+    if (append_text(text, desc.node, desc.data, desc.len)) {
+        string line = "Done receive data '" + text.substr(at) + "' from node " + to_string(desc.node) +
+                      flow_label(desc.flow) + " (consumer " + to_string(consumer) + ")\n";
+        cout << line;
+        text += '\n';
+    }
+    if (trace.enabled())
+        trace.complete(desc.node, desc.flow, desc.len, 0);
+}
+
+void hand_off(const handoff_desc_s &desc) {
+    if (!handoff_backlog.empty() || !handoff.dispatch(desc))
+        handoff_backlog.push_back(desc);
+}
+
+// Give back what the consumers are done with and retry the backlog.
+void progress_handoff() {
+    handoff.reclaim([](const handoff_desc_s &desc) {
+        release_slot(desc.node, desc.slot, desc.imm, desc.len);
+    });
+    while (!handoff_backlog.empty() && handoff.dispatch(handoff_backlog.front()))
+        handoff_backlog.pop_front();
+}
+
+void poll_one_completion();
+int recover_node(uint32_t id);
+
+// Admission of the next node's turn: a node in error gets one recovery
+// attempt, and it is only unlocked once its consumer can take all the
+// messages its ring lets it send.
+sched_admission admit_node(uint32_t id) {
+    if (nodes.state[id] == NODE_NEEDS_RECOVERY && recover_node(id) != 0)
+        return SCHED_SKIP;
+    if (handoff.consumers() != 0 && (!handoff_backlog.empty() || !scheduler.has_room(handoff.room(id))))
+        return SCHED_WAIT;
+    return SCHED_ADMIT;
+}
+
+// End of a pass: wait for the consumers to finish it and collect their lines.
+void collect_consumer_text() {
+    if (handoff.consumers() == 0)
+        return;
+    while (handoff.outstanding() != 0 || !handoff_backlog.empty())
+        poll_one_completion();
+    for (string &text : consumer_text) {
+        round_text += text;
+        text.clear();
+    }
+}
+
+// A node without RoCE only gets a table entry and its receive ring here. The
+// io_uring belongs to the RDMA thread, so that thread attaches the socket,
+// through the reconnect path, before the node is unlocked for the first time.
+void add_tcp_node(int clientSocket, const struct device_info &client_rdma) {
+    if (!tcp_ready) {
+        cout << "> Rejecting TCP NODE " << client_rdma.node_id << ", no io_uring" << endl;
+        close(clientSocket);
+        return;
+    }
+
+    node_setup_s setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.rdma_info = client_rdma;
+    setup.recv_buf = new char[RECV_SLOTS * RECV_SLOT_STRIDE];
+
+    uint32_t id;
+    {
+        std::lock_guard<std::mutex> lock(nodes.mutex);
+        id = nodes.add(nullptr, -1, setup);
+        if (id == INVALID_NODE) {
+            cerr << "Node table full (" << MAX_NODES << " nodes)" << endl;
+            delete[] setup.recv_buf;
+            close(clientSocket);
+            return;
+        }
+        if (!options.ingest_dir.empty() && ingest.register_buffer(id, setup.recv_buf, RECV_SLOTS * RECV_SLOT_STRIDE) != 0) {
+            delete[] setup.recv_buf;
+            close(clientSocket);
+            return;
+        }
+        nodes.state[id] = NODE_NEEDS_RECOVERY;
+        nodes.setup[id].pending_socket = clientSocket;
+        nodes.setup[id].pending_info = client_rdma;
+        nodes.pending_reconnects.push_back(id);
+        nodes.publish(id);
+    }
+    cout << "> TCP NODE " << client_rdma.node_id << " registered with node ID " << id << endl;
+}
 
 void handleClient(int clientSocket) {
     struct device_info client_rdma;
+    node_setup_s setup;
+    struct ibv_qp *qp;
+    uint32_t id;
     
     ssize_t bytesRead = recv(clientSocket, &client_rdma, sizeof(client_rdma), 0);
 
@@ -41,74 +520,118 @@ void handleClient(int clientSocket) {
     } else if (bytesRead == 0) {
         std::cout << "Client disconnected. Client socket: " << clientSocket << std::endl;
         return;
-    } else {
-        // Null-terminate the received data to treat it as a string
-        cout << "> Receive RDMA device info from NODE. QP: " << client_rdma.send_qp_num << ", intf: " << client_rdma.gid.global.interface_id <<  endl;
+    }
 
-        // std::cout << "Received message from client (Socket " << clientSocket << "): " << buffer << std::endl;
-        
-        cout << "> Send RDMA device info to NODE. QP: " << local_rdma.send_qp_num << endl;
-        ssize_t bytesSent = send(clientSocket, &local_rdma, sizeof(local_rdma), 0);
+    // Null-terminate the received data to treat it as a string
+    cout << "> Receive RDMA device info from NODE " << client_rdma.node_id << ". QP: " << client_rdma.send_qp_num << ", intf: " << client_rdma.gid.global.interface_id <<  endl;
 
-        if (bytesSent == -1) {
-            perror("Error while sending data");
+    {
+        std::lock_guard<std::mutex> lock(nodes.mutex);
+        uint32_t known = nodes.find(client_rdma);
+        if (known == INVALID_NODE && options.fan_out != 0 && nodes.size() >= options.fan_out) {
+            cout << "> Rejecting NODE " << client_rdma.node_id << ", fan-out of " << options.fan_out << " reached" << endl;
+            close(clientSocket);
+            return;
+        }
+        if (known != INVALID_NODE) {
+            node_setup_s &existing = nodes.setup[known];
+            // a node that restarts twice before we got to it only keeps the newest socket
+            if (existing.pending_socket != -1)
+                close(existing.pending_socket);
+            else
+                nodes.pending_reconnects.push_back(known);
+            existing.pending_socket = clientSocket;
+            existing.pending_info = client_rdma;
+            if (nodes.transport[known] == TRANSPORT_TCP)
+                cout << "> NODE " << client_rdma.node_id << " reconnected, reusing node ID " << known << " over TCP" << endl;
+            else
+                cout << "> NODE " << client_rdma.node_id << " reconnected, reusing node ID " << known << " and QP " << nodes.qp[known]->qp_num << endl;
             return;
-        } 
+        }
     }
 
-    rdma_client_s client_rdma_info;
-    client_rdma_info.socket_fd = clientSocket;
-    client_rdma_info.rdma_info = client_rdma;
-    // TODO add a check in case same client reconnect
-    clients.push_back(client_rdma_info);
-    set_socket_non_blocking(clientSocket);
-}
-
+    if (client_rdma.transport == TRANSPORT_TCP) {
+        add_tcp_node(clientSocket, client_rdma);
+        return;
+    }
 
-void set_attr_for_reset_state(struct ibv_qp_attr &qp_attr) {
-	memset(&qp_attr, 0, sizeof(qp_attr));
+    memset(&setup, 0, sizeof(setup));
+    setup.rdma_info = client_rdma;
 
-	qp_attr.qp_state   = ibv_qp_state::IBV_QPS_RESET;
-	qp_attr.port_num   = 1;
-	qp_attr.pkey_index = 0;
-	qp_attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
-	                          IBV_ACCESS_REMOTE_WRITE | 
-	                          IBV_ACCESS_REMOTE_READ;
-}
+    struct ibv_qp_init_attr qp_init_attr;
+    qp = create_qp_for_send(qp_init_attr, pd, send_cq);
+    if (!qp)
+    {
+        cerr << "ibv_create_qp failed: " << strerror(errno) << endl;
+        close(clientSocket);
+        return;
+    }
 
-void set_attr_for_init_state(struct ibv_qp_attr &qp_attr) {
-	memset(&qp_attr, 0, sizeof(qp_attr));
+    setup.recv_buf = new char[RECV_SLOTS * RECV_SLOT_STRIDE];
+    setup.recv_mr = ibv_reg_mr(pd, setup.recv_buf, RECV_SLOTS * RECV_SLOT_STRIDE,
+                 IBV_ACCESS_LOCAL_WRITE | 
+                 IBV_ACCESS_REMOTE_WRITE | 
+                 IBV_ACCESS_REMOTE_READ);
+    if (!setup.recv_mr)
+    {
+        cerr << "ibv_reg_mr failed: " << strerror(errno) << endl;
+        goto free_qp;
+    }
 
-	qp_attr.qp_state   = ibv_qp_state::IBV_QPS_INIT;
-	qp_attr.port_num   = 1;
-	qp_attr.pkey_index = 0;
-	qp_attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
-	                          IBV_ACCESS_REMOTE_WRITE | 
-	                          IBV_ACCESS_REMOTE_READ;
-}
+    if (modify_qp_to_init(qp) != 0)
+        goto free_mr;
 
-void set_attr_for_rtr_state(struct ibv_qp_attr &qp_attr, rdma_client_s client) {
-    memset(&qp_attr, 0, sizeof(qp_attr));
+    struct device_info reply;
+    reply = local_rdma;
+    reply.send_qp_num = qp->qp_num;
 
-    qp_attr.path_mtu              = port_attr.active_mtu;
-    qp_attr.qp_state              = ibv_qp_state::IBV_QPS_RTR;
-    qp_attr.rq_psn                = 0;
-    qp_attr.max_dest_rd_atomic    = 1;
-    qp_attr.min_rnr_timer         = 0;
-    qp_attr.ah_attr.is_global     = 1;
-    qp_attr.ah_attr.sl            = 0;
-    qp_attr.ah_attr.src_path_bits = 0;
-    qp_attr.ah_attr.port_num      = 1;
+    cout << "> Send RDMA device info to NODE. QP: " << reply.send_qp_num << endl;
+    if (send(clientSocket, &reply, sizeof(reply), 0) == -1) {
+        perror("Error while sending data");
+        goto free_mr;
+    }
 
-    memcpy(&qp_attr.ah_attr.grh.dgid, &client.rdma_info.gid, sizeof(client.rdma_info.gid));
+    // both sides start with PSN 0, fresh ones are only agreed on recovery
+    if (modify_qp_to_rtr(qp, client_rdma, gidIndex, port_attr.active_mtu, 0) != 0 ||
+        modify_qp_to_rts(qp, 0) != 0)
+        goto free_mr;
 
-    qp_attr.ah_attr.grh.flow_label    = 0;
-    qp_attr.ah_attr.grh.hop_limit     = 5;
-    qp_attr.ah_attr.grh.sgid_index    = gidIndex;
-    qp_attr.ah_attr.grh.traffic_class = 0;
+    set_socket_non_blocking(clientSocket);
+    {
+        std::lock_guard<std::mutex> lock(nodes.mutex);
+        id = nodes.add(qp, clientSocket, setup);
+        if (id == INVALID_NODE) {
+            cerr << "Node table full (" << MAX_NODES << " nodes)" << endl;
+            goto free_mr;
+        }
 
-    qp_attr.ah_attr.dlid = 1;
-    qp_attr.dest_qp_num  = client.rdma_info.send_qp_num;
+        // wr_ids carry the node ID, so the ring is posted once the ID is known
+        prepare_recv_wrs(id);
+        if (post_all_recv_slots(id) != 0)
+            goto free_mr;
+        // the ring doubles as the node's fixed buffer for the log writes
+        if (!options.ingest_dir.empty() && ingest.register_buffer(id, setup.recv_buf, RECV_SLOTS * RECV_SLOT_STRIDE) != 0)
+            goto free_mr;
+
+        nodes.setup[id].rpc = new rpc_endpoint(qp, RPC_WINDOW, make_wr_id(id, 0), poll_one_completion);
+        if (nodes.setup[id].rpc->init(pd) != 0) {
+            delete nodes.setup[id].rpc;
+            goto free_mr;
+        }
+        kv.register_methods(nodes.setup[id].rpc);
+        counters.register_methods(nodes.setup[id].rpc);
+        files.register_methods(nodes.setup[id].rpc);
+        nodes.publish(id);
+    }
+    cout << "> NODE " << client_rdma.node_id << " registered with node ID " << id << endl;
+    return;
+
+free_mr:
+    ibv_dereg_mr(setup.recv_mr);
+free_qp:
+    ibv_destroy_qp(qp);
+    delete[] setup.recv_buf;
+    close(clientSocket);
 }
 
 // Function to accept incoming client connections
@@ -126,7 +649,7 @@ void acceptConnections() {
 
     // Set up server address structure
     serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(PORT);
+    serverAddr.sin_port = htons(options.port);
     serverAddr.sin_addr.s_addr = INADDR_ANY;
 
     // Bind the socket
@@ -144,7 +667,7 @@ void acceptConnections() {
         return;
     }
 
-    std::cout << "Server listening on port " << PORT << std::endl;
+    std::cout << "Server listening on port " << options.port << std::endl;
 
     while (true) {
         if ((clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientAddrLen)) == -1) {
@@ -170,122 +693,1160 @@ void acceptConnections() {
 }
 
 void cleanClientList() {
-    for (const auto& client : clients) {
-        close(client.socket_fd);
+    uint32_t count = nodes.size();
+    for (uint32_t id = 0; id < count; id++) {
+        close(nodes.socket_fd[id]);
     }
+}
 
-    clients.clear();
+bool next_completion(struct ibv_wc &wc) {
+    if (!deferred_wcs.empty()) {
+        wc = deferred_wcs.front();
+        deferred_wcs.pop_front();
+        return true;
+    }
+    bool got;
+    {
+        perf_scope scope(&profiler, PERF_POLL_CQ);
+        got = ibv_poll_cq(send_cq, 1, &wc) > 0;
+        if (!got)
+            scope.cancel();
+    }
+    // the TCP nodes' frames arrive as completions of their own
+    if (!got && tcp_nodes.nodes() != 0)
+        got = tcp_nodes.poll(wc);
+    if (handoff.consumers() != 0)
+        progress_handoff();
+    // log writes go out in batches, or whenever the CQ runs dry
+    if (!options.ingest_dir.empty())
+        ingest.progress(!got);
+    return got;
 }
 
-void rdma_communication() {
-    cout << "START RDMA COMMUNICATION" << endl;
-    char data_send[100];
-    int previous_client_socket = -1;
+void emit_reduce_result() {
+    cout << "> Reduced " << reduce_dtype_name(reducer.result_dtype()) << (reducer.result_op() == REDUCE_SUM ? " sum" : " max")
+         << " of " << reducer.elements() << " elements from " << reducer.round_contributors() << " nodes in "
+         << elapsed_us(round_start) << " us (" << reduce_isa_name(reducer.isa) << ")"
+         << (round_corrupt ? ", CORRUPT" : "") << ":";
+
+    uint32_t shown = reducer.elements() < 4 ? reducer.elements() : 4;
+    for (uint32_t i = 0; i < shown; i++) {
+        if (reducer.result_dtype() == REDUCE_F32)
+            cout << " " << ((const float *)reducer.result())[i];
+        else if (reducer.result_dtype() == REDUCE_F64)
+            cout << " " << ((const double *)reducer.result())[i];
+        else
+            cout << " " << ((const int64_t *)reducer.result())[i];
+    }
+    cout << (shown < reducer.elements() ? " ..." : "") << endl;
+}
+
+// The chunk is folded into the round's output straight from the receive slot
+// and the slot is released right after, the next chunks keep landing in the
+// other posted slots meanwhile. A node counts as delivered once all of its
+// elements are in. A chunk with a CRC32C trailer (`checked`, not part of
+// `len`) is checked in the same pass as it is folded in.
+bool handle_reduce_chunk(uint32_t id, uint32_t slot, const char *buf, uint32_t len, bool checked) {
+    const reduce_chunk_header_s *hdr = (const reduce_chunk_header_s *)buf;
+    uint32_t crc = CRC32C_INIT;
+    size_t bytes = 0;
+    int ret = -1;
+    if (len >= sizeof(*hdr) && len - sizeof(*hdr) >= (uint64_t)hdr->elements * reduce_dtype_size(hdr->dtype)) {
+        if (checked)
+            crc = crc32c_update(crc, hdr, sizeof(*hdr));
+        ret = reducer.contribute(id, *hdr, buf + sizeof(*hdr), checked ? &crc : nullptr);
+        bytes = sizeof(*hdr) + (size_t)hdr->elements * reduce_dtype_size(hdr->dtype);
+    }
+
+    if (checked) {
+        // what the reducer did not read, all of it for a dropped chunk
+        if (ret < 0)
+            crc = crc32c_update(CRC32C_INIT, buf, len);
+        else
+            crc = crc32c_update(crc, buf + bytes, len - bytes);
+        if (!check_crc(id, crc, buf + len)) {
+            cerr << "CRC32C mismatch in reduce chunk from node " << id << (ret < 0 ? "" : ", the round is corrupt") << endl;
+            round_corrupt = round_corrupt || ret >= 0;
+        }
+    }
+    if (ret < 0)
+        cerr << "Dropping reduce chunk from node " << id << " that does not match this round" << endl;
+
+    release_slot(id, slot, REDUCE_IMM, len + (checked ? CRC32C_TRAILER : 0));
+    if (ret == 1)
+        emit_reduce_result();
+    return reducer.node_complete(id);
+}
+
+// Keep up to BCAST_WINDOW chunk writes in flight to a node, everything that
+// fits goes out as one posted list.
+void post_bcast_chunks(uint32_t id) {
+    uint32_t n = std::min(bcast_run.chunks - bcast_run.next_chunk[id], BCAST_WINDOW - bcast_run.in_flight[id]);
+    if (!bcast_run.active || n == 0)
+        return;
+
+    const bcast_target_s &target = bcast_run.targets[id];
+    bcast_build_writes(bcast_wrs, bcast_sges, bcast_mr, bcast_blob, options.bcast_bytes, options.bcast_chunk,
+                       bcast_run.next_chunk[id], n, target.addr, target.rkey, make_wr_id(id, BCAST_WR_SLOT));
+
+    struct ibv_send_wr *bad_wr;
     int ret;
-    while(true) {
-        for(const auto &client : clients) {
-            cout << "> Unlock client socket: " << client.socket_fd << " to send data" << endl;
-            const char* unlockMessage = "[SERVER] UNLOCK";
-            ssize_t bytesSent = send(client.socket_fd, unlockMessage, strlen(unlockMessage), 0);
+    {
+        perf_scope scope(&profiler, PERF_POST_SEND, n);
+        ret = ibv_post_send(nodes.qp[id], bcast_wrs.data(), &bad_wr);
+    }
+    if (ret != 0) {
+        cerr << "ibv_post_send - broadcast - failed for node " << id << ": " << strerror(ret) << endl;
+        return;
+    }
+    bcast_run.next_chunk[id] += n;
+    bcast_run.in_flight[id] += n;
+}
 
-            if (bytesSent == -1) {
-                perror("Error while sending data");
-            } else {
-                std::cout << "Unlock successfully sent to client (Socket " << client.socket_fd << "): " << unlockMessage << std::endl;
+void handle_bcast_done(uint32_t id, const char *buf, uint32_t len) {
+    if (!bcast_run.active || id >= bcast_run.done_us.size() || bcast_run.done_us[id] >= 0 || len < sizeof(bcast_done_s))
+        return;
+
+    const bcast_done_s *msg = (const bcast_done_s *)buf;
+    bcast_run.done_us[id] = elapsed_us(bcast_run.start);
+    bcast_run.done++;
+    if (msg->bytes != options.bcast_bytes || msg->checksum != bcast_sum) {
+        cerr << "Broadcast checksum mismatch on node " << id << endl;
+        bcast_run.mismatches++;
+    }
+}
+
+// Returns true if `wc` delivered a message. A failed or flushed receive only
+// takes its slot off the posted count and marks the owning connection for
+// recovery, which posts every slot again.
+bool handle_completion(const struct ibv_wc &wc) {
+    perf_scope scope(&profiler, PERF_DISPATCH);
+    uint32_t id = wr_id_node(wc.wr_id);
+    if (id >= nodes.size())
+        return false;
+
+    uint32_t slot = wr_id_slot(wc.wr_id);
+    bool rpc_send = rpc_endpoint::is_rpc_send(slot);
+    bool bcast_send = slot == BCAST_WR_SLOT;
+    if (!rpc_send && !bcast_send)
+        nodes.posted_recvs[id]--;
+    if (bcast_send && id < bcast_run.in_flight.size())
+        bcast_run.in_flight[id]--;
+
+    if (wc.status != ibv_wc_status::IBV_WC_SUCCESS)
+    {
+        if (wc.status != ibv_wc_status::IBV_WC_WR_FLUSH_ERR)
+            cerr << "ibv_poll_cq failed for node " << id << ": " << ibv_wc_status_str(wc.status) << endl;
+        nodes.state[id] = NODE_NEEDS_RECOVERY;
+        return false;
+    }
+
+    if (rpc_send) {
+        nodes.setup[id].rpc->handle_send_completion(slot);
+        return false;
+    }
+
+    if (bcast_send) {
+        if (id < bcast_run.next_chunk.size())
+            post_bcast_chunks(id);
+        return false;
+    }
+
+    char *buf = nodes.setup[id].recv_buf + slot * RECV_SLOT_STRIDE + INGEST_HEADER;
+    if (rpc_endpoint::is_rpc_recv(wc)) {
+        nodes.setup[id].rpc->handle_recv(buf, wc.byte_len);
+        post_recv_slot(id, slot);
+        return false;
+    }
+
+    if ((wc.wc_flags & IBV_WC_WITH_IMM) && ntohl(wc.imm_data) == BCAST_DONE_IMM) {
+        handle_bcast_done(id, buf, wc.byte_len);
+        post_recv_slot(id, slot);
+        return false;
+    }
+
+    // an incast message: the slot stays with us until the message was
+    // delivered (or dropped) and processed
+    nodes.held_slots[id] |= 1u << slot;
+    uint32_t imm = (wc.wc_flags & IBV_WC_WITH_IMM) ? ntohl(wc.imm_data) : 0;
+    if (wc.byte_len < sizeof(seq_header_s)) {
+        reorder.stats.invalid++;
+        return_slot(id, slot);
+        return false;
+    }
+    transport_traffic[nodes.transport[id]].messages++;
+    transport_traffic[nodes.transport[id]].bytes += wc.byte_len;
+    const seq_header_s *seq = (const seq_header_s *)buf;
+    if (options.clock_sync)
+        clocks.arrive(id, seq->send_ns, clock_ns());
+    return reorder.arrive(id, { seq->seq, seq->flow, (uint16_t)slot, (uint32_t)(wc.byte_len - sizeof(seq_header_s)), imm });
+}
+
+// The reorder stage hands over the incast messages in sequence. Returns true
+// if the message completes the node's part of the pass.
+bool deliver_message(uint32_t id, const seq_message_s &msg, bool gap) {
+    char *buf = nodes.setup[id].recv_buf + msg.slot * RECV_SLOT_STRIDE + INGEST_HEADER + sizeof(seq_header_s);
+    if (gap)
+        cout << "> Messages missing before " << msg.seq << " of flow " << msg.flow << " from node " << id << endl;
+    // demultiplex: the flow ID picks the stream a message belongs to
+    flow_traffic[msg.flow].messages++;
+    flow_traffic[msg.flow].bytes += msg.len;
+
+    // the trailer stays out of the payload, the slot is released whole
+    const bool checked = ((const seq_header_s *)(buf - sizeof(seq_header_s)))->flags & SEQ_CRC32C;
+    if (checked && msg.len < CRC32C_TRAILER) {
+        cerr << "CRC32C trailer missing, dropping message from node " << id << flow_label(msg.flow) << endl;
+        crc_counts[id].checked++;
+        crc_counts[id].mismatches++;
+        release_slot(id, msg.slot, msg.imm, msg.len);
+        return msg.imm == REDUCE_IMM ? reducer.node_complete(id) : true;
+    }
+    uint32_t len = checked ? msg.len - CRC32C_TRAILER : msg.len;
+
+    if (msg.imm == REDUCE_IMM) {
+        bool done = handle_reduce_chunk(id, msg.slot, buf, len, checked);
+        if (trace.enabled())
+            trace.complete(id, msg.flow, msg.len, TRACE_REDUCE);
+        return done;
+    }
+
+    if (handoff.consumers() != 0) {
+        hand_off({ buf, msg.len, id, msg.slot, 0, msg.flow });
+        return true;
+    }
+
+    size_t at = round_text.size();
+    if (append_text(round_text, id, buf, msg.len)) {
+        cout << "Done receive data '" << round_text.substr(at) << "' from node " << id << flow_label(msg.flow) << endl;
+        round_text += '\n';
+    }
+    if (trace.enabled())
+        trace.complete(id, msg.flow, msg.len, 0);
+    release_slot(id, msg.slot, 0, msg.len);
+    return true;
+}
+
+void drop_message(uint32_t id, const seq_message_s &msg) {
+    return_slot(id, msg.slot);
+}
+
+void poll_one_completion() {
+    struct ibv_wc wc;
+    if (next_completion(wc))
+        handle_completion(wc);
+}
+
+// A node whose send failed tells us over the control socket, our side of the
+// QP may not have noticed anything.
+void check_control_for_errors(uint32_t id) {
+    // messages left behind by a recovery are still buffered
+    control_stream &control = nodes.setup[id].control;
+    control.fill(nodes.socket_fd[id], MSG_DONTWAIT);
+    while (const char *message = control.next()) {
+        if (startsWith(message, "[CLIENT] QP_ERROR")) {
+            cout << "> Node " << id << " reported a QP error" << endl;
+            nodes.state[id] = NODE_NEEDS_RECOVERY;
+        }
+    }
+}
+
+int wait_for_data(uint32_t id) {
+    auto start = std::chrono::steady_clock::now();
+    while (elapsed_us(start) < RECV_TIMEOUT_MS * 1000.0) {
+        struct ibv_wc wc;
+        if (!next_completion(wc)) {
+            // the socket of a TCP node is read by the io_uring, a broken one
+            // shows up as a failed completion
+            if (nodes.transport[id] == TRANSPORT_RDMA)
+                check_control_for_errors(id);
+            if (nodes.state[id] == NODE_NEEDS_RECOVERY)
+                return -1;
+            continue;
+        }
+
+        if (handle_completion(wc) && wr_id_node(wc.wr_id) == id)
+            return 0;
+        if (nodes.state[id] == NODE_NEEDS_RECOVERY)
+            return -1;
+    }
+
+    // the QP can be in error without having produced a completion yet
+    if (nodes.transport[id] == TRANSPORT_RDMA && query_qp_state(nodes.qp[id]) == ibv_qp_state::IBV_QPS_ERR)
+        nodes.state[id] = NODE_NEEDS_RECOVERY;
+
+    cout << "No data from node " << id << " in " << RECV_TIMEOUT_MS << " ms" << endl;
+    return -1;
+}
+
+// Reclaim the receive buffers of a QP in error. Completions that belong to
+// other connections are kept for the main loop instead of being dropped.
+void drain_flushed_recvs(uint32_t id) {
+    auto start = std::chrono::steady_clock::now();
+    while (nodes.posted_recvs[id] > 0 && elapsed_us(start) < CONTROL_TIMEOUT_MS * 1000.0) {
+        struct ibv_wc wc;
+        if (ibv_poll_cq(send_cq, 1, &wc) <= 0)
+            continue;
+
+        if (wr_id_node(wc.wr_id) != id)
+            deferred_wcs.push_back(wc);
+        else if (!rpc_endpoint::is_rpc_send(wr_id_slot(wc.wr_id)) && wr_id_slot(wc.wr_id) != BCAST_WR_SLOT)
+            nodes.posted_recvs[id]--;
+    }
+
+    // whatever was not flushed by now is discarded by the RESET transition
+    nodes.posted_recvs[id] = 0;
+}
+
+// Bring a QP back to INIT from any state: force it into ERR so every posted
+// WR is flushed, reclaim the receive buffers and RESET it.
+int quiesce_qp(uint32_t id) {
+    struct ibv_qp *qp = nodes.qp[id];
+    if (query_qp_state(qp) != ibv_qp_state::IBV_QPS_ERR && modify_qp_to_error(qp) != 0)
+        return -1;
+
+    drain_flushed_recvs(id);
+
+    // RPC frames in flight are gone and calls waiting on this node never get
+    // their answer
+    nodes.setup[id].rpc->reset();
+    nodes.setup[id].rpc->expire(0);
+
+    if (modify_qp_to_reset(qp) != 0 || modify_qp_to_init(qp) != 0)
+        return -1;
+    return 0;
+}
+
+// In-place recovery: ERR -> (flush) -> RESET -> INIT -> RTR -> RTS with fresh
+// PSNs agreed with the node over the control socket. The QP number does not
+// change, so the node only has to reset its own side.
+int recover_node(uint32_t id) {
+    auto start = std::chrono::steady_clock::now();
+    char buffer[CONTROL_LINE_MAX];
+    int socket = nodes.socket_fd[id];
+    node_setup_s &setup = nodes.setup[id];
+
+    // a TCP connection cannot be repaired from here, the node reconnects
+    if (nodes.transport[id] == TRANSPORT_TCP) {
+        cout << "> TCP node " << id << " lost its connection, waiting for it to reconnect" << endl;
+        return -1;
+    }
+
+    cout << "> Recovering QP " << nodes.qp[id]->qp_num << " of node " << id << endl;
+
+    if (quiesce_qp(id) != 0)
+        return -1;
+
+    uint32_t master_psn = generate_psn();
+    uint32_t node_psn = generate_psn();
+    snprintf(buffer, sizeof(buffer), "[SERVER] RECOVER %u %u", master_psn, node_psn);
+    if (send_control(socket, buffer) == -1) {
+        perror("Error while sending recover request");
+        return -1;
+    }
+
+    // the node resets its QP and moves it to RTS before acknowledging, it only
+    // sends again after the next UNLOCK so our RTR below is never late. QP
+    // errors it reported before it saw the request are stale by now.
+    const char *message;
+    while ((message = recv_control(socket, setup.control, CONTROL_TIMEOUT_MS)) && !startsWith(message, "[CLIENT] RECOVERED"))
+        if (!startsWith(message, "[CLIENT] QP_ERROR"))
+            cerr << "Unexpected control message from node " << id << ": " << message << endl;
+    if (!message) {
+        cerr << "Node " << id << " did not acknowledge recovery" << endl;
+        return -1;
+    }
+
+    if (modify_qp_to_rtr(nodes.qp[id], setup.rdma_info, gidIndex, port_attr.active_mtu, node_psn) != 0 ||
+        modify_qp_to_rts(nodes.qp[id], master_psn) != 0)
+        return -1;
+
+    if (post_all_recv_slots(id) != 0)
+        return -1;
+
+    nodes.state[id] = NODE_READY;
+    setup.recoveries++;
+    cout << "> QP " << nodes.qp[id]->qp_num << " recovered in " << elapsed_us(start) << " us (recovery #" << setup.recoveries << ")" << endl;
+    return 0;
+}
+
+// Point the io_uring at the socket of a TCP node, on its first connect and
+// after a restart. Frames of the previous connection are dropped, like the
+// flushed receives of a QP.
+int attach_tcp_node(uint32_t id, int socket, const struct device_info &info) {
+    node_setup_s &setup = nodes.setup[id];
+    bool first = nodes.socket_fd[id] == -1;
+
+    tcp_nodes.remove(id);
+    nodes.posted_recvs[id] = 0;
+    reorder.reset(id);
+    clocks.reset(id);
+
+    // the node only starts once it has our answer
+    struct device_info reply = local_rdma;
+    reply.send_qp_num = 0;
+    reply.transport = TRANSPORT_TCP;
+    if (send(socket, &reply, sizeof(reply), 0) == -1) {
+        perror("Error while sending data");
+        close(socket);
+        return -1;
+    }
+
+    if (!first)
+        close(nodes.socket_fd[id]);
+    set_socket_non_blocking(socket);
+    nodes.socket_fd[id] = socket;
+    setup.control.reset();
+    setup.rdma_info = info;
+    if (tcp_nodes.add(id, socket, setup.recv_buf, RECV_SLOT_STRIDE, INGEST_HEADER, RECV_SLOT_SIZE) != 0)
+        return -1;
+    nodes.state[id] = NODE_READY;
+    if (post_all_recv_slots(id) != 0) {
+        nodes.state[id] = NODE_NEEDS_RECOVERY;
+        return -1;
+    }
+
+    if (!first) {
+        setup.reconnects++;
+        cout << "> TCP NODE " << info.node_id << " reattached as node " << id << " (reconnect #" << setup.reconnects << ")" << endl;
+    } else {
+        cout << "> TCP NODE " << info.node_id << " attached as node " << id << endl;
+    }
+    return 0;
+}
+
+// The node restarted: it has a new QP, but its GID and node ID are the same.
+// Re-target our existing QP and receive ring at it instead of allocating new
+// ones and adopt the new control socket.
+int reconnect_node(uint32_t id) {
+    auto start = std::chrono::steady_clock::now();
+    node_setup_s &setup = nodes.setup[id];
+    int socket;
+    struct device_info info;
+    {
+        std::lock_guard<std::mutex> lock(nodes.mutex);
+        socket = setup.pending_socket;
+        info = setup.pending_info;
+        setup.pending_socket = -1;
+    }
+
+    if (nodes.transport[id] == TRANSPORT_TCP)
+        return attach_tcp_node(id, socket, info);
+
+    if (quiesce_qp(id) != 0) {
+        close(socket);
+        return -1;
+    }
+    // the new process numbers its messages from 0 again
+    reorder.reset(id);
+    clocks.reset(id);
+
+    struct device_info reply = local_rdma;
+    reply.send_qp_num = nodes.qp[id]->qp_num;
+
+    cout << "> Send RDMA device info to NODE " << info.node_id << ". QP: " << reply.send_qp_num << endl;
+    if (send(socket, &reply, sizeof(reply), 0) == -1) {
+        perror("Error while sending data");
+        close(socket);
+        return -1;
+    }
+
+    // a fresh node process starts with PSN 0, like on the first connect
+    if (modify_qp_to_rtr(nodes.qp[id], info, gidIndex, port_attr.active_mtu, 0) != 0 ||
+        modify_qp_to_rts(nodes.qp[id], 0) != 0 ||
+        post_all_recv_slots(id) != 0) {
+        close(socket);
+        nodes.state[id] = NODE_NEEDS_RECOVERY;
+        return -1;
+    }
+
+    close(nodes.socket_fd[id]);
+    set_socket_non_blocking(socket);
+    nodes.socket_fd[id] = socket;
+    setup.control.reset();
+    setup.rdma_info = info;
+    // the restarted process has its defaults again
+    setup.configured = false;
+    nodes.state[id] = NODE_READY;
+    setup.reconnects++;
+    cout << "> NODE " << info.node_id << " reattached to QP " << nodes.qp[id]->qp_num << " in " << elapsed_us(start) << " us (reconnect #" << setup.reconnects << ")" << endl;
+    return 0;
+}
+
+void process_reconnects() {
+    vector<uint32_t> pending;
+    {
+        std::lock_guard<std::mutex> lock(nodes.mutex);
+        pending.swap(nodes.pending_reconnects);
+    }
+    for (uint32_t id : pending)
+        reconnect_node(id);
+}
+
+// Give up on the outstanding RPCs of every node.
+void expire_rpcs(uint32_t count) {
+    for (uint32_t id = 0; id < count; id++)
+        if (nodes.setup[id].rpc)
+            nodes.setup[id].rpc->expire(0);
+}
+
+// One batched frame per node: the config push (once per connection) and a
+// stats query share a single WR, then all answers are collected.
+void query_nodes(uint32_t count) {
+    auto start = std::chrono::steady_clock::now();
+    uint32_t expected = 0;
+    uint32_t answered = 0;
+
+    for (uint32_t id = 0; id < count; id++) {
+        if (nodes.state[id] != NODE_READY || !nodes.setup[id].rpc)
+            continue;
+        rpc_endpoint *rpc = nodes.setup[id].rpc;
+
+        if (!nodes.setup[id].configured) {
+            char *args = rpc->call(RPC_SET_CONFIG, sizeof(node_config_s), [id](uint8_t status, const char *, uint32_t) {
+                if (status == RPC_OK)
+                    nodes.setup[id].configured = true;
+            });
+            if (args) {
+                node_config_s config = { RDMA_MSG_SIZE, 0 };
+                memcpy(args, &config, sizeof(config));
             }
+        }
 
-            // Pool data from RDMA for a small period of time
-            cout << "Pool for data from queue for client " << client.socket_fd << endl;
+        char *args = rpc->call(RPC_GET_STATS, 0, [id, start, &answered](uint8_t status, const char *resp, uint32_t resp_len) {
+            answered++;
+            if (status != RPC_OK || resp_len < sizeof(node_stats_s)) {
+                cerr << "RPC GET_STATS to node " << id << " failed with status " << (int)status << endl;
+                return;
+            }
+            const node_stats_s *stats = (const node_stats_s *)resp;
+            cout << "> Node " << id << " stats after " << elapsed_us(start) << " us: sent " << stats->messages_sent
+                 << ", send errors " << stats->send_errors << ", recoveries " << stats->recoveries << endl;
+        });
+        if (args)
+            expected++;
+
+        rpc->flush();
+    }
+
+    while (answered < expected && elapsed_us(start) < RPC_TIMEOUT_MS * 1000.0)
+        poll_one_completion();
+
+    // callbacks must not outlive `answered`
+    expire_rpcs(count);
+}
 
+// CLOCK_PINGS rounds of one RPC_CLOCK_SYNC ping per node, each round waits
+// for its answers so the pings of a node never queue behind each other.
+void sync_clocks(uint32_t count) {
+    if (!options.clock_sync)
+        return;
+    clocks.begin_pass();
+
+    for (uint32_t ping = 0; ping < CLOCK_PINGS; ping++) {
+        auto start = std::chrono::steady_clock::now();
+        uint32_t expected = 0;
+        uint32_t answered = 0;
+        for (uint32_t id = 0; id < count; id++) {
+            if (nodes.state[id] != NODE_READY || !nodes.setup[id].rpc)
+                continue;
+            rpc_endpoint *rpc = nodes.setup[id].rpc;
+            uint64_t sent = clock_ns();
+            char *args = rpc->call(RPC_CLOCK_SYNC, 0, [id, sent, &answered](uint8_t status, const char *resp, uint32_t resp_len) {
+                uint64_t now = clock_ns();
+                answered++;
+                if (status != RPC_OK || resp_len < sizeof(uint64_t)) {
+                    clocks.stats.lost++;
+                    return;
+                }
+                uint64_t node_ns;
+                memcpy(&node_ns, resp, sizeof(node_ns));
+                clocks.estimator(id).sample(sent, node_ns, now);
+            });
+            if (!args)
+                continue;
+            rpc->flush();
+            expected++;
+            clocks.stats.pings++;
+        }
+
+        while (answered < expected && elapsed_us(start) < RPC_TIMEOUT_MS * 1000.0)
+            poll_one_completion();
+        expire_rpcs(count);
+        if (expected == 0)
+            break;
+    }
+
+    for (uint32_t id = 0; id < count; id++)
+        clocks.estimator(id).end_round();
+}
+
+// The first few counters, as the nodes left them.
+void report_counters() {
+    const uint32_t shown = 4;
+    bool any = false;
+    for (uint32_t slot = 0; slot < shown; slot++)
+        any = any || counters.read(slot) != 0;
+    if (!any)
+        return;
+
+    cout << "> Counters:";
+    for (uint32_t slot = 0; slot < shown; slot++)
+        cout << " [" << slot << "] " << counters.read(slot);
+    cout << endl;
+}
+
+// Traffic of the multiplexed flows in the pass that just ended.
+void report_flows() {
+    bool any = false;
+    for (uint32_t flow = MUX_FIRST_FLOW; flow < SEQ_MAX_FLOWS; flow++) {
+        if (flow_traffic[flow].messages == 0)
+            continue;
+        cout << (any ? "," : "> Flows:") << " [" << flow << "] " << flow_traffic[flow].messages << " msgs "
+             << flow_traffic[flow].bytes << " bytes";
+        any = true;
+    }
+    if (any)
+        cout << endl;
+    memset(flow_traffic, 0, sizeof(flow_traffic));
+}
+
+void report_sequencing() {
+    const reorder_stats_s &st = reorder.stats;
+    if (st.reordered == 0 && st.gaps == 0 && st.duplicates == 0 && st.invalid == 0)
+        return;
+    cout << "> Sequencing: " << st.delivered << " delivered, " << st.reordered << " reordered (depth up to "
+         << st.max_depth << "), " << st.gaps << " gaps with " << st.lost << " lost, " << st.duplicates
+         << " duplicates, " << st.invalid << " invalid" << endl;
+}
+
+// Incast traffic per transport, once there are TCP nodes.
+void report_transports() {
+    if (tcp_nodes.nodes() == 0 && transport_traffic[TRANSPORT_TCP].messages == 0)
+        return;
+    const tcp_ingress_stats_s &st = tcp_nodes.stats;
+    cout << "> Transports: rdma " << transport_traffic[TRANSPORT_RDMA].messages << " msgs "
+         << transport_traffic[TRANSPORT_RDMA].bytes << " bytes, tcp " << transport_traffic[TRANSPORT_TCP].messages
+         << " msgs " << transport_traffic[TRANSPORT_TCP].bytes << " bytes from " << tcp_nodes.nodes() << " nodes ("
+         << st.recvs << " receives, " << st.starved << " out of buffers, " << st.closed << " closed)" << endl;
+    memset(transport_traffic, 0, sizeof(transport_traffic));
+}
+
+void report_handoff() {
+    if (handoff.consumers() == 0)
+        return;
+    cout << "> Handoff: " << handoff.stats.dispatched << " messages to " << handoff.consumers() << " consumers, "
+         << handoff.stats.full << " times a ring was full, " << scheduler.stats.stalls << " unlocks held back" << endl;
+}
 
-            // EXPERIMENT
+void report_trace() {
+    if (!trace.enabled())
+        return;
+    cout << "> Trace: " << trace.stats.written << " records written, " << trace.drops() << " dropped"
+         << (trace.stats.write_errors ? ", " + to_string(trace.stats.write_errors) + " write errors" : "") << endl;
+}
 
-            // set_attr_for_reset_state(qp_attr);
-            // ret = ibv_modify_qp(send_qp, &qp_attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
-            // if (ret != 0)
-            // {
-            //     cerr << "ibv_modify_qp - RESET - failed: " << strerror(ret) << endl;
-            //     exit(1);
-            // }
+// Where each node's turns went, on the master's clock: the slowest nodes by
+// time from grant to arrival, split at the node's send.
+void report_clocks(uint32_t count) {
+    if (!options.clock_sync)
+        return;
+    uint32_t synced = 0;
+    double max_drift = 0;
+    latency_split_s total;
+    memset(&total, 0, sizeof(total));
+    vector<uint32_t> stamped;
+    for (uint32_t id = 0; id < count; id++) {
+        const clock_estimator &est = clocks.estimator(id);
+        if (!est.is_synced())
+            continue;
+        synced++;
+        max_drift = max(max_drift, fabs(est.drift_ppm()));
+        const latency_split_s &split = clocks.latency(id);
+        if (split.messages == 0)
+            continue;
+        total.messages += split.messages;
+        total.node_ns += split.node_ns;
+        total.fabric_ns += split.fabric_ns;
+        stamped.push_back(id);
+    }
 
-            // set_attr_for_init_state(qp_attr);
-            // ret = ibv_modify_qp(send_qp, &qp_attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
-            // if (ret != 0)
-            // {
-            //     cerr << "ibv_modify_qp - INIT - failed: " << strerror(ret) << endl;
-            //     exit(1);
-            // }
+    cout << "> Clocks: " << synced << "/" << count << " nodes synced, drift up to " << max_drift << " ppm, "
+         << clocks.stats.lost << " of " << clocks.stats.pings << " pings lost, " << clocks.stats.unsynced
+         << " messages from unsynced nodes, " << clocks.stats.skewed << " outside their turn" << endl;
+    if (total.messages == 0)
+        return;
+    cout << "> Latency per message: node " << total.node_ns / 1e3 / total.messages << " us, fabric "
+         << total.fabric_ns / 1e3 / total.messages << " us" << endl;
+
+    auto turn_ns = [](uint32_t id) {
+        const latency_split_s &split = clocks.latency(id);
+        return (split.node_ns + split.fabric_ns) / split.messages;
+    };
+    sort(stamped.begin(), stamped.end(), [&turn_ns](uint32_t a, uint32_t b) { return turn_ns(a) > turn_ns(b); });
+    for (size_t i = 0; i < stamped.size() && i < 3; i++) {
+        uint32_t id = stamped[i];
+        const latency_split_s &split = clocks.latency(id);
+        const clock_estimator &est = clocks.estimator(id);
+        bool node_slow = split.node_ns > split.fabric_ns;
+        cout << ">   straggler node " << id << ": node " << split.node_ns / 1e3 / split.messages << " us, fabric "
+             << split.fabric_ns / 1e3 / split.messages << " us (max " << split.max_fabric_ns / 1e3 << "), +-"
+             << est.error_ns() / 1e3 << " us, " << (node_slow ? "node" : "fabric") << " bound" << endl;
+    }
+}
 
-            // ==========================
+// End-to-end checks of the pass, nodes without trailers stay out of it.
+void report_crc(uint32_t count) {
+    uint64_t checked = 0, mismatches = 0;
+    for (uint32_t id = 0; id < count; id++) {
+        checked += crc_counts[id].checked.load(std::memory_order_relaxed);
+        mismatches += crc_counts[id].mismatches.load(std::memory_order_relaxed);
+    }
+    if (checked == 0)
+        return;
+    cout << "> CRC32C (" << crc32c_isa_name(crc32c_best_isa()) << "): " << checked << " messages checked, "
+         << mismatches << " mismatches" << (round_corrupt ? ", reduce round corrupt" : "") << endl;
+    for (uint32_t id = 0; id < count; id++) {
+        uint64_t bad = crc_counts[id].mismatches.exchange(0, std::memory_order_relaxed);
+        uint64_t of = crc_counts[id].checked.exchange(0, std::memory_order_relaxed);
+        if (bad != 0)
+            cout << ">   node " << id << ": " << bad << " of " << of << " mismatched" << endl;
+    }
+}
 
+void report_records() {
+    uint64_t read = record_stats.read.exchange(0, std::memory_order_relaxed);
+    uint64_t rejected = record_stats.rejected.exchange(0, std::memory_order_relaxed);
+    if (read != 0 || rejected != 0)
+        cout << "> Records: " << read << " read in place, " << rejected << " rejected" << endl;
+}
 
-            // set_attr_for_rtr_state(qp_attr, client);
+// What coding the flows saved the master's link, and what decoding cost.
+void report_codec() {
+    uint64_t messages = 0;
+    for (uint32_t c = 0; c < CODECS; c++)
+        messages += codec_traffic.messages[c].load(std::memory_order_relaxed);
+    uint64_t undecodable = codec_traffic.undecodable.exchange(0, std::memory_order_relaxed);
+    if (messages == 0 && undecodable == 0)
+        return;
+    uint64_t wire = codec_traffic.wire_bytes.exchange(0, std::memory_order_relaxed);
+    uint64_t raw = codec_traffic.raw_bytes.exchange(0, std::memory_order_relaxed);
+    uint64_t decode_ns = codec_traffic.decode_ns.exchange(0, std::memory_order_relaxed);
+    cout << "> Codec: " << messages << " messages,";
+    for (uint32_t c = 0; c < CODECS; c++)
+        cout << " " << codec_names[c] << " " << codec_traffic.messages[c].exchange(0, std::memory_order_relaxed);
+    cout << ", " << raw << " bytes in " << wire << " on the wire";
+    if (wire != 0)
+        cout << ", x" << (double)raw / wire << " payload per link byte";
+    if (messages != 0)
+        cout << ", decode " << decode_ns / messages << " ns/msg";
+    cout << (undecodable ? ", " + to_string(undecodable) + " undecodable" : "") << endl;
+}
 
-            // // move the send QP into the RTR state, using ibv_modify_qp
-            // ret = ibv_modify_qp(send_qp, &qp_attr, IBV_QP_STATE | IBV_QP_AV |
-            //                     IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
-            //                     IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+void report_ingest() {
+    if (options.ingest_dir.empty())
+        return;
+    const ingest_stats_s &st = ingest.stats;
+    cout << "> Ingest: " << st.records << " records, " << st.bytes << " bytes in " << st.segments << " segments, "
+         << st.syncs << " syncs, " << st.submits << " submits" << (st.errors ? ", " + to_string(st.errors) + " errors" : "")
+         << (st.skipped ? ", " + to_string(st.skipped) + " failed writes skipped" : "") << endl;
+}
 
-            if (ret != 0)
-            {
-                cerr << "ibv_modify_qp - RTR - failed: " << strerror(ret) << endl;
-                exit(1);
+// Between two unlocks keep serving the nodes' RPCs (KV PUTs) and whatever
+// else lands on the CQ. Only the pace sleeps when there is nothing, a held
+// back unlock waits for its consumer without.
+void serve_once(bool busy) {
+    struct ibv_wc wc;
+    if (next_completion(wc))
+        handle_completion(wc);
+    else if (!busy)
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+// the scheduler's clock, ns into the pass
+uint64_t pass_ns() {
+    return (uint64_t)(elapsed_us(round_start) * 1000.0);
+}
+
+// Push the blob to every ready node. All nodes first register a landing
+// buffer (PREPARE), then get their place in the chain (START), only then the
+// chunks flow. Completion time is taken when the last node reported.
+void broadcast_blob(uint32_t count) {
+    auto start = std::chrono::steady_clock::now();
+    uint32_t expected = 0;
+    uint32_t answered = 0;
+    vector<uint8_t> armed(count, 0);
+
+    bcast_run.active = false;
+    bcast_run.chunks = bcast_chunks(options.bcast_bytes, options.bcast_chunk);
+    bcast_run.members.clear();
+    bcast_run.targets.assign(count, bcast_target_s());
+    bcast_run.next_chunk.assign(count, 0);
+    bcast_run.in_flight.assign(count, 0);
+    bcast_run.done_us.assign(count, -1);
+    bcast_run.done = 0;
+    bcast_run.mismatches = 0;
+
+    for (uint32_t id = 0; id < count; id++) {
+        // TCP nodes have no RPC endpoint and nothing to write to
+        if (nodes.state[id] != NODE_READY || !nodes.setup[id].rpc)
+            continue;
+        char *args = nodes.setup[id].rpc->call(RPC_BCAST_PREPARE, sizeof(bcast_prepare_s), [id, &answered, &armed](uint8_t status, const char *resp, uint32_t resp_len) {
+            answered++;
+            if (status == RPC_OK && resp_len >= sizeof(bcast_target_s)) {
+                memcpy(&bcast_run.targets[id], resp, sizeof(bcast_target_s));
+                armed[id] = 1;
             }
+        });
+        if (args) {
+            bcast_prepare_s prepare = { options.bcast_bytes, options.bcast_chunk, 0 };
+            memcpy(args, &prepare, sizeof(prepare));
+            expected++;
+        }
+        nodes.setup[id].rpc->flush();
+    }
+
+    // registering a multi-MB buffer takes a while on the nodes
+    while (answered < expected && elapsed_us(start) < CONTROL_TIMEOUT_MS * 1000.0)
+        poll_one_completion();
+    expire_rpcs(count);
+
+    for (uint32_t id = 0; id < count; id++) {
+        if (armed[id])
+            bcast_run.members.push_back(id);
+        armed[id] = 0;
+    }
+    if (bcast_run.members.empty())
+        return;
+
+    bool chain = options.bcast_mode == BCAST_CHAIN;
+    uint32_t members = bcast_run.members.size();
+    expected = 0;
+    answered = 0;
+    for (uint32_t i = 0; i < members; i++) {
+        uint32_t id = bcast_run.members[i];
+        char *args = nodes.setup[id].rpc->call(RPC_BCAST_START, sizeof(bcast_start_s), [id, &answered, &armed](uint8_t status, const char *, uint32_t resp_len) {
+            answered++;
+            if (status == RPC_OK && resp_len >= sizeof(uint32_t))
+                armed[id] = 1;
+        });
+        if (!args)
+            continue;
+
+        bcast_start_s req;
+        memset(&req, 0, sizeof(req));
+        req.mode = options.bcast_mode;
+        if (chain && i > 0) {
+            uint32_t prev = bcast_run.members[i - 1];
+            req.has_prev = 1;
+            req.prev_qp_num = bcast_run.targets[prev].out_qp_num;
+            req.prev_gid = nodes.setup[prev].rdma_info.gid;
+        }
+        if (chain && i + 1 < members) {
+            uint32_t next = bcast_run.members[i + 1];
+            req.has_next = 1;
+            req.next_gid = nodes.setup[next].rdma_info.gid;
+            req.next = bcast_run.targets[next];
+        }
+        memcpy(args, &req, sizeof(req));
+        expected++;
+        nodes.setup[id].rpc->flush();
+    }
+
+    while (answered < expected && elapsed_us(start) < CONTROL_TIMEOUT_MS * 1000.0)
+        poll_one_completion();
+    expire_rpcs(count);
+
+    for (uint32_t id : bcast_run.members) {
+        if (!armed[id]) {
+            cout << "> Broadcast skipped, node " << id << " could not take part" << endl;
+            return;
+        }
+    }
+
+    double setup_us = elapsed_us(start);
+    bcast_run.start = std::chrono::steady_clock::now();
+    bcast_run.active = true;
+    if (chain) {
+        post_bcast_chunks(bcast_run.members[0]);
+    } else {
+        for (uint32_t id : bcast_run.members)
+            post_bcast_chunks(id);
+    }
+
+    while (bcast_run.done < members && elapsed_us(bcast_run.start) < BCAST_TIMEOUT_MS * 1000.0)
+        poll_one_completion();
+    bcast_run.active = false;
+
+    double total_us = elapsed_us(bcast_run.start);
+    cout << "> Broadcast of " << options.bcast_bytes << " bytes (" << (chain ? "chain" : "direct") << ", "
+         << bcast_run.chunks << " chunks) to " << members << " nodes: " << bcast_run.done << " done in "
+         << total_us << " us, " << options.bcast_bytes * 8.0 / total_us / 1000.0 << " Gbit/s per node, setup "
+         << setup_us << " us" << (bcast_run.mismatches ? ", CHECKSUM MISMATCHES" : "") << endl;
+}
 
-            memset(data_send, 0, sizeof(data_send));
-
-            // initialise sg_send with the send mr address, size and lkey
-            memset(&sg_recv, 0, sizeof(sg_recv));
-            sg_recv.addr   = (uintptr_t)send_mr->addr;
-            sg_recv.length = sizeof(data_send);
-            sg_recv.lkey   = send_mr->lkey;
-
-            // create a receive work request
-            memset(&wr_recv, 0, sizeof(wr_recv));
-            wr_recv.wr_id      = 0;
-            wr_recv.sg_list    = &sg_recv;
-            wr_recv.num_sge    = 1;
-
-            cout << "Post work request to receive data" << endl;
-            ret = ibv_post_recv(send_qp, &wr_recv, &bad_wr_recv);
-            if (ret != 0)
-            {
-                cerr << "ibv_post_recv failed: " << strerror(ret) << endl;
-                exit(1);
+// Hand the pass that just ended to the upstream thread, nothing is published
+// for a pass without any data.
+void publish_round() {
+    if (options.upstream_ip.empty())
+        return;
+
+    std::lock_guard<std::mutex> lock(aggregate.mutex);
+    if (reducer.complete() && !round_corrupt) {
+        const char *result = (const char *)reducer.result();
+        aggregate.values.assign(result, result + (size_t)reducer.elements() * reduce_dtype_size(reducer.result_dtype()));
+        aggregate.elements = reducer.elements();
+        aggregate.dtype = reducer.result_dtype();
+        aggregate.op = reducer.result_op();
+        aggregate.text.clear();
+    } else if (!round_text.empty()) {
+        aggregate.elements = 0;
+        aggregate.text = round_text;
+    } else {
+        return;
+    }
+    aggregate.round++;
+}
+
+void rdma_communication() {
+    cout << "START RDMA COMMUNICATION" << endl;
+    if (options.perf_counters)
+        profiler.open();
+    while(true) {
+        uint32_t count = nodes.size();
+        if (count == 0) {
+            sleep(1);
+            continue;
+        }
+
+        reducer.begin_round(count);
+        round_corrupt = false;
+        round_start = std::chrono::steady_clock::now();
+        round_text.clear();
+
+        sync_clocks(count);
+        scheduler.begin_pass(count, pass_ns());
+        while (!scheduler.pass_done()) {
+            // restarted nodes are re-attached before anyone gets unlocked
+            process_reconnects();
+
+            uint32_t id = scheduler.next_grant(pass_ns(), admit_node);
+            if (id == SCHED_NO_NODE) {
+                serve_once(scheduler.waiting());
+                continue;
             }
 
-            cout << "Pooling for data..." << endl;
-            ret = 0;
-            int number_of_retries = 0;
-            do
-            {
-                ret = ibv_poll_cq(send_cq, 1, &wc);
-                number_of_retries++;
-            } while (ret == 0 && number_of_retries < 100);
-
-            if (wc.status != ibv_wc_status::IBV_WC_SUCCESS)
-            {
-                cerr << "ibv_poll_cq failed: " << ibv_wc_status_str(wc.status) << endl;
-                exit(1);
+            if (trace.enabled())
+                trace.grant(id);
+            if (options.clock_sync)
+                clocks.grant(id, clock_ns());
+            int socket = nodes.socket_fd[id];
+            cout << "> Unlock node " << id << " (socket " << socket << ") to send data" << endl;
+            const char* unlockMessage = "[SERVER] UNLOCK";
+            if (send_control(socket, unlockMessage) == -1) {
+                perror("Error while sending data");
+            } else {
+                std::cout << "Unlock successfully sent to client (Socket " << socket << "): " << unlockMessage << std::endl;
             }
 
-            cout << "Done receive data '" << data_send << "'" << endl; 
+            // Pool data from RDMA for a small period of time
+            cout << "Pool for data from queue for node " << id << endl;
+            bool delivered = wait_for_data(id) == 0;
+            if (!delivered && nodes.state[id] == NODE_NEEDS_RECOVERY)
+                recover_node(id);
+            // whatever is still missing is not coming anymore
+            reorder.flush(id);
+            scheduler.end_turn(pass_ns(), delivered);
+
+            cout << "Sleep " << options.pace_ms << " ms" << endl;
+        }
+        // the last node gets its pace too, before the pass is summed up
+        while (pass_ns() < scheduler.ready_at())
+            serve_once(false);
+
+        if (reducer.elements() != 0 && !reducer.complete())
+            cout << "> Reduce round incomplete, not every node contributed" << endl;
+        collect_consumer_text();
+        publish_round();
+
+        query_nodes(count);
+        report_counters();
+        report_ingest();
+        report_handoff();
+        report_sequencing();
+        report_flows();
+        report_transports();
+        report_trace();
+        report_clocks(count);
+        report_crc(count);
+        report_codec();
+        report_records();
+        profiler.report(cout, "RDMA thread");
+        if (options.bcast_bytes != 0)
+            broadcast_blob(count);
+    }
+}
+
+// Intermediate master: act as a node of the master one level up and answer
+// each of its UNLOCKs with the aggregate of our last complete pass.
+void upstream_communication(struct ibv_context *context) {
+    upstream_link link;
+    if (link.open(context, pd, options.node_id) != 0 ||
+        link.connect_to(options.upstream_ip, options.upstream_port) != 0) {
+        cerr << "Cannot reach upstream master " << options.upstream_ip << ":" << options.upstream_port << endl;
+        exit(1);
+    }
 
-            cout << "Sleep few seconds" << endl;
-            sleep(5);
+    // registered once and grown when a bigger vector comes along
+    vector<char> buf(RECV_SLOT_SIZE);
+    struct ibv_mr *mr = ibv_reg_mr(pd, buf.data(), buf.size(), IBV_ACCESS_LOCAL_WRITE);
+    uint64_t forwarded = 0;
+
+    while (mr) {
+        link_event event = link.poll();
+        if (event == LINK_CLOSED)
+            break;
+        if (event != LINK_UNLOCK)
+            continue;
+
+        std::unique_lock<std::mutex> lock(aggregate.mutex);
+        if (aggregate.round == forwarded)
+            cout << "> No new round to forward upstream, repeating round " << forwarded << endl;
+
+        if (aggregate.elements != 0) {
+            uint32_t chunks = reduce_chunk_count(aggregate.dtype, aggregate.elements, REDUCE_CHUNK_SIZE);
+            if ((size_t)chunks * REDUCE_CHUNK_SIZE > buf.size()) {
+                ibv_dereg_mr(mr);
+                buf.resize((size_t)chunks * REDUCE_CHUNK_SIZE);
+                mr = ibv_reg_mr(pd, buf.data(), buf.size(), IBV_ACCESS_LOCAL_WRITE);
+                if (!mr) {
+                    cerr << "ibv_reg_mr - upstream - failed: " << strerror(errno) << endl;
+                    break;
+                }
+            }
+            layout_reduce_chunks(buf.data(), REDUCE_CHUNK_SIZE, aggregate.elements, aggregate.dtype, aggregate.op, aggregate.values.data());
+            forwarded = aggregate.round;
+            lock.unlock();
+
+            if (link.send_reduce_chunks(mr, buf.data(), chunks) == 0)
+                cout << "> Forwarded reduce round " << forwarded << " upstream in " << chunks << " chunks" << endl;
+            continue;
         }
+
+        // the text has to fit into a receive slot one level up, behind the sequence header
+        uint32_t max_len = RECV_SLOT_SIZE - sizeof(seq_header_s) - 1;
+        uint32_t len = aggregate.text.size() < max_len ? aggregate.text.size() : max_len;
+        memcpy(buf.data(), aggregate.text.data(), len);
+        buf[len++] = '\0';
+        forwarded = aggregate.round;
+        lock.unlock();
+
+        if (link.send_message(mr, buf.data(), len) == 0)
+            cout << "> Forwarded round " << forwarded << " upstream (" << len << " bytes)" << endl;
     }
+
+    if (mr)
+        ibv_dereg_mr(mr);
+    cerr << "Lost the upstream master" << endl;
+    exit(1);
 }
 
-int main() {
+// A master is the root of the tree unless --upstream_ip is given. Several
+// masters on one host need distinct --port and --node_id values.
+void init_input_params_from_argc(int argc, char *argv[]) {
+	boost::program_options::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "show possible options")
+		("port", boost::program_options::value<int>()->default_value(PORT), "control port nodes connect to")
+		("pace_ms", boost::program_options::value<uint32_t>()->default_value(5000), "pause after unlocking each node")
+		("fan_out", boost::program_options::value<uint32_t>()->default_value(0), "maximum number of children, 0 for no limit")
+		("upstream_ip", boost::program_options::value<string>(), "run as intermediate master below the master at this address")
+		("upstream_port", boost::program_options::value<int>()->default_value(PORT), "control port of the upstream master")
+		("node_id", boost::program_options::value<uint32_t>(), "node identifier towards the upstream master, defaults to a hash of hostname and port")
+		("bcast_bytes", boost::program_options::value<uint64_t>()->default_value(0), "broadcast a blob of this size to every node after each pass")
+		("bcast_chunk", boost::program_options::value<uint32_t>()->default_value(BCAST_DEFAULT_CHUNK), "broadcast chunk size in bytes")
+		("bcast_mode", boost::program_options::value<string>()->default_value("direct"), "direct: master writes to every node, chain: nodes forward to the next one")
+		("kv_buckets", boost::program_options::value<uint32_t>()->default_value(KV_DEFAULT_BUCKETS), "slots of the key-value store the nodes read one-sided")
+		("file_dir", boost::program_options::value<string>()->default_value("received"), "directory for files streamed by the nodes")
+		("consumers", boost::program_options::value<uint32_t>()->default_value(0), "threads that process the text messages, 0 to process them on the polling thread")
+		("consumer_depth", boost::program_options::value<uint32_t>()->default_value(64), "messages queued per consumer thread")
+		("ingest_dir", boost::program_options::value<string>(), "write every incast message to a segmented log in this directory")
+		("ingest_segment_mb", boost::program_options::value<uint32_t>()->default_value(64), "size of an ingest log segment")
+		("ingest_sync_records", boost::program_options::value<uint32_t>()->default_value(64), "fdatasync the log after this many records")
+		("ingest_sync_us", boost::program_options::value<uint32_t>()->default_value(1000), "fdatasync the log after this many microseconds")
+		("trace_file", boost::program_options::value<string>(), "record node, flow, size, grant and completion time of every message here, see replay_trace.exe")
+		("clock_sync", "estimate the nodes' clock offsets and split each turn's latency into node and fabric")
+		("perf_counters", "count cycles, instructions, cache and branch misses of posts, polls and dispatch, printed per message with each pass")
+	;
+
+	boost::program_options::variables_map vm;
+	boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+	boost::program_options::notify(vm);
+
+	if (vm.count("help"))
+	{
+		cout << desc << endl;
+		exit(0);
+	}
+
+	options.port = vm["port"].as<int>();
+	options.pace_ms = vm["pace_ms"].as<uint32_t>();
+	options.fan_out = vm["fan_out"].as<uint32_t>();
+	options.upstream_ip = vm.count("upstream_ip") ? vm["upstream_ip"].as<string>() : "";
+	options.upstream_port = vm["upstream_port"].as<int>();
+	options.bcast_bytes = vm["bcast_bytes"].as<uint64_t>();
+	options.bcast_chunk = vm["bcast_chunk"].as<uint32_t>();
+	options.bcast_mode = vm["bcast_mode"].as<string>() == "chain" ? BCAST_CHAIN : BCAST_DIRECT;
+	options.kv_buckets = vm["kv_buckets"].as<uint32_t>();
+	options.file_dir = vm["file_dir"].as<string>();
+	options.consumers = vm["consumers"].as<uint32_t>();
+	options.consumer_depth = vm["consumer_depth"].as<uint32_t>();
+	if (options.consumers != 0 && options.consumer_depth < RECV_SLOTS)
+	{
+		cerr << "--consumer_depth must be at least " << RECV_SLOTS << endl;
+		exit(1);
+	}
+	options.ingest_dir = vm.count("ingest_dir") ? vm["ingest_dir"].as<string>() : "";
+	options.ingest_segment_bytes = (uint64_t)vm["ingest_segment_mb"].as<uint32_t>() << 20;
+	options.ingest_sync_records = vm["ingest_sync_records"].as<uint32_t>();
+	options.ingest_sync_us = vm["ingest_sync_us"].as<uint32_t>();
+	options.trace_file = vm.count("trace_file") ? vm["trace_file"].as<string>() : "";
+	options.clock_sync = vm.count("clock_sync") != 0;
+	options.perf_counters = vm.count("perf_counters") != 0;
+	if (options.ingest_segment_bytes < RECV_SLOT_STRIDE)
+	{
+		cerr << "--ingest_segment_mb must not be 0" << endl;
+		exit(1);
+	}
+	if (options.kv_buckets == 0)
+	{
+		cerr << "--kv_buckets must not be 0" << endl;
+		exit(1);
+	}
+	if (options.bcast_chunk == 0 || bcast_chunks(options.bcast_bytes, options.bcast_chunk) > ~BCAST_IMM_MASK)
+	{
+		cerr << "--bcast_chunk too small for --bcast_bytes" << endl;
+		exit(1);
+	}
+
+	if (vm.count("node_id"))
+	{
+		options.node_id = vm["node_id"].as<uint32_t>();
+	}
+	else
+	{
+		char hostname[256] = {0};
+		gethostname(hostname, sizeof(hostname) - 1);
+		options.node_id = (uint32_t)std::hash<string>{}(string(hostname) + ":" + to_string(options.port));
+	}
+}
+
+int main(int argc, char *argv[]) {
+    init_input_params_from_argc(argc, argv);
 
     // ==== RDMA variables ====
     struct ibv_device** dev_list = get_rxe_device();
 	struct ibv_context *context = ibv_open_device(dev_list[0]);
-	struct ibv_pd *pd = ibv_alloc_pd(context);
-    struct ibv_qp_init_attr qp_init_attr;
-    int ret;
-    char data_send[100];
+	pd = ibv_alloc_pd(context);
 
     set_gid(context, port_attr, &local_rdma, gidIndex);
 	
@@ -295,44 +1856,73 @@ int main() {
 		exit(1);
 	}
 
-	send_cq = ibv_create_cq(context, 0x10, nullptr, nullptr, 0);
+	// one CQ shared by all per-node QPs, completions are routed by the node ID in wr_id
+	send_cq = ibv_create_cq(context, CQ_SIZE, nullptr, nullptr, 0);
 	if (!send_cq)
 	{
 		cerr << "ibv_create_cq - send - failed: " << strerror(errno) << endl;
 		exit(1);
 	}
 
-	send_qp = create_qp_for_send(qp_init_attr, pd, send_cq);
-	if (!send_qp)
-	{
-		cerr << "ibv_create_qp failed: " << strerror(errno) << endl;
+	if (kv.init(pd, options.kv_buckets) != 0 || counters.init(pd) != 0 || files.init(pd, options.file_dir) != 0)
 		exit(1);
+
+	if (!options.ingest_dir.empty())
+	{
+		if (ingest.init(options.ingest_dir, options.ingest_segment_bytes, options.ingest_sync_records,
+		                options.ingest_sync_us, MAX_NODES) != 0)
+			exit(1);
+		ingest.on_written = ingest_written;
 	}
 
+	if (!options.trace_file.empty() && trace.open(options.trace_file, MAX_NODES) != 0)
+		exit(1);
+
+	// nodes without RoCE are turned away if the kernel has no io_uring
+	tcp_ready = tcp_nodes.init(MAX_NODES) == 0;
+	if (!tcp_ready)
+		cerr << "io_uring unavailable, TCP nodes will be rejected" << endl;
+
+	sched_config_s sched_config;
+	sched_config.window = 1;
+	sched_config.credits = RECV_SLOTS;
+	sched_config.pace_ns = (uint64_t)options.pace_ms * 1000000;
+	scheduler.init(sched_config);
+
+	reorder.init(MAX_NODES);
+	clocks.init(MAX_NODES);
+	reorder.on_deliver = deliver_message;
+	reorder.on_drop = drop_message;
 
-    set_attr_for_init_state(qp_attr);
-	ret = ibv_modify_qp(send_qp, &qp_attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
-	if (ret != 0)
+	if (options.consumers != 0)
 	{
-		cerr << "ibv_modify_qp - INIT - failed: " << strerror(ret) << endl;
-		exit(1);
+		consumer_text.resize(options.consumers);
+		handoff.start(options.consumers, options.consumer_depth, consume_message);
 	}
 
-    send_mr = ibv_reg_mr(pd, data_send, sizeof(data_send), IBV_ACCESS_LOCAL_WRITE | 
-	             IBV_ACCESS_REMOTE_WRITE | 
-	             IBV_ACCESS_REMOTE_READ);
-	if (!send_mr)
+	if (options.bcast_bytes != 0)
 	{
-		cerr << "ibv_reg_mr failed: " << strerror(errno) << endl;
-		exit(1);
+		bcast_blob = new char[options.bcast_bytes];
+		for (uint64_t i = 0; i < options.bcast_bytes; i++)
+			bcast_blob[i] = (char)(i * 131 + 7);
+		bcast_sum = bcast_checksum(bcast_blob, options.bcast_bytes);
+		bcast_mr = ibv_reg_mr(pd, bcast_blob, options.bcast_bytes, IBV_ACCESS_LOCAL_WRITE);
+		if (!bcast_mr)
+		{
+			cerr << "ibv_reg_mr - broadcast - failed: " << strerror(errno) << endl;
+			exit(1);
+		}
 	}
 
-	local_rdma.send_qp_num = send_qp->qp_num;
-
     std::thread serverThread(acceptConnections);
 
     std::thread rdma_communication_thread(rdma_communication);
 
+    if (!options.upstream_ip.empty()) {
+        std::thread upstream_thread(upstream_communication, context);
+        upstream_thread.detach();
+    }
+
     serverThread.join();
     rdma_communication_thread.join();
 
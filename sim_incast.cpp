@@ -0,0 +1,503 @@
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cmath>
+
+#include <boost/program_options.hpp>
+#include "scheduler.h"
+
+using namespace std;
+
+// Discrete-event model of an incast, scheduled by the master's own
+// incast_scheduler (scheduler.h). Everything else is simulated:
+//
+// - every node sits behind its own link of --node_gbps into one switch, the
+//   switch drains toward the master at --master_gbps through a buffer of
+//   --buffer_kb. The fabric is lossless: a node whose message does not fit
+//   into the buffer is paused (PFC) until it does.
+// - a message travels store-and-forward and whole, --latency_ns is added
+//   between switch and master and again for the UNLOCK and the credits on
+//   their way back to the node.
+// - a node may send as many messages as it has credits (receive slots
+//   posted for it). The master frees a slot after --process_ns of work, on
+//   the polling thread or, with --consumers, on the consumer that owns the
+//   node, and the credit returns to the node.
+// - a turn ends with the node's first message at the master, like
+//   wait_for_data(), or after --turn_timeout_us.
+//
+// Every kind of event comes after a fixed delay or from a single server
+// (the master link, the poller, one consumer), so each kind is scheduled in
+// time order on its own. The event queue is one FIFO lane per kind and the
+// next event the earliest lane head, no heap on the way.
+//
+// usage: sim_incast.exe --nodes=5000 --window=1 ... (--help for the list)
+
+typedef struct sim_options_ {
+    uint32_t nodes;
+    uint32_t passes;
+    uint32_t messages;
+    uint32_t message_bytes;
+    // per-node message count drawn from messages * [1 - spread, 1 + spread]
+    double volume_spread;
+    double node_gbps;
+    double master_gbps;
+    uint64_t latency_ns;
+    uint64_t buffer_bytes;
+    uint64_t process_ns;
+    uint32_t consumers;
+    uint32_t consumer_depth;
+    uint64_t turn_timeout_ns;
+    sched_config_s sched;
+} sim_options_s;
+
+enum sim_event_type : uint32_t {
+    EV_GRANT = 0,
+    EV_UNLOCK,
+    EV_NODE_TX_DONE,
+    EV_EGRESS_DONE,
+    EV_DELIVER,
+    EV_PROCESSED,
+    EV_CREDIT,
+    EV_TIMEOUT,
+    // EV_PROCESSED of consumer c goes to lane EV_LANES + c
+    EV_LANES,
+};
+
+typedef struct sim_event_ {
+    uint64_t time;
+    uint32_t type;
+    uint32_t node;
+    // EV_TIMEOUT: the turn it belongs to
+    uint32_t turn;
+} sim_event_s;
+
+typedef struct sim_node_ {
+    uint32_t credits;
+    // messages of the current turn not yet sent, and not yet at the master
+    uint32_t to_send;
+    uint32_t in_transit;
+    uint32_t turn;
+    bool turn_open;
+    bool unlocked;
+    bool tx_busy;
+    // the message on the wire waits for buffer space
+    bool paused;
+    uint64_t grant_time;
+    // the message on the wire started out then
+    uint64_t tx_start;
+    uint64_t pause_start;
+} sim_node_s;
+
+typedef struct sim_consumer_ {
+    uint64_t busy_until;
+    // messages dispatched and not yet processed
+    uint32_t outstanding;
+} sim_consumer_s;
+
+// one message in the switch buffer
+typedef struct sim_packet_ {
+    uint32_t node;
+    uint64_t sent;
+} sim_packet_s;
+
+const uint32_t OCCUPANCY_BUCKETS = 20;
+
+struct sim_stats_s {
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t events;
+    uint64_t pause_ns;
+    uint64_t egress_busy_ns;
+    uint64_t max_occupancy;
+    // time-weighted occupancy: sum of bytes * ns, and ns spent per bucket
+    double occupancy_integral;
+    uint64_t occupancy_ns[OCCUPANCY_BUCKETS + 1];
+    vector<double> turn_us;
+    vector<double> message_us;
+    vector<double> pass_us;
+};
+
+class incast_sim {
+public:
+    incast_sim(const sim_options_s &o)
+        : opt(o), now(0), occupancy(0), occupancy_since(0), in_flight(0), held(0), egress_busy(false), master_busy_until(0),
+          grant_pending(false), rng(42) {
+        nodes.resize(opt.nodes);
+        volumes.resize(opt.nodes);
+        consumers.resize(max<uint32_t>(opt.consumers, 1));
+        lanes.resize(EV_LANES + consumers.size());
+        memset(stats.occupancy_ns, 0, sizeof(stats.occupancy_ns));
+        stats.messages = stats.bytes = stats.events = stats.pause_ns = stats.egress_busy_ns = stats.max_occupancy = 0;
+        stats.occupancy_integral = 0;
+        scheduler.init(opt.sched);
+        node_tx_ns = serialize_ns(opt.message_bytes, opt.node_gbps);
+        egress_ns = serialize_ns(opt.message_bytes, opt.master_gbps);
+        for (sim_node_s &n : nodes) {
+            memset(&n, 0, sizeof(n));
+            n.credits = opt.sched.credits;
+        }
+
+        uniform_real_distribution<double> spread(1.0 - opt.volume_spread, 1.0 + opt.volume_spread);
+        for (uint32_t &v : volumes)
+            v = (uint32_t)(opt.messages * spread(rng) + 0.5);
+    }
+
+    void run() {
+        for (uint32_t pass = 0; pass < opt.passes; pass++) {
+            uint64_t start = now;
+            scheduler.begin_pass(opt.nodes, now);
+            try_grants();
+            // a pass is over once every turn ended and every message was processed
+            while (!(scheduler.pass_done() && idle()) && step())
+                ;
+            stats.pass_us.push_back((now - start) / 1000.0);
+        }
+        account_occupancy();
+    }
+
+    sim_stats_s &result() { return stats; }
+    uint64_t elapsed_ns() const { return now; }
+    incast_scheduler scheduler;
+
+private:
+    static uint64_t serialize_ns(uint64_t bytes, double gbps) {
+        return (uint64_t)(bytes * 8 / gbps + 0.5);
+    }
+
+    void push(uint64_t time, uint32_t type, uint32_t node, uint32_t turn = 0, uint32_t lane = EV_LANES) {
+        lanes[lane == EV_LANES ? type : lane].push_back({ time, type, node, turn });
+    }
+
+    bool idle() const {
+        return in_flight == 0 && held == 0;
+    }
+
+    // false once nothing is left to happen
+    bool step() {
+        deque<sim_event_s> *first = nullptr;
+        for (deque<sim_event_s> &lane : lanes)
+            if (!lane.empty() && (!first || lane.front().time < first->front().time))
+                first = &lane;
+        if (!first)
+            return false;
+        sim_event_s ev = first->front();
+        first->pop_front();
+        now = ev.time;
+        stats.events++;
+        switch (ev.type) {
+        case EV_GRANT:
+            grant_pending = false;
+            try_grants();
+            break;
+        case EV_UNLOCK:
+            nodes[ev.node].unlocked = true;
+            try_send(ev.node);
+            break;
+        case EV_NODE_TX_DONE:
+            node_tx_done(ev.node);
+            break;
+        case EV_EGRESS_DONE:
+            egress_done();
+            break;
+        case EV_DELIVER:
+            deliver(ev.node);
+            break;
+        case EV_PROCESSED:
+            processed(ev.node);
+            break;
+        case EV_CREDIT:
+            nodes[ev.node].credits++;
+            try_send(ev.node);
+            break;
+        case EV_TIMEOUT:
+            if (nodes[ev.node].turn_open && nodes[ev.node].turn == ev.turn)
+                end_turn(ev.node, false);
+            break;
+        }
+        return true;
+    }
+
+    // ==== master ====
+
+    sched_admission admit(uint32_t id) {
+        if (opt.consumers == 0)
+            return SCHED_ADMIT;
+        const sim_consumer_s &c = consumers[id % opt.consumers];
+        return scheduler.has_room(opt.consumer_depth - c.outstanding) ? SCHED_ADMIT : SCHED_WAIT;
+    }
+
+    void try_grants() {
+        uint32_t id;
+        while ((id = scheduler.next_grant(now, [this](uint32_t node) { return admit(node); })) != SCHED_NO_NODE) {
+            sim_node_s &n = nodes[id];
+            n.turn++;
+            n.turn_open = true;
+            n.grant_time = now;
+            n.to_send = volumes[id];
+            push(now + opt.latency_ns, EV_UNLOCK, id);
+            push(now + opt.turn_timeout_ns, EV_TIMEOUT, id, n.turn);
+        }
+        // a waiting grant is retried when a consumer frees an entry
+        if (!scheduler.waiting() && !scheduler.pass_done() && now < scheduler.ready_at() && !grant_pending) {
+            grant_pending = true;
+            push(scheduler.ready_at(), EV_GRANT, 0);
+        }
+    }
+
+    void end_turn(uint32_t id, bool delivered) {
+        nodes[id].turn_open = false;
+        scheduler.end_turn(now, delivered);
+        try_grants();
+    }
+
+    void deliver(uint32_t id) {
+        sim_node_s &n = nodes[id];
+        n.in_transit--;
+        in_flight--;
+        stats.messages++;
+        stats.bytes += opt.message_bytes;
+        if (n.turn_open) {
+            // the master's wait_for_data() returns with the first message
+            end_turn(id, true);
+        }
+        if (n.to_send == 0 && n.in_transit == 0)
+            stats.turn_us.push_back((now - n.grant_time) / 1000.0);
+
+        // the slot is held until the message was processed
+        held++;
+        if (opt.consumers == 0) {
+            master_busy_until = max(master_busy_until, now) + opt.process_ns;
+            push(master_busy_until, EV_PROCESSED, id);
+        } else {
+            sim_consumer_s &c = consumers[id % opt.consumers];
+            c.outstanding++;
+            c.busy_until = max(c.busy_until, now) + opt.process_ns;
+            push(c.busy_until, EV_PROCESSED, id, 0, EV_LANES + id % opt.consumers);
+        }
+    }
+
+    void processed(uint32_t id) {
+        held--;
+        push(now + opt.latency_ns, EV_CREDIT, id);
+        if (opt.consumers != 0) {
+            consumers[id % opt.consumers].outstanding--;
+            if (scheduler.waiting())
+                try_grants();
+        }
+    }
+
+    // ==== fabric ====
+
+    void try_send(uint32_t id) {
+        sim_node_s &n = nodes[id];
+        if (!n.unlocked || n.tx_busy || n.paused || n.to_send == 0 || n.credits == 0)
+            return;
+        n.credits--;
+        n.to_send--;
+        n.in_transit++;
+        in_flight++;
+        n.tx_busy = true;
+        n.tx_start = now;
+        push(now + node_tx_ns, EV_NODE_TX_DONE, id);
+    }
+
+    void node_tx_done(uint32_t id) {
+        sim_node_s &n = nodes[id];
+        if (occupancy + opt.message_bytes > opt.buffer_bytes) {
+            n.paused = true;
+            n.pause_start = now;
+            paused.push_back(id);
+            return;
+        }
+        enqueue(id);
+    }
+
+    void enqueue(uint32_t id) {
+        sim_node_s &n = nodes[id];
+        n.tx_busy = false;
+        set_occupancy(occupancy + opt.message_bytes);
+        switch_queue.push_back({ id, n.tx_start });
+        if (!egress_busy)
+            start_egress();
+        if (n.to_send == 0)
+            n.unlocked = false;
+        try_send(id);
+    }
+
+    void start_egress() {
+        egress_busy = true;
+        stats.egress_busy_ns += egress_ns;
+        push(now + egress_ns, EV_EGRESS_DONE, switch_queue.front().node);
+    }
+
+    void egress_done() {
+        sim_packet_s pkt = switch_queue.front();
+        switch_queue.pop_front();
+        set_occupancy(occupancy - opt.message_bytes);
+        stats.message_us.push_back((now + opt.latency_ns - pkt.sent) / 1000.0);
+        push(now + opt.latency_ns, EV_DELIVER, pkt.node);
+        egress_busy = false;
+        if (!switch_queue.empty())
+            start_egress();
+
+        // paused senders resume in the order they were paused
+        while (!paused.empty() && occupancy + opt.message_bytes <= opt.buffer_bytes) {
+            uint32_t id = paused.front();
+            paused.pop_front();
+            nodes[id].paused = false;
+            stats.pause_ns += now - nodes[id].pause_start;
+            enqueue(id);
+        }
+    }
+
+    void set_occupancy(uint64_t bytes) {
+        account_occupancy();
+        occupancy = bytes;
+        stats.max_occupancy = max(stats.max_occupancy, occupancy);
+    }
+
+    void account_occupancy() {
+        uint64_t dt = now - occupancy_since;
+        stats.occupancy_integral += (double)occupancy * dt;
+        stats.occupancy_ns[occupancy * OCCUPANCY_BUCKETS / max<uint64_t>(opt.buffer_bytes, 1)] += dt;
+        occupancy_since = now;
+    }
+
+    sim_options_s opt;
+    uint64_t now;
+    uint64_t node_tx_ns;
+    uint64_t egress_ns;
+    vector<sim_node_s> nodes;
+    vector<uint32_t> volumes;
+    vector<sim_consumer_s> consumers;
+    vector<deque<sim_event_s>> lanes;
+    deque<sim_packet_s> switch_queue;
+    deque<uint32_t> paused;
+    uint64_t occupancy;
+    uint64_t occupancy_since;
+    // messages sent and not yet at the master
+    uint64_t in_flight;
+    // at the master and not yet processed
+    uint64_t held;
+    bool egress_busy;
+    uint64_t master_busy_until;
+    bool grant_pending;
+    mt19937_64 rng;
+    sim_stats_s stats;
+};
+
+// ==== report ====
+
+void print_distribution(const char *label, vector<double> &values) {
+    if (values.empty())
+        return;
+    sort(values.begin(), values.end());
+    auto at = [&values](double q) { return values[(size_t)(q * (values.size() - 1))]; };
+    cout << "  " << label << " us: p50 " << at(0.5) << ", p90 " << at(0.9) << ", p99 " << at(0.99)
+         << ", max " << values.back() << " (" << values.size() << ")" << endl;
+}
+
+void report(incast_sim &sim, const sim_options_s &opt, double wall_us) {
+    sim_stats_s &st = sim.result();
+    double sim_us = sim.elapsed_ns() / 1000.0;
+    const sched_stats_s &sched = sim.scheduler.stats;
+
+    cout << "Simulated " << opt.nodes << " nodes x " << opt.passes << " passes, window " << opt.sched.window << ", "
+         << opt.sched.credits << " credits, pace " << opt.sched.pace_ns / 1000 << " us" << endl;
+    cout << "  " << st.messages << " messages, " << st.bytes << " bytes in " << sim_us << " us: "
+         << (sim_us > 0 ? st.bytes * 8 / (sim_us * 1000.0) : 0) << " Gbit/s, master link busy "
+         << (sim_us > 0 ? 100.0 * st.egress_busy_ns / (sim_us * 1000.0) : 0) << "%" << endl;
+    cout << "  scheduler: " << sched.grants << " grants, " << sched.stalls << " held back by consumers, "
+         << sched.timeouts << " timeouts" << endl;
+    cout << "  buffer: max " << st.max_occupancy << " of " << opt.buffer_bytes << " bytes, mean "
+         << (sim_us > 0 ? st.occupancy_integral / (sim_us * 1000.0) : 0) << ", senders paused " << st.pause_ns / 1000.0 << " us in total" << endl;
+
+    cout << "  buffer time by fill level:";
+    for (uint32_t b = 0; b <= OCCUPANCY_BUCKETS; b++)
+        if (st.occupancy_ns[b] * 1000 >= sim.elapsed_ns())
+            cout << " " << b * 100 / OCCUPANCY_BUCKETS << "%:" << round(1000.0 * st.occupancy_ns[b] / sim.elapsed_ns()) / 10 << "%";
+    cout << endl;
+
+    print_distribution("turn (grant to last message)", st.turn_us);
+    print_distribution("message (sent to master)", st.message_us);
+    print_distribution("pass", st.pass_us);
+    cout << "  " << st.events << " events in " << wall_us / 1000.0 << " ms, " << (wall_us > 0 ? sim_us / wall_us : 0)
+         << "x real time" << endl;
+}
+
+void init_input_params_from_argc(int argc, char *argv[], sim_options_s &opt) {
+	boost::program_options::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "show possible options")
+		("nodes", boost::program_options::value<uint32_t>()->default_value(5000), "nodes in the incast")
+		("passes", boost::program_options::value<uint32_t>()->default_value(1), "passes over all nodes")
+		("messages", boost::program_options::value<uint32_t>()->default_value(INCAST_RECV_SLOTS), "messages a node sends per turn")
+		("message_bytes", boost::program_options::value<uint32_t>()->default_value(1024), "size of a message, the master takes up to 1024 bytes")
+		("volume_spread", boost::program_options::value<double>()->default_value(0), "per-node messages vary by up to this fraction")
+		("node_gbps", boost::program_options::value<double>()->default_value(25), "link bandwidth of a node")
+		("master_gbps", boost::program_options::value<double>()->default_value(100), "link bandwidth of the master")
+		("latency_ns", boost::program_options::value<uint64_t>()->default_value(2000), "one-way latency between switch and master, and back to the nodes")
+		("buffer_kb", boost::program_options::value<uint64_t>()->default_value(1024), "switch buffer in front of the master's port")
+		("process_ns", boost::program_options::value<uint64_t>()->default_value(500), "master work per message before its slot is reposted")
+		("consumers", boost::program_options::value<uint32_t>()->default_value(0), "consumer threads, 0 processes on the polling thread")
+		("consumer_depth", boost::program_options::value<uint32_t>()->default_value(64), "ring entries per consumer")
+		("turn_timeout_us", boost::program_options::value<uint64_t>()->default_value(1000000), "a turn without a message ends after this")
+		("window", boost::program_options::value<uint32_t>()->default_value(1), "turns open at the same time, the master runs 1")
+		("credits", boost::program_options::value<uint32_t>()->default_value(INCAST_RECV_SLOTS), "receive slots per node")
+		("pace_us", boost::program_options::value<uint64_t>()->default_value(0), "pause after each turn")
+	;
+
+	boost::program_options::variables_map vm;
+	boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+	boost::program_options::notify(vm);
+
+	if (vm.count("help"))
+	{
+		cout << desc << endl;
+		exit(0);
+	}
+
+	opt.nodes = vm["nodes"].as<uint32_t>();
+	opt.passes = vm["passes"].as<uint32_t>();
+	opt.messages = vm["messages"].as<uint32_t>();
+	opt.message_bytes = vm["message_bytes"].as<uint32_t>();
+	opt.volume_spread = vm["volume_spread"].as<double>();
+	opt.node_gbps = vm["node_gbps"].as<double>();
+	opt.master_gbps = vm["master_gbps"].as<double>();
+	opt.latency_ns = vm["latency_ns"].as<uint64_t>();
+	opt.buffer_bytes = vm["buffer_kb"].as<uint64_t>() * 1024;
+	opt.process_ns = vm["process_ns"].as<uint64_t>();
+	opt.consumers = vm["consumers"].as<uint32_t>();
+	opt.consumer_depth = vm["consumer_depth"].as<uint32_t>();
+	opt.turn_timeout_ns = vm["turn_timeout_us"].as<uint64_t>() * 1000;
+	opt.sched.window = vm["window"].as<uint32_t>();
+	opt.sched.credits = vm["credits"].as<uint32_t>();
+	opt.sched.pace_ns = vm["pace_us"].as<uint64_t>() * 1000;
+
+	if (opt.nodes == 0 || opt.message_bytes == 0 || opt.message_bytes > opt.buffer_bytes || opt.sched.credits == 0 ||
+	    opt.node_gbps <= 0 || opt.master_gbps <= 0 || opt.volume_spread < 0 || opt.volume_spread > 1)
+	{
+		cerr << "need nodes, credits and bandwidths > 0, a message that fits into the buffer and a spread in [0, 1]" << endl;
+		exit(1);
+	}
+	if (opt.consumers != 0 && opt.consumer_depth < opt.sched.credits)
+	{
+		cerr << "--consumer_depth must be at least --credits" << endl;
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[]) {
+    sim_options_s opt;
+    init_input_params_from_argc(argc, argv, opt);
+
+    incast_sim sim(opt);
+    auto start = chrono::steady_clock::now();
+    sim.run();
+    report(sim, opt, elapsed_us(start));
+    return 0;
+}
@@ -0,0 +1,368 @@
+#pragma once
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "io_ring.h"
+#include "tcp_link.h"
+
+// Master side of the TCP nodes (tcp_link.h). Every node's socket has one
+// multishot receive armed on an io_uring, the kernel fills buffers from a
+// group of provided buffers shared by all TCP nodes. Frames are cut out of
+// those buffers and copied into the node's receive slots, at the same offset
+// a QP would have written them, and each one is reported as an ibv_wc. The
+// master's loop therefore handles RDMA and TCP nodes alike: post_recv() plays
+// ibv_post_recv and poll() plays ibv_poll_cq.
+//
+// A frame only lands once the node has a posted slot. Until then its bytes
+// stay in the provided buffers, and once they are all taken the receives
+// stop and TCP holds the senders back, like RNR does on a QP. A closed or
+// broken connection flushes the posted slots with error completions.
+
+const uint16_t TCP_INGRESS_GROUP = 0;
+// provided buffers, a power of two
+const uint32_t TCP_INGRESS_BUFFERS = 256;
+const uint32_t TCP_INGRESS_BUFFER_SIZE = 16384;
+const uint32_t TCP_INGRESS_RING_ENTRIES = 256;
+// user_data: node ID in the low bits, the connection's generation above this
+// bit, so completions of a replaced socket are told apart, and this bit for
+// cancels and buffer hand-backs, whose completions carry nothing
+const uint64_t TCP_INGRESS_CONTROL = 1ULL << 32;
+const uint32_t TCP_INGRESS_GEN_SHIFT = 33;
+
+typedef struct tcp_ingress_stats_ {
+    uint64_t frames;
+    uint64_t bytes;
+    // receive completions, each filled one provided buffer
+    uint64_t recvs;
+    // multishot receives that ran out of provided buffers and were rearmed
+    uint64_t starved;
+    uint64_t closed;
+} tcp_ingress_stats_s;
+
+class tcp_ingress {
+public:
+    tcp_ingress() : buffers(nullptr), rearm_pending(false), starved_pending(false) {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    ~tcp_ingress() { free(buffers); }
+
+    int init(uint32_t max_nodes) {
+        if (ring.init(TCP_INGRESS_RING_ENTRIES) != 0)
+            return -1;
+        buffers = (char *)aligned_alloc(4096, (size_t)TCP_INGRESS_BUFFERS * TCP_INGRESS_BUFFER_SIZE);
+        if (!buffers)
+            return -1;
+
+        int provided = -1;
+        if (ring.provide_buffers(buffers, TCP_INGRESS_BUFFER_SIZE, TCP_INGRESS_BUFFERS, TCP_INGRESS_GROUP, 0, TCP_INGRESS_CONTROL) != 0 ||
+            ring.submit(1) < 0)
+            return -1;
+        ring.reap([&provided](const struct io_uring_cqe &cqe) { provided = cqe.res; });
+        if (provided < 0) {
+            cerr << "io_uring provide buffers failed: " << strerror(-provided) << endl;
+            return -1;
+        }
+        conns.reset(new conn_s[max_nodes]);
+        return 0;
+    }
+
+    // Start receiving node `id` from `fd` into its receive ring at `ring_buf`:
+    // slot i starts `i * stride + offset` bytes in and takes `slot_size` bytes.
+    // No slot is posted yet.
+    int add(uint32_t id, int fd, char *ring_buf, uint32_t stride, uint32_t offset, uint32_t slot_size) {
+        conn_s &c = conns[id];
+        c.gen++;
+        c.fd = fd;
+        c.ring_buf = ring_buf;
+        c.stride = stride;
+        c.offset = offset;
+        c.slot_size = slot_size;
+        c.posted = 0;
+        c.closed = false;
+        c.armed = false;
+        active.push_back(id);
+        return arm(id);
+    }
+
+    // Stop receiving node `id` and drop what it sent: before adopting the
+    // socket of a restarted node. Its posted slots are forgotten.
+    void remove(uint32_t id) {
+        conn_s &c = conns[id];
+        if (c.armed) {
+            struct io_uring_sqe *sqe = ring.get_sqe();
+            if (sqe) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = tag(id);
+                sqe->user_data = tag(id) | TCP_INGRESS_CONTROL;
+            }
+            // the canceled receive completes later and finds the node gone
+        }
+        drop_chunks(c);
+        c.posted = 0;
+        c.closed = true;
+        c.fd = -1;
+        // its flushed slots are not reported either
+        ready.erase(std::remove_if(ready.begin(), ready.end(),
+                                   [id](const struct ibv_wc &wc) { return (uint32_t)(wc.wr_id >> 32) == id; }),
+                    ready.end());
+        for (size_t i = 0; i < active.size(); i++) {
+            if (active[i] == id) {
+                active[i] = active.back();
+                active.pop_back();
+                break;
+            }
+        }
+    }
+
+    void post_recv(uint32_t id, uint32_t slot) {
+        conn_s &c = conns[id];
+        if (c.closed) {
+            push_wc(id, slot, IBV_WC_WR_FLUSH_ERR, 0, 0);
+            return;
+        }
+        c.posted |= 1u << slot;
+        deliver(id);
+    }
+
+    // One completion of a TCP node, false if there is none.
+    bool poll(struct ibv_wc &wc) {
+        if (ready.empty()) {
+            // a receive out of buffers only restarts once some came back
+            bool returned = !returns.empty();
+            return_buffers();
+            if (rearm_pending || (starved_pending && returned))
+                rearm();
+            if (ring.submit() < 0)
+                return false;
+            ring.reap([this](const struct io_uring_cqe &cqe) { handle(cqe); });
+        }
+        if (ready.empty())
+            return false;
+        wc = ready.front();
+        ready.pop_front();
+        return true;
+    }
+
+    uint32_t nodes() const { return active.size(); }
+
+    tcp_ingress_stats_s stats;
+
+private:
+    struct chunk_s {
+        uint16_t bid;
+        uint32_t offset;
+        uint32_t len;
+    };
+
+    struct conn_s {
+        int fd = -1;
+        char *ring_buf = nullptr;
+        uint32_t stride = 0;
+        uint32_t offset = 0;
+        uint32_t slot_size = 0;
+        // slots the master posted, as a bitmask
+        uint32_t posted = 0;
+        // received and not yet framed, in arrival order from chunk_head on
+        std::vector<chunk_s> chunks;
+        size_t chunk_head = 0;
+        uint32_t buffered = 0;
+        bool armed = false;
+        bool closed = true;
+        uint32_t gen = 0;
+    };
+
+    uint64_t tag(uint32_t id) const { return id | (uint64_t)conns[id].gen << TCP_INGRESS_GEN_SHIFT; }
+
+    char *buffer(uint16_t bid) { return buffers + (size_t)bid * TCP_INGRESS_BUFFER_SIZE; }
+
+    // Buffers go back to the kernel with the next submit, ahead of any rearm.
+    void give_back(uint16_t bid) { returns.push_back(bid); }
+
+    void return_buffers() {
+        size_t n = 0;
+        while (n < returns.size() &&
+               ring.provide_buffers(buffer(returns[n]), TCP_INGRESS_BUFFER_SIZE, 1, TCP_INGRESS_GROUP, returns[n], TCP_INGRESS_CONTROL) == 0)
+            n++;
+        returns.erase(returns.begin(), returns.begin() + n);
+    }
+
+    int arm(uint32_t id) {
+        struct io_uring_sqe *sqe = ring.get_sqe();
+        if (!sqe) {
+            rearm_pending = true;
+            return 0;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conns[id].fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = TCP_INGRESS_GROUP;
+        sqe->user_data = tag(id);
+        conns[id].armed = true;
+        return 0;
+    }
+
+    // Receives that stopped for lack of buffers (or SQ room) start again.
+    void rearm() {
+        rearm_pending = false;
+        starved_pending = false;
+        for (uint32_t id : active)
+            if (!conns[id].armed && !conns[id].closed)
+                arm(id);
+    }
+
+    void handle(const struct io_uring_cqe &cqe) {
+        if (cqe.user_data & TCP_INGRESS_CONTROL) {
+            if (cqe.res < 0 && cqe.res != -ENOENT && cqe.res != -EALREADY)
+                cerr << "TCP ingress request failed: " << strerror(-cqe.res) << endl;
+            return;
+        }
+        uint32_t id = (uint32_t)cqe.user_data;
+        conn_s &c = conns[id];
+        bool stale = cqe.user_data != tag(id);
+
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe.res <= 0 || c.closed || stale) {
+                give_back(bid);
+            } else {
+                c.chunks.push_back({ bid, 0, (uint32_t)cqe.res });
+                c.buffered += cqe.res;
+                stats.recvs++;
+            }
+        }
+        if (c.closed || stale)
+            return;
+
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            c.armed = false;
+            if (cqe.res == -ENOBUFS) {
+                // the buffers come back as frames are taken
+                stats.starved++;
+                starved_pending = true;
+            } else if (cqe.res <= 0) {
+                if (cqe.res < 0)
+                    cerr << "TCP receive from node " << id << " failed: " << strerror(-cqe.res) << endl;
+                close_conn(id, IBV_WC_REM_ABORT_ERR);
+                return;
+            } else {
+                arm(id);
+            }
+        }
+        deliver(id);
+    }
+
+    // Cut as many frames as there are posted slots.
+    void deliver(uint32_t id) {
+        conn_s &c = conns[id];
+        while (c.posted != 0 && c.buffered >= sizeof(tcp_frame_s)) {
+            tcp_frame_s frame;
+            peek(c, (char *)&frame, sizeof(frame));
+            if (frame.len > c.slot_size || frame.len < sizeof(seq_header_s)) {
+                cerr << "Bad frame of " << frame.len << " bytes from TCP node " << id << endl;
+                close_conn(id, IBV_WC_REM_INV_REQ_ERR);
+                return;
+            }
+            if (c.buffered < sizeof(frame) + frame.len)
+                return;
+
+            uint32_t slot = __builtin_ctz(c.posted);
+            c.posted &= ~(1u << slot);
+            char *dst = c.ring_buf + (size_t)slot * c.stride + c.offset;
+            consume(c, nullptr, sizeof(frame));
+            consume(c, dst, frame.len);
+            // text messages are read as C strings, like from a zeroed RDMA slot
+            if (frame.len < c.slot_size)
+                dst[frame.len] = '\0';
+            push_wc(id, slot, IBV_WC_SUCCESS, frame.len, frame.imm);
+            stats.frames++;
+            stats.bytes += frame.len;
+        }
+    }
+
+    void drop_chunks(conn_s &c) {
+        for (size_t i = c.chunk_head; i < c.chunks.size(); i++)
+            give_back(c.chunks[i].bid);
+        c.chunks.clear();
+        c.chunk_head = 0;
+        c.buffered = 0;
+    }
+
+    void peek(const conn_s &c, char *dst, uint32_t len) {
+        for (auto it = c.chunks.begin() + c.chunk_head; len > 0; ++it) {
+            uint32_t n = std::min(len, it->len);
+            memcpy(dst, buffer(it->bid) + it->offset, n);
+            dst += n;
+            len -= n;
+        }
+    }
+
+    // Copy out `len` bytes (or skip them if dst is null), giving back every
+    // buffer that is used up.
+    void consume(conn_s &c, char *dst, uint32_t len) {
+        c.buffered -= len;
+        while (len > 0) {
+            chunk_s &chunk = c.chunks[c.chunk_head];
+            uint32_t n = std::min(len, chunk.len);
+            if (dst) {
+                memcpy(dst, buffer(chunk.bid) + chunk.offset, n);
+                dst += n;
+            }
+            chunk.offset += n;
+            chunk.len -= n;
+            len -= n;
+            if (chunk.len == 0) {
+                give_back(chunk.bid);
+                if (++c.chunk_head == c.chunks.size()) {
+                    c.chunks.clear();
+                    c.chunk_head = 0;
+                }
+            }
+        }
+    }
+
+    // Like a QP going to the error state: every posted slot completes, the
+    // first one with `status` and the others flushed.
+    void close_conn(uint32_t id, enum ibv_wc_status status) {
+        conn_s &c = conns[id];
+        drop_chunks(c);
+        c.closed = true;
+        stats.closed++;
+        while (c.posted != 0) {
+            uint32_t slot = __builtin_ctz(c.posted);
+            c.posted &= ~(1u << slot);
+            push_wc(id, slot, status, 0, 0);
+            status = IBV_WC_WR_FLUSH_ERR;
+        }
+    }
+
+    void push_wc(uint32_t id, uint32_t slot, enum ibv_wc_status status, uint32_t len, uint32_t imm) {
+        struct ibv_wc wc;
+        memset(&wc, 0, sizeof(wc));
+        wc.wr_id = ((uint64_t)id << 32) | slot;
+        wc.status = status;
+        wc.opcode = IBV_WC_RECV;
+        wc.byte_len = len;
+        if (imm != 0) {
+            wc.wc_flags = IBV_WC_WITH_IMM;
+            wc.imm_data = htonl(imm);
+        }
+        ready.push_back(wc);
+    }
+
+    io_ring ring;
+    char *buffers;
+    std::unique_ptr<conn_s[]> conns;
+    // IDs of the TCP nodes
+    std::vector<uint32_t> active;
+    std::deque<struct ibv_wc> ready;
+    // used-up buffers not yet handed back
+    std::vector<uint16_t> returns;
+    bool rearm_pending;
+    bool starved_pending;
+};
@@ -0,0 +1,264 @@
+#pragma once
+#include <string>
+#include <netinet/tcp.h>
+
+#include "common.h"
+#include "io_ring.h"
+#include "node_link.h"
+#include "reduce.h"
+#include "sequence.h"
+
+// Node side of a connection to a master for nodes without RoCE. The control
+// socket carries the data too: after the handshake the node writes its
+// incast messages into it as frames, the master only ever sends the UNLOCK
+// text back. A frame is a tcp_frame_s and the message as a QP would have sent
+// it, sequence header included, so the master hands it to the same reorder,
+// consumer and ingest stages as an RDMA message.
+//
+// The frames go out with io_uring SEND_ZC from registered buffers: the frame
+// header from the link's own table, the payload from a buffer registered by
+// the caller. The two are linked so they stay in order on the stream. A
+// buffer is reused only after its zero-copy notification, at most
+// INCAST_RECV_SLOTS frames are in flight, like on a QP.
+
+typedef struct tcp_frame_ {
+    // bytes after this header: sequence header and payload
+    uint32_t len;
+    // what an RDMA send would carry as immediate data, 0 for none
+    uint32_t imm;
+} tcp_frame_s;
+
+typedef struct tcp_frame_header_ {
+    tcp_frame_s frame;
+    seq_header_s seq;
+} tcp_frame_header_s;
+
+const uint32_t TCP_LINK_RING_ENTRIES = 64;
+// fixed buffer 0 is the frame header table, the caller's payload buffers follow
+const uint32_t TCP_LINK_HEADER_BUFFER = 0;
+const uint32_t TCP_LINK_BUFFERS = 4;
+// user_data of a frame's sends: frame index << 1 | payload
+const uint64_t TCP_LINK_PAYLOAD = 1;
+
+typedef struct tcp_link_stats_ {
+    uint64_t frames;
+    uint64_t bytes;
+    // notifications telling the kernel had to copy after all (loopback does)
+    uint64_t copied;
+    uint64_t send_errors;
+} tcp_link_stats_s;
+
+class tcp_link {
+public:
+    tcp_link() : socket_fd(-1), in_flight(0), failed(false), broken(false) {
+        memset(&stats, 0, sizeof(stats));
+        memset(next_seq, 0, sizeof(next_seq));
+        memset(parts_left, 0, sizeof(parts_left));
+    }
+
+    ~tcp_link() {
+        if (socket_fd != -1)
+            ::close(socket_fd);
+    }
+
+    int open() {
+        if (ring.init(TCP_LINK_RING_ENTRIES) != 0 || ring.register_sparse_buffers(TCP_LINK_BUFFERS) != 0)
+            return -1;
+        return ring.register_buffer(TCP_LINK_HEADER_BUFFER, headers, sizeof(headers));
+    }
+
+    // Payload buffers the sends below name by `index` (1 .. TCP_LINK_BUFFERS-1).
+    int register_buffer(uint32_t index, void *addr, size_t len) {
+        return ring.register_buffer(index, addr, len);
+    }
+
+    // Same handshake as an RDMA node, with TRANSPORT_TCP and no QP.
+    int connect_to(const std::string &ip, int port, uint32_t node_id) {
+        socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (socket_fd == -1) {
+            perror("Socket creation failed");
+            return -1;
+        }
+
+        struct sockaddr_in serverAddr;
+        memset(&serverAddr, 0, sizeof(serverAddr));
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(port);
+        inet_pton(AF_INET, ip.c_str(), &serverAddr.sin_addr);
+        if (connect(socket_fd, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) == -1) {
+            perror("Connection failed");
+            return -1;
+        }
+
+        struct device_info local;
+        memset(&local, 0, sizeof(local));
+        local.node_id = node_id;
+        local.transport = TRANSPORT_TCP;
+        if (send(socket_fd, &local, sizeof(local), 0) == -1) {
+            perror("Error while sending data");
+            return -1;
+        }
+
+        // the master answers with its device info once we are registered
+        struct device_info reply;
+        ssize_t bytesRead = recv(socket_fd, &reply, sizeof(reply), MSG_WAITALL);
+        if (bytesRead != sizeof(reply)) {
+            cerr << "Master did not accept the TCP node" << endl;
+            return -1;
+        }
+
+        // frames are sent whole, Nagle would only hold back the last one
+        int one = 1;
+        setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        set_socket_non_blocking(socket_fd);
+        cout << "Connected to master " << ip << ":" << port << " over TCP" << endl;
+        return 0;
+    }
+
+    // At most one control message per call, like node_link::poll().
+    link_event poll() {
+        // a frame may be cut off, the master cannot find the next one anymore
+        if (broken)
+            return LINK_CLOSED;
+        const char *message = control.next();
+        if (!message) {
+            ssize_t bytesRead = control.fill(socket_fd);
+            if (bytesRead == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return LINK_IDLE;
+                perror("Error while receiving data");
+                return LINK_CLOSED;
+            } else if (bytesRead == 0) {
+                cout << "Server disconnected." << endl;
+                return LINK_CLOSED;
+            }
+            if (!(message = control.next()))
+                return LINK_IDLE;
+        }
+
+        cout << "Received message from server: " << message << endl;
+        return startsWith(message, "[SERVER] UNLOCK") ? LINK_UNLOCK : LINK_IDLE;
+    }
+
+    // One text message out of fixed buffer `index`, returns once the kernel
+    // let go of it. `flags` are the SEQ_* bits describing it.
+    int send_message(uint32_t index, const char *data, uint32_t len, uint16_t flags = 0) {
+        failed = false;
+        if (queue_frame(DATA_SEQ_HEADER, SEQ_FLOW_DATA, 0, index, data, len, flags) != 0)
+            return -1;
+        return reap_until([this]() { return in_flight == 0; });
+    }
+
+    // The reduce chunks laid out REDUCE_CHUNK_SIZE apart in fixed buffer
+    // `index`, at most INCAST_RECV_SLOTS in flight.
+    int send_reduce_chunks(uint32_t index, const char *chunk_buf, uint32_t chunks) {
+        failed = false;
+        for (uint32_t c = 0; c < chunks; c++) {
+            uint32_t header = c % INCAST_RECV_SLOTS;
+            if (reap_until([this, header]() { return parts_left[header] == 0; }) != 0)
+                return -1;
+            const reduce_chunk_header_s *hdr = (const reduce_chunk_header_s *)(chunk_buf + (size_t)c * REDUCE_CHUNK_SIZE);
+            uint32_t len = sizeof(*hdr) + hdr->elements * reduce_dtype_size(hdr->dtype);
+            if (queue_frame(header, SEQ_FLOW_REDUCE, REDUCE_IMM, index, (const char *)hdr, len) != 0)
+                return -1;
+        }
+        return reap_until([this]() { return in_flight == 0; });
+    }
+
+    tcp_link_stats_s stats;
+
+private:
+    // Header and payload of one frame as two linked SEND_ZCs. The frame's
+    // header entry stays in use until both notifications are in.
+    int queue_frame(uint32_t header, uint16_t flow, uint32_t imm, uint32_t index, const char *data, uint32_t len, uint16_t flags = 0) {
+        tcp_frame_header_s &hdr = headers[header];
+        hdr.frame.len = sizeof(seq_header_s) + len;
+        hdr.frame.imm = imm;
+        hdr.seq.seq = next_seq[flow];
+        hdr.seq.flow = flow;
+        hdr.seq.flags = flags;
+        hdr.seq.send_ns = clock_ns();
+
+        struct io_uring_sqe *sqe[2] = { ring.get_sqe(), ring.get_sqe() };
+        if (!sqe[0] || !sqe[1]) {
+            // cannot happen with INCAST_RECV_SLOTS frames in flight
+            cerr << "io_uring SQ full" << endl;
+            return -1;
+        }
+        prep_send(sqe[0], TCP_LINK_HEADER_BUFFER, &hdr, sizeof(hdr), (uint64_t)header << 1);
+        sqe[0]->flags |= IOSQE_IO_LINK;
+        prep_send(sqe[1], index, data, len, (uint64_t)header << 1 | TCP_LINK_PAYLOAD);
+        if (ring.submit() < 0)
+            return -1;
+
+        parts_left[header] = 2;
+        expected[header] = len;
+        in_flight++;
+        next_seq[flow]++;
+        stats.frames++;
+        stats.bytes += sizeof(hdr) + len;
+        return 0;
+    }
+
+    void prep_send(struct io_uring_sqe *sqe, uint32_t index, const void *addr, uint32_t len, uint64_t user_data) {
+        sqe->opcode = IORING_OP_SEND_ZC;
+        sqe->fd = socket_fd;
+        sqe->addr = (uintptr_t)addr;
+        sqe->len = len;
+        // the socket is non-blocking, WAITALL makes io_uring finish partial sends
+        sqe->msg_flags = MSG_WAITALL;
+        sqe->ioprio = IORING_RECVSEND_FIXED_BUF | IORING_SEND_ZC_REPORT_USAGE;
+        sqe->buf_index = index;
+        sqe->user_data = user_data;
+    }
+
+    template <typename F>
+    int reap_until(F done) {
+        auto start = std::chrono::steady_clock::now();
+        while (!done() && !failed && elapsed_us(start) < CONTROL_TIMEOUT_MS * 1000.0) {
+            if (ring.submit(1) < 0)
+                break;
+            ring.reap([this](const struct io_uring_cqe &cqe) { handle(cqe); });
+        }
+        if (failed || !done()) {
+            cerr << "TCP send failed" << endl;
+            stats.send_errors++;
+            broken = true;
+            return -1;
+        }
+        return 0;
+    }
+
+    // A SEND_ZC completes twice: the result (flagged MORE), then the
+    // notification that the buffer is free. A failed send has no second one.
+    void handle(const struct io_uring_cqe &cqe) {
+        uint32_t header = cqe.user_data >> 1;
+        bool payload = cqe.user_data & TCP_LINK_PAYLOAD;
+        if (cqe.flags & IORING_CQE_F_NOTIF) {
+            if (cqe.res & IORING_NOTIF_USAGE_ZC_COPIED)
+                stats.copied++;
+        } else {
+            uint32_t want = payload ? expected[header] : sizeof(tcp_frame_header_s);
+            if (cqe.res < 0 || (uint32_t)cqe.res != want) {
+                if (cqe.res < 0)
+                    cerr << "SEND_ZC failed: " << strerror(-cqe.res) << endl;
+                failed = true;
+            }
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE) && --parts_left[header] == 0)
+            in_flight--;
+    }
+
+    int socket_fd;
+    control_stream control;
+    io_ring ring;
+    // one per reduce chunk in flight plus the text message, like the QP's
+    // sequence headers
+    tcp_frame_header_s headers[INCAST_RECV_SLOTS + 1];
+    uint8_t parts_left[INCAST_RECV_SLOTS + 1];
+    uint32_t expected[INCAST_RECV_SLOTS + 1];
+    uint32_t next_seq[SEQ_MAX_FLOWS];
+    uint32_t in_flight;
+    bool failed;
+    bool broken;
+};
@@ -0,0 +1,207 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+
+#include "common.h"
+#include "rings.h"
+
+// Trace of the incast for replaying it elsewhere (replay_trace.cpp): one
+// fixed-size record per message with its node, flow and size, when the
+// node's turn was granted and when the master was done with the message.
+//
+// Recording never blocks and never takes a lock. Every thread that records
+// gets its own SPSC ring on its first record, published in a fixed table. A
+// writer thread drains the rings into the file in large writes. A record
+// that finds its ring full is dropped and counted.
+//
+// File: a trace_file_header_s, then trace_record_s until the end. Times are
+// ns since the trace was opened.
+
+const uint32_t TRACE_MAGIC = 0x31435254;  // "TRC1"
+const uint32_t TRACE_VERSION = 1;
+const uint32_t TRACE_RING_ENTRIES = 16384;
+// threads that can record, the RDMA thread and the consumers
+const uint32_t TRACE_MAX_THREADS = 64;
+const size_t TRACE_WRITE_BYTES = 1 << 16;
+
+// trace_record_s flags
+const uint16_t TRACE_REDUCE = 1;
+
+typedef struct trace_file_header_ {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    // wall clock when the trace was opened
+    uint64_t start_unix_ns;
+} trace_file_header_s;
+
+typedef struct trace_record_ {
+    uint32_t node;
+    uint16_t flow;
+    uint16_t flags;
+    // payload bytes, without the sequence header
+    uint32_t size;
+    uint32_t reserved;
+    uint64_t grant_ns;
+    uint64_t complete_ns;
+} trace_record_s;
+
+typedef struct trace_stats_ {
+    uint64_t written;
+    uint64_t write_errors;
+} trace_stats_s;
+
+class trace_writer {
+public:
+    trace_writer() : fd(-1), buffer_count(0), running(false), dropped(0) {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    ~trace_writer() { close(); }
+
+    int open(const std::string &path, uint32_t max_nodes) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror(("open " + path).c_str());
+            return -1;
+        }
+        trace_file_header_s header;
+        memset(&header, 0, sizeof(header));
+        header.magic = TRACE_MAGIC;
+        header.version = TRACE_VERSION;
+        header.record_size = sizeof(trace_record_s);
+        header.start_unix_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   std::chrono::system_clock::now().time_since_epoch()).count();
+        if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+            perror("write trace header");
+            return -1;
+        }
+
+        start = std::chrono::steady_clock::now();
+        grants.reset(new std::atomic<uint64_t>[max_nodes]());
+        running = true;
+        writer = std::thread(&trace_writer::writer_loop, this);
+        return 0;
+    }
+
+    // Drains what was recorded so far and closes the file.
+    void close() {
+        if (!running)
+            return;
+        running = false;
+        writer.join();
+        drain();
+        ::close(fd);
+        fd = -1;
+    }
+
+    bool enabled() const { return fd != -1; }
+
+    uint64_t now_ns() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // the node's turn starts, RDMA thread
+    void grant(uint32_t node) {
+        grants[node].store(now_ns(), std::memory_order_relaxed);
+    }
+
+    // the master is done with a message of `node`, any thread
+    void complete(uint32_t node, uint16_t flow, uint32_t size, uint16_t flags) {
+        trace_record_s rec;
+        rec.node = node;
+        rec.flow = flow;
+        rec.flags = flags;
+        rec.size = size;
+        rec.reserved = 0;
+        rec.grant_ns = grants[node].load(std::memory_order_relaxed);
+        rec.complete_ns = now_ns();
+        spsc_ring<trace_record_s> *ring = local_ring();
+        if (!ring || !ring->push(rec))
+            dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t drops() const { return dropped.load(std::memory_order_relaxed); }
+
+    // writer thread only, read them from the RDMA thread as a rough figure
+    trace_stats_s stats;
+
+private:
+    spsc_ring<trace_record_s> *local_ring() {
+        thread_local trace_writer *owner = nullptr;
+        thread_local spsc_ring<trace_record_s> *ring = nullptr;
+        if (owner == this)
+            return ring;
+
+        uint32_t index = buffer_count.load(std::memory_order_relaxed);
+        do {
+            if (index == TRACE_MAX_THREADS)
+                return nullptr;
+        } while (!buffer_count.compare_exchange_weak(index, index + 1, std::memory_order_relaxed));
+
+        buffers[index].init(TRACE_RING_ENTRIES);
+        published[index].store(true, std::memory_order_release);
+        owner = this;
+        ring = &buffers[index];
+        return ring;
+    }
+
+    // Move everything recorded into the file, returns the records written.
+    uint64_t drain() {
+        uint64_t n = 0;
+        uint32_t count = buffer_count.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < count; i++) {
+            if (!published[i].load(std::memory_order_acquire))
+                continue;
+            trace_record_s rec;
+            while (buffers[i].pop(rec)) {
+                staged.insert(staged.end(), (const char *)&rec, (const char *)&rec + sizeof(rec));
+                n++;
+                if (staged.size() >= TRACE_WRITE_BYTES)
+                    flush();
+            }
+        }
+        flush();
+        stats.written += n;
+        return n;
+    }
+
+    void flush() {
+        size_t done = 0;
+        while (done < staged.size()) {
+            ssize_t ret = write(fd, staged.data() + done, staged.size() - done);
+            if (ret <= 0) {
+                if (ret < 0 && errno == EINTR)
+                    continue;
+                stats.write_errors++;
+                break;
+            }
+            done += ret;
+        }
+        staged.clear();
+    }
+
+    void writer_loop() {
+        while (running.load(std::memory_order_acquire))
+            if (drain() == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    int fd;
+    std::chrono::steady_clock::time_point start;
+    // grant time of each node's current turn
+    std::unique_ptr<std::atomic<uint64_t>[]> grants;
+    spsc_ring<trace_record_s> buffers[TRACE_MAX_THREADS];
+    std::atomic<bool> published[TRACE_MAX_THREADS] = {};
+    std::atomic<uint32_t> buffer_count;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> dropped;
+    std::thread writer;
+    std::vector<char> staged;
+};
@@ -0,0 +1,89 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// Transport-neutral view of one connection, shaped after an RC QP with its own
+// CQ: two-sided SEND/RECV into posted buffers, one-sided WRITE/READ into
+// memory the peer registered, and completions that are polled. Code written
+// against it runs unchanged over
+//   transport_verbs.h  an RC QP, the real thing
+//   transport_shm.h    lock-free rings in shared memory, same host only
+//   transport_tcp.h    a TCP socket, the baseline RDMA is measured against
+//
+// Like verbs, a channel is driven by one thread, every posted operation ends
+// in exactly one completion, buffers must lie in a registered region and a
+// SEND only lands once the peer has posted a receive for it.
+
+enum tr_opcode : uint8_t {
+    TR_SEND = 0,
+    TR_RECV,
+    TR_WRITE,
+    TR_READ,
+};
+
+typedef struct tr_completion_ {
+    uint64_t wr_id;
+    // bytes received, TR_RECV only
+    uint32_t len;
+    uint8_t opcode;
+    // 0 on success
+    int status;
+} tr_completion_s;
+
+// memory registered with a channel, rkey is what the peer names it by
+typedef struct tr_region_ {
+    char *addr;
+    size_t len;
+    uint32_t lkey;
+    uint32_t rkey;
+    // backend private, the ibv_mr for verbs
+    void *handle;
+} tr_region_s;
+
+class transport_channel {
+public:
+    virtual ~transport_channel() {}
+
+    virtual const char *name() const = 0;
+
+    virtual int register_region(void *addr, size_t len, tr_region_s &region) = 0;
+    virtual void deregister_region(tr_region_s &region) = 0;
+
+    // Each returns 0 once the operation is queued, an errno value if it could
+    // not be (a full send queue is ENOMEM, poll and try again).
+    virtual int post_send(uint64_t wr_id, const tr_region_s &region, const void *buf, uint32_t len) = 0;
+    virtual int post_recv(uint64_t wr_id, const tr_region_s &region, void *buf, uint32_t len) = 0;
+    // remote_addr lies in a region the peer registered under rkey
+    virtual int post_write(uint64_t wr_id, const tr_region_s &region, const void *buf, uint32_t len,
+                           uint64_t remote_addr, uint32_t rkey) = 0;
+    virtual int post_read(uint64_t wr_id, const tr_region_s &region, void *buf, uint32_t len,
+                          uint64_t remote_addr, uint32_t rkey) = 0;
+
+    // Up to `max` completions into `out`, returns how many or -1.
+    virtual int poll(tr_completion_s *out, int max) = 0;
+};
+
+// Completions the software backends produce themselves, handed out by poll().
+class tr_completion_queue {
+public:
+    tr_completion_queue() : head(0) {}
+
+    void push(uint64_t wr_id, uint8_t opcode, uint32_t len, int status) {
+        entries.push_back({ wr_id, len, opcode, status });
+    }
+
+    int pop(tr_completion_s *out, int max) {
+        int n = 0;
+        while (n < max && head < entries.size())
+            out[n++] = entries[head++];
+        if (head == entries.size()) {
+            entries.clear();
+            head = 0;
+        }
+        return n;
+    }
+
+private:
+    std::vector<tr_completion_s> entries;
+    size_t head;
+};
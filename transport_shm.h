@@ -0,0 +1,187 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "transport.h"
+
+// The transport interface between two ends on one host, threads or processes
+// forked after the pair was created. Both ends map one shared segment: a SPSC
+// ring of message slots per direction and a heap for memory the peer may
+// WRITE to or READ from. A SEND is one copy into the peer's ring, the peer
+// copies it into its next posted receive when it polls. One-sided operations
+// are a memcpy into the heap, so only regions allocated with alloc() get an
+// rkey.
+//
+// The ring stands in for the peer's receive queue: when it is full post_send
+// returns ENOMEM, like a send queue that ran out of WQEs.
+
+const uint32_t SHM_RING_SLOTS = 64;
+const uint32_t SHM_SLOT_SIZE = 4096;
+// the one rkey of the heap
+const uint32_t SHM_RKEY = 0x5348;
+
+class shm_channel : public transport_channel {
+public:
+    // Both ends of a new segment with `heap_bytes` for one-sided access.
+    static int create_pair(size_t heap_bytes, shm_channel *&a, shm_channel *&b) {
+        std::shared_ptr<segment> seg(new segment());
+        if (seg->map(heap_bytes) != 0)
+            return -1;
+        a = new shm_channel(seg, 0);
+        b = new shm_channel(seg, 1);
+        return 0;
+    }
+
+    const char *name() const override { return "shm"; }
+
+    // Shared memory the peer can name, nullptr once the heap is used up.
+    void *alloc(size_t len) { return seg->alloc(len); }
+
+    int register_region(void *addr, size_t len, tr_region_s &region) override {
+        // any memory works for SENDs and as the local side of one-sided
+        // operations, remote access needs it in the heap
+        region = { (char *)addr, len, 0, seg->in_heap(addr, len) ? SHM_RKEY : 0, nullptr };
+        return 0;
+    }
+
+    void deregister_region(tr_region_s &region) override { region.rkey = 0; }
+
+    int post_send(uint64_t wr_id, const tr_region_s &region, const void *buf, uint32_t len) override {
+        if (len > SHM_SLOT_SIZE)
+            return EMSGSIZE;
+        ring_s &ring = seg->header->rings[1 - side];
+        uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+        if (tail - ring.head.load(std::memory_order_acquire) == SHM_RING_SLOTS)
+            return ENOMEM;
+
+        slot_s &slot = ring.slots[tail % SHM_RING_SLOTS];
+        memcpy(slot.data, buf, len);
+        slot.len = len;
+        ring.tail.store(tail + 1, std::memory_order_release);
+        completions.push(wr_id, TR_SEND, 0, 0);
+        return 0;
+    }
+
+    int post_recv(uint64_t wr_id, const tr_region_s &region, void *buf, uint32_t len) override {
+        recvs.push_back({ wr_id, (char *)buf, len });
+        return 0;
+    }
+
+    int post_write(uint64_t wr_id, const tr_region_s &region, const void *buf, uint32_t len,
+                   uint64_t remote_addr, uint32_t rkey) override {
+        if (rkey != SHM_RKEY || !seg->in_heap((void *)remote_addr, len))
+            return EINVAL;
+        // a SEND posted after this WRITE publishes its data with the ring's
+        // tail, so the peer sees them in order as on an RC QP
+        memcpy((void *)remote_addr, buf, len);
+        completions.push(wr_id, TR_WRITE, 0, 0);
+        return 0;
+    }
+
+    int post_read(uint64_t wr_id, const tr_region_s &region, void *buf, uint32_t len,
+                  uint64_t remote_addr, uint32_t rkey) override {
+        if (rkey != SHM_RKEY || !seg->in_heap((void *)remote_addr, len))
+            return EINVAL;
+        memcpy(buf, (void *)remote_addr, len);
+        completions.push(wr_id, TR_READ, 0, 0);
+        return 0;
+    }
+
+    int poll(tr_completion_s *out, int max) override {
+        ring_s &ring = seg->header->rings[side];
+        uint32_t head = ring.head.load(std::memory_order_relaxed);
+        uint32_t tail = ring.tail.load(std::memory_order_acquire);
+        while (head != tail && !recvs.empty()) {
+            const slot_s &slot = ring.slots[head % SHM_RING_SLOTS];
+            recv_s recv = recvs.front();
+            recvs.pop_front();
+            // a message longer than the buffer fails the receive, like
+            // IBV_WC_LOC_LEN_ERR
+            if (slot.len > recv.len) {
+                completions.push(recv.wr_id, TR_RECV, 0, EMSGSIZE);
+            } else {
+                memcpy(recv.buf, slot.data, slot.len);
+                completions.push(recv.wr_id, TR_RECV, slot.len, 0);
+            }
+            head++;
+        }
+        ring.head.store(head, std::memory_order_release);
+        return completions.pop(out, max);
+    }
+
+private:
+    struct slot_s {
+        uint32_t len;
+        char data[SHM_SLOT_SIZE];
+    };
+
+    struct ring_s {
+        alignas(64) std::atomic<uint32_t> head;
+        alignas(64) std::atomic<uint32_t> tail;
+        slot_s slots[SHM_RING_SLOTS];
+    };
+
+    struct header_s {
+        // rings[i] is what end i receives
+        ring_s rings[2];
+        std::atomic<size_t> heap_used;
+    };
+
+    struct segment {
+        header_s *header = nullptr;
+        char *heap = nullptr;
+        size_t heap_bytes = 0;
+        size_t bytes = 0;
+
+        ~segment() {
+            if (header)
+                munmap(header, bytes);
+        }
+
+        int map(size_t heap_len) {
+            size_t header_bytes = (sizeof(header_s) + 4095) & ~(size_t)4095;
+            bytes = header_bytes + heap_len;
+            void *mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED)
+            {
+                cerr << "mmap - shm transport - failed: " << strerror(errno) << endl;
+                return -1;
+            }
+            // fresh anonymous pages are zero, which is a valid empty header
+            header = (header_s *)mem;
+            heap = (char *)mem + header_bytes;
+            heap_bytes = heap_len;
+            return 0;
+        }
+
+        void *alloc(size_t len) {
+            len = (len + 63) & ~(size_t)63;
+            size_t offset = header->heap_used.fetch_add(len);
+            if (offset + len > heap_bytes)
+                return nullptr;
+            return heap + offset;
+        }
+
+        bool in_heap(const void *addr, size_t len) const {
+            const char *p = (const char *)addr;
+            return p >= heap && p + len <= heap + heap_bytes;
+        }
+    };
+
+    struct recv_s {
+        uint64_t wr_id;
+        char *buf;
+        uint32_t len;
+    };
+
+    shm_channel(std::shared_ptr<segment> seg, int side) : seg(seg), side(side) {}
+
+    std::shared_ptr<segment> seg;
+    // which end of the segment we are, 0 or 1
+    int side;
+    std::deque<recv_s> recvs;
+    tr_completion_queue completions;
+};
@@ -0,0 +1,332 @@
+#pragma once
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include <netinet/tcp.h>
+
+#include "common.h"
+#include "transport.h"
+
+// The transport interface over a TCP stream, the baseline that RDMA is
+// measured against. Every operation is a frame: a header, then the payload
+// for SEND, WRITE and READ_RESP. Frames are queued in one output buffer and
+// flushed with send() from poll(). A SEND or WRITE completes once its frame
+// has been handed to the kernel, which is as far as TCP acknowledges it. The
+// peer's poll() places payloads itself: a SEND into the oldest posted receive
+// (the stream waits until there is one), a WRITE into the region its rkey
+// names, and a READ_REQ is answered with a READ_RESP from there.
+
+enum tcp_frame_type : uint8_t {
+    TCP_FRAME_SEND = 0,
+    TCP_FRAME_WRITE,
+    TCP_FRAME_READ_REQ,
+    TCP_FRAME_READ_RESP,
+};
+
+typedef struct tcp_frame_header_ {
+    uint8_t type;
+    uint8_t pad[3];
+    // payload bytes, for READ_REQ the bytes asked for
+    uint32_t len;
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t pad2;
+    // READ_REQ/READ_RESP: the reader's wr_id
+    uint64_t id;
+} tcp_frame_header_s;
+
+// bytes queued for the kernel before posts return ENOMEM
+const size_t TCP_OUTBUF_LIMIT = 4 * 1024 * 1024;
+const size_t TCP_READ_CHUNK = 256 * 1024;
+
+class tcp_channel : public transport_channel {
+public:
+    // takes over a connected socket
+    tcp_channel(int fd) : fd(fd), out_head(0), out_queued(0), out_flushed(0), in_head(0), in_tail(0), next_rkey(1), broken(false) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        set_socket_non_blocking(fd);
+    }
+
+    ~tcp_channel() { close(fd); }
+
+    // Both ends of a connection over the loopback interface.
+    static int create_pair(tcp_channel *&a, tcp_channel *&b) {
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        socklen_t addr_len = sizeof(addr);
+        if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0 ||
+            getsockname(listener, (struct sockaddr *)&addr, &addr_len) != 0)
+        {
+            cerr << "tcp transport listen failed: " << strerror(errno) << endl;
+            if (listener >= 0)
+                close(listener);
+            return -1;
+        }
+
+        int client = socket(AF_INET, SOCK_STREAM, 0);
+        if (client < 0 || connect(client, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            cerr << "tcp transport connect failed: " << strerror(errno) << endl;
+            close(listener);
+            if (client >= 0)
+                close(client);
+            return -1;
+        }
+        int server = accept(listener, nullptr, nullptr);
+        close(listener);
+        if (server < 0)
+        {
+            cerr << "tcp transport accept failed: " << strerror(errno) << endl;
+            close(client);
+            return -1;
+        }
+        a = new tcp_channel(client);
+        b = new tcp_channel(server);
+        return 0;
+    }
+
+    const char *name() const override { return "tcp"; }
+
+    int register_region(void *addr, size_t len, tr_region_s &region) override {
+        uint32_t key = next_rkey++;
+        region = { (char *)addr, len, key, key, nullptr };
+        regions[key] = region;
+        return 0;
+    }
+
+    void deregister_region(tr_region_s &region) override { regions.erase(region.rkey); }
+
+    int post_send(uint64_t wr_id, const tr_region_s &region, const void *buf, uint32_t len) override {
+        return queue_frame(TCP_FRAME_SEND, buf, len, 0, 0, 0, wr_id, TR_SEND);
+    }
+
+    int post_recv(uint64_t wr_id, const tr_region_s &region, void *buf, uint32_t len) override {
+        recvs.push_back({ wr_id, (char *)buf, len });
+        return 0;
+    }
+
+    int post_write(uint64_t wr_id, const tr_region_s &region, const void *buf, uint32_t len,
+                   uint64_t remote_addr, uint32_t rkey) override {
+        return queue_frame(TCP_FRAME_WRITE, buf, len, remote_addr, rkey, 0, wr_id, TR_WRITE);
+    }
+
+    int post_read(uint64_t wr_id, const tr_region_s &region, void *buf, uint32_t len,
+                  uint64_t remote_addr, uint32_t rkey) override {
+        // the completion comes with the READ_RESP, not with the request
+        int ret = queue_frame(TCP_FRAME_READ_REQ, nullptr, len, remote_addr, rkey, wr_id, 0, 0);
+        if (ret == 0)
+            reads[wr_id] = { wr_id, (char *)buf, len };
+        return ret;
+    }
+
+    int poll(tr_completion_s *out_wc, int max) override {
+        if (!broken) {
+            flush();
+            fill();
+            parse();
+            // READ_RESPs queued by parse()
+            flush();
+        }
+        return completions.pop(out_wc, max);
+    }
+
+private:
+    struct recv_s {
+        uint64_t wr_id;
+        char *buf;
+        uint32_t len;
+    };
+
+    // a send-side completion, due once out_flushed reaches `end`
+    struct pending_s {
+        uint64_t end;
+        uint64_t wr_id;
+        uint8_t opcode;
+    };
+
+    // SEND and WRITE frames complete as `opcode` once flushed, the reads
+    // complete with their response
+    int queue_frame(uint8_t type, const void *payload, uint32_t len, uint64_t addr, uint32_t rkey, uint64_t id,
+                    uint64_t wr_id, uint8_t opcode) {
+        if (broken)
+            return ECONNRESET;
+        uint32_t payload_len = type == TCP_FRAME_READ_REQ ? 0 : len;
+        // the peer's reads are always answered
+        if (type != TCP_FRAME_READ_RESP &&
+            out.size() - out_head + sizeof(tcp_frame_header_s) + payload_len > TCP_OUTBUF_LIMIT)
+            return ENOMEM;
+
+        tcp_frame_header_s hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.type = type;
+        hdr.len = len;
+        hdr.addr = addr;
+        hdr.rkey = rkey;
+        hdr.id = id;
+        out.insert(out.end(), (char *)&hdr, (char *)&hdr + sizeof(hdr));
+        if (payload_len > 0)
+            out.insert(out.end(), (const char *)payload, (const char *)payload + payload_len);
+        out_queued += sizeof(hdr) + payload_len;
+        if (type == TCP_FRAME_SEND || type == TCP_FRAME_WRITE)
+            pending.push_back({ out_queued, wr_id, opcode });
+        return 0;
+    }
+
+    void flush() {
+        while (out_head < out.size()) {
+            ssize_t n = send(fd, out.data() + out_head, out.size() - out_head, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    fail("send");
+                break;
+            }
+            out_head += n;
+            out_flushed += n;
+        }
+        while (!pending.empty() && pending.front().end <= out_flushed) {
+            completions.push(pending.front().wr_id, pending.front().opcode, 0, 0);
+            pending.pop_front();
+        }
+        // compact once the flushed part dominates
+        if (out_head == out.size()) {
+            out.clear();
+            out_head = 0;
+        } else if (out_head > out.size() / 2) {
+            out.erase(out.begin(), out.begin() + out_head);
+            out_head = 0;
+        }
+    }
+
+    void fill() {
+        // read ahead a chunk, or the whole next frame if it is bigger, but no
+        // further: a SEND waiting for a receive stops the stream
+        while (in_tail - in_head < next_frame_bytes()) {
+            size_t want = std::max(next_frame_bytes(), TCP_READ_CHUNK);
+            if (in_tail + want > in.size()) {
+                memmove(in.data(), in.data() + in_head, in_tail - in_head);
+                in_tail -= in_head;
+                in_head = 0;
+                if (in_tail + want > in.size())
+                    in.resize(in_tail + want);
+            }
+            ssize_t n = recv(fd, in.data() + in_tail, in.size() - in_tail, 0);
+            if (n == 0) {
+                errno = ECONNRESET;
+                fail("recv");
+                break;
+            }
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    fail("recv");
+                break;
+            }
+            in_tail += n;
+        }
+    }
+
+    size_t next_frame_bytes() const {
+        if (in_tail - in_head < sizeof(tcp_frame_header_s))
+            return TCP_READ_CHUNK;
+        const tcp_frame_header_s *hdr = (const tcp_frame_header_s *)(in.data() + in_head);
+        size_t bytes = sizeof(*hdr) + (hdr->type == TCP_FRAME_READ_REQ ? 0 : hdr->len);
+        return std::max(bytes, TCP_READ_CHUNK);
+    }
+
+    void parse() {
+        while (in_tail - in_head >= sizeof(tcp_frame_header_s)) {
+            tcp_frame_header_s hdr;
+            memcpy(&hdr, in.data() + in_head, sizeof(hdr));
+            uint32_t payload = hdr.type == TCP_FRAME_READ_REQ ? 0 : hdr.len;
+            if (in_tail - in_head < sizeof(hdr) + payload)
+                break;
+            const char *data = in.data() + in_head + sizeof(hdr);
+
+            if (hdr.type == TCP_FRAME_SEND) {
+                // the stream waits for a receive, like an RNR NAK
+                if (recvs.empty())
+                    break;
+                recv_s recv = recvs.front();
+                recvs.pop_front();
+                if (hdr.len > recv.len) {
+                    completions.push(recv.wr_id, TR_RECV, 0, EMSGSIZE);
+                } else {
+                    memcpy(recv.buf, data, hdr.len);
+                    completions.push(recv.wr_id, TR_RECV, hdr.len, 0);
+                }
+            } else if (hdr.type == TCP_FRAME_WRITE) {
+                char *dst = resolve(hdr.addr, hdr.len, hdr.rkey);
+                if (dst)
+                    memcpy(dst, data, hdr.len);
+            } else if (hdr.type == TCP_FRAME_READ_REQ) {
+                char *src = resolve(hdr.addr, hdr.len, hdr.rkey);
+                // a bad request is answered with an empty response
+                queue_frame(TCP_FRAME_READ_RESP, src, src ? hdr.len : 0, 0, 0, hdr.id, 0, 0);
+            } else if (hdr.type == TCP_FRAME_READ_RESP) {
+                auto it = reads.find(hdr.id);
+                if (it != reads.end()) {
+                    bool ok = hdr.len == it->second.len;
+                    if (ok)
+                        memcpy(it->second.buf, data, hdr.len);
+                    completions.push(hdr.id, TR_READ, 0, ok ? 0 : EFAULT);
+                    reads.erase(it);
+                }
+            }
+            in_head += sizeof(hdr) + payload;
+        }
+        if (in_head == in_tail)
+            in_head = in_tail = 0;
+    }
+
+    // local memory behind a remote access, nullptr if it is outside the region
+    char *resolve(uint64_t addr, uint32_t len, uint32_t rkey) {
+        auto it = regions.find(rkey);
+        if (it == regions.end() || (char *)addr < it->second.addr ||
+            (char *)addr + len > it->second.addr + it->second.len)
+        {
+            cerr << "tcp transport: remote access outside region " << rkey << endl;
+            return nullptr;
+        }
+        return (char *)addr;
+    }
+
+    // a dead stream fails everything outstanding, like a QP in the error state
+    void fail(const char *what) {
+        cerr << "tcp transport " << what << " failed: " << strerror(errno) << endl;
+        broken = true;
+        for (auto &p : pending)
+            completions.push(p.wr_id, p.opcode, 0, ECONNRESET);
+        pending.clear();
+        for (auto &r : recvs)
+            completions.push(r.wr_id, TR_RECV, 0, ECONNRESET);
+        recvs.clear();
+        for (auto &r : reads)
+            completions.push(r.first, TR_READ, 0, ECONNRESET);
+        reads.clear();
+    }
+
+    int fd;
+    std::vector<char> out;
+    size_t out_head;
+    // stream offsets: bytes ever queued and ever handed to the kernel
+    uint64_t out_queued;
+    uint64_t out_flushed;
+    std::deque<pending_s> pending;
+
+    // received bytes are in [in_head, in_tail)
+    std::vector<char> in;
+    size_t in_head;
+    size_t in_tail;
+    std::deque<recv_s> recvs;
+    std::unordered_map<uint64_t, recv_s> reads;
+
+    std::unordered_map<uint32_t, tr_region_s> regions;
+    uint32_t next_rkey;
+    bool broken;
+    tr_completion_queue completions;
+};
@@ -0,0 +1,157 @@
+#pragma once
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "transport.h"
+
+// The transport interface over an RC QP with a CQ of its own. Every call maps
+// to exactly one verb, the layer adds nothing to the data path.
+
+const int VERBS_CHANNEL_DEPTH = 64;
+
+class verbs_channel : public transport_channel {
+public:
+    // takes over a connected QP and its CQ
+    verbs_channel(struct ibv_pd *pd, struct ibv_qp *qp, struct ibv_cq *cq) : pd(pd), qp(qp), cq(cq) {}
+
+    ~verbs_channel() {
+        ibv_destroy_qp(qp);
+        ibv_destroy_cq(cq);
+    }
+
+    // Two channels on one device connected back to back, the node end and
+    // the master end of a same-host run.
+    static int create_loopback(struct ibv_context *context, struct ibv_pd *pd, verbs_channel *&a, verbs_channel *&b) {
+        struct ibv_port_attr port_attr;
+        struct device_info local;
+        memset(&local, 0, sizeof(local));
+        uint32_t gidIndex = 0;
+        set_gid(context, port_attr, &local, gidIndex);
+        if (gidIndex == 0)
+            return -1;
+
+        struct ibv_cq *cq[2];
+        struct ibv_qp *qp[2];
+        for (int i = 0; i < 2; i++) {
+            cq[i] = ibv_create_cq(context, 2 * VERBS_CHANNEL_DEPTH, nullptr, nullptr, 0);
+            if (!cq[i])
+                return -1;
+
+            struct ibv_qp_init_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.send_cq = cq[i];
+            attr.recv_cq = cq[i];
+            attr.qp_type = IBV_QPT_RC;
+            attr.sq_sig_all = 1;
+            attr.cap.max_send_wr  = VERBS_CHANNEL_DEPTH;
+            attr.cap.max_recv_wr  = VERBS_CHANNEL_DEPTH;
+            attr.cap.max_send_sge = 1;
+            attr.cap.max_recv_sge = 1;
+            qp[i] = ibv_create_qp(pd, &attr);
+            if (!qp[i] || modify_qp_to_init(qp[i]) != 0)
+                return -1;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            struct device_info remote = local;
+            remote.send_qp_num = qp[1 - i]->qp_num;
+            if (modify_qp_to_rtr(qp[i], remote, gidIndex, port_attr.active_mtu, 0) != 0 ||
+                modify_qp_to_rts(qp[i], 0) != 0)
+                return -1;
+        }
+        a = new verbs_channel(pd, qp[0], cq[0]);
+        b = new verbs_channel(pd, qp[1], cq[1]);
+        return 0;
+    }
+
+    const char *name() const override { return "verbs"; }
+
+    int register_region(void *addr, size_t len, tr_region_s &region) override {
+        struct ibv_mr *mr = ibv_reg_mr(pd, addr, len, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ);
+        if (!mr)
+        {
+            cerr << "ibv_reg_mr failed: " << strerror(errno) << endl;
+            return -1;
+        }
+        region = { (char *)addr, len, mr->lkey, mr->rkey, mr };
+        return 0;
+    }
+
+    void deregister_region(tr_region_s &region) override {
+        if (region.handle)
+            ibv_dereg_mr((struct ibv_mr *)region.handle);
+        region.handle = nullptr;
+    }
+
+    int post_send(uint64_t wr_id, const tr_region_s &region, const void *buf, uint32_t len) override {
+        return post(wr_id, IBV_WR_SEND, region, buf, len, 0, 0);
+    }
+
+    int post_recv(uint64_t wr_id, const tr_region_s &region, void *buf, uint32_t len) override {
+        struct ibv_sge sge;
+        sge.addr   = (uintptr_t)buf;
+        sge.length = len;
+        sge.lkey   = region.lkey;
+
+        struct ibv_recv_wr wr, *bad_wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id   = wr_id;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        return ibv_post_recv(qp, &wr, &bad_wr);
+    }
+
+    int post_write(uint64_t wr_id, const tr_region_s &region, const void *buf, uint32_t len,
+                   uint64_t remote_addr, uint32_t rkey) override {
+        return post(wr_id, IBV_WR_RDMA_WRITE, region, buf, len, remote_addr, rkey);
+    }
+
+    int post_read(uint64_t wr_id, const tr_region_s &region, void *buf, uint32_t len,
+                  uint64_t remote_addr, uint32_t rkey) override {
+        return post(wr_id, IBV_WR_RDMA_READ, region, buf, len, remote_addr, rkey);
+    }
+
+    int poll(tr_completion_s *out, int max) override {
+        struct ibv_wc wcs[16];
+        int n = ibv_poll_cq(cq, max < 16 ? max : 16, wcs);
+        for (int i = 0; i < n; i++) {
+            out[i].wr_id = wcs[i].wr_id;
+            out[i].len = wcs[i].byte_len;
+            out[i].opcode = opcode_of(wcs[i]);
+            out[i].status = wcs[i].status == ibv_wc_status::IBV_WC_SUCCESS ? 0 : wcs[i].status;
+        }
+        return n;
+    }
+
+private:
+    int post(uint64_t wr_id, enum ibv_wr_opcode opcode, const tr_region_s &region, const void *buf, uint32_t len,
+             uint64_t remote_addr, uint32_t rkey) {
+        struct ibv_sge sge;
+        sge.addr   = (uintptr_t)buf;
+        sge.length = len;
+        sge.lkey   = region.lkey;
+
+        struct ibv_send_wr wr, *bad_wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id      = wr_id;
+        wr.sg_list    = &sge;
+        wr.num_sge    = 1;
+        wr.opcode     = opcode;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.wr.rdma.remote_addr = remote_addr;
+        wr.wr.rdma.rkey        = rkey;
+        return ibv_post_send(qp, &wr, &bad_wr);
+    }
+
+    static uint8_t opcode_of(const struct ibv_wc &wc) {
+        switch (wc.opcode) {
+        case IBV_WC_RDMA_WRITE: return TR_WRITE;
+        case IBV_WC_RDMA_READ: return TR_READ;
+        case IBV_WC_SEND: return TR_SEND;
+        default: return TR_RECV;
+        }
+    }
+
+    struct ibv_pd *pd;
+    struct ibv_qp *qp;
+    struct ibv_cq *cq;
+};
@@ -0,0 +1,136 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <arpa/inet.h>
+
+#include <infiniband/verbs.h>
+
+// Work requests built once per connection and patched per post. A post only
+// writes what changes from message to message (SGE address and length,
+// sometimes the wr_id) into a WR whose opcode, flags, SGE count, SGE list
+// and lkeys were set up front, and a batch is posted as one linked list.
+//
+// send_wr_format fixes the shape of a send at compile time: the opcode, if
+// it is signaled or inline and how many SGEs it has. The rings keep their
+// WRs and SGEs side by side and point the WRs at their own SGEs, so a ring
+// must not move once it is initialized.
+
+template <enum ibv_wr_opcode Opcode, bool Signaled, bool Inline, uint32_t Sges>
+struct send_wr_format {
+    static_assert(Sges >= 1 && Sges <= 4, "one to four SGEs");
+    static_assert(!Inline || Opcode == IBV_WR_SEND || Opcode == IBV_WR_SEND_WITH_IMM ||
+                  Opcode == IBV_WR_RDMA_WRITE || Opcode == IBV_WR_RDMA_WRITE_WITH_IMM,
+                  "only sends and writes can be inline");
+
+    static constexpr enum ibv_wr_opcode opcode = Opcode;
+    static constexpr uint32_t sges = Sges;
+    static constexpr unsigned int send_flags = (Signaled ? IBV_SEND_SIGNALED : 0) | (Inline ? IBV_SEND_INLINE : 0);
+    static constexpr bool has_imm = Opcode == IBV_WR_SEND_WITH_IMM || Opcode == IBV_WR_RDMA_WRITE_WITH_IMM;
+};
+
+template <typename Format, uint32_t Depth>
+class send_wr_ring {
+public:
+    // Everything but the per-message fields. `lkeys` are those of the
+    // memory each SGE usually points into, inline sends do not need them.
+    void init(const uint32_t (&lkeys)[Format::sges]) {
+        memset(wrs, 0, sizeof(wrs));
+        memset(sges, 0, sizeof(sges));
+        for (uint32_t i = 0; i < Depth; i++) {
+            wrs[i].sg_list = sges[i];
+            wrs[i].num_sge = Format::sges;
+            wrs[i].opcode = Format::opcode;
+            wrs[i].send_flags = Format::send_flags;
+            for (uint32_t s = 0; s < Format::sges; s++)
+                sges[i][s].lkey = lkeys[s];
+        }
+    }
+
+    void set_wr_id(uint32_t i, uint64_t wr_id) { wrs[i].wr_id = wr_id; }
+
+    void set_imm(uint32_t i, uint32_t imm) {
+        static_assert(Format::has_imm, "the opcode carries no immediate data");
+        wrs[i].imm_data = htonl(imm);
+    }
+
+    void set_sge(uint32_t i, uint32_t s, uint64_t addr, uint32_t length) {
+        sges[i][s].addr = addr;
+        sges[i][s].length = length;
+    }
+
+    // for an SGE that does not always point into the same registration
+    void set_sge(uint32_t i, uint32_t s, uint64_t addr, uint32_t length, uint32_t lkey) {
+        set_sge(i, s, addr, length);
+        sges[i][s].lkey = lkey;
+    }
+
+    // Link `n` WRs from `first` on, wrapping around, into one list for a
+    // single post.
+    struct ibv_send_wr *chain(uint32_t first, uint32_t n) {
+        for (uint32_t k = 0; k + 1 < n; k++)
+            wrs[(first + k) % Depth].next = &wrs[(first + k + 1) % Depth];
+        wrs[(first + n - 1) % Depth].next = nullptr;
+        return &wrs[first % Depth];
+    }
+
+    // WRs of a failed post that went out before `bad`
+    static uint32_t posted_before(const struct ibv_send_wr *head, const struct ibv_send_wr *bad) {
+        uint32_t n = 0;
+        for (const struct ibv_send_wr *wr = head; wr && wr != bad; wr = wr->next)
+            n++;
+        return n;
+    }
+
+private:
+    struct ibv_send_wr wrs[Depth];
+    struct ibv_sge sges[Depth][Format::sges];
+};
+
+// Receive WRs for buffers that never move, e.g. a connection's receive slots:
+// once set up, a repost patches nothing at all.
+template <uint32_t Depth>
+class recv_wr_ring {
+public:
+    void set(uint32_t i, uint64_t wr_id, uint64_t addr, uint32_t length, uint32_t lkey) {
+        memset(&wrs[i], 0, sizeof(wrs[i]));
+        sges[i].addr = addr;
+        sges[i].length = length;
+        sges[i].lkey = lkey;
+        wrs[i].wr_id = wr_id;
+        wrs[i].sg_list = &sges[i];
+        wrs[i].num_sge = 1;
+    }
+
+    struct ibv_recv_wr *single(uint32_t i) {
+        wrs[i].next = nullptr;
+        return &wrs[i];
+    }
+
+    // The slots in `mask` as one list, in slot order; nullptr for none.
+    struct ibv_recv_wr *chain(uint32_t mask) {
+        struct ibv_recv_wr *head = nullptr, *tail = nullptr;
+        for (uint32_t i = 0; i < Depth; i++) {
+            if (!(mask & (1u << i)))
+                continue;
+            if (tail)
+                tail->next = &wrs[i];
+            else
+                head = &wrs[i];
+            tail = &wrs[i];
+        }
+        if (tail)
+            tail->next = nullptr;
+        return head;
+    }
+
+    static uint32_t posted_before(const struct ibv_recv_wr *head, const struct ibv_recv_wr *bad) {
+        uint32_t n = 0;
+        for (const struct ibv_recv_wr *wr = head; wr && wr != bad; wr = wr->next)
+            n++;
+        return n;
+    }
+
+private:
+    struct ibv_recv_wr wrs[Depth];
+    struct ibv_sge sges[Depth];
+};